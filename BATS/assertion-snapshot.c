@@ -0,0 +1,282 @@
+/*
+ * assertion-snapshot.c
+ *
+ * Checks that a columnar assertion snapshot decodes to what was added,
+ * that strings are stored once, that cut short or foreign buffers are
+ * rejected, and times building and decoding a large snapshot.
+ */
+
+#include <mach/mach_time.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../pmconfigd/AssertionSnapshot.h"
+
+/***
+
+ Build with ../pmconfigd/AssertionSnapshot.c. Runs without powerd; to
+ decode a live snapshot, run 'pmset -g assertions --binary > file' and
+ pass the file as the argument.
+
+ ***/
+
+enum {
+    kEntries            = 20000,
+    kProcesses          = 50
+};
+
+static const char *kTypes[] = {
+    "PreventUserIdleSystemSleep", "PreventUserIdleDisplaySleep",
+    "PreventSystemSleep", "BackgroundTask", "NetworkClientActive"
+};
+#define kTypeCount      (sizeof(kTypes) / sizeof(kTypes[0]))
+
+static double usSince(uint64_t start)
+{
+    mach_timebase_info_data_t   tb;
+
+    mach_timebase_info(&tb);
+    return (double)(mach_absolute_time() - start) * tb.numer / tb.denom / 1000.0;
+}
+
+static void fillEntry(PMAssertionSnapshotEntry *entry, uint32_t n, char *name, size_t nameLen,
+                      char *process, size_t processLen)
+{
+    bzero(entry, sizeof(*entry));
+    snprintf(name, nameLen, "com.apple.test.assertion.%u", n % 1000);
+    snprintf(process, processLen, "testd%u", n % kProcesses);
+    entry->createTime = 1400000000LL + n;
+    entry->timeout = (n % 3) ? 0 : entry->createTime + 600;
+    entry->pid = 100 + n % kProcesses;
+    entry->assertionID = 0x10000 + n;
+    entry->flags = (n % 3) ? 0 : kPMAssertionSnapshotTimed;
+    entry->level = 255;
+    entry->type = kTypes[n % kTypeCount];
+    entry->name = name;
+    entry->process = (n % 7) ? process : NULL;
+}
+
+static bool entryMatches(const PMAssertionSnapshot *snap, uint32_t i)
+{
+    PMAssertionSnapshotEntry    entry;
+    char                        name[64], process[32];
+    const char                  *str;
+
+    fillEntry(&entry, i, name, sizeof(name), process, sizeof(process));
+    if ((snap->createTime[i] != entry.createTime) || (snap->timeout[i] != entry.timeout)
+        || (snap->pid[i] != entry.pid) || (snap->assertionID[i] != entry.assertionID)
+        || (snap->flags[i] != entry.flags) || (snap->level[i] != entry.level))
+    {
+        return false;
+    }
+    if (!(str = PMAssertionSnapshotString(snap, snap->typeAtom[i])) || strcmp(str, entry.type)) {
+        return false;
+    }
+    if (!(str = PMAssertionSnapshotString(snap, snap->nameAtom[i])) || strcmp(str, entry.name)) {
+        return false;
+    }
+    str = PMAssertionSnapshotString(snap, snap->processAtom[i]);
+    return str && !strcmp(str, entry.process ? entry.process : "");
+}
+
+/* Builds a large snapshot, writes it out and decodes it back */
+static uint8_t *buildSnapshot(size_t *size)
+{
+    PMAssertionSnapshotBuilder  *builder;
+    PMAssertionSnapshotEntry    entry;
+    char                        name[64], process[32];
+    uint8_t                     *buf = NULL;
+    uint32_t                    n;
+
+    if (!(builder = PMAssertionSnapshotBuilderCreate())) {
+        printf("[FAIL] Can't create a snapshot builder\n");
+        return NULL;
+    }
+    for (n = 0; n < kEntries; n++) {
+        fillEntry(&entry, n, name, sizeof(name), process, sizeof(process));
+        if (!PMAssertionSnapshotBuilderAdd(builder, &entry)) {
+            printf("[FAIL] Add %u\n", n);
+            goto exit;
+        }
+    }
+    *size = PMAssertionSnapshotBuilderSize(builder);
+    buf = malloc(*size);
+    if (PMAssertionSnapshotBuilderWrite(builder, 1400000000LL, buf, *size - 1)) {
+        printf("[FAIL] A snapshot was written to a short buffer\n");
+        goto fail;
+    }
+    if (!PMAssertionSnapshotBuilderWrite(builder, 1400000000LL, buf, *size)) {
+        printf("[FAIL] Can't write a snapshot of %zu bytes\n", *size);
+        goto fail;
+    }
+    goto exit;
+
+fail:
+    free(buf);
+    buf = NULL;
+exit:
+    PMAssertionSnapshotBuilderRelease(builder);
+    return buf;
+}
+
+static bool testRoundTrip(void)
+{
+    PMAssertionSnapshot snap;
+    uint8_t             *buf;
+    size_t              size = 0;
+    uint64_t            start;
+    double              buildUS, decodeUS;
+    uint32_t            n, sum = 0;
+    bool                passed = false;
+
+    start = mach_absolute_time();
+    if (!(buf = buildSnapshot(&size))) {
+        return false;
+    }
+    buildUS = usSince(start);
+
+    start = mach_absolute_time();
+    if (!PMAssertionSnapshotOpen(buf, size, &snap)) {
+        printf("[FAIL] Can't open a snapshot of %zu bytes\n", size);
+        goto exit;
+    }
+    for (n = 0; n < snap.count; n++) {
+        sum += snap.pid[n];
+    }
+    decodeUS = usSince(start);
+
+    if ((snap.count != kEntries) || (snap.snapshotTime != 1400000000LL)) {
+        printf("[FAIL] The header holds %u entries at %lld\n", snap.count, (long long)snap.snapshotTime);
+        goto exit;
+    }
+    for (n = 0; n < snap.count; n++) {
+        if (!entryMatches(&snap, n)) {
+            printf("[FAIL] Entry %u doesn't decode to what was added\n", n);
+            goto exit;
+        }
+    }
+    if (snap.nameAtom[0] != snap.nameAtom[1000]) {
+        printf("[FAIL] A repeated string has atoms %u and %u\n", snap.nameAtom[0], snap.nameAtom[1000]);
+        goto exit;
+    }
+    if (strlen(PMAssertionSnapshotString(&snap, 0)) || PMAssertionSnapshotString(&snap, snap.stringsSize)) {
+        printf("[FAIL] Atom 0 isn't the empty string, or an atom past the string table was accepted\n");
+        goto exit;
+    }
+    if (((uintptr_t)snap.timeout % 8) || ((uintptr_t)snap.level % 8)) {
+        printf("[FAIL] Columns aren't 8 byte aligned\n");
+        goto exit;
+    }
+
+    printf("%d entries in %zu bytes (%.1f per entry, %u bytes of strings)\n",
+           kEntries, size, (double)size / kEntries, snap.stringsSize);
+    printf("Build and write %.0f us, open and sum a column %.0f us (sum %u)\n", buildUS, decodeUS, sum);
+    printf("[PASS] Every entry decodes to what was added, with each string stored once\n");
+    passed = true;
+
+exit:
+    free(buf);
+    return passed;
+}
+
+static bool testRejects(void)
+{
+    PMAssertionSnapshotBuilder  *builder;
+    PMAssertionSnapshot         snap;
+    uint8_t                     *buf;
+    size_t                      size = 0;
+    bool                        passed = false;
+
+    if (!(buf = buildSnapshot(&size))) {
+        return false;
+    }
+    if (PMAssertionSnapshotOpen(buf, size - 1, &snap)
+        || PMAssertionSnapshotOpen(buf, sizeof(PMAssertionSnapshotHeader) - 1, &snap))
+    {
+        printf("[FAIL] A cut short snapshot was accepted\n");
+        goto exit;
+    }
+    ((PMAssertionSnapshotHeader *)buf)->count = UINT32_MAX;
+    if (PMAssertionSnapshotOpen(buf, size, &snap)) {
+        printf("[FAIL] A count past the buffer was accepted\n");
+        goto exit;
+    }
+    ((PMAssertionSnapshotHeader *)buf)->magic = 0;
+    if (PMAssertionSnapshotOpen(buf, size, &snap)) {
+        printf("[FAIL] A buffer with another magic was accepted\n");
+        goto exit;
+    }
+    free(buf);
+
+    builder = PMAssertionSnapshotBuilderCreate();
+    size = PMAssertionSnapshotBuilderSize(builder);
+    buf = malloc(size);
+    passed = PMAssertionSnapshotBuilderWrite(builder, 0, buf, size) && PMAssertionSnapshotOpen(buf, size, &snap)
+             && (snap.count == 0);
+    PMAssertionSnapshotBuilderRelease(builder);
+    if (!passed) {
+        printf("[FAIL] An empty snapshot doesn't open\n");
+        goto exit;
+    }
+    printf("[PASS] Cut short and foreign snapshots are rejected; an empty one opens\n");
+
+exit:
+    free(buf);
+    return passed;
+}
+
+static bool decodeFile(const char *path)
+{
+    PMAssertionSnapshot snap;
+    FILE                *f = fopen(path, "r");
+    uint8_t             *buf;
+    long                len;
+    uint32_t            i;
+
+    if (!f) {
+        printf("[FAIL] Can't open %s\n", path);
+        return false;
+    }
+    fseek(f, 0, SEEK_END);
+    len = ftell(f);
+    rewind(f);
+    buf = malloc(len);
+    if (!buf || (fread(buf, 1, len, f) != (size_t)len)) {
+        len = 0;
+    }
+    fclose(f);
+
+    if (!PMAssertionSnapshotOpen(buf, len, &snap)) {
+        printf("[FAIL] %s isn't an assertion snapshot\n", path);
+        free(buf);
+        return false;
+    }
+    for (i = 0; i < snap.count; i++) {
+        printf("pid %d(%s) %s \"%s\" id 0x%x level %u created %lld timeout %lld flags 0x%x\n",
+               snap.pid[i], PMAssertionSnapshotString(&snap, snap.processAtom[i]),
+               PMAssertionSnapshotString(&snap, snap.typeAtom[i]),
+               PMAssertionSnapshotString(&snap, snap.nameAtom[i]),
+               snap.assertionID[i], snap.level[i], (long long)snap.createTime[i], (long long)snap.timeout[i],
+               snap.flags[i]);
+    }
+    printf("[PASS] Decoded %u assertions from %s\n", snap.count, path);
+    free(buf);
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    bool    passed;
+
+    printf("Executing assertion-snapshot\n");
+
+    if (argc > 1) {
+        return decodeFile(argv[1]) ? 0 : 1;
+    }
+
+    passed = testRoundTrip();
+    passed = testRejects() && passed;
+
+    return passed ? 0 : 1;
+}
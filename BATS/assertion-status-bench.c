@@ -0,0 +1,181 @@
+/*
+ * assertion-status-bench.c
+ *
+ * Checks that powerd's packed assertion status agrees with the dictionary
+ * IOPMCopyAssertionsStatus() returns, then times status queries both ways.
+ */
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <IOKit/IOReturn.h>
+#include <IOKit/pwr_mgt/IOPMLib.h>
+#include <IOKit/pwr_mgt/IOPMLibPrivate.h>
+#include <mach/mach.h>
+#include <mach/mach_time.h>
+#include <servers/bootstrap.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../pmconfigd/AssertionSnapshot.h"
+#include "powermanagement.h"
+
+/***
+
+ Usage: assertion-status-bench [queries]
+
+ Build with ../pmconfigd/AssertionSnapshot.c and powermanagement.defs.
+ Runs against the live powerd; makes 'queries' (default 5000) status
+ queries each way.
+
+ ***/
+
+enum {
+    kDefaultQueries     = 5000
+};
+
+static double usBetween(uint64_t start, uint64_t end)
+{
+    mach_timebase_info_data_t   tb;
+
+    mach_timebase_info(&tb);
+    return (double)(end - start) * tb.numer / tb.denom / 1000.0;
+}
+
+static bool copyPacked(mach_port_t port, PMAssertionStatus *status)
+{
+    vm_offset_t                 buf = 0;
+    mach_msg_type_number_t      len = 0;
+    const PMAssertionStatus     *packed;
+    int                         rc = kIOReturnError;
+    bool                        copied = false;
+
+    if ((KERN_SUCCESS == io_pm_assertion_copy_details(port, 0, kPMAssertionMIGCopyStatusPacked, &buf, &len, &rc))
+        && (kIOReturnSuccess == rc) && (packed = PMAssertionStatusOpen((const void *)buf, len)))
+    {
+        *status = *packed;
+        copied = true;
+    }
+    if (buf) {
+        vm_deallocate(mach_task_self(), buf, len);
+    }
+    return copied;
+}
+
+static bool testAgreement(mach_port_t port)
+{
+    PMAssertionStatus   status;
+    CFDictionaryRef     dict = NULL;
+    CFStringRef         name;
+    CFNumberRef         value;
+    int                 level, i;
+    bool                agrees = true;
+
+    if (!copyPacked(port, &status)) {
+        printf("[FAIL] Can't copy the packed status\n");
+        return false;
+    }
+    if ((kIOReturnSuccess != IOPMCopyAssertionsStatus(&dict)) || !dict) {
+        printf("[FAIL] Can't copy the status dictionary\n");
+        return false;
+    }
+
+    if (status.typeCount != CFDictionaryGetCount(dict)) {
+        printf("[FAIL] The packed status holds %d types, the dictionary %ld\n",
+               status.typeCount, (long)CFDictionaryGetCount(dict));
+        agrees = false;
+    }
+    for (i = 0; i < status.typeCount; i++) {
+        name = CFStringCreateWithCString(0, status.names[i], kCFStringEncodingUTF8);
+        value = name ? CFDictionaryGetValue(dict, name) : NULL;
+        if (!value || !CFNumberGetValue(value, kCFNumberIntType, &level) || (level != status.levels[i])
+            || (((status.levelBits >> i) & 1) != status.levels[i]))
+        {
+            printf("[FAIL] %s: packed %u, dictionary %d\n", status.names[i], status.levels[i], value ? level : -1);
+            agrees = false;
+        }
+        if (name) CFRelease(name);
+    }
+    CFRelease(dict);
+
+    if (agrees) {
+        printf("[PASS] Every type's packed level matches its dictionary level\n");
+    }
+    return agrees;
+}
+
+static bool timeQueries(mach_port_t port, int queries)
+{
+    PMAssertionStatus   status;
+    CFDictionaryRef     dict;
+    CFDataRef           data;
+    uint64_t            start, end;
+    double              dictUS, packedUS;
+    CFIndex             dictBytes = 0;
+    int                 n;
+
+    start = mach_absolute_time();
+    for (n = 0; n < queries; n++) {
+        dict = NULL;
+        if ((kIOReturnSuccess != IOPMCopyAssertionsStatus(&dict)) || !dict) {
+            break;
+        }
+        CFRelease(dict);
+    }
+    end = mach_absolute_time();
+    if (n != queries) {
+        printf("[FAIL] Dictionary query %d of %d failed\n", n + 1, queries);
+        return false;
+    }
+    dictUS = usBetween(start, end) / queries;
+
+    start = mach_absolute_time();
+    for (n = 0; n < queries; n++) {
+        if (!copyPacked(port, &status)) {
+            break;
+        }
+    }
+    end = mach_absolute_time();
+    if (n != queries) {
+        printf("[FAIL] Packed query %d of %d failed\n", n + 1, queries);
+        return false;
+    }
+    packedUS = usBetween(start, end) / queries;
+
+    if ((kIOReturnSuccess == IOPMCopyAssertionsStatus(&dict)) && dict) {
+        if ((data = CFPropertyListCreateData(0, dict, kCFPropertyListBinaryFormat_v1_0, 0, NULL))) {
+            dictBytes = CFDataGetLength(data);
+            CFRelease(data);
+        }
+        CFRelease(dict);
+    }
+
+    printf("%d queries each way\n", queries);
+    printf("Dictionary: %.1f us per query (%.0f per second), %ld bytes\n",
+           dictUS, 1000000.0 / dictUS, (long)dictBytes);
+    printf("Packed:     %.1f us per query (%.0f per second), %zu bytes\n",
+           packedUS, 1000000.0 / packedUS, sizeof(PMAssertionStatus));
+    printf("[PASS] Every query succeeds both ways\n");
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    mach_port_t     port = MACH_PORT_NULL;
+    int             queries = (argc > 1) ? atoi(argv[1]) : kDefaultQueries;
+    bool            passed;
+
+    printf("Executing assertion-status-bench\n");
+
+    if (queries <= 0) {
+        queries = kDefaultQueries;
+    }
+    if (KERN_SUCCESS != bootstrap_look_up(bootstrap_port, kIOPMServerBootstrapName, &port)) {
+        printf("[FAIL] Can't look up powerd\n");
+        return 1;
+    }
+
+    passed = testAgreement(port) && timeQueries(port, queries);
+
+    mach_port_deallocate(mach_task_self(), port);
+    return passed ? 0 : 1;
+}
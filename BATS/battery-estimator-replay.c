@@ -0,0 +1,449 @@
+/*
+ * battery-estimator-replay.c
+ *
+ * Replays battery traces through each of powerd's time remaining models
+ * and scores their estimates against the time the battery really took
+ * to empty or fill.
+ */
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <IOKit/ps/IOPowerSources.h>
+#include <IOKit/ps/IOPowerSourcesPrivate.h>
+#include <IOKit/ps/IOPSKeys.h>
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../pmconfigd/BatteryEstimator.h"
+
+/***
+
+ Usage: battery-estimator-replay [-c mAh] [file ...]
+
+ Build with ../pmconfigd/BatteryEstimator.c. Runs without powerd.
+
+ Each 'file' is a charge log saved as a property list, as returned by
+ _io_ps_copy_chargelog(): a dictionary of power source names to arrays of
+ log entries. Charge logs record the level in percent, so '-c' gives the
+ full charge capacity the current is converted with; without it the
+ models only see the level. Without a file, generated traces are replayed
+ and checked.
+
+ The true time remaining at each sample of a recorded log is the time
+ until the log's charge or discharge ended, plus what was left at that
+ point at the average rate of the whole charge or discharge. Logs and
+ generated traces have no gas gauge estimate, so the hardware model
+ falls back on the instantaneous current.
+
+ ***/
+
+enum {
+    kMaxPoints          = 4096,
+    kWarmupMinutes      = 5,            // estimates before then aren't scored
+    kMinSegmentMinutes  = 15
+};
+
+#define kGeneratedMAh   6000
+
+typedef struct {
+    BattSample      sample;
+    double          truth;              // minutes; -1 if unknown
+} TracePoint;
+
+typedef struct {
+    long            points;
+    long            estimates;
+    long            covered;
+    double          absError;
+} Score;
+
+static void score(BattModel model, const TracePoint *trace, int count, Score *sc)
+{
+    BattEstimator   e;
+    BattEstimate    est;
+    double          truth;
+
+    bzero(sc, sizeof(*sc));
+    BattEstimatorReset(&e, model);
+    for (int i = 0; i < count; i++)
+    {
+        BattEstimatorUpdate(&e, &trace[i].sample, &est);
+        if ((trace[i].truth < 0) || ((trace[i].sample.time - trace[0].sample.time) < kWarmupMinutes * 60)) {
+            continue;
+        }
+        truth = fmin(trace[i].truth, kBattEstimateMaxMinutes);
+        sc->points++;
+        if (est.minutes < 0) {
+            continue;
+        }
+        sc->estimates++;
+        sc->absError += fabs(est.minutes - truth);
+        if ((est.low <= truth + 0.5) && (truth - 0.5 <= est.high)) {
+            sc->covered++;
+        }
+    }
+}
+
+static void scoreAll(const char *name, const TracePoint *trace, int count, Score scores[kBattModelCount])
+{
+    printf("%s: %d samples\n", name, count);
+    for (int m = 0; m < kBattModelCount; m++)
+    {
+        Score   *sc = &scores[m];
+
+        score((BattModel)m, trace, count, sc);
+        printf("    %-10s %5.1f%% estimated, mean error %6.1f min, range covers %5.1f%%\n",
+               BattModelName((BattModel)m),
+               sc->points ? 100.0 * sc->estimates / sc->points : 0.0,
+               sc->estimates ? sc->absError / sc->estimates : 0.0,
+               sc->estimates ? 100.0 * sc->covered / sc->estimates : 0.0);
+    }
+}
+
+static double meanError(const Score *sc)
+{
+    return sc->estimates ? sc->absError / sc->estimates : INFINITY;
+}
+
+static double estimated(const Score *sc)
+{
+    return sc->points ? (double)sc->estimates / sc->points : 0.0;
+}
+
+static double gaussian(void)
+{
+    double  u = (random() + 1.0) / ((double)RAND_MAX + 2.0);
+    double  v = (random() + 1.0) / ((double)RAND_MAX + 2.0);
+
+    return sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * v);
+}
+
+/*
+ * A battery run down from full by a load that changes between idle, light
+ * and heavy use, or charged at a constant current that tapers off past
+ * 80%. The gauge's averaged current is off by 'noise' (relative) at each
+ * reading. 'logged' samples every five minutes with the level in whole
+ * percent and no capacity, as a charge log does; otherwise every minute,
+ * as powerd polls.
+ */
+static int generate(TracePoint *trace, bool charging, double noise, bool logged)
+{
+    static const struct { double mA; int minutes; } kLoads[] = {
+        { 450, 6 }, { 1300, 4 }, { 2900, 2 }, { 700, 5 }, { 1800, 3 }
+    };
+    double      mAh = charging ? 0.05 * kGeneratedMAh : kGeneratedMAh;
+    double      mA, end = -1;
+    int         count = 0, load = 0, loadLeft = kLoads[0].minutes;
+    int         step = logged ? 5 : 1;
+
+    for (int t = 0; (count < kMaxPoints) && (end < 0); t++)
+    {
+        if (charging) {
+            mA = 3000;
+            if (mAh > 0.8 * kGeneratedMAh) {
+                mA = 300 + 2700 * (kGeneratedMAh - mAh) / (0.2 * kGeneratedMAh);
+            }
+        } else {
+            if (--loadLeft <= 0) {
+                load = (load + 1) % (int)(sizeof(kLoads) / sizeof(kLoads[0]));
+                loadLeft = kLoads[load].minutes;
+            }
+            mA = -kLoads[load].mA;
+        }
+
+        if (t % step == 0) {
+            BattSample  *s = &trace[count++].sample;
+
+            bzero(s, sizeof(*s));
+            s->time = 60.0 * t;
+            s->level = 100.0 * mAh / kGeneratedMAh;
+            if (logged) {
+                s->level = round(s->level);
+            } else {
+                s->fullChargeMAh = kGeneratedMAh;
+            }
+            s->amperage = (int)lround(mA * (1.0 + noise * gaussian()));
+            s->hwMinutes = -1;
+            s->charging = charging;
+            s->external = charging;
+        }
+
+        mAh += mA / 60.0;
+        if (mAh <= 0) {
+            end = t + 1;
+        } else if (mAh >= kGeneratedMAh) {
+            end = t + 1;
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        trace[i].truth = (end < 0) ? -1 : end - trace[i].sample.time / 60.0;
+    }
+    return count;
+}
+
+static bool testDischarge(TracePoint *trace)
+{
+    Score   scores[kBattModelCount];
+    int     count;
+
+    count = generate(trace, false, 0.2, false);
+    scoreAll("Generated discharge, noisy current", trace, count, scores);
+    if ((estimated(&scores[kBattModelHardware]) <= 0.9) || (estimated(&scores[kBattModelEWMA]) <= 0.9)
+        || (estimated(&scores[kBattModelKalman]) <= 0.9))
+    {
+        printf("[FAIL] A model left more than 10%% of a discharge unestimated\n");
+        return false;
+    }
+    if ((meanError(&scores[kBattModelEWMA]) >= meanError(&scores[kBattModelHardware]))
+        || (meanError(&scores[kBattModelKalman]) >= meanError(&scores[kBattModelHardware])))
+    {
+        printf("[FAIL] A filtered model is no better than the instantaneous current\n");
+        return false;
+    }
+    if ((scores[kBattModelEWMA].covered <= scores[kBattModelEWMA].estimates * 8 / 10)
+        || (scores[kBattModelKalman].covered <= scores[kBattModelKalman].estimates * 8 / 10))
+    {
+        printf("[FAIL] A filtered model's range covers the truth less than 80%% of the time\n");
+        return false;
+    }
+    printf("[PASS] The filtered models beat the instantaneous current over a discharge\n");
+    return true;
+}
+
+static bool testDischargeLog(TracePoint *trace)
+{
+    Score   scores[kBattModelCount];
+    int     count;
+
+    count = generate(trace, false, 0.2, true);
+    scoreAll("Generated discharge log, whole percent, no capacity", trace, count, scores);
+    if ((estimated(&scores[kBattModelEWMA]) <= 0.8) || (estimated(&scores[kBattModelKalman]) <= 0.8)
+        || (meanError(&scores[kBattModelEWMA]) >= 30) || (meanError(&scores[kBattModelKalman]) >= 30))
+    {
+        printf("[FAIL] A filtered model isn't within half an hour from the level alone\n");
+        return false;
+    }
+    printf("[PASS] The filtered models estimate from the level alone\n");
+    return true;
+}
+
+static bool testCharge(TracePoint *trace)
+{
+    Score   scores[kBattModelCount];
+    int     count;
+
+    count = generate(trace, true, 0.05, false);
+    scoreAll("Generated charge", trace, count, scores);
+    if ((estimated(&scores[kBattModelEWMA]) <= 0.9) || (estimated(&scores[kBattModelKalman]) <= 0.9)) {
+        printf("[FAIL] A filtered model left more than 10%% of a charge unestimated\n");
+        return false;
+    }
+    printf("[PASS] The filtered models estimate time to full\n");
+    return true;
+}
+
+static bool testReset(void)
+{
+    BattEstimator   e;
+    BattEstimate    est;
+    BattSample      s;
+
+    BattEstimatorReset(&e, kBattModelKalman);
+    bzero(&s, sizeof(s));
+    s.level = 50;
+    s.fullChargeMAh = kGeneratedMAh;
+    s.amperage = -1000;
+    s.hwMinutes = -1;
+    BattEstimatorUpdate(&e, &s, &est);
+    if (abs(est.minutes - 180) >= 9) {
+        printf("[FAIL] A single reading with current estimates %d minutes, expected 180\n", est.minutes);
+        return false;
+    }
+
+    // Plugging in starts over
+    s.time = 60;
+    s.external = true;
+    s.amperage = 0;
+    BattEstimatorUpdate(&e, &s, &est);
+    if ((est.minutes != -1) || (e.samples != 1)) {
+        printf("[FAIL] Plugging in left an estimate of %d minutes from %d samples\n", est.minutes, e.samples);
+        return false;
+    }
+
+    if ((BattModelNamed("kalman") != kBattModelKalman) || (BattModelNamed("ewma") != kBattModelEWMA)
+        || (BattModelNamed("hardware") != kBattModelHardware) || (BattModelNamed("none") != kBattModelCount))
+    {
+        printf("[FAIL] Models aren't found by name\n");
+        return false;
+    }
+    printf("[PASS] Plugging in starts the estimate over\n");
+    return true;
+}
+
+static int intValue(CFDictionaryRef entry, CFStringRef key)
+{
+    CFNumberRef n = CFDictionaryGetValue(entry, key);
+    int         v = 0;
+
+    if (n && (CFGetTypeID(n) == CFNumberGetTypeID())) {
+        CFNumberGetValue(n, kCFNumberIntType, &v);
+    }
+    return v;
+}
+
+/*
+ * Fills in the truth for one charge or discharge, trace[first] to
+ * trace[last], from when it ended and its average rate.
+ */
+static void setSegmentTruth(TracePoint *trace, int first, int last)
+{
+    const BattSample    *a = &trace[first].sample;
+    const BattSample    *z = &trace[last].sample;
+    double              minutes = (z->time - a->time) / 60.0;
+    double              rate, left;
+
+    rate = (z->level - a->level) / minutes;
+    left = z->charging ? (100.0 - z->level) : z->level;
+    if ((minutes < kMinSegmentMinutes) || ((z->charging ? rate : -rate) <= 0)) {
+        return;
+    }
+    for (int i = first; i <= last; i++) {
+        trace[i].truth = (z->time - trace[i].sample.time) / 60.0 + left / fabs(rate);
+    }
+}
+
+static int traceFromLog(CFArrayRef log, int fullChargeMAh, TracePoint *trace)
+{
+    CFDictionaryRef entry;
+    CFDateRef       date;
+    int             count = 0, first = 0, maxCap;
+
+    for (CFIndex i = 0; (i < CFArrayGetCount(log)) && (count < kMaxPoints); i++)
+    {
+        BattSample  *s = &trace[count].sample;
+
+        entry = CFArrayGetValueAtIndex(log, i);
+        if (CFGetTypeID(entry) != CFDictionaryGetTypeID()) {
+            continue;
+        }
+        date = CFDictionaryGetValue(entry, CFSTR(kIOPSBattLogEntryTime));
+        maxCap = intValue(entry, CFSTR(kIOPSMaxCapacityKey));
+        if (!date || (CFGetTypeID(date) != CFDateGetTypeID()) || !maxCap) {
+            continue;
+        }
+
+        bzero(s, sizeof(*s));
+        s->time = CFDateGetAbsoluteTime(date);
+        s->level = 100.0 * intValue(entry, CFSTR(kIOPSCurrentCapacityKey)) / maxCap;
+        s->fullChargeMAh = fullChargeMAh;
+        s->amperage = intValue(entry, CFSTR(kIOPSCurrentKey));
+        s->hwMinutes = -1;
+        s->charging = (kCFBooleanTrue == CFDictionaryGetValue(entry, CFSTR(kIOPSIsChargingKey)));
+        s->external = CFEqual(CFSTR(kIOPSACPowerValue),
+                              CFDictionaryGetValue(entry, CFSTR(kIOPSPowerSourceStateKey)));
+        trace[count].truth = -1;
+
+        if (count && ((s->charging != trace[count - 1].sample.charging)
+                      || (s->external != trace[count - 1].sample.external))) {
+            setSegmentTruth(trace, first, count - 1);
+            first = count;
+        }
+        count++;
+    }
+    if (count) {
+        setSegmentTruth(trace, first, count - 1);
+    }
+    return count;
+}
+
+static bool replayFile(const char *path, int fullChargeMAh)
+{
+    TracePoint      *trace = calloc(kMaxPoints, sizeof(TracePoint));
+    Score           scores[kBattModelCount];
+    CFMutableDataRef data = NULL;
+    CFDictionaryRef logs = NULL;
+    CFIndex         n;
+    const void      **names = NULL, **values = NULL;
+    char            name[128];
+    char            buf[8192];
+    size_t          len;
+    FILE            *f;
+    bool            passed = false;
+
+    if (!(f = fopen(path, "r"))) {
+        printf("[FAIL] Can't open %s\n", path);
+        goto exit;
+    }
+    data = CFDataCreateMutable(0, 0);
+    while ((len = fread(buf, 1, sizeof(buf), f)) > 0) {
+        CFDataAppendBytes(data, (const UInt8 *)buf, len);
+    }
+    fclose(f);
+
+    logs = CFPropertyListCreateWithData(0, data, kCFPropertyListImmutable, NULL, NULL);
+    if (!logs || (CFGetTypeID(logs) != CFDictionaryGetTypeID())) {
+        printf("[FAIL] %s isn't a charge log\n", path);
+        goto exit;
+    }
+
+    n = CFDictionaryGetCount(logs);
+    names = calloc(n, sizeof(void *));
+    values = calloc(n, sizeof(void *));
+    CFDictionaryGetKeysAndValues(logs, names, values);
+    for (CFIndex i = 0; i < n; i++)
+    {
+        if ((CFGetTypeID(values[i]) != CFArrayGetTypeID())
+            || !CFStringGetCString(names[i], name, sizeof(name), kCFStringEncodingUTF8)) {
+            continue;
+        }
+        scoreAll(name, trace, traceFromLog(values[i], fullChargeMAh, trace), scores);
+    }
+    passed = true;
+
+exit:
+    free(names);
+    free(values);
+    if (logs) CFRelease(logs);
+    if (data) CFRelease(data);
+    free(trace);
+    return passed;
+}
+
+int main(int argc, char *argv[])
+{
+    TracePoint  *trace;
+    int         fullChargeMAh = 0;
+    int         ch;
+    bool        passed = true;
+
+    printf("Executing battery-estimator-replay\n");
+
+    while ((ch = getopt(argc, argv, "c:")) != -1) {
+        if (ch == 'c') {
+            fullChargeMAh = atoi(optarg);
+        } else {
+            printf("usage: battery-estimator-replay [-c mAh] [file ...]\n");
+            return 1;
+        }
+    }
+
+    if (optind < argc) {
+        for (int i = optind; i < argc; i++) {
+            passed = replayFile(argv[i], fullChargeMAh) && passed;
+        }
+        return passed ? 0 : 1;
+    }
+
+    srandom(1);
+    trace = calloc(kMaxPoints, sizeof(TracePoint));
+    passed = testDischarge(trace);
+    passed = testDischargeLog(trace) && passed;
+    passed = testCharge(trace) && passed;
+    passed = testReset() && passed;
+    free(trace);
+
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,114 @@
+/*
+ * hididle-sharedmem.c
+ *
+ * Compares the HID idle time powerd publishes in shared memory against
+ * IOHIDSystem's HIDIdleTime property, and times both read paths.
+ */
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <IOKit/IOKitLib.h>
+#include <mach/mach_time.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "../pmconfigd/HIDIdleShared.h"
+
+/***
+
+ This tool checks that the idle time read from powerd's shared page agrees
+ with IOHIDSystem's, then reports the per-call cost of each. powerd's idle
+ time may run ahead by up to kHIDIdleResyncSecs, plus a second of timer
+ leeway, while HID is active.
+
+ ***/
+
+static const int kRegistryIterations    = 10000;
+static const int kSharedIterations      = 10000000;
+
+static double nsPerCall(uint64_t start, uint64_t end, int iterations)
+{
+    mach_timebase_info_data_t   tb;
+
+    mach_timebase_info(&tb);
+    return (double)(end - start) * tb.numer / tb.denom / iterations;
+}
+
+static CFTimeInterval registryIdleTime(io_registry_entry_t hidSystem)
+{
+    CFNumberRef     idleNum;
+    uint64_t        idleNanos = 0;
+    CFTimeInterval  idle = -1.0;
+
+    idleNum = IORegistryEntryCreateCFProperty(hidSystem, CFSTR("HIDIdleTime"), 0, 0);
+    if (idleNum) {
+        if ((CFGetTypeID(idleNum) == CFNumberGetTypeID())
+            && CFNumberGetValue(idleNum, kCFNumberSInt64Type, &idleNanos))
+        {
+            idle = (CFTimeInterval)idleNanos / 1000000000.0;
+        }
+        CFRelease(idleNum);
+    }
+    return idle;
+}
+
+int main(int argc, char *argv[])
+{
+    const HIDIdleShared     *shared = NULL;
+    io_registry_entry_t     hidSystem;
+    CFTimeInterval          sharedIdle, registryIdle;
+    uint64_t                start, end;
+    volatile double         sink = 0;
+    int                     i;
+
+    printf("Executing hididle-sharedmem\n");
+
+    shared = HIDIdleSharedMap();
+    if (!shared) {
+        printf("[FAIL] powerd hasn't published %s\n", kHIDIdleSharedName);
+        return 1;
+    }
+
+    hidSystem = IOServiceGetMatchingService(kIOMasterPortDefault, IOServiceMatching("IOHIDSystem"));
+    if (!hidSystem) {
+        printf("[FAIL] Can't find IOHIDSystem\n");
+        return 1;
+    }
+
+    registryIdle = registryIdleTime(hidSystem);
+    sharedIdle = HIDIdleSharedGetIdleTime(shared);
+    if ((registryIdle < 0) || (sharedIdle < 0)) {
+        printf("[FAIL] Idle time unknown: shared %.1f s, registry %.1f s\n", sharedIdle, registryIdle);
+        IOObjectRelease(hidSystem);
+        return 1;
+    }
+
+    // Allow a second either way for the reads not being simultaneous, and
+    // one more for the resync timer's leeway
+    if ((sharedIdle < registryIdle - 1.0) || (sharedIdle > registryIdle + kHIDIdleResyncSecs + 2.0))
+    {
+        printf("[FAIL] Shared idle time %.1f s doesn't match IOHIDSystem's %.1f s (HID %s)\n",
+               sharedIdle, registryIdle, shared->hidActive ? "active" : "idle");
+        IOObjectRelease(hidSystem);
+        return 1;
+    }
+
+    printf("[PASS] Shared idle time matches: shared %.1f s, registry %.1f s, HID %s, resyncs=%llu\n",
+           sharedIdle, registryIdle, shared->hidActive ? "active" : "idle", shared->resyncCount);
+
+    start = mach_absolute_time();
+    for (i = 0; i < kRegistryIterations; i++) {
+        sink += registryIdleTime(hidSystem);
+    }
+    end = mach_absolute_time();
+    printf("IORegistry HIDIdleTime:     %10.1f ns/call\n", nsPerCall(start, end, kRegistryIterations));
+
+    start = mach_absolute_time();
+    for (i = 0; i < kSharedIterations; i++) {
+        sink += HIDIdleSharedGetIdleTime(shared);
+    }
+    end = mach_absolute_time();
+    printf("HIDIdleSharedGetIdleTime:   %10.1f ns/call\n", nsPerCall(start, end, kSharedIterations));
+
+    IOObjectRelease(hidSystem);
+    return 0;
+}
@@ -0,0 +1,251 @@
+/*
+ * multi-ups-bench.c
+ *
+ * Simulates a rack of UPS units publishing to powerd concurrently, the way
+ * ioupsd does, then checks what powerd publishes and times the updates.
+ */
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <IOKit/IOReturn.h>
+#include <IOKit/ps/IOPowerSources.h>
+#include <IOKit/ps/IOPowerSourcesPrivate.h>
+#include <IOKit/ps/IOPSKeys.h>
+#include <dispatch/dispatch.h>
+#include <libkern/OSAtomic.h>
+#include <mach/mach_time.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+/***
+
+ Usage: multi-ups-bench [units]
+
+ Creates 'units' (default 16) simulated USB UPS power sources. Every unit
+ posts kUpdatesPerUnit readings from its own thread; all but unit 0 switch
+ to battery power along the way.
+
+ Unit 0 stays on AC power throughout. Redundant units keep the machine on
+ external power while any one of them has it, so powerd's UPS shutdown
+ policy must not act on this bench - and the test host won't shut down.
+
+ ***/
+
+static const int kDefaultUnits      = 16;
+static const int kMaxUnits          = 32;
+static const int kUpdatesPerUnit    = 50;
+
+static CFStringRef copyUnitName(int unit)
+{
+    return CFStringCreateWithFormat(0, NULL, CFSTR("Simulated UPS %d"), unit);
+}
+
+static void setInt(CFMutableDictionaryRef d, CFStringRef key, int value)
+{
+    CFNumberRef n = CFNumberCreate(0, kCFNumberIntType, &value);
+
+    if (n) {
+        CFDictionarySetValue(d, key, n);
+        CFRelease(n);
+    }
+}
+
+static CFDictionaryRef copyUnitDictionary(int unit, int capacity, bool onBattery)
+{
+    CFMutableDictionaryRef  d;
+    CFStringRef             name;
+
+    d = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks,
+                                  &kCFTypeDictionaryValueCallBacks);
+    if (!d) {
+        return NULL;
+    }
+
+    name = copyUnitName(unit);
+    CFDictionarySetValue(d, CFSTR(kIOPSNameKey), name);
+    CFRelease(name);
+
+    CFDictionarySetValue(d, CFSTR(kIOPSTransportTypeKey), CFSTR(kIOPSUSBTransportType));
+    CFDictionarySetValue(d, CFSTR(kIOPSTypeKey), CFSTR(kIOPSUPSType));
+    CFDictionarySetValue(d, CFSTR(kIOPSIsPresentKey), kCFBooleanTrue);
+    CFDictionarySetValue(d, CFSTR(kIOPSIsChargingKey), onBattery ? kCFBooleanFalse : kCFBooleanTrue);
+    CFDictionarySetValue(d, CFSTR(kIOPSPowerSourceStateKey),
+                         onBattery ? CFSTR(kIOPSBatteryPowerValue) : CFSTR(kIOPSACPowerValue));
+    setInt(d, CFSTR(kIOPSPowerSourceIDKey), unit);
+    setInt(d, CFSTR(kIOPSMaxCapacityKey), 100);
+    setInt(d, CFSTR(kIOPSCurrentCapacityKey), capacity);
+    setInt(d, CFSTR(kIOPSTimeToEmptyKey), capacity);
+
+    return d;
+}
+
+static int countPublishedUnits(int units, int expectCapacity)
+{
+    CFTypeRef       blob = NULL;
+    CFArrayRef      arr = NULL;
+    CFDictionaryRef details;
+    CFStringRef     name;
+    CFNumberRef     num;
+    int             capacity;
+    int             found = 0;
+
+    blob = IOPSCopyPowerSourcesInfo();
+    if (blob) {
+        arr = IOPSCopyPowerSourcesList(blob);
+    }
+    if (!arr) {
+        if (blob) CFRelease(blob);
+        return 0;
+    }
+
+    for (int unit = 0; unit < units; unit++)
+    {
+        CFStringRef want = copyUnitName(unit);
+
+        for (CFIndex i = 0; i < CFArrayGetCount(arr); i++)
+        {
+            details = IOPSGetPowerSourceDescription(blob, CFArrayGetValueAtIndex(arr, i));
+            if (!details) {
+                continue;
+            }
+            name = CFDictionaryGetValue(details, CFSTR(kIOPSNameKey));
+            if (!name || !CFEqual(name, want)) {
+                continue;
+            }
+            num = CFDictionaryGetValue(details, CFSTR(kIOPSCurrentCapacityKey));
+            capacity = -1;
+            if (num) {
+                CFNumberGetValue(num, kCFNumberIntType, &capacity);
+            }
+            if (capacity == expectCapacity) {
+                found++;
+            } else {
+                printf("Unit %d published capacity %d, expected %d\n", unit, capacity, expectCapacity);
+            }
+            break;
+        }
+        CFRelease(want);
+    }
+
+    CFRelease(arr);
+    CFRelease(blob);
+    return found;
+}
+
+static bool hasInternalBattery(void)
+{
+    CFTypeRef       blob = IOPSCopyPowerSourcesInfo();
+    CFArrayRef      arr = NULL;
+    CFDictionaryRef details;
+    CFStringRef     transport;
+    bool            found = false;
+
+    if (blob) {
+        arr = IOPSCopyPowerSourcesList(blob);
+    }
+    for (CFIndex i = 0; arr && (i < CFArrayGetCount(arr)); i++)
+    {
+        details = IOPSGetPowerSourceDescription(blob, CFArrayGetValueAtIndex(arr, i));
+        transport = details ? CFDictionaryGetValue(details, CFSTR(kIOPSTransportTypeKey)) : NULL;
+        if (transport && CFEqual(transport, CFSTR(kIOPSInternalType))) {
+            found = true;
+            break;
+        }
+    }
+
+    if (arr) CFRelease(arr);
+    if (blob) CFRelease(blob);
+    return found;
+}
+
+static double msBetween(uint64_t start, uint64_t end)
+{
+    mach_timebase_info_data_t   tb;
+
+    mach_timebase_info(&tb);
+    return (double)(end - start) * tb.numer / tb.denom / 1000000.0;
+}
+
+int main(int argc, char *argv[])
+{
+    IOPSPowerSourceID       ids[kMaxUnits];
+    int                     units = kDefaultUnits;
+    __block int32_t         failures = 0;
+    uint64_t                start, end;
+    const int               finalCapacity = 100 - kUpdatesPerUnit;
+    int                     found;
+
+    printf("Executing multi-ups-bench\n");
+
+    if (argc > 1) {
+        units = atoi(argv[1]);
+    }
+    if (units < 2 || units > kMaxUnits) {
+        printf("[FAIL] Unit count must be between 2 and %d\n", kMaxUnits);
+        return 1;
+    }
+
+    for (int unit = 0; unit < units; unit++)
+    {
+        IOReturn ret = IOPSCreatePowerSource(&ids[unit]);
+        if (kIOReturnSuccess != ret) {
+            printf("[FAIL] IOPSCreatePowerSource for unit %d returned 0x%08x\n", unit, ret);
+            return 1;
+        }
+    }
+    printf("[PASS] Created %d simulated UPS power sources\n", units);
+
+    start = mach_absolute_time();
+    dispatch_apply(units, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t unit) {
+        for (int update = 1; update <= kUpdatesPerUnit; update++)
+        {
+            bool            onBattery = (unit != 0) && (update > kUpdatesPerUnit / 2);
+            CFDictionaryRef d = copyUnitDictionary((int)unit, 100 - update, onBattery);
+            IOReturn        ret;
+
+            if (!d) {
+                OSAtomicIncrement32(&failures);
+                continue;
+            }
+            ret = IOPSSetPowerSourceDetails(ids[unit], d);
+            CFRelease(d);
+            if (kIOReturnSuccess != ret) {
+                OSAtomicIncrement32(&failures);
+            }
+        }
+    });
+    end = mach_absolute_time();
+
+    if (failures) {
+        printf("[FAIL] %d of %d IOPSSetPowerSourceDetails calls failed\n", failures, units * kUpdatesPerUnit);
+    } else {
+        printf("[PASS] %d units posted %d updates each\n", units, kUpdatesPerUnit);
+    }
+    printf("%d updates in %.1f ms (%.1f us/update)\n", units * kUpdatesPerUnit,
+           msBetween(start, end), 1000.0 * msBetween(start, end) / (units * kUpdatesPerUnit));
+
+    // Let powerd's coalesced publish run
+    sleep(1);
+
+    found = countPublishedUnits(units, finalCapacity);
+    if (found == units) {
+        printf("[PASS] powerd publishes all %d units with their final readings\n", units);
+    } else {
+        printf("[FAIL] powerd publishes %d of %d units with their final readings\n", found, units);
+        system("pmset -g ps");
+    }
+
+    if (!hasInternalBattery()
+        && (kIOPSTimeRemainingUnlimited != IOPSGetTimeRemainingEstimate()))
+    {
+        printf("[FAIL] Unit 0 is on AC power, but IOPSGetTimeRemainingEstimate() is %f\n",
+               IOPSGetTimeRemainingEstimate());
+    }
+
+    for (int unit = 0; unit < units; unit++)
+    {
+        IOPSReleasePowerSource(ids[unit]);
+    }
+
+    return 0;
+}
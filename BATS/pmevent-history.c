@@ -0,0 +1,388 @@
+/*
+ * pmevent-history.c
+ *
+ * Checks that powerd's binary PM event history reads back what was
+ * written, that its index finds the same records as a full scan, that it
+ * survives a torn last record, rotation, a rotation that fails and a clock
+ * set back, and times index lookups against scanning every record.
+ */
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <mach/mach_time.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../pmconfigd/PMEventHistory.h"
+
+/***
+
+ Build with ../pmconfigd/PMEventHistory.c. Runs without powerd; all files
+ are written under /tmp.
+
+ ***/
+
+enum {
+    kCycles             = 10000,        // enough to rotate the log twice
+    kEventsPerCycle     = 8,
+    kLookups            = 100
+};
+
+static const char   *kPath = "/tmp/pmevent-history.history";
+static const char   *kOldPath = "/tmp/pmevent-history.history.old";
+
+static double msBetween(uint64_t start, uint64_t end)
+{
+    mach_timebase_info_data_t   tb;
+
+    mach_timebase_info(&tb);
+    return (double)(end - start) * tb.numer / tb.denom / 1000000.0;
+}
+
+static void removeHistory(void)
+{
+    const char  *suffixes[] = { "", ".index", ".old", ".old.index" };
+    char        path[256];
+
+    for (int i = 0; i < 4; i++) {
+        snprintf(path, sizeof(path), "%s%s", kPath, suffixes[i]);
+        unlink(path);
+    }
+    rmdir(kOldPath);
+}
+
+static void uuidForCycle(int cycle, char *buf, size_t len)
+{
+    snprintf(buf, len, "%08X-0000-4000-8000-%012X", cycle * 7919, cycle);
+}
+
+static int64_t timeOfSeq(long seq)
+{
+    return 1400000000LL + (int64_t)(seq / kEventsPerCycle) * 600 + (seq % kEventsPerCycle) * 30;
+}
+
+/*
+ * Writes records the way powerd logs a sleep/wake cycle: a boot every
+ * hundred cycles, then a sleep, a wake and assorted other events, each
+ * numbered with a "seq" field and 'timeShift' seconds off timeOfSeq().
+ * Returns the next seq; '*failed' counts appends that failed.
+ */
+static long writeCycles(PMEventHistory *h, int first, int count, long seq, int64_t timeShift, int *failed)
+{
+    const char      *keys[] = { "seq", "Domain", "uuid", "Value", "Message" };
+    const char      *values[5];
+    char            seqStr[24], uuid[40], valueStr[16];
+    PMEventKind     kind;
+
+    for (int c = first; c < first + count; c++)
+    {
+        uuidForCycle(c, uuid, sizeof(uuid));
+        for (int e = 0; e < kEventsPerCycle; e++)
+        {
+            kind = (e == 1) ? kPMEventSleep : (e == 2) ? kPMEventWake : kPMEventOther;
+            if ((e == 0) && (c % 100 == 0)) {
+                kind = kPMEventBoot;
+            }
+
+            snprintf(seqStr, sizeof(seqStr), "%ld", seq);
+            snprintf(valueStr, sizeof(valueStr), "%d", c % 100 + 1);
+            values[0] = seqStr;
+            values[1] = (kind == kPMEventBoot) ? "Start" : (kind == kPMEventSleep) ? "Sleep"
+                        : (kind == kPMEventWake) ? "Wake" : "Assertions";
+            values[2] = uuid;
+            values[3] = valueStr;
+            values[4] = "A message of typical length for the PM log, about this long.";
+
+            if (!PMEventHistoryAppend(h, timeOfSeq(seq) + timeShift, kind, c % 100 + 1, uuid,
+                                      keys, values, 5)) {
+                (*failed)++;
+            }
+            seq++;
+        }
+    }
+    return seq;
+}
+
+static long seqOf(const PMEventRecord *rec)
+{
+    const char  *s = PMEventRecordGet(rec, "seq");
+
+    return s ? strtol(s, NULL, 10) : -1;
+}
+
+/* Finds the first record of cycle 'uuid' by reading every record */
+static bool scanForUUID(PMEventHistory *h, const char *uuid, PMEventRecord *found)
+{
+    PMEventHistoryCursor    cursor;
+    PMEventRecord           rec;
+    const char              *u;
+
+    PMEventHistoryStart(h, &cursor);
+    while (PMEventHistoryNext(h, &cursor, &rec)) {
+        if ((u = PMEventRecordGet(&rec, "uuid")) && !strcasecmp(u, uuid)) {
+            *found = rec;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* The seq of the first record at or after 'time', by reading every record */
+static long scanForTime(PMEventHistory *h, int64_t time)
+{
+    PMEventHistoryCursor    cursor;
+    PMEventRecord           rec;
+
+    PMEventHistoryStart(h, &cursor);
+    while (PMEventHistoryNext(h, &cursor, &rec)) {
+        if (rec.time >= time) {
+            return seqOf(&rec);
+        }
+    }
+    return -1;
+}
+
+/* True if every index entry leads to a record of its kind and time */
+static bool indexMatchesLog(PMEventHistory *h)
+{
+    const PMEventIndexEntry *e;
+    PMEventHistoryCursor    cursor;
+    PMEventRecord           rec;
+
+    for (CFIndex i = 0; i < PMEventHistoryIndexCount(h); i++)
+    {
+        e = PMEventHistoryIndexEntryAt(h, i);
+        PMEventHistoryIndexCursor(h, i, &cursor);
+        if (!PMEventHistoryNext(h, &cursor, &rec) || (rec.time != e->time) || (rec.kind != e->kind)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool testHistory(void)
+{
+    PMEventHistory          *w, *r;
+    PMEventHistoryCursor    cursor;
+    PMEventRecord           rec, scanned;
+    long                    seq, first = -1, last = -1, expect;
+    bool                    inOrder = true, sameAsScan = true;
+    char                    uuid[40];
+    CFIndex                 i;
+    int                     c, failed = 0;
+    uint64_t                start, end;
+    double                  scanMs = 0, indexMs = 0;
+
+    removeHistory();
+    w = PMEventHistoryOpen(kPath, true);
+    if (!w) {
+        printf("[FAIL] Can't create %s\n", kPath);
+        return false;
+    }
+    seq = writeCycles(w, 0, kCycles, 0, 0, &failed);
+    r = PMEventHistoryOpen(kPath, false);
+    if (failed || !r) {
+        printf("[FAIL] %d appends failed; history %s for reading\n", failed, r ? "opens" : "doesn't open");
+        return false;
+    }
+
+    // Every record from the oldest kept to the last written, in order
+    PMEventHistoryStart(r, &cursor);
+    expect = -1;
+    while (PMEventHistoryNext(r, &cursor, &rec)) {
+        if (first < 0) {
+            first = expect = seqOf(&rec);
+        }
+        inOrder = inOrder && (seqOf(&rec) == expect++);
+        last = seqOf(&rec);
+    }
+    if (!inOrder || (last != seq - 1) || (first <= 0) || access(kOldPath, F_OK)) {
+        printf("[FAIL] Records %ld to %ld of %ld read back %s\n", first, last, seq,
+               inOrder ? "in order" : "out of order");
+        return false;
+    }
+    printf("[PASS] Records read back in order across a rotation\n");
+
+    // UUID lookups match a full scan, whatever the case of the UUID
+    srandom(1);
+    for (int l = 0; l < kLookups; l++)
+    {
+        c = kCycles - 1 - (random() % (kCycles / 4));
+        uuidForCycle(c, uuid, sizeof(uuid));
+        if (l & 1) {
+            for (char *u = uuid; *u; u++) {
+                *u = tolower(*u);
+            }
+        }
+
+        start = mach_absolute_time();
+        i = PMEventHistoryIndexFindUUID(r, uuid);
+        if (i >= 0) {
+            PMEventHistoryIndexCursor(r, i, &cursor);
+            PMEventHistoryNext(r, &cursor, &rec);
+        }
+        end = mach_absolute_time();
+        indexMs += msBetween(start, end);
+
+        start = mach_absolute_time();
+        if (!scanForUUID(r, uuid, &scanned) || (i < 0) || (seqOf(&rec) != seqOf(&scanned))) {
+            sameAsScan = false;
+        }
+        end = mach_absolute_time();
+        scanMs += msBetween(start, end);
+    }
+    uuidForCycle(kCycles, uuid, sizeof(uuid));
+    if (!sameAsScan || (PMEventHistoryIndexFindUUID(r, uuid) >= 0)) {
+        printf("[FAIL] Index UUID lookups don't match a full scan\n");
+        return false;
+    }
+    printf("[PASS] Index UUID lookups match a full scan\n");
+    printf("%d UUID lookups: full scan %.2f ms, index %.3f ms\n", kLookups, scanMs, indexMs);
+
+    // Time seeks land on the first record at or after the time
+    for (int l = 0; l < kLookups; l++)
+    {
+        int64_t t = 1400000000LL + (int64_t)(kCycles - 1 - random() % (kCycles / 4)) * 600 + random() % 600;
+
+        PMEventHistorySeekTime(r, t, &cursor);
+        if (!PMEventHistoryNext(r, &cursor, &rec) || (seqOf(&rec) != scanForTime(r, t))) {
+            sameAsScan = false;
+        }
+    }
+    if (!sameAsScan) {
+        printf("[FAIL] Time seeks don't find the first record at or after the time\n");
+        return false;
+    }
+    printf("[PASS] Time seeks find the first record at or after the time\n");
+
+    for (int b = 0; b < 3; b++) {
+        uuidForCycle((kCycles - 1) / 100 * 100 - b * 100, uuid, sizeof(uuid));
+        i = PMEventHistoryIndexFindBoot(r, b);
+        if ((i < 0) || strcmp(PMEventHistoryIndexEntryAt(r, i)->uuid, uuid)) {
+            printf("[FAIL] Boot %d ago isn't found\n", b);
+            return false;
+        }
+    }
+    if (PMEventHistoryIndexFindBoot(r, kCycles) >= 0) {
+        printf("[FAIL] A boot older than the history is found\n");
+        return false;
+    }
+    printf("[PASS] Boots are found by how long ago they were\n");
+    PMEventHistoryClose(r);
+
+    // A record torn by a crash mid-append
+    PMEventHistoryClose(w);
+    c = open(kPath, O_WRONLY | O_APPEND);
+    write(c, "\x40\x00\x00\x00torn record", 15);
+    close(c);
+
+    w = PMEventHistoryOpen(kPath, true);
+    seq = writeCycles(w, kCycles, 1, seq, 0, &failed);
+    r = PMEventHistoryOpen(kPath, false);
+    PMEventHistoryStart(r, &cursor);
+    last = -1;
+    while (PMEventHistoryNext(r, &cursor, &rec)) {
+        last = seqOf(&rec);
+    }
+    PMEventHistoryClose(r);
+    PMEventHistoryClose(w);
+    removeHistory();
+
+    if (failed || (last != seq - 1)) {
+        printf("[FAIL] Appends after a torn record read back through %ld, expected %ld\n", last, seq - 1);
+        return false;
+    }
+    printf("[PASS] Appends after a torn record read back\n");
+    return true;
+}
+
+/* A rotation that can't move the log leaves the log and its index paired */
+static bool testFailedRotation(void)
+{
+    PMEventHistory      *w, *r;
+    long                seq = 0;
+    int                 failed = 0;
+    bool                ok;
+
+    removeHistory();
+    mkdir(kOldPath, 0755);
+    w = PMEventHistoryOpen(kPath, true);
+    for (int c = 0; !failed && (c < kCycles); c++) {
+        seq = writeCycles(w, c, 1, seq, 0, &failed);
+    }
+    PMEventHistoryClose(w);
+
+    r = PMEventHistoryOpen(kPath, false);
+    ok = r && failed && (PMEventHistoryIndexCount(r) > 0) && indexMatchesLog(r);
+    if (r) {
+        PMEventHistoryClose(r);
+    }
+    removeHistory();
+
+    if (!ok) {
+        printf("[FAIL] A failed rotation left the log and its index apart (%d appends refused)\n", failed);
+        return false;
+    }
+    printf("[PASS] A failed rotation leaves the log and its index paired\n");
+    return true;
+}
+
+/* With the clock set back part way, seeks still find the first record in log order */
+static bool testClockSetBack(void)
+{
+    PMEventHistory      *w, *r;
+    PMEventHistoryCursor cursor;
+    PMEventRecord       rec;
+    long                seq;
+    int                 failed = 0;
+    bool                ok = true;
+
+    removeHistory();
+    w = PMEventHistoryOpen(kPath, true);
+    seq = writeCycles(w, 0, 100, 0, 0, &failed);
+    seq = writeCycles(w, 100, 100, seq, -100 * 600 - 86400, &failed);
+    PMEventHistoryClose(w);
+
+    r = PMEventHistoryOpen(kPath, false);
+    if (failed || !r) {
+        printf("[FAIL] Can't write a history with the clock set back\n");
+        removeHistory();
+        return false;
+    }
+    for (int l = 0; l < kLookups; l++)
+    {
+        int64_t t = timeOfSeq(random() % seq) - 86400 * (random() % 2);
+
+        PMEventHistorySeekTime(r, t, &cursor);
+        if ((PMEventHistoryNext(r, &cursor, &rec) ? seqOf(&rec) : -1) != scanForTime(r, t)) {
+            ok = false;
+        }
+    }
+    PMEventHistoryClose(r);
+    removeHistory();
+
+    if (!ok) {
+        printf("[FAIL] Time seeks after the clock was set back don't match a full scan\n");
+        return false;
+    }
+    printf("[PASS] Time seeks after the clock was set back match a full scan\n");
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    bool    passed;
+
+    printf("Executing pmevent-history\n");
+
+    passed = testHistory();
+    passed = testFailedRotation() && passed;
+    passed = testClockSetBack() && passed;
+
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,153 @@
+/*
+ * pmtrace-rings.c
+ *
+ * Exercises the tracepoint ring layout that powerd writes and the copy
+ * `pmset -g trace` reads it back with, then checks that `pmset -g trace`
+ * emits a complete Chrome trace event document.
+ */
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../pmconfigd/PMTrace.h"
+
+/***
+
+ Header only; needs no powerd sources. The ring checks run against a private
+ PMTraceShared. The pmset check runs against the live powerd, and is skipped
+ if powerd was built without PMTRACE.
+
+ ***/
+
+PMTraceShared *gPMTrace = NULL;
+
+static uint64_t tracedFunction(uint64_t n)
+{
+    PMTRACE_SCOPE(kPMTraceEvaluateAssertions, 0);
+
+    PMTRACE_PAYLOAD(n);
+    return n;
+}
+
+static bool testLayout(void)
+{
+    if ((kPMTraceRingSize & (kPMTraceRingSize - 1))
+        || (sizeof(PMTraceRecord) != 24)
+        || (offsetof(PMTraceRing, records) != 8)
+        || (offsetof(PMTraceShared, rings) != 16))
+    {
+        printf("[FAIL] Trace ring layout changed without a version bump: record %zu bytes, rings at %zu\n",
+               sizeof(PMTraceRecord), offsetof(PMTraceShared, rings));
+        return false;
+    }
+    printf("[PASS] Trace ring layout matches version %d\n", kPMTraceSharedVersion);
+    return true;
+}
+
+static bool testRings(void)
+{
+    static PMTraceRing  ring;
+    PMTraceShared       *shared;
+    const PMTraceRecord *rec;
+    uint32_t            total = kPMTraceRingSize * 3 / 2 + 7;
+    uint32_t            first, count, n;
+
+    shared = calloc(1, sizeof(PMTraceShared));
+    shared->version = kPMTraceSharedVersion;
+    shared->ringSize = kPMTraceRingSize;
+
+    // Nothing is recorded before the rings are mapped
+    tracedFunction(1);
+    gPMTrace = shared;
+
+    for (n = 0; n < total; n++) {
+        tracedFunction(n);
+    }
+    PMTraceRecordSpan(kPMTraceMIG, 100, 150, 2);
+
+    count = PMTraceCopyRing(shared, kPMTraceEvaluateAssertions, &ring, &first);
+    if ((count != total) || (first != total - kPMTraceRingSize + 1)) {
+        printf("[FAIL] Wrapped ring copies records %u to %u, expected %u to %u\n",
+               first, count, total - kPMTraceRingSize + 1, total);
+        return false;
+    }
+    for (n = first; n < count; n++) {
+        rec = &ring.records[n & (kPMTraceRingSize - 1)];
+        if ((rec->payload != n) || !rec->begin || (rec->end < rec->begin)) {
+            printf("[FAIL] Record %u holds payload %llu, span %llu-%llu\n",
+                   n, rec->payload, rec->begin, rec->end);
+            return false;
+        }
+    }
+
+    count = PMTraceCopyRing(shared, kPMTraceMIG, &ring, &first);
+    if ((count != 1) || first || (ring.records[0].begin != 100) || (ring.records[0].end != 150)
+        || (ring.records[0].payload != 2))
+    {
+        printf("[FAIL] A single record copies as %u to %u\n", first, count);
+        return false;
+    }
+
+    count = PMTraceCopyRing(shared, kPMTraceEnergySettings, &ring, &first);
+    if (count || first) {
+        printf("[FAIL] An empty ring copies as %u to %u\n", first, count);
+        return false;
+    }
+
+    gPMTrace = NULL;
+    free(shared);
+    printf("[PASS] Trace rings wrap and copy back oldest first\n");
+    return true;
+}
+
+static bool testPmset(void)
+{
+    FILE    *fp;
+    char    line[512];
+    int     lines = 0;
+    bool    opened = false, closed = false;
+
+    if (!PMTraceSharedMap()) {
+        printf("[PASS] powerd has no trace rings; skipping pmset -g trace\n");
+        return true;
+    }
+
+    fp = popen("pmset -g trace", "r");
+    if (!fp) {
+        printf("[FAIL] Can't run pmset -g trace\n");
+        return false;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        if (!lines) {
+            opened = !strcmp(line, "{\"traceEvents\":[\n");
+        } else if (strstr(line, "\"ph\":\"X\"") && !strstr(line, "\"cat\":\"powerd\"")) {
+            opened = false;
+        }
+        closed = !strcmp(line, "],\"displayTimeUnit\":\"ms\"}\n");
+        lines++;
+    }
+    pclose(fp);
+
+    if (!opened || !closed) {
+        printf("[FAIL] pmset -g trace output isn't a trace event document (%d lines)\n", lines);
+        return false;
+    }
+    printf("[PASS] pmset -g trace decodes %d events\n", lines - 3);
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    bool    passed;
+
+    printf("Executing pmtrace-rings\n");
+
+    passed = testLayout();
+    passed = testRings() && passed;
+    passed = testPmset() && passed;
+
+    return passed ? 0 : 1;
+}
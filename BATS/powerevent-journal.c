@@ -0,0 +1,325 @@
+/*
+ * powerevent-journal.c
+ *
+ * Checks that powerd's scheduled power event journal replays to the same
+ * events it was given, survives a torn last record and compaction, and
+ * times it against rewriting the whole event plist on every change.
+ */
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <IOKit/pwr_mgt/IOPMLib.h>
+#include <mach/mach_time.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "../pmconfigd/PowerEventQueue.h"
+#include "../pmconfigd/PowerEventJournal.h"
+
+/***
+
+ Build with ../pmconfigd/PowerEventQueue.c and ../pmconfigd/PowerEventJournal.c.
+ Runs without powerd; all files are written under /tmp.
+
+ ***/
+
+enum {
+    kTypes                  = 6,        // sleep, shutdown, restart, wake, poweron, wakeorpoweron
+    kCheckOperations        = 5000,
+    kTimedChanges           = 1000      // kIOPMMaxScheduledEntries in AutoWakeScheduler.c
+};
+
+static const char   *kJournalPath       = "/tmp/powerevent-journal.journal";
+static const char   *kPlistPath         = "/tmp/powerevent-journal.plist";
+
+static double msBetween(uint64_t start, uint64_t end)
+{
+    mach_timebase_info_data_t   tb;
+
+    mach_timebase_info(&tb);
+    return (double)(end - start) * tb.numer / tb.denom / 1000000.0;
+}
+
+static CFDictionaryRef createEvent(CFAbsoluteTime t, int owner)
+{
+    CFDateRef           date = CFDateCreate(0, t);
+    CFStringRef         app = CFStringCreateWithFormat(0, NULL, CFSTR("com.apple.bench.%d"), owner);
+    CFDictionaryRef     event;
+    const void          *keys[] = { CFSTR(kIOPMPowerEventTimeKey), CFSTR(kIOPMPowerEventAppNameKey),
+                                    CFSTR(kIOPMPowerEventTypeKey) };
+    const void          *values[] = { date, app, CFSTR(kIOPMAutoWake) };
+
+    event = CFDictionaryCreate(0, keys, values, 3, &kCFTypeDictionaryKeyCallBacks,
+                               &kCFTypeDictionaryValueCallBacks);
+    CFRelease(date);
+    CFRelease(app);
+    return event;
+}
+
+static bool sameEvents(PowerEventQueue *a, PowerEventQueue *b)
+{
+    CFArrayRef  ea, eb;
+    bool        same = true;
+
+    for (int type = 0; same && (type < kTypes); type++)
+    {
+        ea = PowerEventQueueCopyEvents(a, type);
+        eb = PowerEventQueueCopyEvents(b, type);
+        same = ea && eb && CFEqual(ea, eb);
+        if (ea) CFRelease(ea);
+        if (eb) CFRelease(eb);
+    }
+    return same;
+}
+
+static PowerEventQueue *reopen(PowerEventJournal **j, bool *replayed)
+{
+    PowerEventQueue *q = PowerEventQueueCreate(kTypes);
+
+    if (*j) {
+        PowerEventJournalClose(*j);
+    }
+    *j = PowerEventJournalOpen(kJournalPath, q, kTypes, replayed);
+    return q;
+}
+
+/*
+ * Applies random adds and cancels to 'model' and the journal alike.
+ */
+static void randomChanges(PowerEventQueue *model, PowerEventJournal *j, int count)
+{
+    CFDictionaryRef event;
+    PowerEvent      *pe;
+    int             type;
+
+    for (int i = 0; i < count; i++)
+    {
+        type = random() % kTypes;
+        pe = PowerEventQueueEarliestAtOrAfter(model, type, random() % 500);
+
+        if (pe && (random() % 3 == 0)) {
+            event = CFRetain(pe->event);
+            PowerEventJournalAppend(j, kPowerEventJournalCancel, type, event);
+            PowerEventQueueRemove(model, pe);
+        } else {
+            event = createEvent(random() % 500, random() % 8);
+            PowerEventJournalAppend(j, kPowerEventJournalAdd, type, event);
+            PowerEventQueueAdd(model, type,
+                    CFDateGetAbsoluteTime(CFDictionaryGetValue(event, CFSTR(kIOPMPowerEventTimeKey))), event);
+        }
+        CFRelease(event);
+    }
+}
+
+static bool testReplay(void)
+{
+    PowerEventJournal   *j = NULL;
+    PowerEventQueue     *model = PowerEventQueueCreate(kTypes);
+    PowerEventQueue     *q;
+    const char          *failed = NULL;
+    bool                replayed;
+    int                 fd;
+
+    unlink(kJournalPath);
+    q = reopen(&j, &replayed);
+    if (!j) {
+        printf("[FAIL] Can't create %s\n", kJournalPath);
+        PowerEventQueueRelease(q);
+        PowerEventQueueRelease(model);
+        return false;
+    }
+    if (replayed) {
+        failed = "A new journal reports events to replay";
+        goto exit;
+    }
+    PowerEventQueueRelease(q);
+
+    srandom(1);
+    randomChanges(model, j, kCheckOperations);
+
+    q = reopen(&j, &replayed);
+    if (!replayed || !sameEvents(model, q)) {
+        failed = "Replay doesn't match the events as scheduled";
+        goto exit;
+    }
+    PowerEventQueueRelease(q);
+
+    // A record torn by a crash mid-append
+    fd = open(kJournalPath, O_WRONLY | O_APPEND);
+    write(fd, "\x40\x00\x00\x00\x01\x03\x00\x00torn", 12);
+    close(fd);
+
+    q = reopen(&j, &replayed);
+    if (!replayed || !sameEvents(model, q)) {
+        failed = "Replay doesn't drop a torn last record";
+        goto exit;
+    }
+
+    randomChanges(model, j, 10);
+    PowerEventQueueRelease(q);
+    q = reopen(&j, &replayed);
+    if (!replayed || !sameEvents(model, q)) {
+        failed = "Appends after a torn record don't replay";
+        goto exit;
+    }
+
+    PowerEventJournalCompactIfNeeded(j, q, kTypes, true);
+    if (PowerEventJournalRecordCount(j) >= kCheckOperations) {
+        failed = "Compaction doesn't drop cancelled events";
+        goto exit;
+    }
+    randomChanges(model, j, 10);
+    PowerEventQueueRelease(q);
+    q = reopen(&j, &replayed);
+    if (!replayed || !sameEvents(model, q)) {
+        failed = "Replay after compaction doesn't match";
+        goto exit;
+    }
+    PowerEventQueueRelease(q);
+
+    // Not a journal at all
+    fd = open(kJournalPath, O_WRONLY | O_TRUNC);
+    write(fd, "<?xml", 5);
+    close(fd);
+
+    q = reopen(&j, &replayed);
+    if (replayed || PowerEventQueueCount(q, 0)) {
+        failed = "A corrupt journal header isn't reset";
+        goto exit;
+    }
+
+exit:
+    PowerEventQueueRelease(q);
+    PowerEventJournalClose(j);
+    PowerEventQueueRelease(model);
+    unlink(kJournalPath);
+
+    if (failed) {
+        printf("[FAIL] %s\n", failed);
+        return false;
+    }
+    printf("[PASS] The journal replays through torn records, compaction and a corrupt header\n");
+    return true;
+}
+
+/*
+ * The pre-journal persistence: every change wrote the whole sorted array
+ * out as a plist and committed it to disk.
+ */
+static void writePlist(PowerEventQueue *q)
+{
+    CFMutableDictionaryRef  prefs;
+    CFArrayRef              events;
+    CFDataRef               data;
+    CFStringRef             key;
+    int                     fd;
+
+    prefs = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks,
+                                      &kCFTypeDictionaryValueCallBacks);
+    for (int type = 0; type < kTypes; type++)
+    {
+        key = CFStringCreateWithFormat(0, NULL, CFSTR("%d"), type);
+        events = PowerEventQueueCopyEvents(q, type);
+        CFDictionarySetValue(prefs, key, events);
+        CFRelease(events);
+        CFRelease(key);
+    }
+
+    data = CFPropertyListCreateData(0, prefs, kCFPropertyListXMLFormat_v1_0, 0, NULL);
+    fd = open(kPlistPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    write(fd, CFDataGetBytePtr(data), CFDataGetLength(data));
+    fsync(fd);
+    close(fd);
+
+    CFRelease(data);
+    CFRelease(prefs);
+}
+
+static bool timeChanges(void)
+{
+    PowerEventJournal   *j = NULL;
+    PowerEventQueue     *q;
+    CFDictionaryRef     event;
+    bool                replayed;
+    uint64_t            start, end;
+    double              plistMs, journalMs, syncedMs;
+    bool                ok;
+
+    // Whole plist per change
+    unlink(kPlistPath);
+    q = PowerEventQueueCreate(kTypes);
+    start = mach_absolute_time();
+    for (int i = 0; i < kTimedChanges; i++)
+    {
+        event = createEvent(i, i % 8);
+        PowerEventQueueAdd(q, i % kTypes, i, event);
+        CFRelease(event);
+        writePlist(q);
+    }
+    end = mach_absolute_time();
+    plistMs = msBetween(start, end);
+    PowerEventQueueRelease(q);
+
+    // Journal, fsync batched as in powerd
+    unlink(kJournalPath);
+    q = reopen(&j, &replayed);
+    start = mach_absolute_time();
+    for (int i = 0; i < kTimedChanges; i++)
+    {
+        event = createEvent(i, i % 8);
+        PowerEventQueueAdd(q, i % kTypes, i, event);
+        PowerEventJournalAppend(j, kPowerEventJournalAdd, i % kTypes, event);
+        CFRelease(event);
+    }
+    PowerEventJournalSync(j);
+    end = mach_absolute_time();
+    journalMs = msBetween(start, end);
+
+    // Journal, fsync on every change
+    start = mach_absolute_time();
+    for (int i = 0; i < kTimedChanges; i++)
+    {
+        event = createEvent(i, i % 8);
+        PowerEventJournalAppend(j, kPowerEventJournalCancel, i % kTypes, event);
+        PowerEventJournalSync(j);
+        CFRelease(event);
+    }
+    end = mach_absolute_time();
+    syncedMs = msBetween(start, end);
+    PowerEventQueueRelease(q);
+
+    printf("%d changes: plist rewrite %.1f ms, journal %.1f ms, journal with fsync per change %.1f ms\n",
+           kTimedChanges, plistMs, journalMs, syncedMs);
+
+    // Startup: replay 2x kTimedChanges records
+    start = mach_absolute_time();
+    q = reopen(&j, &replayed);
+    end = mach_absolute_time();
+    printf("Replaying %ld records: %.2f ms\n", PowerEventJournalRecordCount(j), msBetween(start, end));
+    ok = replayed && (0 == PowerEventQueueCount(q, 0));
+    PowerEventQueueRelease(q);
+
+    PowerEventJournalClose(j);
+    unlink(kJournalPath);
+    unlink(kPlistPath);
+
+    if (!ok) {
+        printf("[FAIL] The timed journal doesn't replay to empty\n");
+        return false;
+    }
+    printf("[PASS] The timed journal replays to empty\n");
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    bool    passed;
+
+    printf("Executing powerevent-journal\n");
+
+    passed = testReplay();
+    passed = timeChanges() && passed;
+
+    return passed ? 0 : 1;
+}
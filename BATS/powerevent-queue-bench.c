@@ -0,0 +1,334 @@
+/*
+ * powerevent-queue-bench.c
+ *
+ * Checks powerd's scheduled power event queue against a brute force model,
+ * then times it against the sorted CFArray it replaced, up to
+ * kIOPMMaxScheduledEntries and beyond.
+ */
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <IOKit/pwr_mgt/IOPMLib.h>
+#include <mach/mach_time.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "../pmconfigd/PowerEventQueue.h"
+
+/***
+
+ Build with ../pmconfigd/PowerEventQueue.c. Runs without powerd.
+
+ ***/
+
+enum {
+    kTypes                  = 6,        // sleep, shutdown, restart, wake, poweron, wakeorpoweron
+    kWakeType               = 3,
+    kWakeOrPowerOnType      = 5,
+    kCheckOperations        = 5000,
+    kMaxScheduledEntries    = 1000      // kIOPMMaxScheduledEntries in AutoWakeScheduler.c
+};
+
+static const int    kQueueSizes[]       = { 100, kMaxScheduledEntries, 10000, 100000 };
+static const int    kMaxArrayBaseline   = 2000;
+
+static double msBetween(uint64_t start, uint64_t end)
+{
+    mach_timebase_info_data_t   tb;
+
+    mach_timebase_info(&tb);
+    return (double)(end - start) * tb.numer / tb.denom / 1000000.0;
+}
+
+static CFDictionaryRef createEvent(CFAbsoluteTime t, int owner)
+{
+    CFDateRef           date = CFDateCreate(0, t);
+    CFStringRef         app = CFStringCreateWithFormat(0, NULL, CFSTR("com.apple.bench.%d"), owner);
+    CFDictionaryRef     event;
+    const void          *keys[] = { CFSTR(kIOPMPowerEventTimeKey), CFSTR(kIOPMPowerEventAppNameKey) };
+    const void          *values[] = { date, app };
+
+    event = CFDictionaryCreate(0, keys, values, 2, &kCFTypeDictionaryKeyCallBacks,
+                               &kCFTypeDictionaryValueCallBacks);
+    CFRelease(date);
+    CFRelease(app);
+    return event;
+}
+
+/*
+ * The pre-queue implementation: one sorted CFArray per type, appended and
+ * resorted on add, scanned on cancel, merged and resorted to find the
+ * next wake.
+ */
+static CFComparisonResult compareEvDates(CFDictionaryRef a1, CFDictionaryRef a2, void *c)
+{
+    return CFDateCompare(CFDictionaryGetValue(a1, CFSTR(kIOPMPowerEventTimeKey)),
+                         CFDictionaryGetValue(a2, CFSTR(kIOPMPowerEventTimeKey)), 0);
+}
+
+static void arrayAdd(CFMutableArrayRef arr, CFDictionaryRef event)
+{
+    CFArrayAppendValue(arr, event);
+    CFArraySortValues(arr, CFRangeMake(0, CFArrayGetCount(arr)),
+                      (CFComparatorFunction)compareEvDates, 0);
+}
+
+static bool arrayRemove(CFMutableArrayRef arr, CFDictionaryRef event)
+{
+    CFIndex     count = CFArrayGetCount(arr);
+
+    for (CFIndex i = 0; i < count; i++) {
+        CFDictionaryRef cancelee = CFArrayGetValueAtIndex(arr, i);
+        if ((kCFCompareEqualTo == compareEvDates(event, cancelee, 0))
+            && CFEqual(CFDictionaryGetValue(event, CFSTR(kIOPMPowerEventAppNameKey)),
+                       CFDictionaryGetValue(cancelee, CFSTR(kIOPMPowerEventAppNameKey))))
+        {
+            CFArrayRemoveValueAtIndex(arr, i);
+            return true;
+        }
+    }
+    return false;
+}
+
+static CFAbsoluteTime arrayEarliestWake(CFMutableArrayRef wake, CFMutableArrayRef wakeorpoweron)
+{
+    CFMutableArrayRef   merged = CFArrayCreateMutableCopy(0, 0, wake);
+    CFAbsoluteTime      t = 0.0;
+
+    CFArrayAppendArray(merged, wakeorpoweron, CFRangeMake(0, CFArrayGetCount(wakeorpoweron)));
+    CFArraySortValues(merged, CFRangeMake(0, CFArrayGetCount(merged)),
+                      (CFComparatorFunction)compareEvDates, 0);
+    if (CFArrayGetCount(merged)) {
+        t = CFDateGetAbsoluteTime(CFDictionaryGetValue(CFArrayGetValueAtIndex(merged, 0),
+                                                       CFSTR(kIOPMPowerEventTimeKey)));
+    }
+    CFRelease(merged);
+    return t;
+}
+
+static CFAbsoluteTime queueEarliestWake(PowerEventQueue *q)
+{
+    PowerEvent  *a = PowerEventQueueEarliest(q, kWakeType);
+    PowerEvent  *b = PowerEventQueueEarliest(q, kWakeOrPowerOnType);
+
+    if (!a) return b ? b->time : 0.0;
+    if (!b) return a->time;
+    return (a->time <= b->time) ? a->time : b->time;
+}
+
+/*
+ * Random adds and cancels, checked against a plain list after every step.
+ */
+typedef struct {
+    int             type;
+    CFAbsoluteTime  time;
+    int             owner;
+    bool            live;
+} ModelEvent;
+
+static bool testModel(void)
+{
+    PowerEventQueue     *q = PowerEventQueueCreate(kTypes);
+    ModelEvent          *model = calloc(kCheckOperations, sizeof(ModelEvent));
+    int                 modelCount = 0;
+    int                 mismatches = 0;
+
+    srandom(1);
+    for (int op = 0; op < kCheckOperations; op++)
+    {
+        // Coarse times and few owners, so equal keys happen
+        if ((0 == modelCount) || (random() % 3)) {
+            ModelEvent      *m = &model[modelCount++];
+            CFDictionaryRef event;
+
+            m->type = (int)(random() % kTypes);
+            m->time = (CFAbsoluteTime)(random() % 500);
+            m->owner = (int)(random() % 4);
+            m->live = true;
+
+            event = createEvent(m->time, m->owner);
+            if (!PowerEventQueueAdd(q, m->type, m->time, event)) {
+                mismatches++;
+            }
+            CFRelease(event);
+        } else {
+            ModelEvent      *m = &model[random() % modelCount];
+            CFStringRef     app = CFStringCreateWithFormat(0, NULL, CFSTR("com.apple.bench.%d"), m->owner);
+            PowerEvent      *pe = PowerEventQueueFind(q, m->type, m->time, app);
+            ModelEvent      *live = NULL;
+
+            CFRelease(app);
+
+            // Any live event with the same key may be found; retire one
+            for (int i = 0; i < modelCount; i++) {
+                if (model[i].live && (model[i].type == m->type)
+                    && (model[i].time == m->time) && (model[i].owner == m->owner)) {
+                    live = &model[i];
+                    break;
+                }
+            }
+            if ((live != NULL) != (pe != NULL)) {
+                mismatches++;
+            }
+            if (pe) {
+                if (live) live->live = false;
+                PowerEventQueueRemove(q, pe);
+            }
+        }
+
+        // Earliest per type, count per type, and earliest after a cutoff
+        for (int type = 0; type < kTypes; type++)
+        {
+            CFAbsoluteTime  cutoff = (CFAbsoluteTime)(op % 500);
+            CFAbsoluteTime  min = -1, minAfter = -1;
+            CFIndex         count = 0;
+            PowerEvent      *pe;
+
+            for (int i = 0; i < modelCount; i++) {
+                if (!model[i].live || (model[i].type != type)) continue;
+                count++;
+                if ((min < 0) || (model[i].time < min)) min = model[i].time;
+                if ((model[i].time >= cutoff) && ((minAfter < 0) || (model[i].time < minAfter)))
+                    minAfter = model[i].time;
+            }
+
+            pe = PowerEventQueueEarliest(q, type);
+            if ((pe ? pe->time : -1) != min) mismatches++;
+            pe = PowerEventQueueEarliestAtOrAfter(q, type, cutoff);
+            if ((pe ? pe->time : -1) != minAfter) mismatches++;
+            if (PowerEventQueueCount(q, type) != count) mismatches++;
+        }
+    }
+
+    // Exported arrays must be sorted
+    for (int type = 0; type < kTypes; type++)
+    {
+        CFArrayRef  events = PowerEventQueueCopyEvents(q, type);
+        for (CFIndex i = 1; events && (i < CFArrayGetCount(events)); i++) {
+            if (kCFCompareGreaterThan == compareEvDates(CFArrayGetValueAtIndex(events, i - 1),
+                                                        CFArrayGetValueAtIndex(events, i), 0)) {
+                mismatches++;
+            }
+        }
+        if (events) CFRelease(events);
+    }
+
+    PowerEventQueueRelease(q);
+    free(model);
+
+    if (mismatches) {
+        printf("[FAIL] PowerEventQueue disagreed with the model %d times in %d operations\n",
+               mismatches, kCheckOperations);
+        return false;
+    }
+    printf("[PASS] PowerEventQueue matches the model over %d operations\n", kCheckOperations);
+    return true;
+}
+
+/*
+ * Schedule n events, look up the next wake after each, then cancel them all
+ * in random order.
+ */
+static bool bench(int n)
+{
+    CFDictionaryRef     *events = calloc(n, sizeof(CFDictionaryRef));
+    int                 *types = calloc(n, sizeof(int));
+    int                 *order = calloc(n, sizeof(int));
+    PowerEventQueue     *q = PowerEventQueueCreate(kTypes);
+    CFAbsoluteTime      now = CFAbsoluteTimeGetCurrent();
+    volatile double     sink = 0;
+    uint64_t            start, end;
+    double              queueMs, arrayMs = 0;
+    bool                passed = true;
+
+    srandom(n);
+    for (int i = 0; i < n; i++) {
+        events[i] = createEvent(now + (random() % (7 * 24 * 3600)), i);
+        types[i] = (int)(random() % kTypes);
+        order[i] = i;
+    }
+    for (int i = n - 1; i > 0; i--) {
+        int j = (int)(random() % (i + 1));
+        int t = order[i]; order[i] = order[j]; order[j] = t;
+    }
+
+    start = mach_absolute_time();
+    for (int i = 0; i < n; i++) {
+        CFDateRef d = CFDictionaryGetValue(events[i], CFSTR(kIOPMPowerEventTimeKey));
+        PowerEventQueueAdd(q, types[i], CFDateGetAbsoluteTime(d), events[i]);
+        sink += queueEarliestWake(q);
+    }
+    for (int i = 0; i < n; i++) {
+        CFDictionaryRef e = events[order[i]];
+        CFDateRef       d = CFDictionaryGetValue(e, CFSTR(kIOPMPowerEventTimeKey));
+        PowerEvent      *pe = PowerEventQueueFind(q, types[order[i]], CFDateGetAbsoluteTime(d),
+                                                  CFDictionaryGetValue(e, CFSTR(kIOPMPowerEventAppNameKey)));
+        if (pe) PowerEventQueueRemove(q, pe);
+        sink += queueEarliestWake(q);
+    }
+    end = mach_absolute_time();
+    queueMs = msBetween(start, end);
+
+    if (n <= kMaxArrayBaseline)
+    {
+        CFMutableArrayRef   arrays[kTypes];
+
+        for (int t = 0; t < kTypes; t++) {
+            arrays[t] = CFArrayCreateMutable(0, 0, &kCFTypeArrayCallBacks);
+        }
+
+        start = mach_absolute_time();
+        for (int i = 0; i < n; i++) {
+            arrayAdd(arrays[types[i]], events[i]);
+            sink += arrayEarliestWake(arrays[kWakeType], arrays[kWakeOrPowerOnType]);
+        }
+        for (int i = 0; i < n; i++) {
+            arrayRemove(arrays[types[order[i]]], events[order[i]]);
+            sink += arrayEarliestWake(arrays[kWakeType], arrays[kWakeOrPowerOnType]);
+        }
+        end = mach_absolute_time();
+        arrayMs = msBetween(start, end);
+
+        for (int t = 0; t < kTypes; t++) {
+            CFRelease(arrays[t]);
+        }
+        printf("%7d events: queue %9.2f ms   sorted arrays %9.2f ms\n", n, queueMs, arrayMs);
+    } else {
+        printf("%7d events: queue %9.2f ms   sorted arrays (skipped)\n", n, queueMs);
+    }
+
+    for (int t = 0; t < kTypes; t++) {
+        if (PowerEventQueueCount(q, t)) {
+            printf("[FAIL] %ld events of type %d left after cancelling all %d\n",
+                   (long)PowerEventQueueCount(q, t), t, n);
+            passed = false;
+        }
+    }
+
+    PowerEventQueueRelease(q);
+    for (int i = 0; i < n; i++) {
+        CFRelease(events[i]);
+    }
+    free(events);
+    free(types);
+    free(order);
+    return passed;
+}
+
+int main(int argc, char *argv[])
+{
+    bool    passed, scheduled = true;
+
+    printf("Executing powerevent-queue-bench\n");
+
+    passed = testModel();
+
+    for (unsigned i = 0; i < sizeof(kQueueSizes) / sizeof(kQueueSizes[0]); i++) {
+        scheduled = bench(kQueueSizes[i]) && scheduled;
+    }
+    if (scheduled) {
+        printf("[PASS] Scheduled and cancelled up to %d events\n",
+               kQueueSizes[sizeof(kQueueSizes) / sizeof(kQueueSizes[0]) - 1]);
+    }
+
+    return (passed && scheduled) ? 0 : 1;
+}
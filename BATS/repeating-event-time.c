@@ -0,0 +1,277 @@
+/*
+ * repeating-event-time.c
+ *
+ * Compares powerd's arithmetic next-occurrence calculation for repeating
+ * power events against the CFCalendar based calculation it replaced, at
+ * random times and around daylight saving transitions, and times both.
+ */
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <mach/mach_time.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../pmconfigd/RepeatingEventTime.h"
+
+/***
+
+ Build with ../pmconfigd/RepeatingEventTime.c. Runs without powerd.
+
+ Where a daylight saving change skips or repeats the local time, CFCalendar
+ may resolve it differently. Those results must match the resolution
+ RepeatingEventNextOccurrence() documents, and are counted separately.
+
+ ***/
+
+static const char *kTimeZones[] = {
+    "America/Los_Angeles", "America/New_York", "America/Sao_Paulo", "Europe/London",
+    "Europe/Berlin", "Asia/Kolkata", "Asia/Tokyo", "Australia/Lord_Howe",
+    "Pacific/Chatham", "Pacific/Apia", "UTC"
+};
+
+enum {
+    kRandomChecks       = 200000,
+    kTransitionChecks   = 2000,
+    kTimedCalls         = 100000
+};
+
+/*
+ * The CFCalendar implementation from RepeatingAutoWake.c, with 'now' and
+ * the calendar passed in.
+ */
+static int referenceDaysUntil(CFCalendarRef cal, CFAbsoluteTime now, int days_mask, int minutes, int today)
+{
+    int hour, minute;
+    int check = today % 7;
+
+    if (0 == days_mask) return -1;
+
+    if (days_mask & (1 << (today - 1))) {
+        CFCalendarDecomposeAbsoluteTime(cal, now, "Hm", &hour, &minute);
+        if (60 * minutes >= 60 * (hour * 60 + minute) + 5) {
+            return 0;
+        }
+    }
+
+    while (!(days_mask & (1 << check))) {
+        check = (check + 1) % 7;
+    }
+    check -= today;
+    check++;
+    check += 7;
+    check %= 7;
+    if (check == 0) check = 7;
+
+    return check;
+}
+
+/*
+ * Optionally also returns the local time it composed, as seconds since the
+ * reference date, in 'wall'; 'gmt' is a calendar in GMT to compose it with.
+ */
+static CFAbsoluteTime referenceNext(CFCalendarRef cal, CFAbsoluteTime now, int days_mask, int minutes,
+                                    CFCalendarRef gmt, CFAbsoluteTime *wall)
+{
+    CFAbsoluteTime  adjusted = now;
+    CFAbsoluteTime  ev_time = 0.0;
+    int             year, month, day, day_of_week;
+
+    CFCalendarDecomposeAbsoluteTime(cal, now, "E", &day_of_week);
+    day_of_week = (day_of_week == 1) ? 7 : day_of_week - 1;
+
+    CFCalendarAddComponents(cal, &adjusted, 0, "d",
+                            referenceDaysUntil(cal, now, days_mask, minutes, day_of_week));
+    CFCalendarDecomposeAbsoluteTime(cal, adjusted, "yMd", &year, &month, &day);
+    CFCalendarComposeAbsoluteTime(cal, &ev_time, "yMdHms", year, month, day,
+                                  minutes / 60, minutes % 60, 0);
+    if (wall) {
+        CFCalendarComposeAbsoluteTime(gmt, wall, "yMdHms", year, month, day,
+                                      minutes / 60, minutes % 60, 0);
+    }
+    return ev_time;
+}
+
+/*
+ * True if 'minutes' past local midnight on the day of 't' is skipped or
+ * repeated: the offset changes within a day of it.
+ */
+static bool nearTransition(CFTimeZoneRef tz, CFAbsoluteTime t)
+{
+    return CFTimeZoneGetSecondsFromGMT(tz, t - 86400) != CFTimeZoneGetSecondsFromGMT(tz, t + 86400);
+}
+
+/*
+ * The resolution RepeatingEventNextOccurrence() documents for 'wall': the
+ * first whole minute from 'now' on whose local time has reached 'wall'.
+ * That's 'wall' itself unless it's skipped, when it's the end of the gap,
+ * or repeated, when it's the first time round that hasn't passed.
+ */
+static CFAbsoluteTime documentedNext(CFTimeZoneRef tz, CFAbsoluteTime now, CFAbsoluteTime wall)
+{
+    CFAbsoluteTime  t;
+
+    // Offsets from GMT are within a day
+    for (t = wall - 86400; t < wall + 86400; t += 60) {
+        if ((t >= now) && (t + CFTimeZoneGetSecondsFromGMT(tz, t) >= wall)) {
+            return t;
+        }
+    }
+    return 0.0;
+}
+
+static double nsPerCall(uint64_t start, uint64_t end, int iterations)
+{
+    mach_timebase_info_data_t   tb;
+
+    mach_timebase_info(&tb);
+    return (double)(end - start) * tb.numer / tb.denom / iterations;
+}
+
+typedef struct {
+    int             checks;
+    int             differences;
+    int             transitionDiffs;    // only in resolving a skipped or repeated local time
+} Comparison;
+
+static void compare(Comparison *cmp, CFCalendarRef cal, CFCalendarRef gmt, CFTimeZoneRef tz,
+                    CFAbsoluteTime now, int mask, int minutes)
+{
+    CFAbsoluteTime  wall = 0.0;
+    CFAbsoluteTime  reference = referenceNext(cal, now, mask, minutes, gmt, &wall);
+    CFAbsoluteTime  expected = reference;
+    CFAbsoluteTime  actual = 0.0;
+
+    cmp->checks++;
+    if (!RepeatingEventNextOccurrence(mask, minutes, now, tz, &actual)) {
+        printf("[FAIL] No occurrence for mask 0x%02x\n", mask);
+        cmp->differences++;
+        return;
+    }
+    if (nearTransition(tz, reference) || nearTransition(tz, actual)) {
+        // Whatever CFCalendar does, powerd must resolve as documented
+        expected = documentedNext(tz, now, wall);
+    }
+    if (actual == expected) {
+        if (actual != reference) {
+            cmp->transitionDiffs++;
+        }
+        return;
+    }
+
+    if (cmp->differences++ < 10) {
+        CFStringRef name = CFTimeZoneGetName(tz);
+        char        buf[64] = "";
+
+        CFStringGetCString(name, buf, sizeof(buf), kCFStringEncodingUTF8);
+        printf("%s now=%.0f mask=0x%02x minutes=%d: expected %.0f, got %.0f\n",
+               buf, now, mask, minutes, expected, actual);
+    }
+}
+
+static bool testTimeZones(void)
+{
+    Comparison      cmp;
+    CFCalendarRef   cal, gmt;
+    CFTimeZoneRef   tz, gmtZone;
+    CFStringRef     name;
+    CFAbsoluteTime  now, transition;
+    bool            found = true;
+    int             i, z;
+
+    bzero(&cmp, sizeof(cmp));
+    srandom(1);
+    gmt = CFCalendarCreateWithIdentifier(0, kCFGregorianCalendar);
+    gmtZone = CFTimeZoneCreateWithTimeIntervalFromGMT(0, 0.0);
+    CFCalendarSetTimeZone(gmt, gmtZone);
+    CFRelease(gmtZone);
+    for (z = 0; z < (int)(sizeof(kTimeZones) / sizeof(kTimeZones[0])); z++)
+    {
+        name = CFStringCreateWithCString(0, kTimeZones[z], kCFStringEncodingUTF8);
+        tz = CFTimeZoneCreateWithName(0, name, true);
+        CFRelease(name);
+        if (!tz) {
+            printf("[FAIL] No time zone %s\n", kTimeZones[z]);
+            found = false;
+            continue;
+        }
+        cal = CFCalendarCreateWithIdentifier(0, kCFGregorianCalendar);
+        CFCalendarSetTimeZone(cal, tz);
+
+        // Anywhere from 2001 to 2037
+        for (i = 0; i < kRandomChecks / 10; i++) {
+            now = (CFAbsoluteTime)(random() % (37 * 365 * 86400)) + (random() % 1000) / 1000.0;
+            compare(&cmp, cal, gmt, tz, now, 1 + random() % 127, random() % 1440);
+        }
+
+        // Within a week before each daylight saving change
+        transition = 0.0;
+        for (i = 0; i < kTransitionChecks / 10; i++) {
+            transition = CFTimeZoneGetNextDaylightSavingTimeTransition(tz, transition);
+            if (transition == 0.0) {
+                break;
+            }
+            now = transition - (random() % (7 * 86400));
+            compare(&cmp, cal, gmt, tz, now, 1 + random() % 127, random() % 1440);
+        }
+
+        CFRelease(cal);
+        CFRelease(tz);
+    }
+    CFRelease(gmt);
+
+    printf("%d differ only in resolving a local time skipped or repeated by a daylight saving change\n",
+           cmp.transitionDiffs);
+    if (cmp.differences) {
+        printf("[FAIL] %d of %d next occurrences differ from CFCalendar or the documented resolution\n",
+               cmp.differences, cmp.checks);
+        return false;
+    }
+    printf("[PASS] %d next occurrences match CFCalendar\n", cmp.checks);
+    return found;
+}
+
+static void timeCalls(void)
+{
+    CFCalendarRef   cal;
+    CFTimeZoneRef   tz;
+    CFAbsoluteTime  now, next;
+    uint64_t        start, end;
+    volatile double sink = 0;
+    int             i;
+
+    tz = CFTimeZoneCopySystem();
+    cal = CFCalendarCreateWithIdentifier(0, kCFGregorianCalendar);
+    CFCalendarSetTimeZone(cal, tz);
+    now = CFAbsoluteTimeGetCurrent();
+
+    start = mach_absolute_time();
+    for (i = 0; i < kTimedCalls; i++) {
+        sink += referenceNext(cal, now + i, 0x1f, 480, NULL, NULL);
+    }
+    end = mach_absolute_time();
+    printf("CFCalendar:                     %8.1f ns/call\n", nsPerCall(start, end, kTimedCalls));
+
+    start = mach_absolute_time();
+    for (i = 0; i < kTimedCalls; i++) {
+        RepeatingEventNextOccurrence(0x1f, 480, now + i, tz, &next);
+        sink += next;
+    }
+    end = mach_absolute_time();
+    printf("RepeatingEventNextOccurrence:   %8.1f ns/call\n", nsPerCall(start, end, kTimedCalls));
+
+    CFRelease(cal);
+    CFRelease(tz);
+}
+
+int main(int argc, char *argv[])
+{
+    bool    passed;
+
+    printf("Executing repeating-event-time\n");
+
+    passed = testTimeZones();
+    timeCalls();
+
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,253 @@
+/*
+ * sleepwake-record.c
+ *
+ * Exercises the sleep/wake record ring (wrapping, reopening, layout
+ * changes) and the cycle state machine that powerd feeds from its sleep
+ * and wake log messages.
+ */
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <mach/mach_time.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../pmconfigd/SleepWakeRecord.h"
+
+/***
+
+ Build with ../pmconfigd/SleepWakeRecord.c. Runs without powerd; rings are
+ written under /tmp.
+
+ ***/
+
+enum {
+    kRecords            = kPMSleepWakeRingSlots * 5 / 2,
+    kDarkWakeUS         = 20000
+};
+
+static const char   *kPath = "/tmp/sleepwake-record.cycles";
+static const char   *kCyclePath = "/tmp/sleepwake-record.statemachine";
+
+static void fillRecord(PMSleepWakeRecord *rec, uint32_t n)
+{
+    bzero(rec, sizeof(*rec));
+    snprintf(rec->uuid, sizeof(rec->uuid), "%08X-0000-4000-8000-%012X", n * 7919, n);
+    rec->sleepTime = 1400000000LL + (int64_t)n * 3600;
+    rec->wakeTime = rec->sleepTime + 1800;
+    rec->fullWakeTime = rec->wakeTime + 60;
+    rec->sleepCount = n;
+    rec->darkWakeCount = n % 4;
+    rec->phaseMS[kPMSleepWakePhaseSleepNotify] = 200 + n % 100;
+    rec->phaseMS[kPMSleepWakePhaseAsleep] = 1800 * 1000;
+    strlcpy(rec->sleepReason, "Idle Sleep", sizeof(rec->sleepReason));
+    strlcpy(rec->wakeReason, "EC.LidOpen", sizeof(rec->wakeReason));
+    strlcpy(rec->wakeType, "user", sizeof(rec->wakeType));
+    rec->responderCount = 1;
+    strlcpy(rec->responders[0].name, "SlowClient", sizeof(rec->responders[0].name));
+    rec->responders[0].delayMS = 2500;
+    rec->responders[0].type = kPMSleepWakeResponseSlow;
+}
+
+static bool testRing(void)
+{
+    PMSleepWakeRing     *w, *r;
+    PMSleepWakeRecord   rec;
+    uint32_t            count, n;
+    uint64_t            start, end, notifySum = 0;
+    mach_timebase_info_data_t   tb;
+    int                 fd;
+
+    unlink(kPath);
+    w = PMSleepWakeRingOpen(kPath, true);
+    if (!w) {
+        printf("[FAIL] Can't create %s\n", kPath);
+        return false;
+    }
+    if (PMSleepWakeRingOpen("/tmp/sleepwake-record.none", false)) {
+        printf("[FAIL] A missing ring opened for reading\n");
+        return false;
+    }
+
+    start = mach_absolute_time();
+    for (n = 0; n < kRecords; n++) {
+        fillRecord(&rec, n);
+        if (!PMSleepWakeRingAppend(w, &rec)) {
+            printf("[FAIL] Append %u to %s\n", n, kPath);
+            return false;
+        }
+    }
+    end = mach_absolute_time();
+    PMSleepWakeRingClose(w);
+
+    mach_timebase_info(&tb);
+    printf("%d records of %zu bytes: %.2f us per append\n", kRecords, sizeof(PMSleepWakeRecord),
+           (double)(end - start) * tb.numer / tb.denom / 1000.0 / kRecords);
+
+    // The newest kPMSleepWakeRingSlots, oldest first
+    r = PMSleepWakeRingOpen(kPath, false);
+    if (!r || ((count = PMSleepWakeRingCount(r)) != kPMSleepWakeRingSlots)) {
+        printf("[FAIL] The wrapped ring reopens with %u records, expected %u\n",
+               r ? PMSleepWakeRingCount(r) : 0, kPMSleepWakeRingSlots);
+        return false;
+    }
+    for (n = 0; n < count; n++) {
+        if (!PMSleepWakeRingRead(r, n, &rec) || (rec.sleepCount != kRecords - count + n)) {
+            printf("[FAIL] Record %u reads back as sleep %u, expected %u\n", n, rec.sleepCount, kRecords - count + n);
+            return false;
+        }
+        notifySum += rec.phaseMS[kPMSleepWakePhaseSleepNotify];
+    }
+    if (PMSleepWakeRingRead(r, count, &rec)) {
+        printf("[FAIL] A read past the newest record succeeded\n");
+        return false;
+    }
+    printf("Mean sleep notify phase over %u cycles: %.1f ms\n", count, (double)notifySum / count);
+    PMSleepWakeRingClose(r);
+
+    // A writer reopening the ring appends after the newest record
+    w = PMSleepWakeRingOpen(kPath, true);
+    fillRecord(&rec, kRecords);
+    PMSleepWakeRingAppend(w, &rec);
+    PMSleepWakeRingClose(w);
+    r = PMSleepWakeRingOpen(kPath, false);
+    if (!r || !PMSleepWakeRingRead(r, PMSleepWakeRingCount(r) - 1, &rec) || (rec.sleepCount != kRecords)) {
+        printf("[FAIL] A reopened writer didn't append after the newest record\n");
+        return false;
+    }
+    PMSleepWakeRingClose(r);
+
+    // A ring from another layout is started over
+    fd = open(kPath, O_WRONLY);
+    write(fd, "\0\0\0\0", 4);
+    close(fd);
+    if (PMSleepWakeRingOpen(kPath, false)) {
+        printf("[FAIL] A reader accepted a ring with another layout\n");
+        return false;
+    }
+    w = PMSleepWakeRingOpen(kPath, true);
+    if (!w || PMSleepWakeRingCount(w)) {
+        printf("[FAIL] A writer didn't start a ring with another layout over\n");
+        return false;
+    }
+    PMSleepWakeRingClose(w);
+
+    unlink(kPath);
+    printf("[PASS] The record ring wraps, reopens and restarts on a layout change\n");
+    return true;
+}
+
+/*
+ * The calls powerd makes for each transition, as logASLMessageSleep() and
+ * logASLMessageWake() make them.
+ */
+static void sleepFromAwake(void)     { cycleRecordSleep("UUID", "Idle Sleep", 1, true, false); }
+static void sleepFailed(void)        { cycleRecordSleep("UUID", NULL, 0, false, false); }
+static void enterS0DarkWake(void)    { cycleRecordSleep("UUID", NULL, 1, true, true); }
+static void wakeToDark(void)         { cycleRecordWake(true, true, "RTC", "Maintenance"); }
+static void wakeToFull(void)         { cycleRecordWake(true, false, "EC.LidOpen", "user"); }
+
+/* Runs a sequence of transitions and reads back the records it wrote */
+static uint32_t runCycles(void (*steps[])(void), PMSleepWakeRecord *records, uint32_t max)
+{
+    PMSleepWakeRing     *r;
+    uint32_t            count = 0, i;
+
+    unlink(kCyclePath);
+    cycleRecordSetRingPath(kCyclePath);
+    for (i = 0; steps[i]; i++) {
+        steps[i]();
+        if (steps[i] == wakeToDark) {
+            usleep(kDarkWakeUS);
+        }
+    }
+    cycleRecordSetRingPath(kCyclePath);     // closes the ring
+
+    if ((r = PMSleepWakeRingOpen(kCyclePath, false))) {
+        count = PMSleepWakeRingCount(r);
+        for (i = 0; (i < count) && (i < max); i++) {
+            PMSleepWakeRingRead(r, i, &records[i]);
+        }
+        PMSleepWakeRingClose(r);
+    }
+    unlink(kCyclePath);
+    return count;
+}
+
+static bool testCycles(void)
+{
+    PMSleepWakeRecord   rec[4];
+    uint32_t            count;
+    uint32_t            darkMS = 2 * kDarkWakeUS / 1000;
+
+    void (*plain[])(void) = { sleepFromAwake, wakeToFull, NULL };
+    count = runCycles(plain, rec, 4);
+    if ((count != 1) || rec[0].flags || rec[0].darkWakeCount || !rec[0].fullWakeTime
+        || strcmp(rec[0].wakeType, "user"))
+    {
+        printf("[FAIL] Sleep then full wake: %u records, flags 0x%x, %u dark wakes\n",
+               count, count ? rec[0].flags : 0, count ? rec[0].darkWakeCount : 0);
+        return false;
+    }
+
+    // PowerNap: every dark wake and sleep until the full wake is one cycle
+    void (*nap[])(void) = { sleepFromAwake, wakeToDark, sleepFromAwake, wakeToDark, wakeToFull, NULL };
+    count = runCycles(nap, rec, 4);
+    if ((count != 1) || (rec[0].flags != kPMSleepWakeFromDarkWake) || (rec[0].darkWakeCount != 2)
+        || (rec[0].phaseMS[kPMSleepWakePhaseDarkWake] < darkMS) || strcmp(rec[0].wakeType, "Maintenance"))
+    {
+        printf("[FAIL] PowerNap cycle: %u records, flags 0x%x, %u dark wakes, %u ms dark\n",
+               count, count ? rec[0].flags : 0, count ? rec[0].darkWakeCount : 0,
+               count ? rec[0].phaseMS[kPMSleepWakePhaseDarkWake] : 0);
+        return false;
+    }
+
+    // S0 DarkWake from a full wake isn't a sleep; one during a dark wake keeps the cycle
+    void (*s0dark[])(void) = { enterS0DarkWake, wakeToFull, sleepFromAwake, wakeToDark,
+                               enterS0DarkWake, sleepFromAwake, wakeToFull, NULL };
+    count = runCycles(s0dark, rec, 4);
+    if ((count != 1) || rec[0].flags || (rec[0].darkWakeCount != 1)
+        || (rec[0].phaseMS[kPMSleepWakePhaseDarkWake] < darkMS / 2))
+    {
+        printf("[FAIL] S0 DarkWake entries: %u records, flags 0x%x, %u dark wakes\n",
+               count, count ? rec[0].flags : 0, count ? rec[0].darkWakeCount : 0);
+        return false;
+    }
+
+    // A sleep with no wake before it leaves the cycle incomplete
+    void (*twice[])(void) = { sleepFromAwake, sleepFromAwake, wakeToFull, NULL };
+    count = runCycles(twice, rec, 4);
+    if ((count != 2) || (rec[0].flags != kPMSleepWakeIncomplete) || rec[1].flags) {
+        printf("[FAIL] Sleep twice: %u records, flags 0x%x, 0x%x\n",
+               count, count ? rec[0].flags : 0, (count > 1) ? rec[1].flags : 0);
+        return false;
+    }
+
+    // A failed sleep from a full wake is its own record; one from a dark wake stays in the cycle
+    void (*failed[])(void) = { sleepFailed, sleepFromAwake, wakeToDark, sleepFailed, wakeToFull, NULL };
+    count = runCycles(failed, rec, 4);
+    if ((count != 2) || (rec[0].flags != kPMSleepWakeSleepFailed)
+        || (rec[1].flags != (kPMSleepWakeSleepFailed | kPMSleepWakeFromDarkWake)))
+    {
+        printf("[FAIL] Failed sleeps: %u records, flags 0x%x, 0x%x\n",
+               count, count ? rec[0].flags : 0, (count > 1) ? rec[1].flags : 0);
+        return false;
+    }
+
+    printf("[PASS] Sleep/wake transitions close one record per cycle\n");
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    bool    passed;
+
+    printf("Executing sleepwake-record\n");
+
+    passed = testRing();
+    passed = testCycles() && passed;
+
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,119 @@
+/*
+ * systemload-sharedmem.c
+ *
+ * Compares powerd's shared memory system load advisory against
+ * IOCopySystemLoadAdvisoryDetailed(), and times both read paths.
+ */
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <IOKit/IOReturn.h>
+#include <IOKit/pwr_mgt/IOPMLib.h>
+#include <IOKit/pwr_mgt/IOPMLibPrivate.h>
+#include <mach/mach_time.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "../pmconfigd/SystemLoadShared.h"
+
+/***
+
+ This tool checks that the levels powerd publishes in shared memory match
+ the levels returned by the SCDynamicStore backed API, then reports the
+ per-call cost of each.
+
+ ***/
+
+static const int kIPCIterations     = 10000;
+static const int kSharedIterations  = 10000000;
+
+static double nsPerCall(uint64_t start, uint64_t end, int iterations)
+{
+    mach_timebase_info_data_t   tb;
+
+    mach_timebase_info(&tb);
+    return (double)(end - start) * tb.numer / tb.denom / iterations;
+}
+
+static int dictLevel(CFDictionaryRef d, CFStringRef key)
+{
+    CFNumberRef     n = CFDictionaryGetValue(d, key);
+    int             level = -1;
+
+    if (n) {
+        CFNumberGetValue(n, kCFNumberIntType, &level);
+    }
+    return level;
+}
+
+int main(int argc, char *argv[])
+{
+    const SystemLoadShared      *shared = NULL;
+    SystemLoadSnapshot          snap;
+    CFDictionaryRef             detailed = NULL;
+    uint64_t                    start, end;
+    volatile uint64_t           sink = 0;
+    int                         i;
+
+    printf("Executing systemload-sharedmem\n");
+
+    shared = SystemLoadSharedMap();
+    if (!shared) {
+        printf("[FAIL] powerd hasn't published %s\n", kSystemLoadSharedName);
+        return 1;
+    }
+
+    if (!SystemLoadSharedCopySnapshot(shared, &snap)) {
+        printf("[FAIL] SystemLoadSharedCopySnapshot couldn't take a consistent copy\n");
+        return 1;
+    }
+
+    detailed = IOCopySystemLoadAdvisoryDetailed();
+    if (!detailed) {
+        printf("[FAIL] IOCopySystemLoadAdvisoryDetailed returned NULL\n");
+        return 1;
+    }
+
+    if ((snap.userLevel != dictLevel(detailed, kIOSystemLoadAdvisoryUserLevelKey))
+        || (snap.batteryLevel != dictLevel(detailed, kIOSystemLoadAdvisoryBatteryLevelKey))
+        || (snap.thermalLevel != dictLevel(detailed, kIOSystemLoadAdvisoryThermalLevelKey))
+        || (snap.combinedLevel != dictLevel(detailed, kIOSystemLoadAdvisoryCombinedLevelKey)))
+    {
+        printf("[FAIL] Shared levels user=%d battery=%d thermal=%d combined=%d don't match IOCopySystemLoadAdvisoryDetailed\n",
+               snap.userLevel, snap.batteryLevel, snap.thermalLevel, snap.combinedLevel);
+        CFShow(detailed);
+        CFRelease(detailed);
+        return 1;
+    }
+    CFRelease(detailed);
+
+    printf("[PASS] Shared levels match: user=%d battery=%d thermal=%d combined=%d changes=%llu\n",
+           snap.userLevel, snap.batteryLevel, snap.thermalLevel, snap.combinedLevel, snap.changeCount);
+
+    start = mach_absolute_time();
+    for (i = 0; i < kIPCIterations; i++) {
+        detailed = IOCopySystemLoadAdvisoryDetailed();
+        if (detailed) {
+            sink += dictLevel(detailed, kIOSystemLoadAdvisoryCombinedLevelKey);
+            CFRelease(detailed);
+        }
+    }
+    end = mach_absolute_time();
+    printf("IOCopySystemLoadAdvisoryDetailed:   %10.1f ns/call\n", nsPerCall(start, end, kIPCIterations));
+
+    start = mach_absolute_time();
+    for (i = 0; i < kSharedIterations; i++) {
+        sink += SystemLoadSharedGetLevels(shared);
+    }
+    end = mach_absolute_time();
+    printf("SystemLoadSharedGetLevels:          %10.1f ns/call\n", nsPerCall(start, end, kSharedIterations));
+
+    start = mach_absolute_time();
+    for (i = 0; i < kSharedIterations; i++) {
+        SystemLoadSharedCopySnapshot(shared, &snap);
+        sink += snap.combinedLevel;
+    }
+    end = mach_absolute_time();
+    printf("SystemLoadSharedCopySnapshot:       %10.1f ns/call\n", nsPerCall(start, end, kSharedIterations));
+
+    return 0;
+}
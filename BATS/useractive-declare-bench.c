@@ -0,0 +1,257 @@
+/*
+ * useractive-declare-bench.c
+ *
+ * Declares user activity from many clients at once, each repeating its
+ * declaration, and times the declarations. Reports how many powerd
+ * coalesced into a timeout update, and checks that a coalesced
+ * declaration's time left properties stay current.
+ */
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <IOKit/IOReturn.h>
+#include <IOKit/pwr_mgt/IOPMLib.h>
+#include <IOKit/pwr_mgt/IOPMLibPrivate.h>
+#include <mach/mach.h>
+#include <mach/mach_time.h>
+#include <servers/bootstrap.h>
+#include <sys/wait.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../pmconfigd/PrivateLib.h"
+#include "powermanagement.h"
+
+/***
+
+ Usage: useractive-declare-bench [clients] [seconds] [rate]
+
+ Build with powermanagement.defs. Runs against the live powerd; forks
+ 'clients' (default 50) processes that together declare user activity
+ 'rate' (default 1000) times a second for 'seconds' (default 10).
+ Needs a non-zero display sleep timer for declarations to coalesce.
+
+ ***/
+
+enum {
+    kDefaultClients     = 50,
+    kDefaultSeconds     = 10,
+    kDefaultRate        = 1000
+};
+
+typedef struct {
+    uint32_t    calls;
+    uint32_t    failed;
+    double      totalUS;
+    double      maxUS;
+} clientResult;
+
+static double usBetween(uint64_t start, uint64_t end)
+{
+    mach_timebase_info_data_t   tb;
+
+    mach_timebase_info(&tb);
+    return (double)(end - start) * tb.numer / tb.denom / 1000.0;
+}
+
+static bool copyStats(mach_port_t port, uint32_t *declared, uint32_t *coalesced)
+{
+    int     value1 = 0, value2 = 0;
+
+    if ((KERN_SUCCESS != io_pm_get_value_int(port, kPMStatsUserActiveDeclared, &value1))
+        || (KERN_SUCCESS != io_pm_get_value_int(port, kPMStatsUserActiveCoalesced, &value2)))
+    {
+        return false;
+    }
+    *declared = (uint32_t)value1;
+    *coalesced = (uint32_t)value2;
+    return true;
+}
+
+/*
+ * Declares every 'intervalUS', starting 'offsetUS' in, until 'seconds'
+ * pass, and writes the result to 'fd'
+ */
+static void runClient(int n, int fd, int seconds, double intervalUS, double offsetUS)
+{
+    IOPMAssertionID     id = kIOPMNullAssertionID;
+    CFStringRef         name;
+    clientResult        result;
+    uint64_t            start, before, after;
+    double              us;
+
+    bzero(&result, sizeof(result));
+    name = CFStringCreateWithFormat(0, NULL, CFSTR("useractive-declare-bench.%d"), n);
+
+    usleep((useconds_t)offsetUS);
+
+    start = mach_absolute_time();
+    while (usBetween(start, mach_absolute_time()) < seconds * 1000000.0) {
+        before = mach_absolute_time();
+        if (kIOReturnSuccess != IOPMAssertionDeclareUserActivity(name, kIOPMUserActiveLocal, &id)) {
+            result.failed++;
+        }
+        after = mach_absolute_time();
+
+        us = usBetween(before, after);
+        result.calls++;
+        result.totalUS += us;
+        if (us > result.maxUS) {
+            result.maxUS = us;
+        }
+        if (us < intervalUS) {
+            usleep((useconds_t)(intervalUS - us));
+        }
+    }
+
+    if (id != kIOPMNullAssertionID) {
+        IOPMAssertionRelease(id);
+    }
+    CFRelease(name);
+    write(fd, &result, sizeof(result));
+    close(fd);
+}
+
+/*
+ * Declares twice, a few seconds apart, and checks that the properties
+ * copied out after the second declaration were updated by it.
+ */
+static bool checkTimeLeft(void)
+{
+    IOPMAssertionID     id = kIOPMNullAssertionID;
+    CFDictionaryRef     props = NULL;
+    CFDateRef           updated;
+    CFAbsoluteTime      declared = 0;
+    bool                ok = false;
+
+    if (kIOReturnSuccess == IOPMAssertionDeclareUserActivity(CFSTR("useractive-declare-bench.timeleft"),
+                                                             kIOPMUserActiveLocal, &id)) {
+        sleep(3);
+        declared = CFAbsoluteTimeGetCurrent();
+        if (kIOReturnSuccess == IOPMAssertionDeclareUserActivity(CFSTR("useractive-declare-bench.timeleft"),
+                                                                 kIOPMUserActiveLocal, &id)) {
+            props = IOPMAssertionCopyProperties(id);
+        }
+    }
+
+    // No time left at all if the display sleep timer is off
+    if (props && !CFDictionaryGetValue(props, kIOPMAssertionTimeoutTimeLeftKey)) {
+        ok = true;
+    }
+    else if (props && (updated = CFDictionaryGetValue(props, kIOPMAssertionTimeoutUpdateTimeKey))
+             && (CFGetTypeID(updated) == CFDateGetTypeID())) {
+        ok = (CFDateGetAbsoluteTime(updated) >= declared - 1.0);
+    }
+
+    if (props) {
+        CFRelease(props);
+    }
+    if (id != kIOPMNullAssertionID) {
+        IOPMAssertionRelease(id);
+    }
+
+    if (!ok) {
+        printf("[FAIL] A repeated declaration left its time left properties from the first\n");
+        return false;
+    }
+    printf("[PASS] A repeated declaration updates its time left properties\n");
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    mach_port_t     port = MACH_PORT_NULL;
+    int             clients = (argc > 1) ? atoi(argv[1]) : kDefaultClients;
+    int             seconds = (argc > 2) ? atoi(argv[2]) : kDefaultSeconds;
+    int             rate = (argc > 3) ? atoi(argv[3]) : kDefaultRate;
+    int             (*fds)[2];
+    clientResult    result, total;
+    uint32_t        declared0 = 0, coalesced0 = 0, declared1 = 0, coalesced1 = 0;
+    double          maxUS = 0;
+    int             i, reported = 0;
+    pid_t           pid;
+    bool            passed = true;
+
+    printf("Executing useractive-declare-bench\n");
+
+    if (clients <= 0) clients = kDefaultClients;
+    if (seconds <= 0) seconds = kDefaultSeconds;
+    if (rate <= 0) rate = kDefaultRate;
+
+    if (KERN_SUCCESS != bootstrap_look_up(bootstrap_port, kIOPMServerBootstrapName, &port)) {
+        printf("[FAIL] Can't look up powerd\n");
+        return 1;
+    }
+    if (!copyStats(port, &declared0, &coalesced0)) {
+        printf("[FAIL] Can't read the user activity counters\n");
+        passed = false;
+    }
+
+    fds = calloc(clients, sizeof(*fds));
+    for (i = 0; i < clients; i++) {
+        if (pipe(fds[i]) < 0) {
+            printf("[FAIL] Can't create a pipe for client %d\n", i);
+            passed = false;
+            break;
+        }
+        if ((pid = fork()) == 0) {
+            close(fds[i][0]);
+            // Spread the clients across the interval
+            runClient(i, fds[i][1], seconds, 1000000.0 * clients / rate, 1000000.0 * i / rate);
+            exit(0);
+        }
+        close(fds[i][1]);
+        if (pid < 0) {
+            close(fds[i][0]);
+            printf("[FAIL] Can't fork client %d\n", i);
+            passed = false;
+            break;
+        }
+    }
+    clients = i;
+
+    bzero(&total, sizeof(total));
+    for (i = 0; i < clients; i++) {
+        if (read(fds[i][0], &result, sizeof(result)) == sizeof(result)) {
+            total.calls += result.calls;
+            total.failed += result.failed;
+            total.totalUS += result.totalUS;
+            if (result.maxUS > maxUS) {
+                maxUS = result.maxUS;
+            }
+            reported++;
+        }
+        close(fds[i][0]);
+    }
+    while (wait(NULL) > 0);
+    free(fds);
+
+    if ((reported != clients) || !total.calls || total.failed) {
+        printf("[FAIL] %d of %d clients reported; %u of %u declarations failed\n",
+               reported, clients, total.failed, total.calls);
+        passed = false;
+    } else {
+        printf("[PASS] Every client's declarations succeeded\n");
+    }
+    if (!copyStats(port, &declared1, &coalesced1)) {
+        printf("[FAIL] Can't read the user activity counters\n");
+        passed = false;
+    }
+
+    if (total.calls) {
+        printf("%d clients, %u declarations in %d s (%.0f per second)\n",
+               clients, total.calls, seconds, (double)total.calls / seconds);
+        printf("Declaration: %.1f us average, %.1f us worst\n", total.totalUS / total.calls, maxUS);
+    }
+    if (declared1 > declared0) {
+        printf("powerd: %u declared, %u coalesced (%.1f%%)\n",
+               declared1 - declared0, coalesced1 - coalesced0,
+               100.0 * (coalesced1 - coalesced0) / (declared1 - declared0));
+    }
+
+    passed = checkTimeLeft() && passed;
+
+    mach_port_deallocate(mach_task_self(), port);
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,235 @@
+/*
+ * wakeplan-sim.c
+ *
+ * Replays wake requests through powerd's wake planner and compares the
+ * RTC wakes it needs against waking for each request time separately.
+ */
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../pmconfigd/WakePlanner.h"
+
+/***
+
+ Usage: wakeplan-sim [file]
+
+ Build with ../pmconfigd/WakePlanner.c. Runs without powerd.
+
+ 'file' holds recorded schedules, such as the output of
+ 'pmset -g log | grep WakeRequests' ('-' reads stdin). Each line with
+ "request=<Type> inDelta=<seconds>" entries is one sleep. Without a file,
+ random schedules are generated.
+
+ Each sleep is simulated from time 0. The system wakes, every request
+ whose window has opened is served, and it goes back to sleep until the
+ next wake, as powerd does at each sleep.
+
+ ***/
+
+enum {
+    kMaxRequests        = 256,
+    kRandomSleeps       = 10000
+};
+
+#define kNotBefore      60.0
+
+static const struct {
+    const char  *name;
+    wakeType_e  type;
+} kTypeNames[] = {
+    { "UserWake",       kChooseFullWake },
+    { "Maintenance",    kChooseMaintenance },
+    { "SleepService",   kChooseSleepServiceWake },
+    { "TimerPlugin",    kChooseTimerPlugin }
+};
+
+typedef struct {
+    long        sleeps;
+    long        requests;
+    long        unplannedWakes;
+    long        plannedWakes;
+    int         failed;             // wake plan checks
+} SimResult;
+
+static bool typeFromName(const char *name, size_t len, wakeType_e *type)
+{
+    for (int i = 0; i < (int)(sizeof(kTypeNames) / sizeof(kTypeNames[0])); i++) {
+        if ((strlen(kTypeNames[i].name) == len) && !strncmp(kTypeNames[i].name, name, len)) {
+            *type = kTypeNames[i].type;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void fail(SimResult *result, const char *what, int id)
+{
+    if (result->failed++ < 10) {
+        printf("[FAIL] sleep %ld request %d: %s\n", result->sleeps, id, what);
+    }
+}
+
+/*
+ * Wakes needed if the RTC is set for the earliest pending request each
+ * time: one per distinct requested time.
+ */
+static int countUnplanned(const WakeRequest *reqs, int count)
+{
+    int distinct = 0;
+
+    for (int i = 0; i < count; i++) {
+        int j;
+        for (j = 0; j < i; j++) {
+            if (reqs[j].earliest == reqs[i].earliest) {
+                break;
+            }
+        }
+        if (j == i) {
+            distinct++;
+        }
+    }
+    return distinct;
+}
+
+/*
+ * Plans one sleep the way powerd does, waking for the first planned wake
+ * and planning again with what's left, and checks that every request is
+ * served inside its window.
+ */
+static void simulate(SimResult *result, WakeRequest *reqs, int count)
+{
+    WakeRequest     pending[kMaxRequests];
+    PlannedWake     wakes[kMaxRequests];
+    bool            served[kMaxRequests] = { false };
+    int             pendingCount = count;
+    int             planned, wakeCount = 0;
+
+    if (count == 0) {
+        return;
+    }
+    result->sleeps++;
+    result->requests += count;
+    result->unplannedWakes += countUnplanned(reqs, count);
+
+    memcpy(pending, reqs, count * sizeof(WakeRequest));
+    planned = WakePlanCompute(pending, count, wakes);
+
+    while (pendingCount > 0)
+    {
+        pendingCount = 0;
+        for (int i = 0; i < count; i++) {
+            if (!served[reqs[i].id]) {
+                pending[pendingCount++] = reqs[i];
+            }
+        }
+        if (!pendingCount) {
+            break;
+        }
+        if (WakePlanCompute(pending, pendingCount, wakes) < 1) {
+            fail(result, "no wake planned", pending[0].id);
+            break;
+        }
+        wakeCount++;
+
+        for (int i = 0; i < pendingCount; i++) {
+            if (pending[i].earliest > wakes[0].time) {
+                continue;
+            }
+            if (pending[i].latest < wakes[0].time) {
+                fail(result, "served after its tolerance", pending[i].id);
+            }
+            if ((pending[i].type == kChooseFullWake) && (pending[i].earliest != wakes[0].time)) {
+                fail(result, "full wake moved", pending[i].id);
+            }
+            served[pending[i].id] = true;
+        }
+    }
+
+    if (wakeCount != planned) {
+        fail(result, "replanning at each wake changed the wake count", 0);
+    }
+    result->plannedWakes += wakeCount;
+}
+
+static void replayFile(SimResult *result, FILE *f)
+{
+    WakeRequest     reqs[kMaxRequests];
+    char            line[8192];
+    const char      *p, *type, *delta;
+    wakeType_e      t;
+    int             count;
+
+    while (fgets(line, sizeof(line), f))
+    {
+        count = 0;
+        for (p = line; (type = strstr(p, "request=")) && (count < kMaxRequests); p = delta)
+        {
+            type += strlen("request=");
+            if (!(delta = strstr(type, " inDelta="))) {
+                break;
+            }
+            if (typeFromName(type, delta - type, &t)) {
+                WakeRequestSet(&reqs[count], t, strtod(delta + strlen(" inDelta="), NULL),
+                               kNotBefore, count);
+                count++;
+            }
+            delta += strlen(" inDelta=");
+        }
+        simulate(result, reqs, count);
+    }
+}
+
+/*
+ * A few clients polling on their own intervals, with the odd user wake.
+ */
+static void replayRandom(SimResult *result)
+{
+    WakeRequest     reqs[kMaxRequests];
+    int             count;
+
+    srandom(1);
+    for (int s = 0; s < kRandomSleeps; s++)
+    {
+        count = 1 + random() % 12;
+        for (int i = 0; i < count; i++) {
+            wakeType_e  t = (random() % 20) ? (1 + random() % 3) : kChooseFullWake;
+            WakeRequestSet(&reqs[i], t, random() % (4 * 3600), kNotBefore, i);
+        }
+        simulate(result, reqs, count);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    SimResult   result;
+    FILE        *f;
+
+    printf("Executing wakeplan-sim\n");
+
+    bzero(&result, sizeof(result));
+    if (argc > 1) {
+        f = strcmp(argv[1], "-") ? fopen(argv[1], "r") : stdin;
+        if (!f) {
+            printf("[FAIL] Can't open %s\n", argv[1]);
+            return 1;
+        }
+        replayFile(&result, f);
+        if (f != stdin) {
+            fclose(f);
+        }
+    } else {
+        replayRandom(&result);
+    }
+
+    printf("Wakes: %ld unplanned, %ld planned, %ld saved\n",
+           result.unplannedWakes, result.plannedWakes, result.unplannedWakes - result.plannedWakes);
+    if (result.failed) {
+        printf("[FAIL] %d wake plan checks failed\n", result.failed);
+        return 1;
+    }
+    printf("[PASS] %ld requests in %ld sleeps served inside their windows\n", result.requests, result.sleeps);
+    return 0;
+}
@@ -20,7 +20,7 @@ static void createAndCheckForExistence(CFStringRef useName);
 static void fillAndReleaseAllPowerSourceSlots(int count);
 
 static const int kTryDictionaries = 5;
-static const int kMaxPSCount = 7;
+static const int kMaxPSCount = 40;
 
 int main(int argc, const char * argv[])
 {
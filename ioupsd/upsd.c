@@ -33,6 +33,7 @@
 #include <servers/bootstrap.h>
 #include <sysexits.h>
 #include <notify.h>
+#include <dispatch/dispatch.h>
 
 #include <IOKit/IOKitLib.h>
 #include <IOKit/IOKitServer.h>
@@ -55,15 +56,21 @@
 
 #define kDefaultUPSName		"Generic UPS"
 
+// Changed UPS readings are published to powerd at most once per
+// kUPSPublishInterval; a reading is never held back longer than that.
+// Power source state and presence changes are always published immediately.
+#define kUPSPublishInterval     2.0
+
 //---------------------------------------------------------------------------
 // Globals
 //---------------------------------------------------------------------------
 static CFRunLoopSourceRef       gClientRequestRunLoopSource = NULL;
 static CFRunLoopRef             gMainRunLoop = NULL;
-static CFMutableArrayRef        gUPSDataArrayRef = NULL;
 static unsigned int             gUPSCount = 0;
+static Boolean                  gNotifyTimeRemainingPending = false;
 static IONotificationPortRef	gNotifyPort = NULL;
 static io_iterator_t            gAddedIter = MACH_PORT_NULL;
+static dispatch_source_t        gInfoSignalSource = NULL;
 
 //---------------------------------------------------------------------------
 // TypeDefs
@@ -77,10 +84,25 @@ typedef struct UPSData {
     CFMutableDictionaryRef  upsStoreDict;
     CFRunLoopSourceRef      upsEventSource;
     CFRunLoopTimerRef       upsEventTimer;
+    CFRunLoopTimerRef       publishTimer;
+    CFAbsoluteTime          lastPublishTime;
+    Boolean                 publishPending;
+    UInt32                  eventsReceived;
+    UInt32                  eventsPublished;
+    Boolean                 slotFree;
 } UPSData;
 
 typedef UPSData *UPSDataRef;
 
+// UPS units are kept in a table indexed by upsID, so MIG requests find their
+// UPS directly. Slots of removed units go on a free list and are handed to
+// the next unit that attaches, which keeps upsIDs small and stable.
+static UPSDataRef              *gUPSTable = NULL;
+static int                      gUPSTableCount = 0;
+static int                      gUPSTableCapacity = 0;
+static int                     *gUPSFreeSlots = NULL;
+static int                      gUPSFreeCount = 0;
+
 
 //---------------------------------------------------------------------------
 // Methods
@@ -95,7 +117,15 @@ static void DeviceNotification(void *refCon, io_service_t service,
 static void UPSEventCallback(void * target, IOReturn result, void *refcon,
                              void *sender, CFDictionaryRef event);
 static void ProcessUPSEvent(UPSDataRef upsDataRef, CFDictionaryRef event);
+static void PublishUPSEvent(UPSDataRef upsDataRef);
+static void PublishTimerCallback(CFRunLoopTimerRef timer, void *info);
+static void LogUPSEventCounts(void);
 static UPSDataRef GetPrivateData( CFDictionaryRef properties );
+static void ReleasePrivateData(UPSDataRef upsDataRef);
+static UPSDataRef UPSDataForID(int upsID);
+static void PostTimeRemainingChanged(void);
+static void NotifyObserverCallback(CFRunLoopObserverRef observer,
+                                   CFRunLoopActivity activity, void *info);
 static IOReturn CreatePowerManagerUPSEntry(UPSDataRef upsDataRef,
                                            CFDictionaryRef properties,
                                            CFSetRef capabilities);
@@ -108,7 +138,29 @@ static Boolean SetupMIGServer();
 int main (int argc, const char *argv[]) {
     openlog("upsd", LOG_PID|LOG_NDELAY, LOG_USER);
     signal(SIGINT, SignalHandler);
+
+    // kill -INFO logs how many UPS events were received and published
+    signal(SIGINFO, SIG_IGN);
+    gInfoSignalSource = dispatch_source_create(DISPATCH_SOURCE_TYPE_SIGNAL,
+                                               SIGINFO, 0, dispatch_get_main_queue());
+    if (gInfoSignalSource) {
+        dispatch_source_set_event_handler(gInfoSignalSource, ^{ LogUPSEventCounts(); });
+        dispatch_resume(gInfoSignalSource);
+    }
+
     SetupMIGServer();
+
+    // With several UPS units publishing, post one time remaining
+    // notification per run loop pass instead of one per unit.
+    CFRunLoopObserverRef notifyObserver = CFRunLoopObserverCreate(
+                                    kCFAllocatorDefault, kCFRunLoopBeforeWaiting,
+                                    true, 0, NotifyObserverCallback, NULL);
+    if (notifyObserver) {
+        CFRunLoopAddObserver(CFRunLoopGetCurrent(), notifyObserver,
+                             kCFRunLoopCommonModes);
+        CFRelease(notifyObserver);
+    }
+
     // Listen for any HID Power Devices or Battery Systems
     InitUPSNotifications(kIOPowerDeviceUsageKey);
     InitUPSNotifications(kIOBatterySystemUsageKey);
@@ -303,6 +355,12 @@ void UPSDeviceAdded(void *refCon, io_iterator_t iterator) {
     SInt32                  score;
         
     while ( (upsDevice = IOIteratorNext(iterator)) ) {
+        upsDataRef          = NULL;
+        upsEventSource      = NULL;
+        upsEventTimer       = NULL;
+        upsPlugInInterface  = NULL;
+        typeRef             = NULL;
+
         // Create the CF plugin for this device
         kr = IOCreatePlugInInterfaceForService(upsDevice, kIOUPSPlugInTypeID,
                                                kIOCFPlugInInterfaceID,
@@ -405,6 +463,14 @@ void UPSDeviceAdded(void *refCon, io_iterator_t iterator) {
 
 UPSDEVICEADDED_FAIL:
         // Failed to allocate a UPS interface.  Do some cleanup
+        if (upsDataRef) {
+            upsDataRef->upsPlugInInterface = NULL;
+            upsDataRef->upsEventSource = NULL;
+            upsDataRef->upsEventTimer = NULL;
+            ReleasePrivateData(upsDataRef);
+            upsDataRef = NULL;
+        }
+
         if (upsPlugInInterface) {
             (*upsPlugInInterface)->Release(upsPlugInInterface);
             upsPlugInInterface = NULL;
@@ -464,6 +530,17 @@ void DeviceNotification(void *refCon, io_service_t service,
             upsDataRef->upsEventTimer = NULL;
         }
 
+        if (upsDataRef->publishTimer) {
+            CFRunLoopTimerInvalidate(upsDataRef->publishTimer);
+            CFRelease(upsDataRef->publishTimer);
+            upsDataRef->publishTimer = NULL;
+        }
+        upsDataRef->publishPending = false;
+
+        syslog(LOG_INFO, "upsd: UPS%d removed; %u events received, %u published\n",
+               upsDataRef->upsID, (unsigned int)upsDataRef->eventsReceived,
+               (unsigned int)upsDataRef->eventsPublished);
+
         if (upsDataRef->upsPlugInInterface != NULL) {
             (*(upsDataRef->upsPlugInInterface))->Release(upsDataRef->upsPlugInInterface);
             upsDataRef->upsPlugInInterface = NULL;
@@ -474,23 +551,9 @@ void DeviceNotification(void *refCon, io_service_t service,
             upsDataRef->notification = MACH_PORT_NULL;
         }
         
-        if (upsDataRef->upsStoreDict) {
-            CFRelease(upsDataRef->upsStoreDict);
-            upsDataRef->upsStoreDict = NULL;
-        }
-        
-        if (upsDataRef->powerSourceID) {
-            IOReturn result = IOPSReleasePowerSource(upsDataRef->powerSourceID);
-            gUPSCount--;
-            if (result != kIOReturnSuccess) {
-                syslog(LOG_ERR, "IOPSReleasePowerSource failed (IOReturn: %d\n",
-                       result);
-            }
-            upsDataRef->powerSourceID = NULL;
-        }
+        ReleasePrivateData(upsDataRef);
         
         if (gUPSCount == 0) {
-            CFRelease(gUPSDataArrayRef);
             CleanupAndExit();
         }
     }
@@ -506,37 +569,175 @@ void UPSEventCallback(void *target, IOReturn result, void *refcon, void *sender,
     ProcessUPSEvent((UPSDataRef) refcon, event);
 }
 
+//---------------------------------------------------------------------------
+// MergeUPSEventValue
+//
+// CFDictionaryApplyFunction callback. Copies one event value into the
+// UPS's store dictionary, noting whether anything actually changed.
+//---------------------------------------------------------------------------
+typedef struct {
+    CFMutableDictionaryRef  storeDict;
+    Boolean                 changed;
+    Boolean                 urgent;
+} UPSEventMerge;
+
+static void MergeUPSEventValue(const void *key, const void *value, void *context) {
+    UPSEventMerge   *merge = (UPSEventMerge *)context;
+    CFTypeRef       oldValue;
+
+    oldValue = CFDictionaryGetValue(merge->storeDict, key);
+    if (oldValue && CFEqual(oldValue, value))
+        return;
+
+    CFDictionarySetValue(merge->storeDict, key, value);
+    merge->changed = true;
+
+    // powerd's UPS shutdown policy keys off these; don't delay them
+    if (CFEqual(key, CFSTR(kIOPSPowerSourceStateKey))
+        || CFEqual(key, CFSTR(kIOPSIsPresentKey))) {
+        merge->urgent = true;
+    }
+}
+
 //---------------------------------------------------------------------------
 // ProcessUPSEvent
 //
+// Merges the event into the UPS's store dictionary. Only changed readings
+// are published, and no more often than every kUPSPublishInterval.
 //---------------------------------------------------------------------------
 void ProcessUPSEvent(UPSDataRef upsDataRef, CFDictionaryRef event) {
-    UInt32 count, index;
+    UPSEventMerge       merge;
+    CFAbsoluteTime      now;
+    CFAbsoluteTime      nextPublish;
     
-    if (!upsDataRef || !event)
+    if (!upsDataRef || !event || !upsDataRef->upsStoreDict)
         return;
-      
-    if ((count = CFDictionaryGetCount(event))) {
-        CFTypeRef *keys     = (CFTypeRef *) malloc(sizeof(CFTypeRef) * count);
-        CFTypeRef *values   = (CFTypeRef *) malloc(sizeof(CFTypeRef) * count);
 
-        CFDictionaryGetKeysAndValues(event, (const void **)keys,
-                                     (const void **)values);
-        
-        for (index = 0; index < count; index++) {
-            CFDictionarySetValue(upsDataRef->upsStoreDict, keys[index],
-                                 values[index]);
-        }
-        
-        free (keys);
-        free (values);
-        
-        IOReturn result = IOPSSetPowerSourceDetails(upsDataRef->powerSourceID,
-                                                    upsDataRef->upsStoreDict);
-        if (result != kIOReturnSuccess) {
-            // TODO: do I need to deal with this?
+    upsDataRef->eventsReceived++;
+
+    merge.storeDict = upsDataRef->upsStoreDict;
+    merge.changed = false;
+    merge.urgent = false;
+    CFDictionaryApplyFunction(event, MergeUPSEventValue, &merge);
+
+    if (!merge.changed)
+        return;
+
+    now = CFAbsoluteTimeGetCurrent();
+    nextPublish = upsDataRef->lastPublishTime + kUPSPublishInterval;
+
+    if (merge.urgent || (now >= nextPublish)) {
+        PublishUPSEvent(upsDataRef);
+        return;
+    }
+
+    // Hold this reading until the interval expires; later readings
+    // merge into the same publish.
+    if (upsDataRef->publishPending)
+        return;
+
+    upsDataRef->publishPending = true;
+
+    // The timer doesn't repeat, so once it has fired it is invalid and
+    // can't be rearmed.
+    if (upsDataRef->publishTimer && !CFRunLoopTimerIsValid(upsDataRef->publishTimer)) {
+        CFRelease(upsDataRef->publishTimer);
+        upsDataRef->publishTimer = NULL;
+    }
+
+    if (!upsDataRef->publishTimer) {
+        CFRunLoopTimerContext   context = {0, upsDataRef, NULL, NULL, NULL};
+
+        upsDataRef->publishTimer = CFRunLoopTimerCreate(kCFAllocatorDefault,
+                                                        nextPublish, 0, 0, 0,
+                                                        PublishTimerCallback,
+                                                        &context);
+        if (!upsDataRef->publishTimer) {
+            PublishUPSEvent(upsDataRef);
+            return;
         }
-        notify_post(kIOPSNotifyTimeRemaining);
+        CFRunLoopAddTimer(CFRunLoopGetCurrent(), upsDataRef->publishTimer,
+                          kCFRunLoopDefaultMode);
+    } else {
+        CFRunLoopTimerSetNextFireDate(upsDataRef->publishTimer, nextPublish);
+    }
+}
+
+//---------------------------------------------------------------------------
+// PublishUPSEvent
+//
+//---------------------------------------------------------------------------
+void PublishUPSEvent(UPSDataRef upsDataRef) {
+    upsDataRef->publishPending = false;
+    upsDataRef->lastPublishTime = CFAbsoluteTimeGetCurrent();
+
+    if (!upsDataRef->powerSourceID || !upsDataRef->upsStoreDict)
+        return;
+
+    upsDataRef->eventsPublished++;
+
+    IOReturn result = IOPSSetPowerSourceDetails(upsDataRef->powerSourceID,
+                                                upsDataRef->upsStoreDict);
+    if (result != kIOReturnSuccess) {
+        // TODO: do I need to deal with this?
+    }
+    PostTimeRemainingChanged();
+}
+
+//---------------------------------------------------------------------------
+// PostTimeRemainingChanged
+//
+// Defers kIOPSNotifyTimeRemaining to NotifyObserverCallback, so that any
+// number of UPS units publishing in one run loop pass cost powerd's clients
+// a single notification.
+//---------------------------------------------------------------------------
+void PostTimeRemainingChanged(void) {
+    gNotifyTimeRemainingPending = true;
+}
+
+//---------------------------------------------------------------------------
+// NotifyObserverCallback
+//
+//---------------------------------------------------------------------------
+void NotifyObserverCallback(CFRunLoopObserverRef observer,
+                            CFRunLoopActivity activity, void *info) {
+    if (!gNotifyTimeRemainingPending)
+        return;
+
+    gNotifyTimeRemainingPending = false;
+    notify_post(kIOPSNotifyTimeRemaining);
+}
+
+//---------------------------------------------------------------------------
+// PublishTimerCallback
+//
+//---------------------------------------------------------------------------
+void PublishTimerCallback(CFRunLoopTimerRef timer, void *info) {
+    UPSDataRef upsDataRef = (UPSDataRef)info;
+
+    if (upsDataRef && upsDataRef->publishPending)
+        PublishUPSEvent(upsDataRef);
+}
+
+//---------------------------------------------------------------------------
+// LogUPSEventCounts
+//
+//---------------------------------------------------------------------------
+void LogUPSEventCounts(void) {
+    int         i;
+    UPSDataRef  upsDataRef;
+
+    syslog(LOG_NOTICE, "upsd: %u UPS units attached, %d slots\n",
+           gUPSCount, gUPSTableCount);
+
+    for (i = 0; i < gUPSTableCount; i++) {
+        upsDataRef = gUPSTable[i];
+        if (!upsDataRef || !upsDataRef->isPresent)
+            continue;
+
+        syslog(LOG_NOTICE, "upsd: UPS%d: %u events received, %u published\n",
+               upsDataRef->upsID, (unsigned int)upsDataRef->eventsReceived,
+               (unsigned int)upsDataRef->eventsPublished);
     }
 }
 
@@ -546,62 +747,97 @@ void ProcessUPSEvent(UPSDataRef upsDataRef, CFDictionaryRef event) {
 //
 // Now that UPS entries remain in the System Configuration store, we also 
 // preserve the UPSDeviceData struct that is associated with it. Before 
-// getting a null entry from the gUPSDataRef that means we will have to 
-// create a new UPSDeviceData struct, we check the existing ones to see if 
-// there is a matching one that we can just reactivate. If we can't find an 
-// existing UPSDeviceData struct, we will create the storage that is 
-// necessary to keep track of the UPS.  We also update the global array of 
-// UPSDeviceData and fill in that data ref with the values that we want to
-// track from the UPS
+// allocating a new UPSDeviceData struct, we take a slot released by a UPS 
+// that went away and reactivate its struct. If there are no free slots, we 
+// will create the storage that is necessary to keep track of the UPS at 
+// the end of the table.  We also fill in that data ref with the values that 
+// we want to track from the UPS
 //---------------------------------------------------------------------------
 
 UPSDataRef GetPrivateData(CFDictionaryRef properties) {
     UPSDataRef upsDataRef = NULL;
-    CFMutableDataRef data = NULL;
-    UInt32 i = 0;
-    UInt32 count = 0;
-    
+    int upsID;
 
-    // Allocated the global array if necessary
-    if (!gUPSDataArrayRef && 
-        !(gUPSDataArrayRef = CFArrayCreateMutable(kCFAllocatorDefault, 0,
-                                                  &kCFTypeArrayCallBacks))) {
-        return NULL;
-    }
+    if (gUPSFreeCount > 0) {
+        upsID = gUPSFreeSlots[--gUPSFreeCount];
+        upsDataRef = gUPSTable[upsID];
+    } else {
+        // Grow the table (and the free list, which never holds more entries)
+        if (gUPSTableCount == gUPSTableCapacity) {
+            int newCapacity = gUPSTableCapacity ? (2 * gUPSTableCapacity) : 8;
+            UPSDataRef *newTable;
+            int *newFreeSlots;
+
+            newTable = realloc(gUPSTable, newCapacity * sizeof(UPSDataRef));
+            if (!newTable)
+                return NULL;
+            gUPSTable = newTable;
+
+            newFreeSlots = realloc(gUPSFreeSlots, newCapacity * sizeof(int));
+            if (!newFreeSlots)
+                return NULL;
+            gUPSFreeSlots = newFreeSlots;
+
+            gUPSTableCapacity = newCapacity;
+        }
 
-    // Find an empty location in our array
-    count = CFArrayGetCount(gUPSDataArrayRef);
-    for (i = 0; i < count; i++) {
-        data = (CFMutableDataRef)CFArrayGetValueAtIndex(gUPSDataArrayRef, i);
-        if (!data)
-            continue;
-            
-        upsDataRef = (UPSDataRef)CFDataGetMutableBytePtr(data);
+        upsDataRef = calloc(1, sizeof(UPSData));
+        if (!upsDataRef)
+            return NULL;
 
-        if (upsDataRef && !(upsDataRef->isPresent))
-            break;
-        
-        upsDataRef = NULL;
+        upsID = gUPSTableCount++;
+        gUPSTable[upsID] = upsDataRef;
     }
     
-    // No valid upsDataRef was found, so let's go ahead and allocate one
-    if ((upsDataRef == NULL) &&
-            (data = CFDataCreateMutable(kCFAllocatorDefault,
-                                        sizeof(UPSData)))) {
-        upsDataRef = (UPSDataRef)CFDataGetMutableBytePtr(data);
-        bzero(upsDataRef, sizeof(UPSData));
-
-        CFArrayAppendValue(gUPSDataArrayRef, data);
-        CFRelease(data);
-    }
+    // Fill in some of the fields in that structure
+    upsDataRef->upsID = upsID;
+    upsDataRef->slotFree = FALSE;
+    upsDataRef->lastPublishTime = 0;
+    upsDataRef->eventsReceived = 0;
+    upsDataRef->eventsPublished = 0;
     
-    // If we have a pointer to our global, then fill in some of the field in that structure
-    //
-    if (upsDataRef != NULL) {
-        upsDataRef->upsID = i;
+    return upsDataRef;
+}
+
+//---------------------------------------------------------------------------
+// ReleasePrivateData
+//
+// Withdraws the UPS's power source and returns its slot to the free list.
+//---------------------------------------------------------------------------
+void ReleasePrivateData(UPSDataRef upsDataRef) {
+    if (upsDataRef->slotFree)
+        return;
+
+    upsDataRef->isPresent = FALSE;
+
+    if (upsDataRef->upsStoreDict) {
+        CFRelease(upsDataRef->upsStoreDict);
+        upsDataRef->upsStoreDict = NULL;
     }
     
-    return upsDataRef;
+    if (upsDataRef->powerSourceID) {
+        IOReturn result = IOPSReleasePowerSource(upsDataRef->powerSourceID);
+        gUPSCount--;
+        if (result != kIOReturnSuccess) {
+            syslog(LOG_ERR, "IOPSReleasePowerSource failed (IOReturn: %d\n",
+                   result);
+        }
+        upsDataRef->powerSourceID = NULL;
+    }
+
+    upsDataRef->slotFree = TRUE;
+    gUPSFreeSlots[gUPSFreeCount++] = upsDataRef->upsID;
+}
+
+//---------------------------------------------------------------------------
+// UPSDataForID
+//
+//---------------------------------------------------------------------------
+UPSDataRef UPSDataForID(int upsID) {
+    if ((upsID < 0) || (upsID >= gUPSTableCount))
+        return NULL;
+
+    return gUPSTable[upsID];
 }
 
 
@@ -727,14 +963,16 @@ IOReturn CreatePowerManagerUPSEntry(UPSDataRef upsDataRef,
              upsDataRef->upsID);
     
     result = IOPSCreatePowerSource(&(upsDataRef->powerSourceID));
-    gUPSCount++;
     
     // TODO: possible trouble spot.
     //       Shouldn't need to check/release since it only exists if we succeed.
     if (result != kIOReturnSuccess) {
         upsDataRef->powerSourceID = NULL;
+        if (upsStoreDict)
+            CFRelease(upsStoreDict);
         return result;
     }
+    gUPSCount++;
     
     result = IOPSSetPowerSourceDetails(upsDataRef->powerSourceID, upsStoreDict);
     
@@ -764,7 +1002,6 @@ IOReturn CreatePowerManagerUPSEntry(UPSDataRef upsDataRef,
 kern_return_t _io_ups_send_command(mach_port_t server, int upsID,
                                    void *commandBuffer, IOByteCount commandSize) {
     CFDictionaryRef	command;
-    CFMutableDataRef data;
     UPSDataRef upsDataRef;
     IOReturn res = kIOReturnError;
         
@@ -772,14 +1009,10 @@ kern_return_t _io_ups_send_command(mach_port_t server, int upsID,
                                                kCFAllocatorDefault,
                                                kNilOptions, NULL);
     if (command) {
-        if (!gUPSDataArrayRef || (upsID >= CFArrayGetCount(gUPSDataArrayRef))) {
+        if (!(upsDataRef = UPSDataForID(upsID))) {
             res = kIOReturnBadArgument;
         } else {
-            data = (CFMutableDataRef)CFArrayGetValueAtIndex(gUPSDataArrayRef,
-                                                            upsID);
-            upsDataRef =(UPSDataRef)CFDataGetMutableBytePtr(data);
-            
-            if (upsDataRef && upsDataRef->upsPlugInInterface)
+            if (upsDataRef->upsPlugInInterface)
                 res = (*upsDataRef->upsPlugInInterface)->sendCommand(upsDataRef->upsPlugInInterface, command);
         }
         CFRelease(command);
@@ -798,19 +1031,16 @@ kern_return_t _io_ups_get_event( mach_port_t server, int upsID,
                                 void **eventBufferPtr,
                                 IOByteCount *eventBufferSizePtr) {
     CFDictionaryRef	event;
-    CFMutableDataRef data;
     CFDataRef serializedData;
     UPSDataRef upsDataRef;
     IOReturn res = kIOReturnError;
         
-    if (!eventBufferPtr || !eventBufferSizePtr ||
-        !gUPSDataArrayRef || (upsID >= CFArrayGetCount(gUPSDataArrayRef))) {
+    if (!eventBufferPtr || !eventBufferSizePtr) {
         
         return kIOReturnBadArgument;
     }
     
-    data = (CFMutableDataRef)CFArrayGetValueAtIndex(gUPSDataArrayRef, upsID);
-    upsDataRef = (UPSDataRef)CFDataGetMutableBytePtr(data);
+    upsDataRef = UPSDataForID(upsID);
     
     if (!upsDataRef || !upsDataRef->upsPlugInInterface)
         return kIOReturnBadArgument;
@@ -850,19 +1080,16 @@ kern_return_t _io_ups_get_capabilities(mach_port_t server, int upsID,
                                        void **capabilitiesBufferPtr,
                                        IOByteCount *capabilitiesBufferSizePtr) {
     CFSetRef capabilities;
-    CFMutableDataRef data;
     CFDataRef serializedData;
     UPSDataRef upsDataRef;
     IOReturn res = kIOReturnError;
         
-    if (!capabilitiesBufferPtr || !capabilitiesBufferSizePtr ||
-        !gUPSDataArrayRef || (upsID >= CFArrayGetCount(gUPSDataArrayRef))) {
+    if (!capabilitiesBufferPtr || !capabilitiesBufferSizePtr) {
         
         return kIOReturnBadArgument;
     }
     
-    data = (CFMutableDataRef)CFArrayGetValueAtIndex(gUPSDataArrayRef, upsID);
-    upsDataRef = (UPSDataRef)CFDataGetMutableBytePtr(data);
+    upsDataRef = UPSDataForID(upsID);
     
     if (!upsDataRef || !upsDataRef->upsPlugInInterface)
         return kIOReturnBadArgument;
@@ -0,0 +1,369 @@
+/*
+ * Copyright (c) 2014 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "AssertionSnapshot.h"
+
+// Columns in the order they're laid out
+enum {
+    kColCreateTime = 0,
+    kColTimeout,
+    kColPID,
+    kColTypeAtom,
+    kColNameAtom,
+    kColProcessAtom,
+    kColAssertionID,
+    kColFlags,
+    kColLevel,
+    kColCount
+};
+
+static const size_t kColumnWidth[kColCount] = {
+    sizeof(int64_t), sizeof(int64_t), sizeof(int32_t),
+    sizeof(uint32_t), sizeof(uint32_t), sizeof(uint32_t), sizeof(uint32_t), sizeof(uint32_t),
+    sizeof(uint8_t)
+};
+
+#define kAlign(n)       (((n) + 7) & ~(size_t)7)
+
+/*
+ * Offsets of each column and of the string table from the start of a
+ * snapshot of 'count' assertions. Returns the offset of the string table.
+ */
+static size_t columnOffsets(uint32_t count, size_t offsets[kColCount])
+{
+    size_t      offset = kAlign(sizeof(PMAssertionSnapshotHeader));
+    int         c;
+
+    for (c = 0; c < kColCount; c++) {
+        offsets[c] = offset;
+        offset = kAlign(offset + kColumnWidth[c] * count);
+    }
+    return offset;
+}
+
+__private_extern__ bool PMAssertionSnapshotOpen(const void *buf, size_t len, PMAssertionSnapshot *snap)
+{
+    const PMAssertionSnapshotHeader *header = buf;
+    const uint8_t                   *base = buf;
+    size_t                          offsets[kColCount];
+    size_t                          stringsOffset;
+
+    if (!buf || (len < sizeof(*header))
+        || (header->magic != kPMAssertionSnapshotMagic)
+        || (header->version != kPMAssertionSnapshotVersion)
+        || (header->headerSize != sizeof(*header))
+        || (header->count > len / sizeof(int64_t)))
+    {
+        return false;
+    }
+
+    stringsOffset = columnOffsets(header->count, offsets);
+    if ((header->stringsSize == 0) || (stringsOffset > len) || (header->stringsSize > len - stringsOffset)
+        || (base[stringsOffset + header->stringsSize - 1] != '\0'))
+    {
+        return false;
+    }
+
+    snap->count = header->count;
+    snap->snapshotTime = header->snapshotTime;
+    snap->createTime = (const int64_t *)(base + offsets[kColCreateTime]);
+    snap->timeout = (const int64_t *)(base + offsets[kColTimeout]);
+    snap->pid = (const int32_t *)(base + offsets[kColPID]);
+    snap->typeAtom = (const uint32_t *)(base + offsets[kColTypeAtom]);
+    snap->nameAtom = (const uint32_t *)(base + offsets[kColNameAtom]);
+    snap->processAtom = (const uint32_t *)(base + offsets[kColProcessAtom]);
+    snap->assertionID = (const uint32_t *)(base + offsets[kColAssertionID]);
+    snap->flags = (const uint32_t *)(base + offsets[kColFlags]);
+    snap->level = base + offsets[kColLevel];
+    snap->strings = (const char *)(base + stringsOffset);
+    snap->stringsSize = header->stringsSize;
+    return true;
+}
+
+__private_extern__ const char *PMAssertionSnapshotString(const PMAssertionSnapshot *snap, uint32_t atom)
+{
+    return (atom < snap->stringsSize) ? snap->strings + atom : NULL;
+}
+
+__private_extern__ const PMAssertionStatus *PMAssertionStatusOpen(const void *buf, size_t len)
+{
+    const PMAssertionStatus     *status = buf;
+
+    if (!buf || (len < sizeof(*status))
+        || (status->magic != kPMAssertionStatusMagic)
+        || (status->version != kPMAssertionStatusVersion)
+        || (status->typeCount > kPMAssertionStatusMaxTypes))
+    {
+        return NULL;
+    }
+    return status;
+}
+
+/*
+ * The builder keeps the entries as rows and the string table as it will
+ * be written. Strings are found again through an open-addressed table of
+ * their atoms, so each distinct name is stored once.
+ */
+typedef struct {
+    int64_t             createTime;
+    int64_t             timeout;
+    int32_t             pid;
+    uint32_t            typeAtom;
+    uint32_t            nameAtom;
+    uint32_t            processAtom;
+    uint32_t            assertionID;
+    uint32_t            flags;
+    uint8_t             level;
+} snapshotRow_t;
+
+struct PMAssertionSnapshotBuilder {
+    snapshotRow_t       *rows;
+    uint32_t            count;
+    uint32_t            capacity;
+
+    char                *strings;
+    uint32_t            stringsSize;
+    uint32_t            stringsCapacity;
+
+    uint32_t            *atoms;         // hash slots holding atom + 1; 0 is empty
+    uint32_t            atomSlots;      // a power of 2
+    uint32_t            atomCount;
+};
+
+static uint32_t hashString(const char *str)
+{
+    uint32_t    hash = 2166136261u;
+
+    while (*str) {
+        hash = (hash ^ (uint8_t)*str++) * 16777619u;
+    }
+    return hash;
+}
+
+static bool growAtoms(PMAssertionSnapshotBuilder *builder)
+{
+    uint32_t    slots = builder->atomSlots ? builder->atomSlots * 2 : 64;
+    uint32_t    *atoms = calloc(slots, sizeof(uint32_t));
+    uint32_t    i, h;
+
+    if (!atoms) {
+        return false;
+    }
+    for (i = 0; i < builder->atomSlots; i++) {
+        if (!builder->atoms[i]) {
+            continue;
+        }
+        h = hashString(builder->strings + builder->atoms[i] - 1) & (slots - 1);
+        while (atoms[h]) {
+            h = (h + 1) & (slots - 1);
+        }
+        atoms[h] = builder->atoms[i];
+    }
+    free(builder->atoms);
+    builder->atoms = atoms;
+    builder->atomSlots = slots;
+    return true;
+}
+
+/*
+ * The atom for 'str', adding it to the string table if it's new. Returns
+ * false if out of memory.
+ */
+static bool atomFor(PMAssertionSnapshotBuilder *builder, const char *str, uint32_t *atom)
+{
+    size_t      len;
+    uint32_t    h, need;
+    char        *strings;
+
+    if (!str || !*str) {
+        *atom = 0;
+        return true;
+    }
+
+    if ((builder->atomCount + 1) * 2 > builder->atomSlots && !growAtoms(builder)) {
+        return false;
+    }
+
+    h = hashString(str) & (builder->atomSlots - 1);
+    while (builder->atoms[h]) {
+        if (!strcmp(builder->strings + builder->atoms[h] - 1, str)) {
+            *atom = builder->atoms[h] - 1;
+            return true;
+        }
+        h = (h + 1) & (builder->atomSlots - 1);
+    }
+
+    len = strlen(str) + 1;
+    if (len > UINT32_MAX - builder->stringsSize) {
+        return false;
+    }
+    need = builder->stringsSize + (uint32_t)len;
+    if (need > builder->stringsCapacity) {
+        uint32_t capacity = builder->stringsCapacity * 2;
+
+        if (capacity < need) {
+            capacity = need;
+        }
+        if (!(strings = realloc(builder->strings, capacity))) {
+            return false;
+        }
+        builder->strings = strings;
+        builder->stringsCapacity = capacity;
+    }
+
+    *atom = builder->stringsSize;
+    memcpy(builder->strings + builder->stringsSize, str, len);
+    builder->stringsSize = need;
+    builder->atoms[h] = *atom + 1;
+    builder->atomCount++;
+    return true;
+}
+
+__private_extern__ PMAssertionSnapshotBuilder *PMAssertionSnapshotBuilderCreate(void)
+{
+    PMAssertionSnapshotBuilder  *builder = calloc(1, sizeof(PMAssertionSnapshotBuilder));
+
+    if (!builder) {
+        return NULL;
+    }
+
+    // Atom 0, the empty string
+    builder->stringsCapacity = 1024;
+    builder->strings = calloc(1, builder->stringsCapacity);
+    builder->stringsSize = 1;
+    if (!builder->strings || !growAtoms(builder)) {
+        PMAssertionSnapshotBuilderRelease(builder);
+        return NULL;
+    }
+    return builder;
+}
+
+__private_extern__ void PMAssertionSnapshotBuilderRelease(PMAssertionSnapshotBuilder *builder)
+{
+    if (!builder) {
+        return;
+    }
+    free(builder->rows);
+    free(builder->strings);
+    free(builder->atoms);
+    free(builder);
+}
+
+__private_extern__ bool PMAssertionSnapshotBuilderAdd(
+    PMAssertionSnapshotBuilder      *builder,
+    const PMAssertionSnapshotEntry  *entry)
+{
+    snapshotRow_t   *row;
+
+    if (builder->count == builder->capacity) {
+        uint32_t    capacity = builder->capacity ? builder->capacity * 2 : 64;
+
+        if (!(row = realloc(builder->rows, capacity * sizeof(snapshotRow_t)))) {
+            return false;
+        }
+        builder->rows = row;
+        builder->capacity = capacity;
+    }
+
+    row = &builder->rows[builder->count];
+    if (!atomFor(builder, entry->type, &row->typeAtom)
+        || !atomFor(builder, entry->name, &row->nameAtom)
+        || !atomFor(builder, entry->process, &row->processAtom))
+    {
+        return false;
+    }
+    row->createTime = entry->createTime;
+    row->timeout = entry->timeout;
+    row->pid = entry->pid;
+    row->assertionID = entry->assertionID;
+    row->flags = entry->flags;
+    row->level = entry->level;
+    builder->count++;
+    return true;
+}
+
+__private_extern__ size_t PMAssertionSnapshotBuilderSize(PMAssertionSnapshotBuilder *builder)
+{
+    size_t      offsets[kColCount];
+
+    return columnOffsets(builder->count, offsets) + builder->stringsSize;
+}
+
+__private_extern__ bool PMAssertionSnapshotBuilderWrite(
+    PMAssertionSnapshotBuilder  *builder,
+    int64_t                     snapshotTime,
+    void                        *buf,
+    size_t                      len)
+{
+    PMAssertionSnapshotHeader   *header = buf;
+    uint8_t                     *base = buf;
+    size_t                      offsets[kColCount];
+    size_t                      stringsOffset;
+    int64_t                     *createTime, *timeout;
+    int32_t                     *pid;
+    uint32_t                    *typeAtom, *nameAtom, *processAtom, *assertionID, *flags;
+    uint8_t                     *level;
+    uint32_t                    i;
+
+    stringsOffset = columnOffsets(builder->count, offsets);
+    if (len < stringsOffset + builder->stringsSize) {
+        return false;
+    }
+    bzero(buf, stringsOffset);
+
+    header->magic = kPMAssertionSnapshotMagic;
+    header->version = kPMAssertionSnapshotVersion;
+    header->headerSize = sizeof(*header);
+    header->count = builder->count;
+    header->stringsSize = builder->stringsSize;
+    header->snapshotTime = snapshotTime;
+
+    createTime = (int64_t *)(base + offsets[kColCreateTime]);
+    timeout = (int64_t *)(base + offsets[kColTimeout]);
+    pid = (int32_t *)(base + offsets[kColPID]);
+    typeAtom = (uint32_t *)(base + offsets[kColTypeAtom]);
+    nameAtom = (uint32_t *)(base + offsets[kColNameAtom]);
+    processAtom = (uint32_t *)(base + offsets[kColProcessAtom]);
+    assertionID = (uint32_t *)(base + offsets[kColAssertionID]);
+    flags = (uint32_t *)(base + offsets[kColFlags]);
+    level = base + offsets[kColLevel];
+
+    for (i = 0; i < builder->count; i++) {
+        const snapshotRow_t *row = &builder->rows[i];
+
+        createTime[i] = row->createTime;
+        timeout[i] = row->timeout;
+        pid[i] = row->pid;
+        typeAtom[i] = row->typeAtom;
+        nameAtom[i] = row->nameAtom;
+        processAtom[i] = row->processAtom;
+        assertionID[i] = row->assertionID;
+        flags[i] = row->flags;
+        level[i] = row->level;
+    }
+    memcpy(base + stringsOffset, builder->strings, builder->stringsSize);
+    return true;
+}
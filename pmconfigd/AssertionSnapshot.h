@@ -0,0 +1,158 @@
+/*
+ * Copyright (c) 2014 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#ifndef _AssertionSnapshot_h_
+#define _AssertionSnapshot_h_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A columnar copy of the assertions powerd holds, returned by
+ * io_pm_assertion_copy_details() for kPMAssertionMIGCopyColumnar and
+ * written to stdout by 'pmset -g assertions --binary'.
+ *
+ * The snapshot is a PMAssertionSnapshotHeader followed by one fixed-width
+ * array per field, each 'count' long, in the order of the columns in
+ * PMAssertionSnapshot, then a table of NUL-terminated strings. Strings are
+ * stored once and referred to by their offset in the table, an atom; atom
+ * 0 is the empty string. Every array starts on an 8 byte boundary, and
+ * integers are in the byte order of the host that wrote them.
+ */
+
+#define kPMAssertionMIGCopyColumnar         0x100   // whichData for io_pm_assertion_copy_details()
+
+#define kPMAssertionSnapshotMagic           0x504d4153      // 'PMAS'
+#define kPMAssertionSnapshotVersion         1
+
+// PMAssertionSnapshot flags
+enum {
+    kPMAssertionSnapshotTimed               = 0x0001,   // has a timeout
+    kPMAssertionSnapshotInactive            = 0x0002,   // timed out or released to level 0
+    kPMAssertionSnapshotValidOnBattery      = 0x0004,
+    kPMAssertionSnapshotAppliesOnLidClose   = 0x0008,
+    kPMAssertionSnapshotTimeoutIsSystemTimer = 0x0010
+};
+
+typedef struct {
+    uint32_t            magic;
+    uint16_t            version;
+    uint16_t            headerSize;
+    uint32_t            count;          // assertions
+    uint32_t            stringsSize;    // bytes in the string table
+    int64_t             snapshotTime;   // seconds since 1970
+    uint64_t            reserved;
+} PMAssertionSnapshotHeader;
+
+/*
+ * A decoded snapshot. The columns point into the buffer it was opened
+ * from; entry i is column[i].
+ */
+typedef struct {
+    uint32_t            count;
+    int64_t             snapshotTime;
+    const int64_t       *createTime;    // seconds since 1970
+    const int64_t       *timeout;       // seconds since 1970; 0 if none
+    const int32_t       *pid;
+    const uint32_t      *typeAtom;
+    const uint32_t      *nameAtom;
+    const uint32_t      *processAtom;
+    const uint32_t      *assertionID;
+    const uint32_t      *flags;
+    const uint8_t       *level;
+    const char          *strings;
+    uint32_t            stringsSize;
+} PMAssertionSnapshot;
+
+/* PMAssertionSnapshotOpen
+ * Checks the snapshot in 'buf' and points 'snap' at its columns. Returns
+ * false if it has another layout or is cut short.
+ */
+__private_extern__ bool         PMAssertionSnapshotOpen(const void *buf, size_t len, PMAssertionSnapshot *snap);
+
+/* PMAssertionSnapshotString
+ * The string for an atom, or NULL if the atom isn't in the table.
+ */
+__private_extern__ const char   *PMAssertionSnapshotString(const PMAssertionSnapshot *snap, uint32_t atom);
+
+/*
+ * Builds a snapshot. Add each assertion, then size a buffer with
+ * PMAssertionSnapshotBuilderSize() and write the snapshot into it.
+ */
+typedef struct {
+    int64_t             createTime;
+    int64_t             timeout;
+    int32_t             pid;
+    uint32_t            assertionID;
+    uint32_t            flags;
+    uint8_t             level;
+    const char          *type;          // strings may be NULL
+    const char          *name;
+    const char          *process;
+} PMAssertionSnapshotEntry;
+
+typedef struct PMAssertionSnapshotBuilder PMAssertionSnapshotBuilder;
+
+__private_extern__ PMAssertionSnapshotBuilder   *PMAssertionSnapshotBuilderCreate(void);
+__private_extern__ void     PMAssertionSnapshotBuilderRelease(PMAssertionSnapshotBuilder *builder);
+__private_extern__ bool     PMAssertionSnapshotBuilderAdd(PMAssertionSnapshotBuilder *builder,
+                                                          const PMAssertionSnapshotEntry *entry);
+__private_extern__ size_t   PMAssertionSnapshotBuilderSize(PMAssertionSnapshotBuilder *builder);
+__private_extern__ bool     PMAssertionSnapshotBuilderWrite(PMAssertionSnapshotBuilder *builder,
+                                                            int64_t snapshotTime, void *buf, size_t len);
+
+/*
+ * The system-wide aggregate level of every assertion type, returned by
+ * io_pm_assertion_copy_details() for kPMAssertionMIGCopyStatusPacked.
+ * It holds what kIOPMAssertionMIGCopyStatus returns as a dictionary of
+ * CFNumbers, as one fixed-size struct indexed by powerd's type number.
+ */
+
+#define kPMAssertionMIGCopyStatusPacked     0x101   // whichData for io_pm_assertion_copy_details()
+
+#define kPMAssertionStatusMagic             0x504d4147      // 'PMAG'
+#define kPMAssertionStatusVersion           1
+
+enum {
+    kPMAssertionStatusMaxTypes      = 32,
+    kPMAssertionStatusNameLen       = 48
+};
+
+typedef struct {
+    uint32_t            magic;
+    uint16_t            version;
+    uint16_t            typeCount;      // entries used in levels and names
+    uint32_t            levelBits;      // bit n is levels[n]
+    uint32_t            kernelBits;     // user assertion bits last sent to the kernel
+    uint64_t            generation;     // changes when any level changes
+    uint8_t             levels[kPMAssertionStatusMaxTypes];
+    char                names[kPMAssertionStatusMaxTypes][kPMAssertionStatusNameLen];
+} PMAssertionStatus;
+
+/* PMAssertionStatusOpen
+ * The status in 'buf', or NULL if it has another layout.
+ */
+__private_extern__ const PMAssertionStatus  *PMAssertionStatusOpen(const void *buf, size_t len);
+
+#endif // _AssertionSnapshot_h_
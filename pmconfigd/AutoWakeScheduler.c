@@ -30,11 +30,14 @@
  */
 
 #include <syslog.h>
+#include <asl.h>
 #include <bsm/libbsm.h>
 #include "PrivateLib.h"
 #include "AutoWakeScheduler.h"
 #include "RepeatingAutoWake.h"
 #include "PMAssertions.h"
+#include "PowerEventQueue.h"
+#include "PowerEventJournal.h"
 
 enum {
     kIOWakeTimer = 0,
@@ -54,6 +57,12 @@ static CFAbsoluteTime        gMinScheduleTime = 5.0;
 #define MIN_SCHEDULE_TIME   (0.0)
 #endif
 
+// Fire date of the power event timer while nothing is scheduled
+#define kPowerEventTimerIdle    (1.0e10)
+
+// Seconds after a change before the events are exported to kIOPMAutoWakePrefsPath
+#define kPrefsExportDelay       30
+
 typedef void (*powerEventCallout)(CFDictionaryRef);
 
 /* 
@@ -64,12 +73,14 @@ typedef void (*powerEventCallout)(CFDictionaryRef);
 struct PowerEventBehavior {
     // These values change to reflect the state of current 
     // and upcoming power events
-    CFMutableArrayRef       array;
     CFDictionaryRef         currentEvent;
-    CFRunLoopTimerRef       timer;
+    CFAbsoluteTime          fireTime;       // of currentEvent; 0 if none
 
     CFStringRef             title;
 
+    // This behavior's event type in gEventQueue
+    int                     queueType;
+
     // wake and poweron sharedEvents pointer points to wakeorpoweron struct
     struct PowerEventBehavior      *sharedEvents;
 
@@ -91,6 +102,23 @@ PowerEventBehavior          poweronBehavior;
 PowerEventBehavior          wakeorpoweronBehavior;
 
 static uint32_t     activeEventCnt = 0;
+
+/*
+ * All scheduled events, by behavior, and the one run loop timer
+ * that fires the earliest of the behaviors' currentEvents.
+ */
+static PowerEventQueue      *gEventQueue = NULL;
+static CFRunLoopTimerRef    gPowerEventTimer = NULL;
+
+#if !TARGET_OS_EMBEDDED
+/*
+ * Adds and cancels are persisted by appending to gEventJournal. The
+ * SCPreferences file is only an export, written some time after changes
+ * settle, and read at boot only if there's no usable journal.
+ */
+static PowerEventJournal    *gEventJournal = NULL;
+static bool                 gPrefsExportScheduled = false;
+#endif
 enum {
     kBehaviorsCount = 6
 };
@@ -111,14 +139,16 @@ PowerEventBehavior *behaviors[] =
 /*
  * forwards
  */
-static bool             isEntryValidAndFuturistic(CFDictionaryRef, CFDateRef);
 static void             schedulePowerEvent(PowerEventBehavior *);
 static bool             purgePastEvents(PowerEventBehavior *);
 static void             copyScheduledPowerChangeArrays(void);
 static CFDictionaryRef  copyEarliestUpcoming(PowerEventBehavior *);
 static CFDateRef        _getScheduledEventDate(CFDictionaryRef);
-static CFArrayRef       copyMergedEventArray(PowerEventBehavior *, 
-                                             PowerEventBehavior *);
+static void             removeQueuedEvent(PowerEvent *);
+static void             armPowerEventTimer(void);
+static void             handleTimerExpiration(CFRunLoopTimerRef, void *);
+static IOReturn         journalEvent(PowerEventBehavior *, int, CFDictionaryRef);
+static void             schedulePrefsExport(void);
 static CFComparisonResult compareEvDates(CFDictionaryRef, 
                                              CFDictionaryRef, void *);
 
@@ -149,54 +179,62 @@ void restartTimerExpiredCallout(CFDictionaryRef);
  *
  * WAKE
  * Wake is simpler than power on, since we get a notification on the way to sleep.
- * At going-to-sleep time we scan the wake_arr CFArray for the next upcoming
- * wakeup time (in AutoWakeSleepWakeNotification())
+ * At going-to-sleep time we look up the next upcoming wakeup time
+ * (in AutoWakeSleepWakeNotification())
+ *
+ * QUEUE
+ * Events of every type live in gEventQueue, a min-heap per type, so the
+ * next event of a type is always at hand. A single run loop timer fires at
+ * the earliest upcoming event across all types (in armPowerEventTimer()).
  *
- * LOADING NEW AUTOWAKEUP TIMES
- * Via SCPreferences notifications
+ * PERSISTENCE
+ * Each add and cancel is appended to the event journal (PowerEventJournal.c), and
+ * replayed from it at boot. The journal is compacted once it's mostly cancelled
+ * or expired events. kIOPMAutoWakePrefsPath is still written, kPrefsExportDelay
+ * seconds after changes settle, for anything that reads it; powerd reads it only
+ * when there's no usable journal, e.g. on first boot with the journal.
  *
  * PURGING OLD TIMES
  * In memory events with old timestamo gets purged at boot, at wakeup and when new event is added. 
- * But, we don't update on-disk contents unless a new event is being added or existing event is deleted
- * thru IOKit.
- * So to minimize disk access we only purge when we think the disk is "up" anyway.
+ * Purges aren't journaled; replay re-adds the expired events, which are purged again,
+ * and compaction drops them for good.
  */
 #pragma mark -
 #pragma mark AutoWakeScheduler
 
 /*
- * Deletes events with specific appName in the given behavior array.
- *
- * The event array pointer gets modified. 
+ * Deletes events with specific appName in the given behavior's queue.
  */
 static void
 removeEventsByAppName(PowerEventBehavior *behave, CFStringRef appName)
 {
-    CFIndex             count, j;
-    CFDictionaryRef     cancelee = 0;
-
-
-    if ( (behave->array == NULL) || 
-            (count = CFArrayGetCount(behave->array)) == 0)
+    CFArrayRef          events;
+    CFDictionaryRef     cancelee;
+    CFDateRef           date;
+    PowerEvent          *pe;
+    CFIndex             i, count;
+
+    events = PowerEventQueueCopyEvents(gEventQueue, behave->queueType);
+    if (!events)
         return;
-    for (j = count-1; j >= 0; j--)
+
+    count = CFArrayGetCount(events);
+    for (i = 0; i < count; i++)
     {
-        cancelee = CFArrayGetValueAtIndex(behave->array, j);
-        if( CFEqual(
-            CFDictionaryGetValue(cancelee, CFSTR(kIOPMPowerEventAppNameKey)), appName
-            ))
-        {
+        cancelee = CFArrayGetValueAtIndex(events, i);
+        date = _getScheduledEventDate(cancelee);
+        if (!date)
+            continue;
+
+        pe = PowerEventQueueFind(gEventQueue, behave->queueType, 
+                                 CFDateGetAbsoluteTime(date), appName);
+        if (pe) {
             // This is the one to cancel
-            if (behave->currentEvent && CFEqual(cancelee, behave->currentEvent)) {
-                CFRelease(behave->currentEvent);
-                behave->currentEvent = NULL;
-            }
-
-            CFArrayRemoveValueAtIndex(behave->array, j);
-            activeEventCnt--;
+            removeQueuedEvent(pe);
         }
     }
 
+    CFRelease(events);
 }
 
 
@@ -211,6 +249,14 @@ AutoWake_prime(void)
     {
         this_behavior = behaviors[i];
         bzero(this_behavior, sizeof(PowerEventBehavior));
+        this_behavior->queueType = i;
+    }
+
+    gPowerEventTimer = CFRunLoopTimerCreate(0, kPowerEventTimerIdle, 
+                    kPowerEventTimerIdle, 0, 0, handleTimerExpiration, NULL);
+    if (gPowerEventTimer) {
+        CFRunLoopAddTimer(CFRunLoopGetCurrent(), gPowerEventTimer, 
+                          kCFRunLoopDefaultMode);
     }
 
     wakeBehavior.title                      = CFSTR(kIOPMAutoWake);
@@ -260,6 +306,10 @@ AutoWake_prime(void)
            schedulePowerEvent(this_behavior);
     }
 
+#if !TARGET_OS_EMBEDDED
+    if (gEventJournal)
+        PowerEventJournalCompactIfNeeded(gEventJournal, gEventQueue, kBehaviorsCount, false);
+#endif
 
     return;
 }
@@ -292,6 +342,12 @@ __private_extern__ void AutoWakeCapabilitiesNotification(
         } else {
             // Going to sleep
             schedulePowerEvent(&wakeBehavior);
+
+#if !TARGET_OS_EMBEDDED
+            // Don't leave recent requests in the page cache across sleep
+            if (gEventJournal)
+                PowerEventJournalSync(gEventJournal);
+#endif
         }
         
     }
@@ -304,6 +360,8 @@ __private_extern__ void AutoWakeCalendarChange(void)
      */
     PowerEventBehavior      *this_behavior;
     int i;
+
+    RepeatingAutoWakeTimeChange(false);
     
     for(i=0; i<kBehaviorsCount; i++)
     {
@@ -332,31 +390,61 @@ __private_extern__ void AutoWakeCalendarChange(void)
  */
 
 static void
-handleTimerExpiration(CFRunLoopTimerRef blah, void *info)
+handleTimerExpiration(CFRunLoopTimerRef blah __unused, void *info __unused)
 {
-    PowerEventBehavior  *behave = (PowerEventBehavior *)info;
+    PowerEventBehavior  *behave;
+    CFAbsoluteTime      now = CFAbsoluteTimeGetCurrent();
+    int                 i;
 
-    if(!behave) return;
-    
-    if (behave->timer) {
-        CFRelease(behave->timer);
-        behave->timer = 0;
-    }
+    for (i = 0; i < kBehaviorsCount; i++)
+    {
+        behave = behaviors[i];
+        if (!behave->fireTime || (behave->fireTime > now))
+            continue;
+
+        behave->fireTime = 0.0;
+
+        if( behave->timerExpirationCallout ) {
+            (*behave->timerExpirationCallout)(behave->currentEvent);
+        }
         
-    if( behave->timerExpirationCallout ) {
-        (*behave->timerExpirationCallout)(behave->currentEvent);
+        if (behave->currentEvent)
+           CFRelease(behave->currentEvent);
+        behave->currentEvent = NULL;
+
+        // Schedule the next event
+        schedulePowerEvent(behave);
     }
-    
-    if (behave->currentEvent)
-       CFRelease(behave->currentEvent);
-    behave->currentEvent = NULL;
 
-    // Schedule the next event
-    schedulePowerEvent(behave);
+    armPowerEventTimer();
     
     return;
 }    
 
+/*
+ * Points the power event timer at the earliest fireTime among the behaviors.
+ */
+static void
+armPowerEventTimer(void)
+{
+    CFAbsoluteTime      earliest = 0.0;
+    int                 i;
+
+    for (i = 0; i < kBehaviorsCount; i++)
+    {
+        if (behaviors[i]->fireTime 
+            && (!earliest || (behaviors[i]->fireTime < earliest)))
+        {
+            earliest = behaviors[i]->fireTime;
+        }
+    }
+
+    if (gPowerEventTimer) {
+        CFRunLoopTimerSetNextFireDate(gPowerEventTimer, 
+                            earliest ? earliest : kPowerEventTimerIdle);
+    }
+}
+
 /*
  * Required behaviors at event scheduling time:
  *
@@ -369,17 +457,10 @@ handleTimerExpiration(CFRunLoopTimerRef blah, void *info)
 static void
 schedulePowerEvent(PowerEventBehavior *behave)
 {
-    static CFRunLoopTimerContext    tmr_context = {0,0,0,0,0};
-    CFAbsoluteTime                  fire_time = 0.0;
     CFDictionaryRef                 upcoming = NULL;
     CFDateRef                       temp_date = NULL;
 
-    if(behave->timer) 
-    {
-       CFRunLoopTimerInvalidate(behave->timer);
-       CFRelease(behave->timer);
-       behave->timer = 0;
-    }
+    behave->fireTime = 0.0;
     
     // find upcoming time
     upcoming = copyEarliestUpcoming(behave);
@@ -389,7 +470,7 @@ schedulePowerEvent(PowerEventBehavior *behave)
         if (behave->noScheduledEventCallout) {
             (*behave->noScheduledEventCallout)(NULL);
         }
-        return;
+        goto exit;
     }
         
     /* 
@@ -404,24 +485,14 @@ schedulePowerEvent(PowerEventBehavior *behave)
     }
 
     behave->currentEvent = (CFDictionaryRef)upcoming;
-    tmr_context.info = (void *)behave;    
     
     temp_date = _getScheduledEventDate(upcoming);
     if(!temp_date) goto exit;
 
-    fire_time = CFDateGetAbsoluteTime(temp_date);
-
-    behave->timer = CFRunLoopTimerCreate(0, fire_time, 0.0, 0, 
-                    0, handleTimerExpiration, &tmr_context);
-
-    if(behave->timer)
-    {
-        CFRunLoopAddTimer( CFRunLoopGetCurrent(), 
-                            behave->timer, 
-                            kCFRunLoopDefaultMode);
-    }
+    behave->fireTime = CFDateGetAbsoluteTime(temp_date);
 
 exit:
+    armPowerEventTimer();
     return;
 }
 
@@ -561,43 +632,6 @@ void restartTimerExpiredCallout(CFDictionaryRef event __unused)
  ******************************************************************************/
 
 
-/*
- *
- * isEntryValidAndFuturistic
- * Returns true if the CFDictionary is validly formed
- *     AND if the date is in the future
- * Returns false if anything about the dictionary is invalid
- *     OR if the CFDate is prior to the current time
- *
- */
-static bool 
-isEntryValidAndFuturistic(CFDictionaryRef wakeup_dict, CFDateRef date_now)
-{
-    CFDateRef           wakeup_date;
-    bool                ret = true;
-
-    wakeup_dict = isA_CFDictionary(wakeup_dict);
-    if(!wakeup_dict) 
-    {
-        // bogus entry!
-        ret = false;
-    } else 
-    {
-        // valid entry    
-        wakeup_date = isA_CFDate(CFDictionaryGetValue(wakeup_dict, 
-                                        CFSTR(kIOPMPowerEventTimeKey)));
-        if( !wakeup_date 
-            || (kCFCompareLessThan == CFDateCompare(wakeup_date, date_now, 0)))
-        {
-            // date is too early
-            ret = false;
-        }
-        // otherwise date is after now, and ret = true
-    }
-
-    return ret;
-}
-
 /*
  *
  * Purge past wakeup times
@@ -609,43 +643,26 @@ isEntryValidAndFuturistic(CFDictionaryRef wakeup_dict, CFDateRef date_now)
 static bool 
 purgePastEvents(PowerEventBehavior  *behave)
 {
-    CFDateRef           date_now;
-    CFDictionaryRef     event;
-    bool                ret;
+    CFAbsoluteTime      now;
+    PowerEvent          *pe;
 
-    
-    if( !behave 
-        || !behave->title
-        || !behave->array
-        || (0 == CFArrayGetCount(behave->array)))
+    if( !behave || !gEventQueue )
     {
         return true;
     }
     
-    date_now = CFDateCreate(0, CFAbsoluteTimeGetCurrent());
+    now = CFAbsoluteTimeGetCurrent();
 
-    // Loop over the array and remove any values that are in the past.
-    // Since array is sorted by date already, we stop once we reach an event
+    // Remove events from the front of the queue until we reach one
     // scheduled in the future.
-    // Do not try to optimize the CFArrayGetCount out of the while loop; this value may
-    // change during loop execution.
-    while(0 < CFArrayGetCount(behave->array))
+    while ((pe = PowerEventQueueEarliest(gEventQueue, behave->queueType))
+           && (pe->time < now))
     {
-        event = CFArrayGetValueAtIndex(behave->array, 0);
-        if (isEntryValidAndFuturistic(event, date_now) )
-                break;
-
-        // Remove entry from the array - its time has past
-        // The rest of the array will shift down to fill index 0
-        CFArrayRemoveValueAtIndex(behave->array, 0);
+        PowerEventQueueRemove(gEventQueue, pe);
         activeEventCnt--;
     }
 
-    CFRelease(date_now);
-
-    ret = true;
-
-    return ret;
+    return true;
 }
 
 
@@ -657,41 +674,65 @@ purgePastEvents(PowerEventBehavior  *behave)
 static void
 copyScheduledPowerChangeArrays(void)
 {
+    if (gEventQueue) {
+        PowerEventQueueRelease(gEventQueue);
+    }
+    gEventQueue = PowerEventQueueCreate(kBehaviorsCount);
+    activeEventCnt = 0;
+
 #if !TARGET_OS_EMBEDDED
     CFArrayRef              tmp;
     SCPreferencesRef        prefs;
     PowerEventBehavior      *this_behavior;
+    CFDictionaryRef         event;
+    CFDateRef               date;
+    CFIndex                 j, count;
     int                     i;
-   
+    bool                    replayed = false;
+
+    if (!gEventQueue) return;
+
+    if (gEventJournal) 
+        PowerEventJournalClose(gEventJournal);
+    gEventJournal = PowerEventJournalOpen(kPowerEventJournalPath, gEventQueue, 
+                                          kBehaviorsCount, &replayed);
+    if (replayed) {
+        for(i=0; i<kBehaviorsCount; i++)
+            activeEventCnt += PowerEventQueueCount(gEventQueue, i);
+        return;
+    }
+
+    // No journal yet; import the exported prefs, and start the journal from them
     prefs = SCPreferencesCreate(0, 
                                 CFSTR("PM-configd-AutoWake"),
                                 CFSTR(kIOPMAutoWakePrefsPath));
     if(!prefs) return;
 
-    activeEventCnt = 0;
     // Loop through all sleep, wake, shutdown powerbehaviors
-    for(i=0; i<kBehaviorsCount; i++) 
+    for(i=0; gEventQueue && (i<kBehaviorsCount); i++) 
     {
         this_behavior = behaviors[i];
 
-        if(this_behavior->array) {
-            CFRelease(this_behavior->array);
-            this_behavior->array = NULL;
-        }
-
         tmp = isA_CFArray(SCPreferencesGetValue(prefs, this_behavior->title));
-        if(tmp && (0 < CFArrayGetCount(tmp))) {
-            this_behavior->array = CFArrayCreateMutableCopy(0, 0, tmp);
-            activeEventCnt += CFArrayGetCount(tmp);
-        } else {
-            this_behavior->array = NULL;
+        count = tmp ? CFArrayGetCount(tmp) : 0;
+        for (j = 0; j < count; j++) 
+        {
+            // Entries without a date can never fire; drop them
+            event = isA_CFDictionary(CFArrayGetValueAtIndex(tmp, j));
+            if (!event || !(date = _getScheduledEventDate(event)))
+                continue;
+
+            if (PowerEventQueueAdd(gEventQueue, this_behavior->queueType, 
+                                   CFDateGetAbsoluteTime(date), event))
+                activeEventCnt++;
         }
     }
 
-
-
     CFRelease(prefs);
 
+    if (gEventJournal)
+        PowerEventJournalCompactIfNeeded(gEventJournal, gEventQueue, kBehaviorsCount, true);
+
 #endif
 }
 
@@ -706,44 +747,34 @@ copyScheduledPowerChangeArrays(void)
 static CFDictionaryRef 
 copyEarliestUpcoming(PowerEventBehavior *b)
 {
-    CFArrayRef              arr = NULL;
-    CFDateRef               now = NULL;
+    CFAbsoluteTime          now;
+    PowerEvent              *pe = NULL;
+    PowerEvent              *shared = NULL;
     CFDictionaryRef         the_result = NULL;
     CFDictionaryRef         repeatEvent = NULL;
-    CFIndex                 i, count;
     CFComparisonResult      eq;
 
     if(!b) return NULL;
 
-    // wake and poweron types get merged with wakeorpoweron array
-    if(b->sharedEvents) {
-
-        // musst release arr later
-        arr = copyMergedEventArray(b, b->sharedEvents);
-
-    } else {
-        arr = b->array;
-    }
-
-    // If the array is NULL, we have no work to do.
-    if (arr && (count = CFArrayGetCount(arr)) != 0) {
-
-        
-        now = CFDateCreate(0, CFAbsoluteTimeGetCurrent() + MIN_SCHEDULE_TIME);
-
-        // iterate through all past entries, stopping at one occurring  
-        // >MIN_SCHEDULE_TIME seconds in the future, or at the end of the array
-        i = 0;
-        while( (i < count)
-            && !isEntryValidAndFuturistic(CFArrayGetValueAtIndex(arr, i), now) )
-        {
-            i++;
+    if (gEventQueue)
+    {
+        // skip past entries, stopping at one occurring  
+        // >MIN_SCHEDULE_TIME seconds in the future
+        now = CFAbsoluteTimeGetCurrent() + MIN_SCHEDULE_TIME;
+
+        pe = PowerEventQueueEarliestAtOrAfter(gEventQueue, b->queueType, now);
+
+        // wake and poweron types also take events from wakeorpoweron
+        if (b->sharedEvents) {
+            shared = PowerEventQueueEarliestAtOrAfter(gEventQueue, 
+                                        b->sharedEvents->queueType, now);
+            if (shared && (!pe || (shared->time < pe->time))) {
+                pe = shared;
+            }
         }
-        CFRelease(now);
 
-        if(i < count) 
-        {
-            the_result = CFArrayGetValueAtIndex(arr, i);
+        if (pe) {
+            the_result = pe->event;
             CFRetain(the_result);
         }
     }
@@ -767,14 +798,12 @@ copyEarliestUpcoming(PowerEventBehavior *b)
         }
     }
     
-    if(arr && b->sharedEvents) CFRelease(arr);
-    
     return the_result;
 }
 
 /*
  *
- * comapareEvDates() - internal sorting helper for copyMergedEventArray()
+ * comapareEvDates() - orders event dictionaries by date
  *
  */
  static CFComparisonResult 
@@ -797,49 +826,6 @@ compareEvDates(
     return CFDateCompare(d1, d2, 0);
 }
 
-/*
- *
- * copyMergedEventArray
- *
- * Takes two PowerEventBehavior*, merges their CFArray array members into one 
- * mutable array, sorted by date.
- */
-static CFArrayRef       
-copyMergedEventArray(
-    PowerEventBehavior *a, 
-    PowerEventBehavior *b)
-{
-    CFMutableArrayRef       merged;
-    CFIndex                 bcount;
-    CFRange                 rng;
-
-    if(!a || !b) return NULL;
-    if(!a->array && !b->array) return NULL;
-    if(!a->array) return CFRetain(b->array);
-    if(!b->array) return CFRetain(a->array);
-
-    // merge!
-    merged = CFArrayCreateMutableCopy(0, 0, a->array);
-    
-    bcount = CFArrayGetCount(b->array);
-    rng =  CFRangeMake(0, bcount);
-    CFArrayAppendArray(merged, b->array, rng);
-
-    // sort!
-    // We sort using the same compare_dates function used in IOKitUser
-    // pwr_mgt/IOPMAutoWake.c. Arrays must be sorted identically to how
-    // they would be there.
-    bcount = CFArrayGetCount(merged);
-    rng =  CFRangeMake(0, bcount);
-    CFArraySortValues(merged, rng, (CFComparatorFunction)compareEvDates, 0);
-
-    // caller must release
-    return merged;
-}
-
-
-
-
 
 static CFDateRef
 _getScheduledEventDate(CFDictionaryRef event)
@@ -897,108 +883,140 @@ destroySCSession(SCPreferencesRef prefs, int unlock)
 #endif
 }
 
-static void
+static bool
 addEvent(PowerEventBehavior  *behave, CFDictionaryRef event)
 {
-    if (isA_CFArray(behave->array)) {
+    CFDateRef   date = _getScheduledEventDate(event);
 
-        // First clear off any expired events
-        purgePastEvents(behave);
+    if (!date || !gEventQueue)
+        return false;
 
-        CFArrayAppendValue(behave->array, event);
+    // First clear off any expired events
+    purgePastEvents(behave);
 
-        // XXX: Manual sorting is probably better than using CFArraySortValues()
-        // Element is being added to already sorted array
-        CFArraySortValues( 
-                behave->array, CFRangeMake(0, CFArrayGetCount(behave->array)),
-                (CFComparatorFunction)compareEvDates, 0);
-    }
-    else {
-        behave->array = CFArrayCreateMutable(
-                            0, 0, &kCFTypeArrayCallBacks); 
-        CFArrayAppendValue(behave->array, event);
-    }
-    activeEventCnt++;
+    if (!PowerEventQueueAdd(gEventQueue, behave->queueType, 
+                            CFDateGetAbsoluteTime(date), event))
+        return false;
 
+    activeEventCnt++;
+    return true;
 }
 
 
+/*
+ * Records an add or cancel of 'event' in the journal.
+ */
 static IOReturn
-updateToDisk(SCPreferencesRef prefs, PowerEventBehavior  *behavior, CFStringRef type)  
+journalEvent(PowerEventBehavior  *behavior, int op, CFDictionaryRef event)  
 {
     IOReturn ret = kIOReturnSuccess;
 #if !TARGET_OS_EMBEDDED
-
-    if(!SCPreferencesSetValue(prefs, type, behavior->array)) 
+    if (!gEventJournal
+        || !PowerEventJournalAppend(gEventJournal, op, behavior->queueType, event))
     {
         ret = kIOReturnError;
         goto exit;
     }
 
+    PowerEventJournalCompactIfNeeded(gEventJournal, gEventQueue, kBehaviorsCount, false);
+    schedulePrefsExport();
+exit:
+#endif
+    return ret;
+}
+
+#if !TARGET_OS_EMBEDDED
+/*
+ * Writes every behavior's events to kIOPMAutoWakePrefsPath.
+ */
+static void
+exportToPrefs(void)
+{
+    SCPreferencesRef    prefs = NULL;
+    CFArrayRef          events;
+    int                 i;
+
+    gPrefsExportScheduled = false;
+
+    if (kIOReturnSuccess != createSCSession(&prefs, 0, 1))
+        goto exit;
+
+    for(i=0; i<kBehaviorsCount; i++) 
+    {
+        events = PowerEventQueueCopyEvents(gEventQueue, behaviors[i]->queueType);
+        if (events) {
+            SCPreferencesSetValue(prefs, behaviors[i]->title, events);
+            CFRelease(events);
+        }
+    }
+
     // Add a warning to the file
     SCPreferencesSetValue(prefs, CFSTR("WARNING"), 
         CFSTR("Do not edit this file by hand. It must remain in sorted-by-date order."));
     //
     //  commit the SCPreferences file out to disk
     if(!SCPreferencesCommitChanges(prefs))
-    {
-        ret = kIOReturnError;
-        goto exit;
-    }
+        asl_log(NULL, NULL, ASL_LEVEL_ERR, "PMCFGD: Failed to export scheduled power events\n");
+
 exit:
+    destroySCSession(prefs, 1);
+}
 #endif
-    return ret;
+
+static void
+schedulePrefsExport(void)
+{
+#if !TARGET_OS_EMBEDDED
+    if (gPrefsExportScheduled)
+        return;
+    gPrefsExportScheduled = true;
+
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, kPrefsExportDelay * NSEC_PER_SEC), 
+                   dispatch_get_main_queue(), ^{ exportToPrefs(); });
+#endif
+}
+
+
+/*
+ * Removes 'pe' from the queue. If it's any behavior's current event, 
+ * clears currentEvent; the caller takes care of re-scheduling.
+ */
+static void
+removeQueuedEvent(PowerEvent *pe)
+{
+    int     j;
+
+    for (j = 0; j < kBehaviorsCount; j++)
+        if (behaviors[j]->currentEvent && CFEqual(pe->event, behaviors[j]->currentEvent)) {
+            CFRelease(behaviors[j]->currentEvent);
+            behaviors[j]->currentEvent = NULL;
+        }
+
+    PowerEventQueueRemove(gEventQueue, pe);
+    activeEventCnt--;
 }
 
 
 static bool
 removeEvent(PowerEventBehavior  *behave, CFDictionaryRef event)   
 {
+    CFDateRef           date = _getScheduledEventDate(event);
+    CFStringRef         appName;
+    PowerEvent          *pe;
 
-    CFIndex             count, i;
-    int                 j;
-    CFComparisonResult  eq;
-    CFDictionaryRef     cancelee = 0;
+    if (!date || !gEventQueue)
+        return false;
+
+    appName = isA_CFString(CFDictionaryGetValue(event, CFSTR(kIOPMPowerEventAppNameKey)));
 
-    if (!behave->array || !isA_CFArray(behave->array))
+    pe = PowerEventQueueFind(gEventQueue, behave->queueType, 
+                             CFDateGetAbsoluteTime(date), appName);
+    if (!pe)
         return false;
 
-    count = CFArrayGetCount(behave->array);
-    for (i = 0; i < count; i++)
-    {
-        cancelee = CFArrayGetValueAtIndex(behave->array, i);
-        eq = compareEvDates(event, cancelee, 0);
-        if(kCFCompareLessThan == eq)
-        {
-            // fail, date to cancel < date at index
-            break;
-        }
-        else if(kCFCompareEqualTo == eq)
-        {
-            // We have confirmation on the dates and types being equal. Check id.
-            if( CFEqual(
-                CFDictionaryGetValue(event, CFSTR(kIOPMPowerEventAppNameKey)), 
-                CFDictionaryGetValue(cancelee, CFSTR(kIOPMPowerEventAppNameKey))
-                ))
-            {
-                // This is the one to cancel.
-                // First check if cancelee is the current scheduled event
-                // If so, delete currentEvent field. Caller will take care of 
-                // re-scheduling the next event
-                for (j = 0; j < kBehaviorsCount; j++)
-                    if (behaviors[j]->currentEvent && CFEqual(cancelee, behaviors[j]->currentEvent)) {
-                        CFRelease(behaviors[j]->currentEvent);
-                        behaviors[j]->currentEvent = NULL;
-                    }
-                
-                CFArrayRemoveValueAtIndex(behave->array, i);
-                activeEventCnt--;
-                return true;
-            }
-        }
-    }
- 
-    return false;
+    // This is the one to cancel.
+    removeQueuedEvent(pe);
+    return true;
 }
 
 
@@ -1020,7 +1038,6 @@ _io_pm_schedule_power_event
     CFDictionaryRef     event = NULL;
     CFDataRef           dataRef = NULL;
     CFStringRef         type = NULL;
-    SCPreferencesRef    prefs = 0;
     uid_t               callerEUID;
     int                 i;
 
@@ -1063,29 +1080,36 @@ _io_pm_schedule_power_event
     //asl_log(0, 0, ASL_LEVEL_ERR, "Sched event type: %s by  %s\n", CFStringGetCStringPtr(type,kCFStringEncodingMacRoman ),
     //       CFStringGetCStringPtr( who, kCFStringEncodingMacRoman));
 
-    if((*return_code = createSCSession(&prefs, callerEUID, 1)) != kIOReturnSuccess)
+#if !TARGET_OS_EMBEDDED
+    if (callerEUID != 0) {
+        *return_code = kIOReturnNotPrivileged;
         goto exit;
+    }
+#endif
 
     if (action == 1) {
 
-        /* Add event to in-memory array */
-        addEvent(behaviors[i], event);
+        /* Add event to in-memory queue */
+        if (!addEvent(behaviors[i], event)) {
+            *return_code = kIOReturnBadArgument;
+            goto exit;
+        }
         
         /* Commit changes to disk */
-        if ((*return_code = updateToDisk(prefs, behaviors[i], type)) != kIOReturnSuccess) {
+        if ((*return_code = journalEvent(behaviors[i], kPowerEventJournalAdd, event)) != kIOReturnSuccess) {
             removeEvent(behaviors[i], event);
             goto exit;
         }
     }
     else {
-        /* Remove event from in-memory array */
+        /* Remove event from in-memory queue */
         if (!removeEvent(behaviors[i], event)) {
             *return_code = kIOReturnNotFound;
             goto exit;
         }
 
         /* Update to disk. Ignore the failure; */
-        updateToDisk(prefs, behaviors[i], type);
+        journalEvent(behaviors[i], kPowerEventJournalCancel, event);
     }
     /* Schedule the power event */
     if (CFEqual(type, CFSTR(kIOPMAutoWakeOrPowerOn))) {
@@ -1102,7 +1126,6 @@ _io_pm_schedule_power_event
 
 
 exit:
-    destroySCSession(prefs, 1);
     if (dataRef)
         CFRelease(dataRef);
 
@@ -1118,24 +1141,18 @@ __private_extern__ CFArrayRef copyScheduledPowerEvents(void)
 {
 
     CFMutableArrayRef       powerEvents = NULL;
-    PowerEventBehavior      *this_behavior;
+    CFArrayRef              events;
     int                     i;
-    CFIndex                 bcount;
-    CFRange                 rng;
 
     powerEvents = CFArrayCreateMutable( 0, 0, &kCFTypeArrayCallBacks); 
-    for(i=0; i<kBehaviorsCount; i++) {
-        this_behavior = behaviors[i];
-
-        if(this_behavior->array && isA_CFArray(this_behavior->array)) {
-            bcount = CFArrayGetCount(this_behavior->array);
-            rng =  CFRangeMake(0, bcount);
-            CFArrayAppendArray(powerEvents, this_behavior->array, rng);
+    for(i=0; gEventQueue && (i<kBehaviorsCount); i++) {
+        events = PowerEventQueueCopyEvents(gEventQueue, behaviors[i]->queueType);
+        if (events) {
+            CFArrayAppendArray(powerEvents, events, 
+                               CFRangeMake(0, CFArrayGetCount(events)));
+            CFRelease(events);
         }
     }
 
     return powerEvents;
 }
-
-
-
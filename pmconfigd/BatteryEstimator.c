@@ -0,0 +1,323 @@
+/*
+ * Copyright (c) 2014 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+#include <math.h>
+#include <string.h>
+
+#include "BatteryEstimator.h"
+
+// Slower than this, in percent per minute, the battery isn't draining or charging
+#define kMinRate                0.001
+
+// kBattModelEWMA
+#define kEWMAShareTauMinutes    30.0            // how long the mix of loads is remembered
+#define kEWMALoadTauMinutes     5.0             // and the rate under each load
+#define kLoadIdleMaxRate        (8.0 / 60.0)    // percent per minute
+#define kLoadLightMaxRate       (20.0 / 60.0)
+#define kLoadHysteresis         0.2             // how far past a bound the rate goes to change class
+#define kMinRateVariance        1e-4
+
+// kBattModelKalman
+#define kKalmanRateDrift        1e-5            // (percent per minute)^2 per minute
+#define kKalmanLevelNoise       0.1             // percent^2
+#define kKalmanCurrentNoise     0.5             // relative: the load comes and goes around its mean
+#define kKalmanUnknownRate      1.0             // (percent per minute)^2
+#define kKalmanLoadGate         25.0            // level innovations past 5 sigma are a load change
+
+enum {
+    kLoadUnknown    = -1,
+    kLoadIdle       = 0,
+    kLoadLight,
+    kLoadHeavy
+};
+
+static const char *kModelNames[kBattModelCount] = { "hardware", "ewma", "kalman" };
+
+__private_extern__ BattModel BattModelNamed(const char *name)
+{
+    int     i;
+
+    for (i = 0; name && (i < kBattModelCount); i++) {
+        if (!strcmp(name, kModelNames[i])) {
+            break;
+        }
+    }
+    return name ? (BattModel)i : kBattModelCount;
+}
+
+__private_extern__ const char *BattModelName(BattModel model)
+{
+    return (model < kBattModelCount) ? kModelNames[model] : "unknown";
+}
+
+__private_extern__ void BattEstimatorReset(BattEstimator *e, BattModel model)
+{
+    bzero(e, sizeof(*e));
+    e->model = model;
+    e->loadClass = kLoadUnknown;
+}
+
+/*
+ * The charge rate in percent per minute, from the current if the full
+ * charge capacity is known, or else from the level since the last sample.
+ */
+static bool measuredRate(const BattEstimator *e, const BattSample *s, double dt, double *rate)
+{
+    if ((s->fullChargeMAh > 0) && (s->amperage != 0)) {
+        *rate = (double)s->amperage * 100.0 / (double)s->fullChargeMAh / 60.0;
+        return true;
+    }
+    if (e->samples && (dt > 0)) {
+        *rate = (s->level - e->lastLevel) / dt;
+        return true;
+    }
+    return false;
+}
+
+/*
+ * Minutes to get from 'level' to empty or full at 'speed' percent per
+ * minute toward it.
+ */
+static int minutesAt(bool charging, double level, double speed)
+{
+    double  left = charging ? (100.0 - level) : level;
+    double  minutes;
+
+    if (left <= 0) {
+        return 0;
+    }
+    if (speed < kMinRate) {
+        return kBattEstimateMaxMinutes;
+    }
+    minutes = left / speed;
+    return (minutes < kBattEstimateMaxMinutes) ? (int)lround(minutes) : kBattEstimateMaxMinutes;
+}
+
+static void setEstimate(BattEstimate *out, bool charging, double level, double rate, double sigma)
+{
+    double  speed = charging ? rate : -rate;
+
+    if (speed < kMinRate) {
+        // Moving the wrong way, or not at all
+        return;
+    }
+    out->minutes = minutesAt(charging, level, speed);
+    out->low = minutesAt(charging, level, speed + 2.0 * sigma);
+    out->high = minutesAt(charging, level, speed - 2.0 * sigma);
+}
+
+static void updateHardware(BattEstimator *e, const BattSample *s, double dt, BattEstimate *out)
+{
+    double  rate;
+
+    if ((s->hwMinutes >= 0) && (s->hwMinutes < 0xffff)) {
+        out->minutes = (s->hwMinutes < kBattEstimateMaxMinutes) ? s->hwMinutes : kBattEstimateMaxMinutes;
+        out->low = out->high = out->minutes;
+    } else if (measuredRate(e, s, dt, &rate)) {
+        // No gas gauge estimate, as when replaying a charge log
+        setEstimate(out, s->charging, s->level, rate, 0);
+    }
+}
+
+static int loadClassOf(double rate, int current)
+{
+    double  speed = fabs(rate);
+    double  idleMax = kLoadIdleMaxRate;
+    double  lightMax = kLoadLightMaxRate;
+
+    // Only leave the current class once clearly past its bounds
+    if (current == kLoadIdle) {
+        idleMax *= 1.0 + kLoadHysteresis;
+    } else if (current == kLoadLight) {
+        idleMax *= 1.0 - kLoadHysteresis;
+        lightMax *= 1.0 + kLoadHysteresis;
+    } else if (current == kLoadHeavy) {
+        lightMax *= 1.0 - kLoadHysteresis;
+    }
+
+    if (speed < idleMax) {
+        return kLoadIdle;
+    }
+    return (speed < lightMax) ? kLoadLight : kLoadHeavy;
+}
+
+/*
+ * Readings are sorted into load classes (idle, light and heavy use), and
+ * exponentially weighted averages kept of the rate under each load and of
+ * the share of time spent in it. The estimate drains at the mix of those
+ * rates, so it follows a change of load as the time spent in it grows
+ * rather than jumping with every burst.
+ *
+ * The range assumes loads come and go about as often as the mix is
+ * remembered, so their spread averages out over a long time remaining.
+ */
+static void updateEWMA(BattEstimator *e, const BattSample *s, double dt, BattEstimate *out)
+{
+    double  z, d, alpha, beta, horizon;
+    int     load;
+
+    if (!measuredRate(e, s, dt, &z)) {
+        return;
+    }
+
+    load = loadClassOf(z, e->loadClass);
+    if (e->loadClass == kLoadUnknown) {
+        e->loadRate[load] = z;
+        e->loadShare[load] = 1.0;
+        e->rate = z;
+        e->variance = kMinRateVariance;
+    } else {
+        alpha = 1.0 - exp(-dt / kEWMAShareTauMinutes);
+        beta = 1.0 - exp(-dt / kEWMALoadTauMinutes);
+        if (e->loadShare[load] > 0) {
+            e->loadRate[load] += beta * (z - e->loadRate[load]);
+        } else {
+            e->loadRate[load] = z;
+        }
+        e->rate = 0;
+        for (int i = 0; i < kBattLoadClasses; i++) {
+            e->loadShare[i] = (1.0 - alpha) * e->loadShare[i] + ((i == load) ? alpha : 0);
+            e->rate += e->loadShare[i] * e->loadRate[i];
+        }
+        d = z - e->rate;
+        e->variance = (1.0 - alpha) * (e->variance + alpha * d * d);
+        if (e->variance < kMinRateVariance) {
+            e->variance = kMinRateVariance;
+        }
+    }
+    e->loadClass = load;
+
+    horizon = minutesAt(s->charging, s->level, s->charging ? e->rate : -e->rate) / kEWMAShareTauMinutes;
+    setEstimate(out, s->charging, s->level, e->rate, sqrt(e->variance / fmax(horizon, 1.0)));
+}
+
+/*
+ * A Kalman filter over the charge level and its rate of change. The level
+ * moves at the rate between samples while the rate drifts; each sample
+ * measures the level, and the rate too when the current can be converted
+ * to percent. The current is only a loose measure of the rate, since the
+ * load comes and goes around its mean. A level far outside what the
+ * filter expects is taken as a lasting change of load, and the rate's
+ * variance is widened so the filter follows it at once.
+ *
+ * The range adds the spread of the current readings around the rate,
+ * averaged over the time remaining as for kBattModelEWMA.
+ */
+static void updateKalman(BattEstimator *e, const BattSample *s, double dt, BattEstimate *out)
+{
+    double  (*P)[2] = e->cov;
+    double  z, y, S, R, k0, k1, p00, p01, p11, alpha, horizon;
+
+    if (!e->samples) {
+        e->level = s->level;
+        e->rate = 0;
+        P[0][0] = kKalmanLevelNoise;
+        P[0][1] = P[1][0] = 0;
+        P[1][1] = kKalmanUnknownRate;
+    } else {
+        // Predict
+        e->level += e->rate * dt;
+        p00 = P[0][0] + 2.0 * dt * P[0][1] + dt * dt * P[1][1] + kKalmanRateDrift * dt * dt * dt / 3.0;
+        p01 = P[0][1] + dt * P[1][1] + kKalmanRateDrift * dt * dt / 2.0;
+        p11 = P[1][1] + kKalmanRateDrift * dt;
+
+        // Measure the level
+        y = s->level - e->level;
+        S = p00 + kKalmanLevelNoise;
+        if ((y * y > kKalmanLoadGate * S) && (dt > 0)) {
+            p11 += (y / dt) * (y / dt);
+        }
+        k0 = p00 / S;
+        k1 = p01 / S;
+        e->level += k0 * y;
+        e->rate += k1 * y;
+        P[0][0] = (1.0 - k0) * p00;
+        P[0][1] = P[1][0] = (1.0 - k0) * p01;
+        P[1][1] = p11 - k1 * p01;
+        e->hasRate = true;
+    }
+
+    // Measure the rate
+    if ((s->fullChargeMAh > 0) && (s->amperage != 0) && measuredRate(e, s, dt, &z)) {
+        R = (kKalmanCurrentNoise * z) * (kKalmanCurrentNoise * z) + kMinRateVariance;
+        y = z - e->rate;
+        S = P[1][1] + R;
+        alpha = e->hasRate ? (1.0 - exp(-dt / kEWMAShareTauMinutes)) : 1.0;
+        e->variance += alpha * (y * y - e->variance);
+        k0 = P[0][1] / S;
+        k1 = P[1][1] / S;
+        e->level += k0 * y;
+        e->rate += k1 * y;
+        P[0][0] -= k0 * P[0][1];
+        P[1][1] *= (1.0 - k1);
+        P[0][1] = P[1][0] = (1.0 - k1) * P[0][1];
+        e->hasRate = true;
+    }
+
+    if (e->level < 0) {
+        e->level = 0;
+    } else if (e->level > 100.0) {
+        e->level = 100.0;
+    }
+
+    if (e->hasRate) {
+        horizon = minutesAt(s->charging, e->level, s->charging ? e->rate : -e->rate) / kEWMAShareTauMinutes;
+        setEstimate(out, s->charging, e->level, e->rate, sqrt(P[1][1] + e->variance / fmax(horizon, 1.0)));
+    }
+}
+
+__private_extern__ void BattEstimatorUpdate(BattEstimator *e, const BattSample *s, BattEstimate *out)
+{
+    double  dt = 0;
+
+    if (e->samples && ((s->charging != e->charging) || (s->external != e->external))) {
+        BattEstimatorReset(e, e->model);
+    }
+    if (e->samples && (s->time > e->lastTime)) {
+        dt = (s->time - e->lastTime) / 60.0;
+    }
+
+    out->minutes = out->low = out->high = -1;
+
+    // On AC and not charging, there's nothing to estimate
+    if (s->charging || !s->external) {
+        switch (e->model) {
+            case kBattModelEWMA:
+                updateEWMA(e, s, dt, out);
+                break;
+            case kBattModelKalman:
+                updateKalman(e, s, dt, out);
+                break;
+            default:
+                updateHardware(e, s, dt, out);
+                break;
+        }
+    }
+
+    e->samples++;
+    e->lastTime = s->time;
+    e->lastLevel = s->level;
+    e->charging = s->charging;
+    e->external = s->external;
+}
@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2014 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+#ifndef _BatteryEstimator_h_
+#define _BatteryEstimator_h_
+
+#include <CoreFoundation/CoreFoundation.h>
+
+/*
+ * BatteryEstimator turns a battery's samples into the minutes until it's
+ * empty (discharging) or full (charging), and a range around that
+ * estimate.
+ *
+ * Each update takes only what a charge log entry from
+ * _io_ps_copy_chargelog() records: the charge level, the current and the
+ * charging state, plus the full charge capacity when it's known. The
+ * estimators keep no powerd state, so recorded logs can be replayed
+ * through every model offline to compare them.
+ *
+ * The model is chosen with the kBattEstimatorModelKey preference.
+ */
+
+#define kBattEstimatorModelKey          "BatteryTimeRemainingModel"
+
+// Estimates and their ranges are capped at this many minutes
+#define kBattEstimateMaxMinutes         1200
+
+// kBattModelEWMA sorts readings into idle, light and heavy use
+#define kBattLoadClasses                3
+
+// Power source description keys for the range around a model's estimate
+#define kBattEstimateLowKey             "Time Remaining Low"
+#define kBattEstimateHighKey            "Time Remaining High"
+
+typedef enum {
+    kBattModelHardware      = 0,    // the gas gauge's own estimate
+    kBattModelEWMA          = 1,    // smoothed drain rate of each load, weighted by time spent in it
+    kBattModelKalman        = 2,    // charge level and drain rate, Kalman filtered
+    kBattModelCount         = 3
+} BattModel;
+
+typedef struct {
+    CFAbsoluteTime      time;
+    double              level;          // percent of full charge
+    int                 fullChargeMAh;  // 0 if unknown
+    int                 amperage;       // mA, negative while discharging; 0 if unknown
+    int                 hwMinutes;      // the gas gauge's estimate; -1 if none
+    bool                charging;
+    bool                external;
+} BattSample;
+
+typedef struct {
+    int                 minutes;        // -1 while still calculating
+    int                 low;            // the range the model is about 95% sure of
+    int                 high;
+} BattEstimate;
+
+typedef struct {
+    BattModel           model;
+    int                 samples;        // since the last reset
+    CFAbsoluteTime      lastTime;
+    double              lastLevel;
+    bool                charging;
+    bool                external;
+    bool                hasRate;
+    double              rate;           // percent per minute, positive while charging
+    double              variance;       // of readings around rate
+    int                 loadClass;
+    double              loadRate[kBattLoadClasses];
+    double              loadShare[kBattLoadClasses];
+    double              level;          // kBattModelKalman
+    double              cov[2][2];      // of level and rate
+} BattEstimator;
+
+/* BattModelNamed
+ * Returns the model called 'name', or kBattModelCount if there's none.
+ */
+__private_extern__ BattModel    BattModelNamed(const char *name);
+__private_extern__ const char   *BattModelName(BattModel model);
+
+/* BattEstimatorReset
+ * Forgets every sample, and switches to 'model'. A zeroed BattEstimator
+ * is reset to kBattModelHardware.
+ */
+__private_extern__ void         BattEstimatorReset(BattEstimator *e, BattModel model);
+
+/* BattEstimatorUpdate
+ * Adds 'sample' and puts the estimate in 'out'. A change of charging
+ * state or power source starts the estimate over.
+ */
+__private_extern__ void         BattEstimatorUpdate(BattEstimator *e, const BattSample *sample,
+                                                    BattEstimate *out);
+
+#endif // _BatteryEstimator_h_
@@ -42,6 +42,7 @@
 #include "PMAssertions.h"
 #include "PrivateLib.h"
 #include "PMStore.h"
+#include "PMTrace.h"
 
 
 /**** PMBattery configd plugin
@@ -89,8 +90,6 @@ typedef struct {
 #define kBattLogMaxEntries      64
 #define kBattLogUpdateFreq      (5*60)  // 5 mins
 
-#define kPSMaxCount   7
-
 static PSStruct gPSList[kPSMaxCount];
 
 // kBattNotCharging checks for (int16_t)-1 invalid current readings
@@ -108,7 +107,7 @@ SlewStruct *slew = NULL;
 
 // Battery health calculation constants
 #define kSmartBattReserve_mAh    200.0
-#define kMaxBattMinutes     1200
+#define kMaxBattMinutes     kBattEstimateMaxMinutes
 
 
 // static global variables for tracking battery state
@@ -122,14 +121,66 @@ typedef struct {
     int              psPercentChangeNotifyToken;
     bool             noPoll;
     bool             needsNotifyAC;
+    BattModel        estimatorModel;
     PSStruct         *internal;
 } BatteryControl;
 static BatteryControl   control;
 
 
+/* What kernelPowerSourcesDidChange() last published for a battery: the
+ * fields of its IOPSCopyPowerSourcesInfo() description, and the inputs to
+ * the time remaining, percent, warning level and AC notifications.
+ * Each update is compared field by field against it, and only what
+ * changed is rebuilt and republished.
+ */
+typedef struct {
+    int                 swCalculatedTR;
+    int                 swCalculatedTRLow;
+    int                 swCalculatedTRHigh;
+    int                 swCalculatedPR;
+    int                 maxCap;
+    int                 designCap;
+    int                 avgAmperage;
+    uint32_t            pfStatus;
+    CFStringRef         failureDetected;
+    CFStringRef         chargeStatus;
+    CFStringRef         batterySerialNumber;
+    CFStringRef         name;
+    uint64_t            amperagePublished;
+    int                 batteryCount;
+    bool                valid;
+    bool                externalConnected;
+    bool                isCharging;
+    bool                isPresent;
+    bool                isTimeRemainingUnknown;
+    bool                isCritical;
+    bool                isRestricted;
+    bool                fullyCharged;
+    bool                finishingCharge;
+    bool                healthObserved;     // the 7-day low capacity observation is complete
+    bool                noPoll;
+} BatteryPublishedState;
+
+// Which notifications and publishes a battery update affects
+enum {
+    kBattChangedDescription     = 0x01,
+    kBattChangedTimeRemaining   = 0x02,
+    kBattChangedPercent         = 0x04,
+    kBattChangedWarning         = 0x08,
+    kBattChangedAC              = 0x10,
+    kBattChangedAll             = 0xFF
+};
+
+// Amperage alone changes on nearly every update; republish it at most this often
+#define kBattAmperagePublishFreq    60
+
+static BatteryPublishedState    gBattPublished;
+
+
 // forward declarations
 static PSStruct         *iops_newps(int pid, int psid);
 static void             _initializeBatteryCalculations(void);
+static void             estimateTimeRemaining(IOPMBattery **batts);
 static void             checkTimeRemainingValid(IOPMBattery **batts);
 static CFDictionaryRef packageKernelPowerSource(IOPMBattery *b);
 
@@ -149,6 +200,8 @@ static void             publish_IOPSGetPercentRemaining(int percent,
                                                         IOPMBattery *b);
 
 static void             HandlePublishAllPowerSources(void);
+static void             publishPowerSourceChanges(uint32_t changed);
+static void             schedulePublishAllPowerSources(void);
 
 
 
@@ -176,7 +229,9 @@ BatteryTimeRemaining_prime(void)
      recordFDREvent(kFDRInit, false, NULL);
 
 #if !TARGET_OS_EMBEDDED
+    _loadLowCapRatioTimes();
 #endif
+    BatteryTimeRemainingPrefsHaveChanged();
     _initializeBatteryCalculations();
 
     /*
@@ -216,9 +271,14 @@ BatteryTimeRemainingRTCDidResync(void)
  */
 static void _discontinuityOccurred(void)
 {
+    IOPMBattery     **batts = _batteries();
+
     if (slew) {
         bzero(slew, sizeof(SlewStruct));
     }
+    for (int i = 0; i < _batteryCount(); i++) {
+        BattEstimatorReset(&batts[i]->estimator, control.estimatorModel);
+    }
     control.lastDiscontinuity = CFAbsoluteTimeGetCurrent();
     
     // Kick off a battery poll now,
@@ -438,6 +498,36 @@ static bool startBatteryPoll(PollCommand doCommand)
     return true;
 }
 
+/* BatteryTimeRemainingPrefsHaveChanged
+ * Picks up the time remaining model from the kBattEstimatorModelKey
+ * preference; every estimator switches to it on the next battery update.
+ */
+__private_extern__ void BatteryTimeRemainingPrefsHaveChanged(void)
+{
+    SCPreferencesRef    prefs;
+    CFStringRef         name;
+    char                buf[32];
+    BattModel           model = kBattModelHardware;
+
+    prefs = SCPreferencesCreate(kCFAllocatorDefault, CFSTR(kIOPMAppName), CFSTR(kIOPMPrefsPath));
+    if (prefs) {
+        name = isA_CFString(SCPreferencesGetValue(prefs, CFSTR(kBattEstimatorModelKey)));
+        if (name && CFStringGetCString(name, buf, sizeof(buf), kCFStringEncodingUTF8)) {
+            model = BattModelNamed(buf);
+            if (model == kBattModelCount) {
+                asl_log(NULL, NULL, ASL_LEVEL_ERR, "Unknown battery time remaining model %s\n", buf);
+                model = kBattModelHardware;
+            }
+        }
+        CFRelease(prefs);
+    }
+
+    if (model != control.estimatorModel) {
+        control.estimatorModel = model;
+        asl_log(NULL, NULL, ASL_LEVEL_NOTICE, "Battery time remaining model is now %s\n", BattModelName(model));
+    }
+}
+
 __private_extern__ void BatterySetNoPoll(bool noPoll)
 {
 
@@ -532,6 +622,7 @@ static void publish_IOPSBatteryGetWarningLevel(
             PMStoreSetValue(lowBatteryKey, newlevel );
             CFRelease(newlevel);
             
+            PMStoreFlush();
             notify_post(kIOPSNotifyLowBattery);
             if ((newWarningLevel != prevLoggedLevel) && (newWarningLevel != kIOPSLowBatteryWarningNone)) {
                 logASLLowBatteryWarning(newWarningLevel, combinedTime, b->currentCap);
@@ -659,12 +750,129 @@ static void publish_IOPSGetPercentRemaining(
 }
 
 
+static bool sameString(CFStringRef a, CFStringRef b)
+{
+    return (a == b) || (a && b && CFEqual(a, b));
+}
+
+/* The battery's strings belong to its properties dictionary, which is
+ * replaced on every update; the published state keeps its own copies.
+ */
+static CFStringRef copyPublishedString(CFStringRef s)
+{
+    return s ? CFStringCreateCopy(0, s) : NULL;
+}
+
+static void releasePublishedStrings(BatteryPublishedState *state)
+{
+    if (state->failureDetected)     CFRelease(state->failureDetected);
+    if (state->chargeStatus)        CFRelease(state->chargeStatus);
+    if (state->batterySerialNumber) CFRelease(state->batterySerialNumber);
+    if (state->name)                CFRelease(state->name);
+}
+
+/* batteryStateChanges
+ * Compares b against what was last published and records it as published.
+ * Returns the kBattChanged bits for what differs.
+ */
+static uint32_t batteryStateChanges(IOPMBattery *b)
+{
+    BatteryPublishedState   now;
+    BatteryPublishedState   *last = &gBattPublished;
+    uint32_t                changed = 0;
+    uint64_t                curTime = getMonotonicTime();
+    time_t                  wallTime = time(NULL);
+
+    bzero(&now, sizeof(now));
+    now.valid                   = true;
+    now.batteryCount            = _batteryCount();
+    now.swCalculatedTR          = b->swCalculatedTR;
+    now.swCalculatedTRLow       = b->swCalculatedTRLow;
+    now.swCalculatedTRHigh      = b->swCalculatedTRHigh;
+    now.swCalculatedPR          = b->swCalculatedPR;
+    now.maxCap                  = b->maxCap;
+    now.designCap               = b->designCap;
+    now.avgAmperage             = b->avgAmperage;
+    now.pfStatus                = b->pfStatus;
+    now.failureDetected         = copyPublishedString(b->failureDetected);
+    now.chargeStatus            = copyPublishedString(b->chargeStatus);
+    now.batterySerialNumber     = copyPublishedString(b->batterySerialNumber);
+    now.name                    = copyPublishedString(b->name);
+    now.externalConnected       = b->externalConnected;
+    now.isCharging              = b->isCharging;
+    now.isPresent               = b->isPresent;
+    now.isTimeRemainingUnknown  = b->isTimeRemainingUnknown;
+    now.isCritical              = b->isCritical;
+    now.isRestricted            = b->isRestricted;
+    now.fullyCharged            = isFullyCharged(b);
+    now.finishingCharge         = b->maxCap && (99 <= (100*b->currentCap/b->maxCap));
+    now.healthObserved          = b->hasLowCapRatio && (wallTime - b->lowCapRatioSinceTime > 604800);
+    now.noPoll                  = control.noPoll;
+    now.amperagePublished       = last->amperagePublished;
+
+    if (!last->valid || (now.batteryCount != last->batteryCount)) {
+        changed = kBattChangedAll;
+    }
+
+    if ((now.externalConnected != last->externalConnected)) {
+        changed |= kBattChangedAC | kBattChangedTimeRemaining | kBattChangedPercent
+                 | kBattChangedWarning | kBattChangedDescription;
+    }
+    if ((now.isCharging != last->isCharging) || (now.noPoll != last->noPoll)) {
+        changed |= kBattChangedTimeRemaining | kBattChangedPercent | kBattChangedDescription;
+    }
+    if ((now.swCalculatedTR != last->swCalculatedTR)
+        || (now.isTimeRemainingUnknown != last->isTimeRemainingUnknown)) {
+        changed |= kBattChangedTimeRemaining | kBattChangedWarning | kBattChangedDescription;
+    }
+    if ((now.swCalculatedPR != last->swCalculatedPR) || (now.fullyCharged != last->fullyCharged)
+        || (now.isCritical != last->isCritical) || (now.isRestricted != last->isRestricted)) {
+        changed |= kBattChangedPercent | kBattChangedDescription;
+    }
+    if (control.warningsShouldResetForSleep) {
+        changed |= kBattChangedWarning;
+    }
+
+    // Fields only in the description, or feeding its health and failure keys
+    if ((now.isPresent != last->isPresent)
+        || (now.swCalculatedTRLow != last->swCalculatedTRLow)
+        || (now.swCalculatedTRHigh != last->swCalculatedTRHigh)
+        || (now.finishingCharge != last->finishingCharge)
+        || (now.maxCap != last->maxCap)
+        || (now.designCap != last->designCap)
+        || (now.pfStatus != last->pfStatus)
+        || (now.healthObserved != last->healthObserved)
+        || !sameString(now.failureDetected, last->failureDetected)
+        || !sameString(now.chargeStatus, last->chargeStatus)
+        || !sameString(now.batterySerialNumber, last->batterySerialNumber)
+        || !sameString(now.name, last->name)) {
+        changed |= kBattChangedDescription;
+    }
+
+    if ((now.avgAmperage != last->avgAmperage)
+        && (curTime - last->amperagePublished >= kBattAmperagePublishFreq)) {
+        changed |= kBattChangedDescription;
+    }
+
+    if (changed & kBattChangedDescription) {
+        now.amperagePublished = curTime;
+    } else {
+        // Keep comparing against the amperage that's in the published description
+        now.avgAmperage = last->avgAmperage;
+    }
+
+    releasePublishedStrings(last);
+    *last = now;
+    return changed;
+}
+
 __private_extern__ void
 kernelPowerSourcesDidChange(IOPMBattery *b)
 {
     static int                  _lastExternalConnected = -1;
     int                         _nowExternalConnected = 0;
     int                         percentRemaining = 0;
+    uint32_t                    changed;
     IOPMBattery               **_batts = _batteries();
 
     /*
@@ -693,7 +901,7 @@ kernelPowerSourcesDidChange(IOPMBattery *b)
                              CFDictionaryGetValue(b->properties, CFSTR(kIOPMPSAdapterDetailsKey)));
 
 
-
+    estimateTimeRemaining(_batts);
     checkTimeRemainingValid(_batts);
 
     if (b->maxCap) {
@@ -705,12 +913,17 @@ kernelPowerSourcesDidChange(IOPMBattery *b)
     // b->swCalculatedPR is used by packageKernelPowerSource()
     b->swCalculatedPR = percentRemaining;
 
+    changed = batteryStateChanges(b);
+    if (control.internal && !control.internal->description) {
+        changed |= kBattChangedDescription;
+    }
+
     /************************************************************************
      *
      * PUBLISH: SCDynamicStoreSetValue / IOPSCopyPowerSourcesInfo()
      *
      ************************************************************************/
-    if (control.internal) {
+    if (control.internal && (changed & kBattChangedDescription)) {
         if (control.internal->description) {
             CFRelease(control.internal->description);
         }
@@ -718,10 +931,44 @@ kernelPowerSourcesDidChange(IOPMBattery *b)
         updateLogBuffer(control.internal, false);
     }
 
-    HandlePublishAllPowerSources();
+    if (changed) {
+        publishPowerSourceChanges(changed);
+    } else {
+        recordFDREvent(kFDRBattEventPeriodic, false, _batts);
+    }
+}
+
+/* schedulePublishAllPowerSources
+ *
+ * Each user-space power source update used to trigger its own publish.
+ * With many UPS units reporting at once, collapse them into one pass.
+ */
+static void schedulePublishAllPowerSources(void)
+{
+    static bool     publishScheduled = false;
+
+    if (publishScheduled) {
+        return;
+    }
+    publishScheduled = true;
+
+    dispatch_async(dispatch_get_main_queue(), ^() {
+        publishScheduled = false;
+        HandlePublishAllPowerSources();
+    });
 }
 
 static void HandlePublishAllPowerSources(void)
+{
+    publishPowerSourceChanges(kBattChangedAll);
+}
+
+/* publishPowerSourceChanges
+ * Publishes the combined battery and UPS state. 'changed' holds the
+ * kBattChanged bits for what may have changed; notifications that can't
+ * be affected are skipped.
+ */
+static void publishPowerSourceChanges(uint32_t changed)
 {
     IOPMBattery               **batteries = _batteries();
     IOPMBattery                *b = NULL;
@@ -731,10 +978,14 @@ static void HandlePublishAllPowerSources(void)
     bool                        tr_posted;
     bool                        ups_externalConnected = false;
     bool                        externalConnected, tr_unknown, is_charging, fully_charged;
-    CFDictionaryRef             ups = NULL;
+    UPSAggregate                upsAgg;
+    bool                        ups = false;
     int                         ups_tr = -1;
 
-    if ((0 == _batteryCount()) && ((ups = getActiveUPSDictionary()) == NULL) ) {
+    PMTRACE_SCOPE(kPMTracePublishPowerSources, _batteryCount());
+
+    ups = getUPSAggregate(&upsAgg);
+    if ((0 == _batteryCount()) && !ups) {
         return;
     }
 
@@ -752,15 +1003,11 @@ static void HandlePublishAllPowerSources(void)
     }
 
     if (ups) {
-        CFNumberRef num_cf = CFDictionaryGetValue(ups, CFSTR(kIOPSTimeToEmptyKey));
-        if (num_cf) {
-            CFNumberGetValue(num_cf, kCFNumberIntType, &ups_tr);
-            if (ups_tr != -1) combinedTime += ups_tr;
-        }
+        ups_tr = upsAgg.minutesRemaining;
+        if (ups_tr != -1) combinedTime += ups_tr;
 
-        CFStringRef src = CFDictionaryGetValue(ups, CFSTR(kIOPSPowerSourceStateKey));
-        if (src && (CFStringCompare(src, CFSTR(kIOPSACPowerValue), kNilOptions) == kCFCompareEqualTo))
-            ups_externalConnected = true;
+        // Redundant units: still on external power while any unit is
+        ups_externalConnected = (upsAgg.onBattery < upsAgg.present);
     }
     
     if (b) {
@@ -776,9 +1023,8 @@ static void HandlePublishAllPowerSources(void)
     }
     else {
         int mcap = 0, ccap = 0;
-        CFNumberRef mcap_cf = NULL, ccap_cf = NULL;
 
-        /* ups must be non-NULL */
+        /* ups must be true */
         externalConnected = ups_externalConnected;
 
         if (!externalConnected && (ups_tr == -1)) {
@@ -788,16 +1034,9 @@ static void HandlePublishAllPowerSources(void)
             tr_unknown = true;
         }
 
-        if (CFDictionaryGetValue(ups, CFSTR(kIOPSIsChargingKey)) == kCFBooleanTrue)
-            is_charging = true;
-
-        ccap_cf = CFDictionaryGetValue(ups, CFSTR(kIOPSCurrentCapacityKey));
-        if (ccap_cf)
-            CFNumberGetValue(ccap_cf, kCFNumberIntType, &ccap);
-
-        mcap_cf = CFDictionaryGetValue(ups, CFSTR(kIOPSMaxCapacityKey));
-        if (mcap_cf)
-            CFNumberGetValue(mcap_cf, kCFNumberIntType, &mcap);
+        is_charging = upsAgg.isCharging;
+        ccap = upsAgg.currentCapacity;
+        mcap = upsAgg.maxCapacity;
 
         if (ccap && mcap)
             percentRemaining = (ccap*100)/mcap;
@@ -806,21 +1045,26 @@ static void HandlePublishAllPowerSources(void)
             fully_charged = true;
     }
 
-    tr_posted = publish_IOPSGetTimeRemainingEstimate(combinedTime,
-                                         externalConnected,
-                                         tr_unknown,
-                                         is_charging,
-                                         control.noPoll);
+    tr_posted = false;
+    if (changed & kBattChangedTimeRemaining) {
+        tr_posted = publish_IOPSGetTimeRemainingEstimate(combinedTime,
+                                             externalConnected,
+                                             tr_unknown,
+                                             is_charging,
+                                             control.noPoll);
+    }
     
-    if (b) {
+    if (b && (changed & kBattChangedWarning)) {
         publish_IOPSBatteryGetWarningLevel(b, combinedTime);
     }
 
-    publish_IOPSGetPercentRemaining(percentRemaining, 
-                                    externalConnected, 
-                                    is_charging,
-                                    fully_charged,
-                                    b);
+    if (changed & kBattChangedPercent) {
+        publish_IOPSGetPercentRemaining(percentRemaining, 
+                                        externalConnected, 
+                                        is_charging,
+                                        fully_charged,
+                                        b);
+    }
     
     if ((percentRemaining != prev_percentRemaining) && !tr_posted) {
         notify_post(kIOPSNotifyTimeRemaining);
@@ -835,9 +1079,11 @@ static void HandlePublishAllPowerSources(void)
 
      
  #if !TARGET_OS_EMBEDDED
-     // Notifiy PSLowPower of power sources change
-    UPSLowPowerPSChange();
-    PMSettingsPSChange();
+    if (changed & (kBattChangedAC | kBattChangedTimeRemaining | kBattChangedPercent)) {
+        // Notifiy PSLowPower of power sources change
+        UPSLowPowerPSChange();
+        PMSettingsPSChange();
+    }
  #endif
 
 
@@ -855,7 +1101,9 @@ static void HandlePublishAllPowerSources(void)
     }
 
 
-    notify_post(kIOPSNotifyAnyPowerSource);
+    if (changed & kBattChangedDescription) {
+        notify_post(kIOPSNotifyAnyPowerSource);
+    }
 
     /************************************************************************
      *
@@ -872,6 +1120,40 @@ static void HandlePublishAllPowerSources(void)
 
 
 
+/* estimateTimeRemaining
+ * Feeds each battery's latest reading to its estimator, and places the
+ * estimate in b->swCalculatedTR, or -1 while it's still calculating.
+ */
+static void estimateTimeRemaining(IOPMBattery **batts)
+{
+    IOPMBattery     *b;
+    BattSample      sample;
+    BattEstimate    estimate;
+    CFAbsoluteTime  now = CFAbsoluteTimeGetCurrent();
+
+    for (int i = 0; i < _batteryCount(); i++)
+    {
+        b = batts[i];
+        if (b->estimator.model != control.estimatorModel) {
+            BattEstimatorReset(&b->estimator, control.estimatorModel);
+        }
+
+        bzero(&sample, sizeof(sample));
+        sample.time = now;
+        sample.level = b->maxCap ? (100.0 * b->currentCap / b->maxCap) : 0;
+        sample.fullChargeMAh = b->maxCap;
+        sample.amperage = b->avgAmperage;
+        sample.hwMinutes = b->hwAverageTR;
+        sample.charging = b->isCharging;
+        sample.external = b->externalConnected;
+        BattEstimatorUpdate(&b->estimator, &sample, &estimate);
+
+        b->swCalculatedTR = estimate.minutes;
+        b->swCalculatedTRLow = estimate.low;
+        b->swCalculatedTRHigh = estimate.high;
+    }
+}
+
 /* checkTimeRemainingValid
  * Implicit inputs: battery state; battery's own time remaining estimate
  * Implicit output: estimated time remaining placed in b->swCalculatedTR; or -1 if indeterminate
@@ -1318,6 +1600,22 @@ CFDictionaryRef packageKernelPowerSource(IOPMBattery *b)
     }
     CFRelease(n0);
 
+    // The range around the estimate, from the models that have one
+    if (b->isPresent && !control.noPoll && (minutes >= 0)
+        && (b->swCalculatedTRLow != b->swCalculatedTRHigh))
+    {
+        n = CFNumberCreate(kCFAllocatorDefault, kCFNumberIntType, &b->swCalculatedTRLow);
+        if (n) {
+            CFDictionarySetValue(mDict, CFSTR(kBattEstimateLowKey), n);
+            CFRelease(n);
+        }
+        n = CFNumberCreate(kCFAllocatorDefault, kCFNumberIntType, &b->swCalculatedTRHigh);
+        if (n) {
+            CFDictionarySetValue(mDict, CFSTR(kBattEstimateHighKey), n);
+            CFRelease(n);
+        }
+    }
+
     // Set health & confidence
     _setBatteryHealthConfidence(mDict, b);
 
@@ -1496,6 +1794,7 @@ static IOReturn _readAndPublishACAdapter(bool adapterExists, CFDictionaryRef bat
     }
 
     if (success) {
+        PMStoreFlush();
         notify_post("com.apple.system.powermanagement.poweradapter");
         ret = kIOReturnSuccess;
     } else {
@@ -1593,6 +1892,81 @@ __private_extern__ CFDictionaryRef getActiveUPSDictionary(void)
 }
 
 
+static bool isUPSDescription(CFDictionaryRef description)
+{
+    CFStringRef transport_type = CFDictionaryGetValue(description,
+                                          CFSTR(kIOPSTransportTypeKey));
+
+    return (isA_CFString(transport_type)
+            && ( CFEqual(transport_type, CFSTR(kIOPSSerialTransportType))
+                || CFEqual(transport_type, CFSTR(kIOPSUSBTransportType))
+                || CFEqual(transport_type, CFSTR(kIOPSNetworkTransportType)) ));
+}
+
+static int intFromDescription(CFDictionaryRef description, CFStringRef key, int missing)
+{
+    CFNumberRef     num = isA_CFNumber(CFDictionaryGetValue(description, key));
+    int             value = missing;
+
+    if (num) {
+        CFNumberGetValue(num, kCFNumberIntType, &value);
+    }
+    return value;
+}
+
+__private_extern__ bool getUPSAggregate(UPSAggregate *agg)
+{
+    CFDictionaryRef     d;
+    CFStringRef         ps_state;
+    int                 minutes;
+    int                 timedUnits = 0;
+    int                 minutesSum = 0;
+
+    bzero(agg, sizeof(*agg));
+    agg->minutesRemaining = -1;
+
+    for (int i=0; i<kPSMaxCount; i++)
+    {
+        d = gPSList[i].description;
+        if (!d || !isUPSDescription(d)) {
+            continue;
+        }
+        if (kCFBooleanTrue != CFDictionaryGetValue(d, CFSTR(kIOPSIsPresentKey))) {
+            continue;
+        }
+
+        agg->present++;
+        agg->currentCapacity += intFromDescription(d, CFSTR(kIOPSCurrentCapacityKey), 0);
+        agg->maxCapacity += intFromDescription(d, CFSTR(kIOPSMaxCapacityKey), 0);
+
+        if (kCFBooleanTrue == CFDictionaryGetValue(d, CFSTR(kIOPSIsChargingKey))) {
+            agg->isCharging = true;
+        }
+
+        minutes = intFromDescription(d, CFSTR(kIOPSTimeToEmptyKey), -1);
+        if (minutes >= 0) {
+            timedUnits++;
+            minutesSum += minutes;
+        }
+
+        ps_state = CFDictionaryGetValue(d, CFSTR(kIOPSPowerSourceStateKey));
+        if (isA_CFString(ps_state) && CFEqual(ps_state, CFSTR(kIOPSBatteryPowerValue)))
+        {
+            agg->ids[agg->onBattery++] = isA_CFNumber(CFDictionaryGetValue(d,
+                                                CFSTR(kIOPSPowerSourceIDKey)));
+        }
+    }
+
+    /* Each unit reports time to empty at its share of the load. Assuming
+     * the load is shared evenly, and moves to the survivors as units run
+     * out, the units together last for the mean of those times.
+     */
+    if (timedUnits) {
+        agg->minutesRemaining = minutesSum / timedUnits;
+    }
+
+    return (agg->present > 0);
+}
 
 __private_extern__ int getActivePSType(void)
 {
@@ -1710,8 +2084,7 @@ kern_return_t _io_ps_new_pspowersource(
         }
         bzero(ps, sizeof(PSStruct));
 
-        dispatch_async(dispatch_get_main_queue(), ^()
-                       { HandlePublishAllPowerSources(); });
+        schedulePublishAllPowerSources();
     });
 
     dispatch_source_set_event_handler(ps->procdeathsrc, ^{
@@ -1764,8 +2137,7 @@ kern_return_t _io_ps_update_pspowersource(
             next->description = details;
             updateLogBuffer(next, false);
             *return_code = kIOReturnSuccess;
-            dispatch_async(dispatch_get_main_queue(), ^()
-                       { HandlePublishAllPowerSources(); });
+            schedulePublishAllPowerSources();
         }
     }
 
@@ -52,6 +52,8 @@ __private_extern__ bool BatteryHandleDeadName(mach_port_t deadName);
 
 __private_extern__ void BatterySetNoPoll(bool noPoll);
 
+__private_extern__ void BatteryTimeRemainingPrefsHaveChanged(void);
+
 __private_extern__ bool isFullyCharged(IOPMBattery *b);
 
 
@@ -62,6 +64,31 @@ __private_extern__ int getActivePSType(void);
 __private_extern__ CFDictionaryRef getActiveBatteryDictionary(void);
 __private_extern__ CFDictionaryRef getActiveUPSDictionary(void);
 
+/* Maximum number of user-space power sources (ioupsd's UPS units and
+ * anything else calling IOPSCreatePowerSource).
+ */
+#define kPSMaxCount   40
+
+/* UPSAggregate
+ * Combined state of every present UPS, as returned by getUPSAggregate().
+ * Redundant units power the same machine, so the machine only runs from
+ * UPS battery power once every present unit is on battery (onBattery == present).
+ */
+typedef struct {
+    int             present;            // present UPS units
+    int             onBattery;          // present units drawing from their own battery
+    int             currentCapacity;    // summed across present units
+    int             maxCapacity;        // summed across present units
+    int             minutesRemaining;   // combined time to empty; -1 if unknown
+    bool            isCharging;         // any present unit is charging
+    CFNumberRef     ids[kPSMaxCount];   // kIOPSPowerSourceIDKey of units on battery; may be NULL
+} UPSAggregate;
+
+/* getUPSAggregate
+ * Fills in 'agg'. Returns true if at least one UPS is present.
+ */
+__private_extern__ bool getUPSAggregate(UPSAggregate *agg);
+
 
 #ifndef kIOPSFailureKey
 #define kIOPSFailureKey                         "Failure"
@@ -27,6 +27,7 @@
 #include <libproc.h>
 #include <bsm/libbsm.h>
 #include "HIDEventWatcher.h"
+#include "SystemLoad.h"
 
 static CFMutableArrayRef   gHIDEventHistory = NULL;
 
@@ -70,6 +71,10 @@ __private_extern__ kern_return_t _io_pm_hid_event_report_activity(
         *allowEvent = 1;
     }
 
+    if (__NX_NULL_EVENT != _action) {
+        userActiveHandleHIDActivity();
+    }
+
 
     // Unwrapping big data structure...
     if (!gHIDEventHistory) {
@@ -0,0 +1,214 @@
+/*
+ * Copyright (c) 2014 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#include <asl.h>
+#include <mach/mach_time.h>
+
+#include "PrivateLib.h"
+#include "HIDIdle.h"
+#include "HIDIdleShared.h"
+
+#ifndef kIOHIDIdleTimeKey
+#define kIOHIDIdleTimeKey               "HIDIdleTime"
+#endif
+
+/* Allowed lateness of the resync timer */
+#define kHIDIdleResyncLeewaySecs        1
+
+/*! HIDIdleStruct tracks the time of the last HID activity.
+ *
+ *  The HID activity notifications powerd receives move it on. While HID
+ *  is active, events powerd doesn't see also count, so it's resynced from
+ *  IOHIDSystem at most kHIDIdleResyncSecs after the last resync, and once
+ *  more when HID goes idle. The resync is what keeps the shared page within
+ *  kHIDIdleResyncSecs (plus the timer's leeway) of IOHIDSystem for clients
+ *  that read it instead of the registry.
+ */
+typedef struct {
+    io_registry_entry_t         hidSystem;
+    mach_timebase_info_data_t   timebase;
+
+    /*! lastActivity is the mach_absolute_time() of the last HID activity,
+     *  or 0 until it's known.
+     */
+    uint64_t                    lastActivity;
+
+    dispatch_source_t           resyncTimer;
+    bool                        resyncing;
+
+    HIDIdleShared               *shared;
+} HIDIdleStruct;
+
+static HIDIdleStruct hidIdle;
+
+static void hidIdleSetLastActivity(uint64_t lastActivity)
+{
+    hidIdle.lastActivity = lastActivity;
+    if (hidIdle.shared) {
+        hidIdle.shared->lastActivity = lastActivity;
+    }
+}
+
+/* While HID is active, (re)starts the resync interval from now. */
+static void hidIdleArmResync(void)
+{
+    if (!hidIdle.resyncing) {
+        return;
+    }
+    dispatch_source_set_timer(hidIdle.resyncTimer,
+                              dispatch_time(DISPATCH_TIME_NOW, kHIDIdleResyncSecs * NSEC_PER_SEC),
+                              kHIDIdleResyncSecs * NSEC_PER_SEC, kHIDIdleResyncLeewaySecs * NSEC_PER_SEC);
+}
+
+/* Reads IOHIDSystem's idle time, and moves the last activity time to match.
+ * A resync for any reason puts off the next timed one by a full interval.
+ */
+static void hidIdleResync(void)
+{
+    CFNumberRef     idleNum = NULL;
+    uint64_t        idleNanos = 0;
+    uint64_t        idle;
+    uint64_t        now;
+
+    if (IO_OBJECT_NULL == hidIdle.hidSystem) {
+        return;
+    }
+
+    idleNum = IORegistryEntryCreateCFProperty(hidIdle.hidSystem, CFSTR(kIOHIDIdleTimeKey), 0, 0);
+    if (isA_CFNumber(idleNum) && CFNumberGetValue(idleNum, kCFNumberSInt64Type, &idleNanos))
+    {
+        now = mach_absolute_time();
+        idle = idleNanos * hidIdle.timebase.denom / hidIdle.timebase.numer;
+        hidIdleSetLastActivity((idle < now) ? (now - idle) : 1);
+        if (hidIdle.shared) {
+            hidIdle.shared->resyncCount++;
+        }
+        hidIdleArmResync();
+    }
+
+    if (idleNum) {
+        CFRelease(idleNum);
+    }
+}
+
+/* Runs the resync timer only while HID is active. Once HID is idle the
+ * last activity time can only move on with a notification.
+ */
+static void hidIdleSetActive(bool hidActive)
+{
+    if (hidIdle.shared) {
+        hidIdle.shared->hidActive = hidActive;
+    }
+
+    if (!hidIdle.resyncTimer) {
+        hidIdle.resyncTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0,
+                                                     0, dispatch_get_main_queue());
+        if (!hidIdle.resyncTimer) {
+            asl_log(NULL, NULL, ASL_LEVEL_ERR, "HIDIdle: can't create the resync timer\n");
+            return;
+        }
+        dispatch_source_set_event_handler(hidIdle.resyncTimer, ^{
+            hidIdleResync();
+        });
+    }
+
+    if (hidActive == hidIdle.resyncing) {
+        return;
+    }
+    hidIdle.resyncing = hidActive;
+
+    if (hidActive) {
+        hidIdleArmResync();
+        dispatch_resume(hidIdle.resyncTimer);
+    }
+    else {
+        dispatch_suspend(hidIdle.resyncTimer);
+    }
+}
+
+/* Maps the shared page that exports the last HID activity time. */
+__private_extern__ void HIDIdle_prime(void)
+{
+    bzero(&hidIdle, sizeof(HIDIdleStruct));
+    mach_timebase_info(&hidIdle.timebase);
+
+    hidIdle.shared = (HIDIdleShared *)_sharedPageMap(kHIDIdleSharedName, sizeof(HIDIdleShared));
+    if (!hidIdle.shared) {
+        asl_log(NULL, NULL, ASL_LEVEL_ERR, "HIDIdle: HID idle time isn't published for clients\n");
+        return;
+    }
+
+    // Left from a previous powerd, the time may be stale
+    hidIdle.shared->lastActivity = 0;
+    hidIdle.shared->hidActive = 0;
+    hidIdle.shared->timebaseNumer = hidIdle.timebase.numer;
+    hidIdle.shared->timebaseDenom = hidIdle.timebase.denom;
+    hidIdle.shared->version = kHIDIdleSharedVersion;
+}
+
+__private_extern__ void HIDIdleSystemMatched(io_registry_entry_t hidSystem)
+{
+    if (IO_OBJECT_NULL == hidIdle.hidSystem) {
+        IOObjectRetain(hidSystem);
+        hidIdle.hidSystem = hidSystem;
+        hidIdleResync();
+    }
+}
+
+__private_extern__ void HIDIdleHIDActivityChanged(bool hidActive)
+{
+    if (hidActive) {
+        hidIdleSetLastActivity(mach_absolute_time());
+    }
+    else {
+        hidIdleResync();
+    }
+    hidIdleSetActive(hidActive);
+}
+
+__private_extern__ void HIDIdleHandleActivity(void)
+{
+    hidIdleSetLastActivity(mach_absolute_time());
+}
+
+/*! _getHIDIdleTime
+ *  Seconds since the last HID activity. Reads IOHIDSystem only until the
+ *  time of the last activity is known.
+ */
+__private_extern__ CFTimeInterval _getHIDIdleTime(void)
+{
+    uint64_t    now;
+
+    if (!hidIdle.lastActivity) {
+        hidIdleResync();
+        if (!hidIdle.lastActivity) {
+            return 0.0;
+        }
+    }
+
+    now = mach_absolute_time();
+    if (now <= hidIdle.lastActivity) {
+        return 0.0;
+    }
+    return (CFTimeInterval)(now - hidIdle.lastActivity) * hidIdle.timebase.numer / hidIdle.timebase.denom / NSEC_PER_SEC;
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2014 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#ifndef _HIDIdle_h_
+#define _HIDIdle_h_
+
+/*
+ * HIDIdle tracks the time of the last HID activity, so HID idle time can be
+ * had without reading IOHIDSystem's HIDIdleTime property, and publishes it
+ * for clients in the shared page described in HIDIdleShared.h.
+ */
+
+__private_extern__ void HIDIdle_prime(void);
+
+/* HIDIdleSystemMatched
+ * Keeps the IOHIDSystem service to resync from.
+ */
+__private_extern__ void HIDIdleSystemMatched(io_registry_entry_t hidSystem);
+
+/* HIDIdleHIDActivityChanged
+ * IOHIDSystem reported HID going active, or idle.
+ */
+__private_extern__ void HIDIdleHIDActivityChanged(bool hidActive);
+
+/* HIDIdleHandleActivity
+ * A HID event was posted through powerd.
+ */
+__private_extern__ void HIDIdleHandleActivity(void);
+
+/* Seconds since the last HID activity */
+__private_extern__ CFTimeInterval _getHIDIdleTime(void);
+
+#endif
@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2014 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#ifndef _HIDIdleShared_h_
+#define _HIDIdleShared_h_
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <mach/mach_time.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * powerd publishes the time of the last HID activity in a read-only shared
+ * memory page, so clients can compute HID idle time without reading
+ * IOHIDSystem's HIDIdleTime registry property.
+ *
+ * Only powerd writes the page. It moves the time on from the HID activity
+ * notifications it receives, and resyncs it from IOHIDSystem at most
+ * kHIDIdleResyncSecs apart while HID is active, so the idle time read here
+ * may run up to kHIDIdleResyncSecs, plus a second of timer leeway, ahead
+ * of IOHIDSystem's.
+ */
+
+#define kHIDIdleSharedName              "com.apple.powerd.hididle"
+#define kHIDIdleSharedVersion           1
+
+#define kHIDIdleResyncSecs              30
+
+typedef struct {
+    uint32_t            version;
+
+    /* mach_timebase_info() of the writer */
+    uint32_t            timebaseNumer;
+    uint32_t            timebaseDenom;
+
+    /* Non-zero while IOHIDSystem reports HID activity within 5 minutes */
+    volatile uint32_t   hidActive;
+
+    /* mach_absolute_time() of the last HID activity; 0 until powerd knows it.
+     * A single aligned 64-bit word: always consistent on its own.
+     */
+    volatile uint64_t   lastActivity;
+
+    /* Incremented each time the time is resynced from IOHIDSystem */
+    uint64_t            resyncCount;
+} HIDIdleShared;
+
+/* HIDIdleSharedMap
+ * Maps powerd's page read-only. Returns NULL if powerd hasn't published it,
+ * or if the object isn't root's alone to write.
+ * The mapping lives for the life of the process; callers should map once.
+ */
+static inline const HIDIdleShared *HIDIdleSharedMap(void)
+{
+    const HIDIdleShared     *shared = NULL;
+    struct stat             sb;
+    void                    *addr;
+    int                     fd;
+
+    fd = shm_open(kHIDIdleSharedName, O_RDONLY, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    if ((0 != fstat(fd, &sb))
+        || (0 != sb.st_uid)
+        || (sb.st_mode & (S_IWGRP | S_IWOTH))
+        || (sb.st_size < (off_t)sizeof(HIDIdleShared)))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    addr = mmap(NULL, sizeof(HIDIdleShared), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (MAP_FAILED == addr) {
+        return NULL;
+    }
+
+    shared = (const HIDIdleShared *)addr;
+    if (kHIDIdleSharedVersion != shared->version) {
+        munmap(addr, sizeof(HIDIdleShared));
+        return NULL;
+    }
+
+    return shared;
+}
+
+/* HIDIdleSharedGetIdleTime
+ * Wait-free: seconds since the last HID activity, or -1 if powerd doesn't
+ * know it yet.
+ */
+static inline CFTimeInterval HIDIdleSharedGetIdleTime(const HIDIdleShared *shared)
+{
+    uint64_t    last = shared->lastActivity;
+    uint64_t    now = mach_absolute_time();
+
+    if (!last) {
+        return -1.0;
+    }
+    if (now <= last) {
+        return 0.0;
+    }
+    return (CFTimeInterval)(now - last) * shared->timebaseNumer / shared->timebaseDenom / 1000000000.0;
+}
+
+#endif
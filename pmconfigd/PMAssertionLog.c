@@ -28,6 +28,7 @@
 
 #include "PMAssertions.h"
 #include "PrivateLib.h"
+#include "SleepWakeRecord.h"
 
 #include <IOReport.h>
 
@@ -209,47 +210,56 @@ __private_extern__ void logASLAssertionTypeSummary( kerAssertionType type)
                              });
 }
 
+/*
+ * Adds the holders of 'type' assertions to the current sleep/wake record
+ * as the assertions that blocked its sleep.
+ */
+__private_extern__ void recordAssertionTypeBlockers(kerAssertionType type)
+{
+    uint64_t    now = getMonotonicTime();
+
+    applyToAllAssertionsSync(&gAssertionTypes[type], false,
+                             ^(assertion_t *assertion) {
+        char    name[kProcNameBufLen];
+
+        if (!assertion->pinfo || !assertion->pinfo->name ||
+            !CFStringGetCString(assertion->pinfo->name, name, sizeof(name), kCFStringEncodingUTF8)) {
+            snprintf(name, sizeof(name), "pid %d", assertion->pinfo ? assertion->pinfo->pid : -1);
+        }
+        cycleRecordBlocker(name, type, (uint32_t)(now - assertion->createTime));
+    });
+}
+
+static const struct {
+    kerAssertionType    type;
+    const char          *label;
+} aggregateLabels[] = {
+    { kPreventIdleType,             " PrevIdle" },
+    { kPreventDisplaySleepType,     " PrevDisp" },
+    { kPreventSleepType,            " PrevSleep" },
+    { kDeclareUserActivityType,     " DeclUser" },
+    { kPushServiceTaskType,         " PushSrvc" },
+    { kBackgroundTaskType,          " BGTask" },
+    { kDeclareSystemActivityType,   " SysAct" },
+    { kSRPreventSleepType,          " SRPrevSleep" },
+    { kTicklessDisplayWakeType,     " DispWake" },
+    { kIntPreventDisplaySleepType,  " IntPrevDisp" },
+    { kNetworkAccessType,           " NetAcc" },
+    { kInteractivePushServiceType,  " IPushSrvc" }
+};
+
 static void printAggregateAssertionsToBuf(char *aBuf, int bufsize, uint32_t kbits)
 {
-    size_t printed = 0;
+    uint32_t    levels = getAggregateLevelBits();
+    size_t      printed = 0;
+    size_t      i;
 
     snprintf(aBuf, bufsize, "[System:");
 
-    if (getAssertionLevel(kPreventIdleType)) {
-        printed += strlcat(aBuf, " PrevIdle", bufsize);
-    }
-    if (getAssertionLevel(kPreventDisplaySleepType)) {
-        printed += strlcat(aBuf, " PrevDisp", bufsize);
-    }
-    if (getAssertionLevel(kPreventSleepType)) {
-        printed += strlcat(aBuf, " PrevSleep", bufsize);
-    }
-    if (getAssertionLevel(kDeclareUserActivityType)) {
-        printed += strlcat(aBuf, " DeclUser", bufsize);
-    }
-    if (getAssertionLevel(kPushServiceTaskType)) {
-        printed += strlcat(aBuf, " PushSrvc", bufsize);
-    }
-    if (getAssertionLevel(kBackgroundTaskType)) {
-        printed += strlcat(aBuf, " BGTask", bufsize);
-    }
-    if (getAssertionLevel(kDeclareSystemActivityType)) {
-        printed += strlcat(aBuf, " SysAct", bufsize);
-    }
-    if (getAssertionLevel(kSRPreventSleepType)) {
-        printed += strlcat(aBuf, " SRPrevSleep", bufsize);
-    }
-    if (getAssertionLevel(kTicklessDisplayWakeType)) {
-        printed += strlcat(aBuf, " DispWake", bufsize);
-    }
-    if (getAssertionLevel(kIntPreventDisplaySleepType)) {
-        printed += strlcat(aBuf, " IntPrevDisp", bufsize);
-    }
-    if (getAssertionLevel(kNetworkAccessType)) {
-        printed += strlcat(aBuf, " NetAcc", bufsize);
-    }
-    if (getAssertionLevel(kInteractivePushServiceType)) {
-        printed += strlcat(aBuf, " IPushSrvc", bufsize);
+    for (i = 0; i < sizeof(aggregateLabels) / sizeof(aggregateLabels[0]); i++) {
+        if (levels & (1U << aggregateLabels[i].type)) {
+            printed += strlcat(aBuf, aggregateLabels[i].label, bufsize);
+        }
     }
     if (kbits & kIOPMDriverAssertionCPUBit) {
         printed += strlcat(aBuf, " kCPU", bufsize);
@@ -430,7 +440,7 @@ static void logAssertionToASL(assertLogAction  action,
     asl_set(m, ASL_KEY_MSG, aslMessageString);
     asl_set(m, kPMASLActionKey, assertionAction);
     asl_set(m, kPMASLDomainKey, kPMASLDomainPMAssertions);
-    asl_send(NULL, m);
+    send_msg_pmset_log(m);
     asl_free(m);
 
 }
@@ -461,7 +471,7 @@ void logASLAssertionsAggregate( )
     m = new_msg_pmset_log();
     asl_set(m, ASL_KEY_MSG, aslMessageString);
     asl_set(m, kPMASLActionKey, kPMASLAssertionActionSummary);
-    asl_send(NULL, m);
+    send_msg_pmset_log(m);
     asl_free(m);
     //
     //    for (int i=0; i<kIOPMNumAssertionTypes; i++) {
@@ -45,6 +45,8 @@
 #include "powermanagementServer.h"
 #include "SystemLoad.h"
 #include "Platform.h"
+#include "PMTrace.h"
+#include "AssertionSnapshot.h"
 
 //#include <IOKit/IOReportMacros.h>
 
@@ -117,6 +119,8 @@ static IOReturn                     doSetProperties(pid_t pid,
                                                     CFDictionaryRef props);
 
 static CFArrayRef                   copyPIDAssertionDictionaryFlattened(void);
+static IOReturn                     copyAssertionsColumnar(vm_offset_t *snapshot, mach_msg_type_number_t *snapshotCnt);
+static IOReturn                     copyAggregateStatusPacked(vm_offset_t *status, mach_msg_type_number_t *statusCnt);
 static CFDictionaryRef              copyAggregateValuesDictionary(void);
 
 static IOReturn                     doCreate(pid_t pid, CFMutableDictionaryRef newProperties,
@@ -133,6 +137,7 @@ static void                         setClamshellSleepState(int clamshellSleepSta
 static int                          getAssertionTypeIndex(CFStringRef type);
 
 static void                         handleAssertionTimeout(assertionType_t *assertType);
+static void                         linkByTimeout(assertion_t *assertion, assertionType_t *assertType);
 static void                         resetGlobalTimer(assertionType_t *assertType, uint64_t timer);
 static IOReturn                     raiseAssertion(assertion_t *assertion);
 static void                         allocStatsBuf(ProcessInfo *pinfo);
@@ -142,7 +147,8 @@ __private_extern__ void             logASLMessageSleepServiceTerminated(int forc
 
 // globals
 static uint32_t                     kerAssertionBits = 0;
-static int                          aggregate_assertions;
+static PMAssertionStatus            gAggregateStatus;   /* Aggregate level of each type, as bits and as levels */
+_Static_assert(kIOPMNumAssertionTypes <= kPMAssertionStatusMaxTypes, "Assertion types don't fit PMAssertionStatus");
 static CFStringRef                  assertion_types_arr[kIOPMNumAssertionTypes];
 
 static CFMutableDictionaryRef       gAssertionsArray = NULL;
@@ -156,6 +162,15 @@ unsigned long                       gIdleSleepTimer = 0;         /* Idle Sleep t
 extern uint32_t                     gDebugFlags;
 static IOPMAssertionID              gDarkWakeNetworkAssertion = kIOPMNullAssertionID;
 
+/*
+ * Repeated user activity declarations on a live assertion only push its
+ * timeout out; the display is tickled at most once per interval.
+ */
+#define kUserActiveTickleIntervalSecs       1
+static uint64_t                     gUserActiveLastTickle = 0;
+static uint32_t                     gUserActiveDeclared = 0;
+static uint32_t                     gUserActiveCoalesced = 0;
+
 /* Number of procs interested in kIOPMAssertionsAnyChangedNotifyString notification */
 static  uint32_t                    gAnyChange = 0;
 /* Number of procs interested in kIOPMAssertionsChangedNotifyString notification */
@@ -351,6 +366,17 @@ kern_return_t _io_pm_assertion_copy_details (
 
     *return_val = kIOReturnNotFound;
 
+    if (kPMAssertionMIGCopyColumnar == whichData)
+    {
+        *return_val = copyAssertionsColumnar(assertions, assertionsCnt);
+        return KERN_SUCCESS;
+    }
+    if (kPMAssertionMIGCopyStatusPacked == whichData)
+    {
+        *return_val = copyAggregateStatusPacked(assertions, assertionsCnt);
+        return KERN_SUCCESS;
+    }
+
     if (kIOPMAssertionMIGCopyAll == whichData)
     {
         theCollection = copyPIDAssertionDictionaryFlattened();
@@ -723,21 +749,34 @@ void createOnBootAssertions( )
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+/*
+ * The dictionary is rebuilt only when an aggregate level has changed since
+ * the last one was built.
+ */
 static CFDictionaryRef copyAggregateValuesDictionary(void)
 {
-    CFDictionaryRef                 assertions_info = NULL;
+    static CFDictionaryRef          assertions_info = NULL;
+    static uint64_t                 assertions_info_gen = 0;
     CFNumberRef                     cf_agg_vals[kIOPMNumAssertionTypes];
     int                             i;
 
+    if (assertions_info && (assertions_info_gen == gAggregateStatus.generation)) {
+        return CFRetain(assertions_info);
+    }
+    if (assertions_info) {
+        CFRelease(assertions_info);
+    }
+
     // Massage int values into CFNumbers for CFDictionaryCreate
     for (i=0; i<kIOPMNumAssertionTypes; i++)
     {
-        int tmp_bit = getAssertionLevel(i);
+        int tmp_bit = gAggregateStatus.levels[i];
 
         cf_agg_vals[i] = CFNumberCreate(0, kCFNumberIntType, &tmp_bit);
     }
 
-    // We return the contents of aggregate_assertions packed into a CFDictionary.
+    // We return the aggregate levels packed into a CFDictionary.
+    assertions_info_gen = gAggregateStatus.generation;
     assertions_info = CFDictionaryCreate(
                                          0,
                                          (const void **)assertion_types_arr,     // type: CFStringRef
@@ -754,7 +793,46 @@ static CFDictionaryRef copyAggregateValuesDictionary(void)
 
     // TODO: strip unsupported assertions?
 
-    return assertions_info;
+    return assertions_info ? CFRetain(assertions_info) : NULL;
+}
+
+static IOReturn copyAggregateStatusPacked(vm_offset_t *status, mach_msg_type_number_t *statusCnt)
+{
+    vm_address_t    buf = 0;
+
+    *status = 0;
+    *statusCnt = 0;
+    if (vm_allocate(mach_task_self(), &buf, sizeof(PMAssertionStatus), TRUE) != KERN_SUCCESS) {
+        return kIOReturnNoMemory;
+    }
+
+    gAggregateStatus.kernelBits = kerAssertionBits;
+    memcpy((void *)buf, &gAggregateStatus, sizeof(PMAssertionStatus));
+
+    *status = buf;
+    *statusCnt = sizeof(PMAssertionStatus);
+    return kIOReturnSuccess;
+}
+
+/*
+ * Fills in the parts of gAggregateStatus that don't change once the types
+ * are configured.
+ */
+static void initAggregateStatus(void)
+{
+    int     i;
+
+    gAggregateStatus.magic = kPMAssertionStatusMagic;
+    gAggregateStatus.version = kPMAssertionStatusVersion;
+    gAggregateStatus.typeCount = kIOPMNumAssertionTypes;
+    for (i = 0; i < kIOPMNumAssertionTypes; i++) {
+        if (!assertion_types_arr[i] ||
+            !CFStringGetCString(assertion_types_arr[i], gAggregateStatus.names[i],
+                                sizeof(gAggregateStatus.names[i]), kCFStringEncodingUTF8)) {
+            gAggregateStatus.names[i][0] = '\0';
+        }
+    }
+    gAggregateStatus.generation++;
 }
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
@@ -1717,6 +1795,73 @@ exit:
     return KERN_SUCCESS;
 }
 
+static uint64_t hashDeclaration(const void *props, size_t len)
+{
+    const uint8_t   *p = props;
+    uint64_t        hash = 14695981039346656037ULL;
+
+    while (len--) {
+        hash = (hash ^ *p++) * 1099511628211ULL;
+    }
+    return hash ? hash : 1;
+}
+
+/*
+ * A repeated declaration, with the same properties, on a user activity
+ * assertion that hasn't timed out yet only restarts its display sleep
+ * timer window. The assertion is moved along the timed list without
+ * rerunning the type's handler, and the assertion timer is left to find
+ * the later timeout when it fires. Its time left properties are brought
+ * up to date when the assertion is next copied out. Returns false if the
+ * declaration needs the full path.
+ */
+static bool coalesceUserActive(pid_t pid, IOPMAssertionID id, const void *props, size_t propsCnt)
+{
+    assertionType_t     *assertType = &gAssertionTypes[kDeclareUserActivityType];
+    assertion_t         *assertion = NULL;
+    uint64_t            now;
+
+    if (!gDisplaySleepTimer || (id == kIOPMNullAssertionID))
+        return false;
+
+    if ((lookupAssertion(pid, id, &assertion) != kIOReturnSuccess) || !assertion
+        || (assertion->kassert != kDeclareUserActivityType))
+        return false;
+
+    if ((assertion->state & (kAssertionStateInactive | kAssertionStateTimed | kAssertionTimeoutIsSystemTimer))
+        != (kAssertionStateTimed | kAssertionTimeoutIsSystemTimer))
+        return false;
+
+    now = getMonotonicTime();
+    if ((assertion->timeout <= now) || (assertion->declHash != hashDeclaration(props, propsCnt)))
+        return false;
+
+    LIST_REMOVE(assertion, link);
+    assertion->createTime = now;
+    assertion->timeout = now + gDisplaySleepTimer * 60;
+    assertion->state |= kAssertionTimeoutPropsStale;
+    linkByTimeout(assertion, assertType);
+
+    if (now - gUserActiveLastTickle >= kUserActiveTickleIntervalSecs) {
+        gUserActiveLastTickle = now;
+        sendActivityTickle();
+        _unclamp_silent_running(true);
+    }
+
+    gUserActiveCoalesced++;
+    return true;
+}
+
+__private_extern__ void PMAssertionsGetUserActiveStats(uint32_t *declared, uint32_t *coalesced)
+{
+    if (declared) {
+        *declared = gUserActiveDeclared;
+    }
+    if (coalesced) {
+        *coalesced = gUserActiveCoalesced;
+    }
+}
+
 kern_return_t  _io_pm_declare_user_active (   
                                            mach_port_t             server  __unused,
                                            audit_token_t           token,
@@ -1740,6 +1885,13 @@ kern_return_t  _io_pm_declare_user_active (
     audit_token_to_au32(token, NULL, NULL, NULL, NULL, NULL, &callerPID, NULL, NULL);    
 
     *disableAppSleep = 0;
+    gUserActiveDeclared++;
+
+    if (assertion_id && coalesceUserActive(callerPID, *assertion_id, (const void *)props, propsCnt)) {
+        *return_code = kIOReturnSuccess;
+        goto done;
+    }
+
     unfolder = CFDataCreateWithBytesNoCopy(0, (const UInt8 *)props, propsCnt, kCFAllocatorNull);
     if (unfolder) {
         assertionProperties = (CFMutableDictionaryRef)
@@ -1798,6 +1950,13 @@ kern_return_t  _io_pm_declare_user_active (
 
     }
 
+    /* Remember what was declared, so the same declaration repeated can take the fast path */
+    if ((*return_code == kIOReturnSuccess) && assertion) {
+        assertion->declHash = hashDeclaration((const void *)props, propsCnt);
+        gUserActiveLastTickle = getMonotonicTime();
+    }
+
+done:
 #if !TARGET_OS_EMBEDDED
     if (*return_code == kIOReturnSuccess)
         updateAppSleepStates(processInfoGet(callerPID), disableAppSleep, NULL);
@@ -2119,15 +2278,38 @@ exit:
 
 uint8_t getAssertionLevel(kerAssertionType idx)
 {
-    return ((aggregate_assertions & (1 << idx)) ? 1:0);
+    return ((gAggregateStatus.levelBits >> idx) & 1);
+}
+
+uint32_t getAggregateLevelBits(void)
+{
+    return gAggregateStatus.levelBits;
+}
+
+/*
+ * Sets the aggregate level of every type in 'mask' to its bit in 'bits'.
+ * Only the level array entries of types that changed are rewritten.
+ */
+void setAggregateLevels(uint32_t mask, uint32_t bits)
+{
+    uint32_t    changed = (gAggregateStatus.levelBits ^ bits) & mask;
+    int         idx;
+
+    if (!changed)
+        return;
+
+    gAggregateStatus.levelBits ^= changed;
+    while (changed) {
+        idx = __builtin_ctz(changed);
+        gAggregateStatus.levels[idx] = (gAggregateStatus.levelBits >> idx) & 1;
+        changed &= changed - 1;
+    }
+    gAggregateStatus.generation++;
 }
 
 void setAggregateLevel(kerAssertionType idx, uint8_t val)
 {
-    if (val)
-        aggregate_assertions |= (1 << idx);
-    else
-        aggregate_assertions &= ~(1<<idx);
+    setAggregateLevels(1U << idx, val ? (1U << idx) : 0);
 }
 
 uint32_t getKerAssertionBits( )
@@ -2135,6 +2317,74 @@ uint32_t getKerAssertionBits( )
     return kerAssertionBits;
 }
 
+/*
+ * Adds 'sign' times the active counts of 'assertType' to its effect's.
+ * Used when the type's effect or flags change.
+ */
+static void countTypeInEffect(assertionType_t *assertType, int sign)
+{
+    assertionEffect_t   *effect = &gAssertionEffects[assertType->effectIdx];
+
+    if (assertType->flags & kAssertionTypeNotValidOnBatt) {
+        effect->battRestrictedCnt += sign * (int)assertType->activeCnt;
+        effect->validOnBattCnt += sign * (int)assertType->validOnBattCount;
+    }
+    else {
+        effect->activeCnt += sign * (int)assertType->activeCnt;
+    }
+}
+
+/*
+ * Adds the assertion to, or takes it out of, the active counts of its type
+ * and effect as it enters or leaves the active lists.
+ */
+static void countActiveAssertion(assertion_t *assertion, assertionType_t *assertType, bool active)
+{
+    assertionEffect_t   *effect = &gAssertionEffects[assertType->effectIdx];
+    int                 sign = active ? 1 : -1;
+
+    if (active == ((assertion->state & kAssertionStateCounted) != 0))
+        return;
+
+    assertType->activeCnt += sign;
+    if (assertion->state & kAssertionStateValidOnBatt)
+        assertType->validOnBattCount += sign;
+    if (assertion->state & kAssertionLidStateModifier)
+        assertType->lidSleepCount += sign;
+
+    if (assertType->flags & kAssertionTypeNotValidOnBatt) {
+        effect->battRestrictedCnt += sign;
+        if (assertion->state & kAssertionStateValidOnBatt)
+            effect->validOnBattCnt += sign;
+    }
+    else {
+        effect->activeCnt += sign;
+    }
+
+    if (active)
+        assertion->state |= kAssertionStateCounted;
+    else
+        assertion->state &= ~kAssertionStateCounted;
+}
+
+/*
+ * Sets or clears a state bit the counts depend on, recounting the
+ * assertion if it's active.
+ */
+static void setCountedState(assertion_t *assertion, assertionType_t *assertType, uint32_t bit, bool set)
+{
+    bool    counted = (assertion->state & kAssertionStateCounted) != 0;
+
+    if (counted)
+        countActiveAssertion(assertion, assertType, false);
+    if (set)
+        assertion->state |= bit;
+    else
+        assertion->state &= ~bit;
+    if (counted)
+        countActiveAssertion(assertion, assertType, true);
+}
+
 void insertInactiveAssertion(assertion_t *assertion, assertionType_t *assertType) 
 {
     LIST_INSERT_HEAD(&assertType->inactive, assertion, link);
@@ -2152,13 +2402,7 @@ void insertActiveAssertion(assertion_t *assertion, assertionType_t *assertType)
 {
     LIST_INSERT_HEAD(&assertType->active, assertion, link);
     assertion->state &= ~(kAssertionStateTimed|kAssertionStateInactive);
-
-    if ( (assertType->flags & kAssertionTypeNotValidOnBatt) &&
-         (assertion->state & kAssertionStateValidOnBatt) )
-        assertType->validOnBattCount++;
-
-    if (assertion->state & kAssertionLidStateModifier)
-        assertType->lidSleepCount++;
+    countActiveAssertion(assertion, assertType, true);
 
     updateAppStats(assertion, kAssertionOpRaise);
     schedDisableAppSleep(assertion);
@@ -2167,12 +2411,7 @@ void insertActiveAssertion(assertion_t *assertion, assertionType_t *assertType)
 void removeActiveAssertion(assertion_t *assertion, assertionType_t *assertType)
 {
     LIST_REMOVE(assertion, link);
-
-    if ( (assertion->state & kAssertionStateValidOnBatt) && assertType->validOnBattCount)
-        assertType->validOnBattCount--;
-
-    if ( (assertion->state & kAssertionLidStateModifier) && assertType->lidSleepCount)
-        assertType->lidSleepCount--;
+    countActiveAssertion(assertion, assertType, false);
 
     updateAppStats(assertion, kAssertionOpRelease);
     schedEnableAppSleep(assertion);
@@ -2248,12 +2487,7 @@ void handleAssertionTimeout(assertionType_t *assertType)
 
         LIST_REMOVE(assertion, link);
         assertion->state &= ~kAssertionStateTimed;
-
-        if ( (assertion->state & kAssertionStateValidOnBatt) && assertType->validOnBattCount)
-            assertType->validOnBattCount--;
-
-        if ( (assertion->state & kAssertionLidStateModifier) && assertType->lidSleepCount)
-            assertType->lidSleepCount--;
+        countActiveAssertion(assertion, assertType, false);
 
         updateAppStats(assertion, kAssertionOpRelease);
         schedEnableAppSleep( assertion );
@@ -2288,9 +2522,8 @@ void handleAssertionTimeout(assertionType_t *assertType)
 
     }
 
-    if ( !timedoutCnt ) return;
-
     resetAssertionTimer(assertType);
+    if ( !timedoutCnt ) return;   /* Timeouts were pushed out after the timer was set */
 
     if (displayProxy) delayDisplayTurnOff( );
 
@@ -2313,12 +2546,7 @@ void removeTimedAssertion(assertion_t *assertion, assertionType_t *assertType, b
     }
     LIST_REMOVE(assertion, link);
     assertion->state &= ~kAssertionStateTimed;
-
-    if ( (assertion->state & kAssertionStateValidOnBatt) && assertType->validOnBattCount)
-        assertType->validOnBattCount--;
-
-    if ( (assertion->state & kAssertionLidStateModifier) && assertType->lidSleepCount)
-        assertType->lidSleepCount--;
+    countActiveAssertion(assertion, assertType, false);
 
     updateAppStats(assertion, kAssertionOpRelease);
     schedEnableAppSleep(assertion);
@@ -2369,14 +2597,37 @@ void updateAssertionTimer(assertionType_t *assertType)
 
 }
 
-/* Inserts assertion into activeTimed list, sorted by timeout */
-static void insertByTimeout(assertion_t *assertion, assertionType_t *assertType)
+/* Links assertion into the activeTimed list, sorted by timeout */
+static void linkByTimeout(assertion_t *assertion, assertionType_t *assertType)
 {
     assertion_t *a, *prev;
+
+    if (LIST_EMPTY(&assertType->activeTimed) ) {
+        LIST_INSERT_HEAD(&assertType->activeTimed, assertion, link);
+    }
+    else {
+        LIST_FOREACH(a, &assertType->activeTimed, link) 
+        {
+            prev = a;
+            if (a->timeout > assertion->timeout)
+                break;
+        }
+        if (a)
+            LIST_INSERT_BEFORE(a, assertion, link);
+        else
+            LIST_INSERT_AFTER(prev, assertion, link);
+    }
+}
+
+/* Sets the time left and update time properties from the assertion's timeout */
+static void updateTimeoutProps(assertion_t *assertion)
+{
     CFNumberRef         timeLeftCF = NULL;
     uint64_t            currTime, timeLeft;
     CFDateRef           updateDate = NULL;
 
+    assertion->state &= ~kAssertionTimeoutPropsStale;
+
     currTime = getMonotonicTime();
     if (assertion->timeout > currTime) {
         /* Update timeout time left property */
@@ -2395,23 +2646,13 @@ static void insertByTimeout(assertion_t *assertion, assertionType_t *assertType)
             CFRelease(updateDate);
         }
     }
+}
 
-    if (LIST_EMPTY(&assertType->activeTimed) ) {
-        LIST_INSERT_HEAD(&assertType->activeTimed, assertion, link);
-    }
-    else {
-        LIST_FOREACH(a, &assertType->activeTimed, link) 
-        {
-            prev = a;
-            if (a->timeout > assertion->timeout)
-                break;
-        }
-        if (a)
-            LIST_INSERT_BEFORE(a, assertion, link);
-        else
-            LIST_INSERT_AFTER(prev, assertion, link);
-    }
-
+/* Inserts assertion into activeTimed list, sorted by timeout */
+static void insertByTimeout(assertion_t *assertion, assertionType_t *assertType)
+{
+    updateTimeoutProps(assertion);
+    linkByTimeout(assertion, assertType);
 }
 
 void insertTimedAssertion(assertion_t *assertion, assertionType_t *assertType, bool updateTimer)
@@ -2419,12 +2660,7 @@ void insertTimedAssertion(assertion_t *assertion, assertionType_t *assertType, b
     insertByTimeout(assertion, assertType);
 
     assertion->state |= kAssertionStateTimed;
-    if ( (assertType->flags & kAssertionTypeNotValidOnBatt) &&
-         (assertion->state & kAssertionStateValidOnBatt) )
-        assertType->validOnBattCount++;
-
-    if (assertion->state & kAssertionLidStateModifier)
-        assertType->lidSleepCount++;
+    countActiveAssertion(assertion, assertType, true);
 
     updateAppStats(assertion, kAssertionOpRaise);
     schedDisableAppSleep( assertion );
@@ -2639,14 +2875,12 @@ static void forwardPropertiesToAssertion(const void *key, const void *value, voi
         if ((assertType->flags & kAssertionTypeNotValidOnBatt) == 0) return;
         if ((value == kCFBooleanTrue) && !(assertion->state & kAssertionStateValidOnBatt))
         {
-            assertType->validOnBattCount++;
-            assertion->state |= kAssertionStateValidOnBatt;
+            setCountedState(assertion, assertType, kAssertionStateValidOnBatt, true);
             assertion->mods |= kAssertionModPowerConstraint;
         }
         else if ((value == kCFBooleanFalse) && (assertion->state & kAssertionStateValidOnBatt) )
         {
-            if (assertType->validOnBattCount) assertType->validOnBattCount--;
-            assertion->state &= ~kAssertionStateValidOnBatt;
+            setCountedState(assertion, assertType, kAssertionStateValidOnBatt, false);
             assertion->mods |= kAssertionModPowerConstraint;
         }
 
@@ -2654,13 +2888,11 @@ static void forwardPropertiesToAssertion(const void *key, const void *value, voi
     else if ( (assertion->kassert == kDeclareUserActivityType) && CFEqual(key, kIOPMAssertionAppliesOnLidClose)) {
         if (!isA_CFBoolean(value)) return;
         if ((value == kCFBooleanTrue) && !(assertion->state & kAssertionLidStateModifier)) {
-            assertType->lidSleepCount++;
-            assertion->state |= kAssertionLidStateModifier;
+            setCountedState(assertion, assertType, kAssertionLidStateModifier, true);
             assertion->mods |= kAssertionModLidState;
         }
         else if((value == kCFBooleanFalse) && (assertion->state & kAssertionLidStateModifier)) {
-            if (assertType->lidSleepCount) assertType->lidSleepCount--;
-            assertion->state &= ~kAssertionLidStateModifier;
+            setCountedState(assertion, assertType, kAssertionLidStateModifier, false);
             assertion->mods |= kAssertionModLidState;
         }
     }
@@ -2694,6 +2926,7 @@ static IOReturn doSetProperties(pid_t pid,
     }
 
     assertion->mods = 0;
+    assertion->declHash = 0;    // Properties may no longer match the last declaration
     assertType = &gAssertionTypes[assertion->kassert];
     oldState = assertion->state;
     CFDictionaryApplyFunction(inProps, forwardPropertiesToAssertion,
@@ -2791,6 +3024,32 @@ static IOReturn doSetProperties(pid_t pid,
     return kIOReturnSuccess;    
 }
 
+/*
+ * Active assertions of a type, from its counts. A type that's temporarily
+ * disabled while it changes effect has none.
+ */
+static inline bool typeHasActives(assertionType_t *assertType)
+{
+    if (assertType->flags & kAssertionTypeDisabled)
+        return false;
+
+    if ( (assertType->flags & kAssertionTypeNotValidOnBatt) && ( _getPowerSource() == kBatteryPowered) )
+        return (assertType->validOnBattCount > 0);
+
+    return (assertType->activeCnt > 0);
+}
+
+static inline bool effectHasActives(assertionEffect_t *effect)
+{
+    if (effect->activeCnt)
+        return true;
+
+    if (_getPowerSource() == kBatteryPowered)
+        return (effect->validOnBattCnt > 0);
+
+    return (effect->battRestrictedCnt > 0);
+}
+
 /*
  * Check for active assertions of the specified type and also for active
  * assertions of linked types.
@@ -2799,39 +3058,20 @@ static IOReturn doSetProperties(pid_t pid,
  */
 bool checkForActives(assertionType_t *assertType, bool *existsInThisType )
 {
-    bool                typeActive = false;
-    bool                effectActive = false;
-    assertionType_t     *type = NULL;
-    assertionEffect_t   *effect = NULL;
+#ifdef DEBUG
+    if (!assertionCountsAreConsistent())
+        abort();
+#endif
 
-    if (existsInThisType) 
+    if (existsInThisType)
         *existsInThisType = false;
     if (assertType->effectIdx == kNoEffect)
         return false;
 
-    effect = &gAssertionEffects[assertType->effectIdx];
-
-    LIST_FOREACH(type, &effect->assertTypes, link) {
-
-        /* 
-         * Check for active assertions in this assertionType's 'active' & 'activeTimed' lists 
-         */
-        if ( (type->flags & kAssertionTypeNotValidOnBatt) && ( _getPowerSource() == kBatteryPowered) )
-            typeActive = (type->validOnBattCount > 0);
-        else
-            typeActive = (LIST_FIRST(&type->active) || LIST_FIRST(&type->activeTimed));
-
-        effectActive |= typeActive; 
-        if (existsInThisType && (type == assertType) && typeActive) { 
-            *existsInThisType = true;
-            return true;
-        }
-        if (typeActive && !existsInThisType) 
-            return true;
-
-    }
+    if (existsInThisType)
+        *existsInThisType = typeHasActives(assertType);
 
-    return effectActive;
+    return effectHasActives(&gAssertionEffects[assertType->effectIdx]);
 }
 
 /*
@@ -2865,12 +3105,73 @@ __private_extern__ bool checkForActivesByType(kerAssertionType type)
  */
 __private_extern__ bool checkForEntriesByType(kerAssertionType type)
 {
-    assertionType_t *assertType = &gAssertionTypes[type];
+    return (gAssertionTypes[type].activeCnt > 0);
+}
 
-    if (LIST_FIRST(&assertType->active) || LIST_FIRST(&assertType->activeTimed))
-        return true;
+/*
+ * Recounts the active lists of every type, by effect, and compares them
+ * with the kept counts. Logs each difference and returns false if there
+ * are any.
+ */
+__private_extern__ bool assertionCountsAreConsistent(void)
+{
+    assertionEffect_t   *effect;
+    assertionType_t     *type;
+    assertion_t         *assertion;
+    assertion_t         *lists[2];
+    uint32_t            active, validOnBatt, lid, uncounted;
+    uint32_t            effActive, effRestricted, effValidOnBatt;
+    bool                consistent = true;
+    int                 e, l;
+
+    for (e = 0; e < kMaxAssertionEffects; e++)
+    {
+        effect = &gAssertionEffects[e];
+        effActive = effRestricted = effValidOnBatt = 0;
 
-    return false;
+        LIST_FOREACH(type, &effect->assertTypes, link)
+        {
+            active = validOnBatt = lid = uncounted = 0;
+            lists[0] = LIST_FIRST(&type->active);
+            lists[1] = LIST_FIRST(&type->activeTimed);
+            for (l = 0; l < 2; l++) {
+                for (assertion = lists[l]; assertion; assertion = LIST_NEXT(assertion, link)) {
+                    active++;
+                    if (assertion->state & kAssertionStateValidOnBatt) validOnBatt++;
+                    if (assertion->state & kAssertionLidStateModifier) lid++;
+                    if (!(assertion->state & kAssertionStateCounted)) uncounted++;
+                }
+            }
+
+            if ((active != type->activeCnt) || (validOnBatt != type->validOnBattCount)
+                || (lid != type->lidSleepCount) || uncounted) {
+                asl_log(NULL, NULL, ASL_LEVEL_ERR,
+                        "Assertion type %d counts %u active, %u valid on battery, %u lid; lists have %u, %u, %u (%u uncounted)\n",
+                        type->kassert, type->activeCnt, type->validOnBattCount, type->lidSleepCount,
+                        active, validOnBatt, lid, uncounted);
+                consistent = false;
+            }
+
+            if (type->flags & kAssertionTypeNotValidOnBatt) {
+                effRestricted += active;
+                effValidOnBatt += validOnBatt;
+            }
+            else {
+                effActive += active;
+            }
+        }
+
+        if ((effActive != effect->activeCnt) || (effRestricted != effect->battRestrictedCnt)
+            || (effValidOnBatt != effect->validOnBattCnt)) {
+            asl_log(NULL, NULL, ASL_LEVEL_ERR,
+                    "Assertion effect %d counts %u active, %u restricted, %u valid on battery; lists have %u, %u, %u\n",
+                    e, effect->activeCnt, effect->battRestrictedCnt, effect->validOnBattCnt,
+                    effActive, effRestricted, effValidOnBatt);
+            consistent = false;
+        }
+    }
+
+    return consistent;
 }
 
 /* Disable the specified assertion type */
@@ -3312,6 +3613,7 @@ void enforceAssertionTypeTimeCap(assertionType_t *assertType)
     {
         LIST_REMOVE(assertion, link);
         assertion->state &= ~kAssertionStateTimed;
+        countActiveAssertion(assertion, assertType, false);
 
         updateAppStats(assertion, kAssertionOpRelease);
         schedEnableAppSleep( assertion );
@@ -3592,6 +3894,9 @@ static void copyAssertion(assertion_t *assertion, CFMutableDictionaryRef asserti
     if (assertion->kassert < kIOPMNumAssertionTypes) {
         CFDictionarySetValue(assertion->props, kIOPMAssertionTrueTypeKey, assertion_types_arr[assertion->kassert]);
     }
+    if (assertion->state & kAssertionTimeoutPropsStale) {
+        updateTimeoutProps(assertion);
+    }
 
     CFArrayAppendValue(pidAssertionsArr, assertion->props);
     CFRelease(pidCF);
@@ -3646,6 +3951,91 @@ static CFArrayRef copyPIDAssertionDictionaryFlattened(void)
     return returnArray;
 }
 
+static const char *snapshotString(CFStringRef str, char *buf, size_t len)
+{
+    const char  *ptr;
+    CFIndex     used = 0;
+
+    if (!isA_CFString(str) || !len) {
+        return NULL;
+    }
+    if ((ptr = CFStringGetCStringPtr(str, kCFStringEncodingUTF8))) {
+        return ptr;
+    }
+    // Truncates to whole characters when the string doesn't fit
+    CFStringGetBytes(str, CFRangeMake(0, CFStringGetLength(str)), kCFStringEncodingUTF8,
+                     '?', false, (UInt8 *)buf, len - 1, &used);
+    buf[used] = '\0';
+    return buf;
+}
+
+/*
+ * The assertions kIOPMAssertionMIGCopyAll returns, as a columnar snapshot
+ * in one vm_allocate'd buffer. Monotonic create and timeout times are
+ * converted to seconds since 1970.
+ */
+static IOReturn copyAssertionsColumnar(vm_offset_t *snapshot, mach_msg_type_number_t *snapshotCnt)
+{
+    PMAssertionSnapshotBuilder  *builder;
+    __block bool                added = true;
+    int64_t                     now = time(NULL);
+    uint64_t                    monoNow = getMonotonicTime();
+    vm_address_t                buf = 0;
+    size_t                      size;
+    int                         i;
+
+    *snapshot = 0;
+    *snapshotCnt = 0;
+    if (!(builder = PMAssertionSnapshotBuilderCreate())) {
+        return kIOReturnNoMemory;
+    }
+
+    for (i = 0; i < kIOPMNumAssertionTypes; i++)
+    {
+        if (i == kEnableIdleType) continue;
+        applyToAllAssertionsSync(&gAssertionTypes[i], false, ^(assertion_t *assertion)
+        {
+            PMAssertionSnapshotEntry    entry;
+            char                        type[64], name[128], process[64];
+
+            if (!added) return;
+            bzero(&entry, sizeof(entry));
+            entry.createTime = now - (int64_t)(monoNow - assertion->createTime);
+            if (assertion->timeout) {
+                entry.timeout = now + ((int64_t)assertion->timeout - (int64_t)monoNow);
+            }
+            entry.pid = assertion->pinfo->pid;
+            entry.assertionID = assertion->assertionId;
+            entry.level = (assertion->state & kAssertionStateInactive) ? kIOPMAssertionLevelOff : kIOPMAssertionLevelOn;
+            if (assertion->state & kAssertionStateTimed)            entry.flags |= kPMAssertionSnapshotTimed;
+            if (assertion->state & kAssertionStateInactive)         entry.flags |= kPMAssertionSnapshotInactive;
+            if (assertion->state & kAssertionStateValidOnBatt)      entry.flags |= kPMAssertionSnapshotValidOnBattery;
+            if (assertion->state & kAssertionLidStateModifier)      entry.flags |= kPMAssertionSnapshotAppliesOnLidClose;
+            if (assertion->state & kAssertionTimeoutIsSystemTimer)  entry.flags |= kPMAssertionSnapshotTimeoutIsSystemTimer;
+            entry.type = snapshotString(assertion_types_arr[assertion->kassert], type, sizeof(type));
+            entry.name = snapshotString(CFDictionaryGetValue(assertion->props, kIOPMAssertionNameKey),
+                                        name, sizeof(name));
+            entry.process = snapshotString(assertion->pinfo->name, process, sizeof(process));
+            added = PMAssertionSnapshotBuilderAdd(builder, &entry);
+        });
+    }
+
+    size = PMAssertionSnapshotBuilderSize(builder);
+    if (!added || (size > UINT32_MAX)
+        || (vm_allocate(mach_task_self(), &buf, size, TRUE) != KERN_SUCCESS))
+    {
+        PMAssertionSnapshotBuilderRelease(builder);
+        return kIOReturnNoMemory;
+    }
+
+    PMAssertionSnapshotBuilderWrite(builder, now, (void *)buf, size);
+    PMAssertionSnapshotBuilderRelease(builder);
+
+    *snapshot = buf;
+    *snapshotCnt = (mach_msg_type_number_t)size;
+    return kIOReturnSuccess;
+}
+
 static IOReturn copyAssertionForID(
                                    pid_t inPID, int inID,
                                    CFMutableDictionaryRef  *outAssertion)
@@ -3664,6 +4054,9 @@ static IOReturn copyAssertionForID(
         goto exit;
     }
 
+    if (assertion->state & kAssertionTimeoutPropsStale) {
+        updateTimeoutProps(assertion);
+    }
     CFRetain(assertion->props);
     *outAssertion = assertion->props;
 
@@ -3898,7 +4291,10 @@ static void   evaluateAssertions(void)
     static int  prevPwrSrc = -1;
     assertionType_t    *assertType;
 
+    PMTRACE_SCOPE(kPMTraceEvaluateAssertions, 0);
+
     pwrSrc = _getPowerSource();
+    PMTRACE_PAYLOAD(pwrSrc);
     if (pwrSrc == prevPwrSrc)
         return; // If power source hasn't changed, there is nothing to do
 
@@ -3912,25 +4308,29 @@ static void   evaluateAssertions(void)
         }
     }
 
-    // re-configure assertions that change with power source 
-    configAssertionType(kBackgroundTaskType, false);
-    configAssertionType(kNetworkAccessType, false);
-    configAssertionType(kInteractivePushServiceType, false);
+    // re-configure assertion types whose policy changes with power source;
+    // the others find their policy unchanged and return at once
+    for (i=0; i < kIOPMNumAssertionTypes; i++)
+        configAssertionType(i, false);
 
     /* Timeout for Interactive push assertions changes with power source change */
     evalAllInteractivePushAssertions( );
     cancelPowerNapStates( );
 
-    for (i=0; i < kIOPMNumAssertionTypes; i++)
+    // Update only the stats that change, and skip the walk unless stats are kept
+    for (i=0; gActivityAggCnt && (i < kIOPMNumAssertionTypes); i++)
     {
         assertType = &gAssertionTypes[i];
         if (assertType->flags & kAssertionTypeNotValidOnBatt) {
             applyToAllAssertionsSync(assertType, false, ^(assertion_t *assertion)
             {
-                if ((pwrSrc == kBatteryPowered) && !(assertion->state & kAssertionStateValidOnBatt)) {
-                    updateAppStats(assertion, kAssertionOpRelease);
+                if (pwrSrc == kBatteryPowered) {
+                    if ((assertion->state & (kAssertionStateValidOnBatt | kAssertionStateAddsToProcStats))
+                            == kAssertionStateAddsToProcStats) {
+                        updateAppStats(assertion, kAssertionOpRelease);
+                    }
                 }
-                else if (pwrSrc != kBatteryPowered) {
+                else if (!(assertion->state & kAssertionStateAddsToProcStats)) {
                     updateAppStats(assertion, kAssertionOpRaise);
                 }
             });
@@ -3966,306 +4366,219 @@ static void configAssertionEffect(kerAssertionEffect idx)
 }
 
 
-__private_extern__ void configAssertionType(kerAssertionType idx, bool initialConfig)
-{
-    assertionHandler_f   oldHandler = NULL;
-    CFNumberRef idxRef = NULL;
-    uint32_t    oldFlags, flags;
-    static bool prevBTdisable = false;
-    kerAssertionType  altIdx;
-    assertionType_t *assertType;
-    kerAssertionEffect  prevEffect, newEffect;
-
-    // This can get called before gUserAssertionTypesDict is initialized
-    if ( !gUserAssertionTypesDict )
-        return;
-
-    assertType = &gAssertionTypes[idx];
-    if (!initialConfig) {
-        oldHandler = assertType->handler;
-        oldFlags = assertType->flags;
-        prevEffect = assertType->effectIdx;
-    }
-
-    assertType->kassert = idx;
-    switch(idx) 
-    {
-    case kHighPerfType:
-        idxRef = CFNumberCreate(0, kCFNumberIntType, &idx);
-        CFDictionarySetValue(gUserAssertionTypesDict, kIOPMAssertionTypeNeedsCPU, idxRef);
-        assertType->handler = modifySettings;
-        newEffect = kHighPerfEffect;
-        break;
-
-    case kPreventIdleType:
-        idxRef = CFNumberCreate(0, kCFNumberIntType, &idx);
-        CFDictionarySetValue(gUserAssertionTypesDict, kIOPMAssertionTypePreventUserIdleSystemSleep, idxRef);
-        CFDictionarySetValue(gUserAssertionTypesDict, kIOPMAssertionTypeNoIdleSleep, idxRef);
-        assertType->handler = modifySettings;
-
-        newEffect = kPrevIdleSlpEffect;
-        assertType->flags |= kAssertionTypePreventAppSleep;
-        break;
-
-    case kDisableInflowType:
-        idxRef = CFNumberCreate(0, kCFNumberIntType, &idx);
-        CFDictionarySetValue(gUserAssertionTypesDict, kIOPMAssertionTypeDisableInflow, idxRef);
-        assertType->handler = handleBatteryAssertions;
-        newEffect = kDisableInflowEffect;
-        break;
-
-
-    case kInhibitChargeType:
-        idxRef = CFNumberCreate(0, kCFNumberIntType, &idx);
-        CFDictionarySetValue(gUserAssertionTypesDict, kIOPMAssertionTypeInhibitCharging, idxRef);
-        assertType->handler = handleBatteryAssertions;
-        newEffect = kInhibitChargeEffect;
-        break;
-
-    case kDisableWarningsType:
-        idxRef = CFNumberCreate(0, kCFNumberIntType, &idx);
-        CFDictionarySetValue(gUserAssertionTypesDict, kIOPMAssertionTypeDisableLowBatteryWarnings, idxRef);
-        assertType->handler = handleBatteryAssertions;
-        newEffect = kDisableWarningsEffect;
-        break;
-
-    case kPreventDisplaySleepType:
-        idxRef = CFNumberCreate(0, kCFNumberIntType, &idx);
-        CFDictionarySetValue(gUserAssertionTypesDict, kIOPMAssertionTypePreventUserIdleDisplaySleep, idxRef);
-        CFDictionarySetValue(gUserAssertionTypesDict, kIOPMAssertionTypeNoDisplaySleep, idxRef);
-        assertType->handler = setKernelAssertions;
-
-        assertType->flags |= kAssertionTypePreventAppSleep | kAssertionTypeLogOnCreate;
-        newEffect = kPrevDisplaySlpEffect;
-        break;
-
-    case kEnableIdleType:
-        idxRef = CFNumberCreate(0, kCFNumberIntType, &idx);
-        CFDictionarySetValue(gUserAssertionTypesDict, kIOPMAssertionTypeEnableIdleSleep, idxRef);
-        assertType->handler = enableIdleHandler;
-        newEffect = kEnableIdleEffect;
-        break;
-
-    case kPreventSleepType:
-        idxRef = CFNumberCreate(0, kCFNumberIntType, &idx);
-        CFDictionarySetValue(gUserAssertionTypesDict, kIOPMAssertionTypePreventSystemSleep, idxRef);
-        CFDictionarySetValue(gUserAssertionTypesDict, kIOPMAssertionTypeDenySystemSleep, idxRef);
-        assertType->flags |= kAssertionTypeNotValidOnBatt | kAssertionTypePreventAppSleep 
-            | kAssertionTypeLogOnCreate;
-        assertType->handler = setKernelAssertions;
-
-        newEffect = kPrevDemandSlpEffect;
-        break;
-
-    case kSRPreventSleepType:
-        idxRef = CFNumberCreate(0, kCFNumberIntType, &idx);
-        CFDictionarySetValue(gUserAssertionTypesDict, kIOPMAssertInternalPreventSleep, idxRef);
-        CFDictionarySetValue(gUserAssertionTypesDict, kIOPMAssertMaintenanceActivity, idxRef);
-        assertType->flags |= kAssertionTypeNotValidOnBatt | kAssertionTypePreventAppSleep | kAssertionTypeLogOnCreate;
-        assertType->handler = setKernelAssertions;
-
-        newEffect = kPrevDemandSlpEffect;
-
-        break;
-
-    case kPreventDiskSleepType:
-        idxRef = CFNumberCreate(0, kCFNumberIntType, &idx);
-        CFDictionarySetValue(gUserAssertionTypesDict, kIOPMAssertPreventDiskIdle, idxRef);
-        assertType->handler = modifySettings;
-        newEffect = kPreventDiskSleepEffect;
-        break;
-
-    case kExternalMediaType:
-        idxRef = CFNumberCreate(0, kCFNumberIntType, &idx);
-        CFDictionarySetValue(gUserAssertionTypesDict, _kIOPMAssertionTypeExternalMedia, idxRef);
-        assertType->handler = setKernelAssertions;
-        newEffect = kExternalMediaEffect;
-        break;
-
-    case kDeclareUserActivityType:
-        idxRef = CFNumberCreate(0, kCFNumberIntType, &idx);
-        CFDictionarySetValue(gUserAssertionTypesDict, kIOPMAssertionUserIsActive, idxRef);
-        assertType->handler = setKernelAssertions;
-
-        assertType->flags |= kAssertionTypePreventAppSleep | kAssertionTypeLogOnCreate;
-        newEffect = kPrevDisplaySlpEffect;
-        break;
-
-    case kDeclareSystemActivityType:
-        idxRef = CFNumberCreate(0, kCFNumberIntType, &idx);
-        CFDictionarySetValue(gUserAssertionTypesDict, kIOPMAssertionTypeSystemIsActive, idxRef);
-        assertType->handler = modifySettings;
-
-        newEffect = kPrevIdleSlpEffect;
-        assertType->flags |= kAssertionTypePreventAppSleep | kAssertionTypeLogOnCreate;
-        break;
-
-    case kPushServiceTaskType:
-        if ( isA_SleepSrvcWake() && _SS_allowed() ) {
-            idxRef = CFNumberCreate(0, kCFNumberIntType, &idx);
-            CFDictionarySetValue(gUserAssertionTypesDict, kIOPMAssertionTypeApplePushServiceTask, idxRef);
-            newEffect = kPrevDemandSlpEffect;
-        }
-        else {
-            /* Set this as an alias to BackgroundTask assertion for non-sleep srvc wakes */
-            altIdx = kBackgroundTaskType;
-            idxRef = CFNumberCreate(0, kCFNumberIntType, &altIdx);
-            CFDictionarySetValue(gUserAssertionTypesDict, kIOPMAssertionTypeApplePushServiceTask, idxRef);
-            newEffect = kNoEffect;
-        }
-        assertType->flags |= kAssertionTypeGloballyTimed | kAssertionTypePreventAppSleep;
-        assertType->handler = setKernelAssertions;
-
-
-        break;
-
-    case kBackgroundTaskType:
-        idxRef = CFNumberCreate(0, kCFNumberIntType, &idx);
-        CFDictionarySetValue(gUserAssertionTypesDict, kIOPMAssertionTypeBackgroundTask, idxRef);
-        assertType->flags |= kAssertionTypeNotValidOnBatt | kAssertionTypePreventAppSleep;
-        if (_DWBT_enabled()) {
-            assertType->handler = setKernelAssertions;
-
-            if ( !isA_BTMtnceWake() ) {
-                if (!prevBTdisable) {
-                    assertType->disableCnt++;
-                    prevBTdisable = true;
-                }
-            }
-            else if (prevBTdisable)  {
-                if (assertType->disableCnt) 
-                    assertType->disableCnt--;
-                prevBTdisable = false;
-            }
-            newEffect = kPrevDemandSlpEffect;
-        }
-        else  {
-            assertType->handler = modifySettings;
-            newEffect = kPrevIdleSlpEffect;
-            if (prevBTdisable) {
-                if (assertType->disableCnt) 
-                    assertType->disableCnt--;
-                prevBTdisable = false;
-            }
-        }
-
-        break;
+/*
+ * Assertion type policy.
+ *
+ * What an assertion type does (the type its name resolves to, its handler,
+ * flags and effect) depends only on a few bits of environment: the power
+ * source, whether this is a sleep services wake, and whether PowerNap
+ * background tasks and TCP keep alives are on. gAssertionPolicy lists each
+ * type's choices as rows, tried in order; the first row whose masked
+ * environment bits match applies, and a row with no mask always matches.
+ *
+ * configAssertionType() re-applies a type only when its row or effect
+ * changes, so an environment change touches just the types depending on it.
+ */
+enum {
+    kPolicyEnvOnAC              = 0x01,
+    kPolicyEnvSleepSrvcWake     = 0x02,     /* In a sleep services window, and they're allowed */
+    kPolicyEnvDWBT              = 0x04,     /* DarkWake background tasks are enabled */
+    kPolicyEnvKeepAlive         = 0x08      /* TCP keep alives are active */
+};
 
-    case kTicklessDisplayWakeType:
+#define kMaxPolicyRows          3
+#define kPolicyNoName           kIOPMNumAssertionTypes  /* The type's name isn't registered */
+
+typedef struct {
+    uint32_t            envMask;
+    uint32_t            envValue;
+    kerAssertionType    nameIdx;        /* Type the assertion type's name resolves to */
+    assertionHandler_f  handler;
+    uint32_t            flags;
+    kerAssertionEffect  effect;
+} assertionPolicy_t;
+
+#define kAppSleepLogged         (kAssertionTypePreventAppSleep | kAssertionTypeLogOnCreate)
+
+static const assertionPolicy_t gAssertionPolicy[kIOPMNumAssertionTypes][kMaxPolicyRows] = {
+    [kHighPerfType] = {
+        { 0, 0, kHighPerfType, modifySettings, 0, kHighPerfEffect } },
+    [kPreventIdleType] = {
+        { 0, 0, kPreventIdleType, modifySettings, kAssertionTypePreventAppSleep, kPrevIdleSlpEffect } },
+    [kDisableInflowType] = {
+        { 0, 0, kDisableInflowType, handleBatteryAssertions, 0, kDisableInflowEffect } },
+    [kInhibitChargeType] = {
+        { 0, 0, kInhibitChargeType, handleBatteryAssertions, 0, kInhibitChargeEffect } },
+    [kDisableWarningsType] = {
+        { 0, 0, kDisableWarningsType, handleBatteryAssertions, 0, kDisableWarningsEffect } },
+    [kPreventDisplaySleepType] = {
+        { 0, 0, kPreventDisplaySleepType, setKernelAssertions, kAppSleepLogged, kPrevDisplaySlpEffect } },
+    [kEnableIdleType] = {
+        { 0, 0, kEnableIdleType, enableIdleHandler, 0, kEnableIdleEffect } },
+    [kPreventSleepType] = {
+        { 0, 0, kPreventSleepType, setKernelAssertions,
+            kAssertionTypeNotValidOnBatt | kAppSleepLogged, kPrevDemandSlpEffect } },
+    [kExternalMediaType] = {
+        { 0, 0, kExternalMediaType, setKernelAssertions, 0, kExternalMediaEffect } },
+    [kDeclareUserActivityType] = {
+        { 0, 0, kDeclareUserActivityType, setKernelAssertions, kAppSleepLogged, kPrevDisplaySlpEffect } },
+    [kPushServiceTaskType] = {
+        { kPolicyEnvSleepSrvcWake, kPolicyEnvSleepSrvcWake, kPushServiceTaskType, setKernelAssertions,
+            kAssertionTypeGloballyTimed | kAssertionTypePreventAppSleep, kPrevDemandSlpEffect },
+        /* An alias to BackgroundTask outside sleep services wakes */
+        { 0, 0, kBackgroundTaskType, setKernelAssertions,
+            kAssertionTypeGloballyTimed | kAssertionTypePreventAppSleep, kNoEffect } },
+    [kBackgroundTaskType] = {
+        { kPolicyEnvDWBT, kPolicyEnvDWBT, kBackgroundTaskType, setKernelAssertions,
+            kAssertionTypeNotValidOnBatt | kAssertionTypePreventAppSleep, kPrevDemandSlpEffect },
+        { 0, 0, kBackgroundTaskType, modifySettings,
+            kAssertionTypeNotValidOnBatt | kAssertionTypePreventAppSleep, kPrevIdleSlpEffect } },
+    [kDeclareSystemActivityType] = {
+        { 0, 0, kDeclareSystemActivityType, modifySettings, kAppSleepLogged, kPrevIdleSlpEffect } },
+    [kSRPreventSleepType] = {
+        { 0, 0, kSRPreventSleepType, setKernelAssertions,
+            kAssertionTypeNotValidOnBatt | kAppSleepLogged, kPrevDemandSlpEffect } },
+    [kTicklessDisplayWakeType] = {
 #if TCPKEEPALIVE
-        idxRef = CFNumberCreate(0, kCFNumberIntType, &idx);
-        CFDictionarySetValue(gUserAssertionTypesDict, kIOPMAssertDisplayWake, idxRef);
-        assertType->handler = displayWakeHandler;
-        assertType->flags |= kAssertionTypePreventAppSleep | kAssertionTypeLogOnCreate;
-        newEffect = kTicklessDisplayWakeEffect;
-        assertType->entitlement = kIOPMDarkWakeControlEntitlement;
+        { 0, 0, kTicklessDisplayWakeType, displayWakeHandler, kAppSleepLogged, kTicklessDisplayWakeEffect } },
 #else
-        // TicklessDisplayWake is not a valid assertion type.
-        // We are intentionally disabling it.
-        altIdx = kPreventDisplaySleepType;
-        idxRef = CFNumberCreate(0, kCFNumberIntType, &altIdx);
-        newEffect = kNoEffect;
+        /* TicklessDisplayWake is not a valid assertion type; it's intentionally disabled */
+        { 0, 0, kPolicyNoName, NULL, 0, kNoEffect } },
 #endif
-        break;
+    [kPreventDiskSleepType] = {
+        { 0, 0, kPreventDiskSleepType, modifySettings, 0, kPreventDiskSleepEffect } },
+    [kIntPreventDisplaySleepType] = {
+        { 0, 0, kIntPreventDisplaySleepType, setKernelAssertions, kAssertionTypeLogOnCreate, kPrevDisplaySlpEffect } },
+    [kNetworkAccessType] = {
+        { kPolicyEnvOnAC, kPolicyEnvOnAC, kNetworkAccessType, setKernelAssertions, kAppSleepLogged, kPrevDemandSlpEffect },
+        { 0, 0, kNetworkAccessType, modifySettings, kAppSleepLogged, kPrevIdleSlpEffect } },
+    [kInteractivePushServiceType] = {
+#if TCPKEEPALIVE
+        { kPolicyEnvKeepAlive, kPolicyEnvKeepAlive, kInteractivePushServiceType, setKernelAssertions,
+            kAssertionTypePreventAppSleep | kAssertionTypeAutoTimed, kPrevDemandSlpEffect },
+        { kPolicyEnvSleepSrvcWake, kPolicyEnvSleepSrvcWake, kPushServiceTaskType, NULL, 0, kNoEffect },
+        /* Behaves like BackgroundTask when PowerNap is disabled */
+        { 0, 0, kInteractivePushServiceType, modifySettings,
+            kAssertionTypeNotValidOnBatt | kAssertionTypePreventAppSleep | kAssertionTypeAutoTimed,
+            kPrevIdleSlpEffect } },
+#else
+        { kPolicyEnvSleepSrvcWake, kPolicyEnvSleepSrvcWake, kPushServiceTaskType, NULL, 0, kNoEffect },
+        { 0, 0, kBackgroundTaskType, NULL, 0, kNoEffect } },
+#endif
+    [kReservePwrPreventIdleType] = {
+#if TARGET_OS_EMBEDDED
+        { 0, 0, kReservePwrPreventIdleType, modifySettings, kAssertionTypePreventAppSleep, kPrevIdleSlpEffect } },
+#else
+        { 0, 0, kPreventIdleType, modifySettings, kAssertionTypePreventAppSleep, kPrevIdleSlpEffect } },
+#endif
+};
 
-    case kIntPreventDisplaySleepType:
-        idxRef = CFNumberCreate(0, kCFNumberIntType, &idx);
-        CFDictionarySetValue(gUserAssertionTypesDict, kIOPMAssertInternalPreventDisplaySleep, idxRef);
-        CFDictionarySetValue(gUserAssertionTypesDict, kIOPMAssertRequiresDisplayAudio, idxRef);
-        assertType->handler = setKernelAssertions;
-        assertType->flags |= kAssertionTypeLogOnCreate;
+/* The row each type last applied */
+static const assertionPolicy_t      *gAppliedPolicy[kIOPMNumAssertionTypes];
 
-        newEffect = kPrevDisplaySlpEffect;
-        break;
-
-    case kNetworkAccessType:
-        idxRef = CFNumberCreate(0, kCFNumberIntType, &idx);
-        CFDictionarySetValue(gUserAssertionTypesDict, kIOPMAssertNetworkClientActive, idxRef);
-        assertType->flags |= kAssertionTypePreventAppSleep | kAssertionTypeLogOnCreate;
+/*
+ * Reads only the environment bits 'idx' has rows for.
+ */
+static uint32_t policyEnvironment(kerAssertionType idx)
+{
+    uint32_t    mask = 0, env = 0;
+    int         i;
 
-        if (kACPowered == _getPowerSource()) {
-            assertType->handler = setKernelAssertions;
-            newEffect = kPrevDemandSlpEffect;
-        }
-        else {
-            assertType->handler = modifySettings;
-            newEffect = kPrevIdleSlpEffect;
-        }
-        break;
+    for (i = 0; i < kMaxPolicyRows; i++) {
+        mask |= gAssertionPolicy[idx][i].envMask;
+    }
 
-    case kInteractivePushServiceType:
-        newEffect = kNoEffect;
+    if ((mask & kPolicyEnvOnAC) && (kACPowered == _getPowerSource()))
+        env |= kPolicyEnvOnAC;
+    if ((mask & kPolicyEnvSleepSrvcWake) && isA_SleepSrvcWake() && _SS_allowed())
+        env |= kPolicyEnvSleepSrvcWake;
+    if ((mask & kPolicyEnvDWBT) && _DWBT_enabled())
+        env |= kPolicyEnvDWBT;
 #if TCPKEEPALIVE
-        if (getTCPKeepAliveState(NULL, 0) == kActive) {
-            /* If keep alives are allowed */
-            idxRef = CFNumberCreate(0, kCFNumberIntType, &idx);
+    if ((mask & kPolicyEnvKeepAlive) && (getTCPKeepAliveState(NULL, 0) == kActive))
+        env |= kPolicyEnvKeepAlive;
+#endif
+    return env;
+}
 
-            assertType->handler = setKernelAssertions;
-            assertType->flags = kAssertionTypePreventAppSleep | kAssertionTypeAutoTimed;
-            assertType->autoTimeout = getCurrentSleepServiceCapTimeout()/1000;
+static const assertionPolicy_t *policyFor(kerAssertionType idx, uint32_t env)
+{
+    const assertionPolicy_t *row = gAssertionPolicy[idx];
 
-            newEffect = kPrevDemandSlpEffect;
-        }
-        else if ( isA_SleepSrvcWake() && _SS_allowed() ) {
-            /* else if in a sleep service window, set this as an alias to ApplePushServiceTask  */
+    while ((row->envMask) && ((env & row->envMask) != row->envValue)) {
+        row++;
+    }
+    return row;
+}
 
-            altIdx = kPushServiceTaskType;
-            idxRef = CFNumberCreate(0, kCFNumberIntType, &altIdx);
+static void registerAssertionTypeName(CFStringRef name, kerAssertionType idx)
+{
+    CFNumberRef idxRef = CFNumberCreate(0, kCFNumberIntType, &idx);
 
-        }
-        else {
-            /* else make this behave same as BackgroundTask assertion when PowerNap is disabled */
-            idxRef = CFNumberCreate(0, kCFNumberIntType, &idx);
-            assertType->flags = kAssertionTypeNotValidOnBatt | kAssertionTypePreventAppSleep;
-            assertType->flags |= kAssertionTypeAutoTimed;
-            assertType->autoTimeout = getCurrentSleepServiceCapTimeout()/1000;
-            assertType->handler = modifySettings;
+    if (idxRef) {
+        CFDictionarySetValue(gUserAssertionTypesDict, name, idxRef);
+        CFRelease(idxRef);
+    }
+}
 
-            newEffect = kPrevIdleSlpEffect;
+__private_extern__ void configAssertionType(kerAssertionType idx, bool initialConfig)
+{
+    const assertionPolicy_t *policy;
+    assertionHandler_f   oldHandler;
+    uint32_t    oldFlags, flags, env;
+    static bool prevBTdisable = false;
+    bool        BTdisable;
+    assertionType_t *assertType;
+    kerAssertionEffect  prevEffect, newEffect;
+    kerAssertionType    prevNameIdx;
 
+    // This can get called before gUserAssertionTypesDict is initialized
+    if ( !gUserAssertionTypesDict || (idx >= kIOPMNumAssertionTypes) )
+        return;
+
+    assertType = &gAssertionTypes[idx];
+    env = policyEnvironment(idx);
+    policy = policyFor(idx, env);
+
+    if (idx == kBackgroundTaskType) {
+        // With PowerNap on, background tasks only run in maintenance wakes
+        BTdisable = (env & kPolicyEnvDWBT) && !isA_BTMtnceWake();
+        if (BTdisable && !prevBTdisable) {
+            assertType->disableCnt++;
         }
-#else
-        if ( isA_SleepSrvcWake() && _SS_allowed() ) {
-            altIdx = kPushServiceTaskType;
-        }
-        else {
-            altIdx = kBackgroundTaskType;
+        else if (!BTdisable && prevBTdisable && assertType->disableCnt) {
+            assertType->disableCnt--;
         }
+        prevBTdisable = BTdisable;
+    }
 
-        idxRef = CFNumberCreate(0, kCFNumberIntType, &altIdx);
-#endif
-        CFDictionarySetValue(gUserAssertionTypesDict, kIOPMAssertInteractivePushServiceTask, idxRef);
-        assertType->entitlement = kIOPMInteractivePushEntitlement;
-
-        break;
-
-    case kReservePwrPreventIdleType:
-#if TARGET_OS_EMBEDDED
-        idxRef = CFNumberCreate(0, kCFNumberIntType, &idx);
-#else
-        altIdx = kPreventIdleType;
-        idxRef = CFNumberCreate(0, kCFNumberIntType, &altIdx);
-#endif
-        CFDictionarySetValue(gUserAssertionTypesDict, kIOPMAssertAwakeReservePower, idxRef);
-        assertType->flags |= kAssertionTypePreventAppSleep ;
-        assertType->handler = modifySettings;
-        newEffect = kPrevIdleSlpEffect;
-        assertType->entitlement = kIOPMReservePwrCtrlEntitlement;
-
-        break;
-
+    if (policy->flags & kAssertionTypeAutoTimed) {
+        assertType->autoTimeout = getCurrentSleepServiceCapTimeout()/1000;
+    }
 
-    default:
+    newEffect = assertType->disableCnt ? kNoEffect : policy->effect;
+    if (!initialConfig && (policy == gAppliedPolicy[idx]) && (newEffect == assertType->effectIdx)) {
         return;
     }
-    if (idxRef)
-        CFRelease(idxRef);
-
 
-    if (assertType->disableCnt) {
-        newEffect = kNoEffect;
+    prevNameIdx = gAppliedPolicy[idx] ? gAppliedPolicy[idx]->nameIdx : kPolicyNoName;
+    gAppliedPolicy[idx] = policy;
+    if ((policy->nameIdx != prevNameIdx) && (policy->nameIdx != kPolicyNoName)) {
+        registerAssertionTypeName(assertion_types_arr[idx], policy->nameIdx);
     }
 
+    oldHandler = assertType->handler;
+    oldFlags = assertType->flags;
+    prevEffect = assertType->effectIdx;
+
+    // The type's actives leave its effect's counts until it's reconfigured
+    if (!initialConfig)
+        countTypeInEffect(assertType, -1);
+
+    assertType->kassert = idx;
+    assertType->handler = policy->handler;
+    assertType->flags = policy->flags;
+
     if (initialConfig) {
         assertType->effectIdx = newEffect;
         LIST_INSERT_HEAD(&gAssertionEffects[newEffect].assertTypes, assertType, link);
@@ -4274,8 +4587,10 @@ __private_extern__ void configAssertionType(kerAssertionType idx, bool initialCo
         // Temporarily disable the assertion type and call the old handler.
         flags = assertType->flags;
         LIST_REMOVE(assertType, link);
+        assertType->flags |= kAssertionTypeDisabled;
 
-        oldHandler(assertType, kAssertionOpEval);
+        if (oldHandler)
+            oldHandler(assertType, kAssertionOpEval);
         assertType->flags = flags;
         if (gActivityAggCnt && (prevEffect != newEffect)) {
             applyToAllAssertionsSync(assertType, false, ^(assertion_t *assertion)
@@ -4287,9 +4602,10 @@ __private_extern__ void configAssertionType(kerAssertionType idx, bool initialCo
         assertType->effectIdx = newEffect;
 
         LIST_INSERT_HEAD(&gAssertionEffects[newEffect].assertTypes, assertType, link);
+        countTypeInEffect(assertType, 1);
 
         // Call the new handler
-        if (newEffect != kNoEffect)
+        if ((newEffect != kNoEffect) && assertType->handler)
             assertType->handler(assertType, kAssertionOpEval);
 
         if (gActivityAggCnt && (prevEffect != newEffect)) {
@@ -4300,8 +4616,9 @@ __private_extern__ void configAssertionType(kerAssertionType idx, bool initialCo
         }
 
     }
-    else if (oldFlags != assertType->flags) {
-        if (assertType->handler)
+    else {
+        countTypeInEffect(assertType, 1);
+        if ((oldFlags != assertType->flags) && assertType->handler)
             assertType->handler(assertType, kAssertionOpEval);
     }
 
@@ -4346,6 +4663,20 @@ __private_extern__ void PMAssertions_prime(void)
 
     for (idx = 0; idx < kIOPMNumAssertionTypes; idx++)
         configAssertionType(idx, true);
+    initAggregateStatus();
+
+    // Older and internal names for assertion types
+    registerAssertionTypeName(kIOPMAssertionTypeNoIdleSleep, kPreventIdleType);
+    registerAssertionTypeName(kIOPMAssertionTypeNoDisplaySleep, kPreventDisplaySleepType);
+    registerAssertionTypeName(kIOPMAssertionTypeDenySystemSleep, kPreventSleepType);
+    registerAssertionTypeName(kIOPMAssertMaintenanceActivity, kSRPreventSleepType);
+    registerAssertionTypeName(kIOPMAssertRequiresDisplayAudio, kIntPreventDisplaySleepType);
+
+#if TCPKEEPALIVE
+    gAssertionTypes[kTicklessDisplayWakeType].entitlement = kIOPMDarkWakeControlEntitlement;
+#endif
+    gAssertionTypes[kInteractivePushServiceType].entitlement = kIOPMInteractivePushEntitlement;
+    gAssertionTypes[kReservePwrPreventIdleType].entitlement = kIOPMReservePwrCtrlEntitlement;
 
     getDisplaySleepTimer(&gDisplaySleepTimer); 
     getIdleSleepTimer(&gIdleSleepTimer); 
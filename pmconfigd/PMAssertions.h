@@ -188,6 +188,8 @@ typedef struct {
                                                      // Set only for app sleep preventing assertions
     uint32_t   aggTypes;                             // Aggregate assertion types of this proc. 
                                                      // Set only for app sleep preventing assertions
+    uint32_t   mt2Process;                           // Index in the MT2 aggregator, valid while
+    uint32_t   mt2Epoch;                             // mt2Epoch matches the aggregator's
 #endif
     effectStats_t       stats[kMaxEffectStats]; // Stats per assertion effect
     void                *reportBuf;                  // Stats buffer for IOReporter
@@ -222,6 +224,8 @@ typedef struct assertion {
 
     pid_t           causingPid;         // PID for process on whose behalf this assertion is raised
     ProcessInfo     *causingPinfo;      // Corresponding ProcessInfo struct 
+
+    uint64_t        declHash;           // Hash of the properties of the last user activity declaration
 } assertion_t;
 
 /* State bits for assertion_t structure */
@@ -233,6 +237,8 @@ typedef struct assertion {
 #define kAssertionSkipLogging               0x20  // Avoid logging this assertion, even if type is set to kAssertionTypeLogOnCreate
 #define kAssertionStateLogged               0x40
 #define kAssertionStateAddsToProcStats      0x80
+#define kAssertionStateCounted              0x100 // Assertion is in its type's and effect's active counts
+#define kAssertionTimeoutPropsStale         0x200 // Timeout moved without updating the time left properties
 
 /* Mods bits for assertion_t structure */
 #define kAssertionModTimer              0x1
@@ -252,9 +258,18 @@ typedef enum {
 typedef struct assertionType assertionType_t;
 typedef void (*assertionHandler_f)(assertionType_t *a, assertionOps op);
 
+/*
+ * Active assertion counts are kept per type and per effect as assertions
+ * enter and leave the active lists, so "is anything active" is a read.
+ * An effect counts its types' actives apart by whether the type is valid
+ * on battery power.
+ */
 typedef struct {
     LIST_HEAD(, assertionType)  assertTypes;
     kerAssertionEffect  effectIdx;
+    uint32_t            activeCnt;          /* Actives of types valid on battery */
+    uint32_t            battRestrictedCnt;  /* Actives of kAssertionTypeNotValidOnBatt types */
+    uint32_t            validOnBattCnt;     /* ... of those, the ones with kAssertionStateValidOnBatt */
 } assertionEffect_t;
 
 /* Structure per kernel assertion type */
@@ -282,10 +297,12 @@ struct assertionType {
     uint32_t            disableCnt;     /* Number of active disable requests for this type */
     CFArrayRef          procs;          /* ProcessInfo of processes holding this assertion type */
 
+    uint32_t   activeCnt;               /* Count of assertions in the active and activeTimed lists */
+
     // Fields changed by properties set on assertion. 
     // Not all fields are valid for all assertion types 
-    uint32_t   validOnBattCount;        /* Count of assertions requesting to be active on Battery power */
-    uint32_t   lidSleepCount;           /* Count of assertions changing clamshellSleep state(For kDeclareUserActivityType only) */
+    uint32_t   validOnBattCount;        /* Count of active assertions requesting to be active on Battery power */
+    uint32_t   lidSleepCount;           /* Count of active assertions changing clamshellSleep state(For kDeclareUserActivityType only) */
 } ;
 
 /* Flag bits for assertionType_t structure */
@@ -361,6 +378,7 @@ __private_extern__ void setSleepServicesTimeCap(uint32_t  timeoutInMS);
 __private_extern__ bool systemBlockedInS0Dark( );
 __private_extern__ bool checkForActivesByType(kerAssertionType type);
 __private_extern__ bool checkForEntriesByType(kerAssertionType type);
+__private_extern__ bool assertionCountsAreConsistent(void);
 __private_extern__ void disableAssertionType(kerAssertionType type);
 __private_extern__ void enableAssertionType(kerAssertionType type);
 __private_extern__ void applyToAllAssertionsSync(assertionType_t *assertType, 
@@ -369,7 +387,10 @@ __private_extern__ void configAssertionType(kerAssertionType idx, bool initialCo
 __private_extern__ void logAssertionEvent(assertLogAction assertionAction, assertion_t *assertion);
 __private_extern__ uint8_t getAssertionLevel(kerAssertionType idx);
 __private_extern__ void setAggregateLevel(kerAssertionType idx, uint8_t val);
+__private_extern__ void setAggregateLevels(uint32_t mask, uint32_t bits);
+__private_extern__ uint32_t getAggregateLevelBits(void);
 __private_extern__ uint32_t getKerAssertionBits( );
+__private_extern__ void PMAssertionsGetUserActiveStats(uint32_t *declared, uint32_t *coalesced);
 __private_extern__ void setAssertionActivityLog(int value);
 __private_extern__ void setAssertionActivityAggregate(int value);
 __private_extern__ kern_return_t setReservePwrMode(int enable);
@@ -379,6 +400,7 @@ __private_extern__ void logASLAllAssertions( );
 #if !TARGET_OS_EMBEDDED
 
 __private_extern__ void logASLAssertionTypeSummary( kerAssertionType type);
+__private_extern__ void recordAssertionTypeBlockers(kerAssertionType type);
 
 #endif
 
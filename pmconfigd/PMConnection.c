@@ -53,6 +53,9 @@
 #endif
 #include "PMSettings.h"
 #include "Platform.h"
+#include "WakePlanner.h"
+#include "SleepWakeRecord.h"
+#include "PMTrace.h"
 
 /************************************************************************************/
 
@@ -86,20 +89,15 @@ enum {
     _kOnStateBits = 0xFFFF
 };
 
-/* Array indices & for PMChooseScheduledEvent */
-typedef enum {
-    kChooseFullWake         = 0,
-    kChooseMaintenance      = 1,
-    kChooseSleepServiceWake = 2,
-    kChooseTimerPlugin      = 3,
-    kChooseWakeTypeCount    = 4
-} wakeType_e;
-
 enum {
     kSilentRunningOff = 0,
     kSilentRunningOn  = 1
 };
 
+/* Wakes scheduled at sleep, and wake requests they served beyond the first */
+static uint32_t             gWakesScheduled = 0;
+static uint32_t             gWakeRequestsMerged = 0;
+
 /* Auto Poweroff info */
 static dispatch_source_t   gApoDispatch;
 CFAbsoluteTime              ts_apo = 0; // Time at which system should go for auto power off
@@ -208,7 +206,8 @@ typedef struct {
  * PMScheduleWakeEventChooseBest
  *
  * Expected to be called ONCE at each system sleep by PMConnection.c.
- * Compares maintenance, sleepservice, and autowake requests, and schedules the earliest event with the RTC.
+ * Schedules the first wake that WakePlanCompute() planned for the maintenance,
+ * sleepservice, timer plugin and autowake requests with the RTC.
  */
 static IOReturn createConnectionWithID(
                     PMConnection **);
@@ -1142,6 +1141,9 @@ static void setSystemSleepStateTracking(IOPMCapabilityBits capables)
     if (capablesNum) {
         PMStoreSetValue(key, capablesNum);     
         CFRelease(capablesNum);
+
+        // Callers notify_post(kIOPMSystemPowerStateNotify) right after this
+        PMStoreFlush();
     }
 
     CFRelease(key);
@@ -1332,7 +1334,7 @@ static void logASLMessageSleepServiceBegins(long withCapTime)
     snprintf(strbuf, sizeof(strbuf), "SleepService: window begins with cap time=%ld secs", withCapTime/1000);
     asl_set(m, ASL_KEY_MSG, strbuf);
     
-    asl_send(NULL, m);
+    send_msg_pmset_log(m);
     asl_release(m);
 }
 #endif
@@ -1390,7 +1392,7 @@ __private_extern__ void logASLMessageSleepServiceTerminated(int forcedTimeoutCnt
         asl_set(m, kPMASLSignatureKey, kPMASLSigSleepServiceTimedOut);
     }
     
-    asl_send(NULL, m);
+    send_msg_pmset_log(m);
     asl_release(m);
     
     /* Messages describes the next state - S3, S0Dark, S0
@@ -1717,11 +1719,14 @@ static void handleLastCallMsg(void *messageData)
        checkForActivesByType(kDeclareSystemActivityType) )
     {
         logASLMessageSleepCanceledAtLastCall();
+        cycleRecordCanceledAtLastCall();
 #if !TARGET_OS_EMBEDDED
         /* Log all assertions that could have canceled sleep */
         CFRunLoopPerformBlock(_getPMRunLoop(), kCFRunLoopDefaultMode,
                               ^{ logASLAssertionTypeSummary(kInteractivePushServiceType);
-                              logASLAssertionTypeSummary(kDeclareSystemActivityType);});
+                              logASLAssertionTypeSummary(kDeclareSystemActivityType);
+                              recordAssertionTypeBlockers(kInteractivePushServiceType);
+                              recordAssertionTypeBlockers(kDeclareSystemActivityType);});
         CFRunLoopWakeUp(_getPMRunLoop());
 #endif
 
@@ -1782,6 +1787,8 @@ static void PMConnectionPowerCallBack(
     CFStringRef wakeType = CFSTR("");
 #endif
 
+    PMTRACE_SCOPE(kPMTracePowerCallBack, inMessageType);
+
     if(inMessageType == kIOPMMessageLastCallBeforeSleep)
     {
         handleLastCallMsg(messageData);
@@ -2197,6 +2204,8 @@ static PMResponseWrangler *connectionFireNotification(
     PMResponseWrangler      *responseWrangler = NULL;
     PMResponse              *awaitThis = NULL;
 
+    PMTRACE_SCOPE(kPMTraceFireNotification, interestBitsNotify);
+
     /*
      * If a response wrangler is active, store the new notification on the
      * active wrangler. Then wait for its completion before firing the new
@@ -2532,10 +2541,14 @@ static bool checkResponses_ScheduleWakeEvents(PMResponseWrangler *wrangler)
     int                     chosenReq = -1;
     CFAbsoluteTime          userWake = 0.0; 
     CFAbsoluteTime          earliestWake = kCFAbsoluteTimeIntervalSince1904; // Invalid value
+    CFAbsoluteTime          notBefore;
     wakeType_e              type = kChooseWakeTypeCount; // Invalid value
     CFBooleanRef            scheduleEvent = kCFBooleanFalse;
     bool                    userWakeReq = false, ssWakeReq = false;
     int                     reqCnt = 0;
+    WakeRequest             *reqs = NULL;
+    PlannedWake             *wakes = NULL;
+    int                     wakeCnt = 0;
 
     
 #if 0
@@ -2548,6 +2561,17 @@ static bool checkResponses_ScheduleWakeEvents(PMResponseWrangler *wrangler)
     }
 #endif
     responsesCount = CFArrayGetCount(wrangler->awaitingResponses);    
+
+    // Up to three requests per client, plus the user's AutoWake
+    reqs = calloc(3 * responsesCount + 1, sizeof(WakeRequest));
+    wakes = calloc(3 * responsesCount + 1, sizeof(PlannedWake));
+    if (!reqs || !wakes) {
+        asl_log(NULL, NULL, ASL_LEVEL_ERR, "Can't allocate %ld wake requests\n", 3 * responsesCount + 1);
+        goto exit;
+    }
+
+    // Make sure that wake request is at least 1 min from now
+    notBefore = CFAbsoluteTimeGetCurrent() + 60;
     
     for (i=0; i<responsesCount; i++)
     {
@@ -2574,12 +2598,8 @@ static bool checkResponses_ScheduleWakeEvents(PMResponseWrangler *wrangler)
                                     "Maintenance",
                                     oneResponse->maintenanceRequested,
                                     oneResponse->clientInfoString);
-            if (oneResponse->maintenanceRequested < earliestWake)
-            {
-                earliestWake = oneResponse->maintenanceRequested;
-                type = kChooseMaintenance;
-                chosenReq = reqCnt;
-            }
+            WakeRequestSet(&reqs[reqCnt], kChooseMaintenance, 
+                           oneResponse->maintenanceRequested, notBefore, reqCnt);
             reqCnt++;
         }
 
@@ -2589,13 +2609,8 @@ static bool checkResponses_ScheduleWakeEvents(PMResponseWrangler *wrangler)
                                     "SleepService",
                                     oneResponse->sleepServiceRequested,
                                     oneResponse->clientInfoString);
-
-            if (oneResponse->sleepServiceRequested < earliestWake)
-            {
-                earliestWake = oneResponse->sleepServiceRequested;
-                type = kChooseSleepServiceWake;
-                chosenReq = reqCnt;
-            }
+            WakeRequestSet(&reqs[reqCnt], kChooseSleepServiceWake, 
+                           oneResponse->sleepServiceRequested, notBefore, reqCnt);
             ssWakeReq = true;
             reqCnt++;
         }
@@ -2606,13 +2621,8 @@ static bool checkResponses_ScheduleWakeEvents(PMResponseWrangler *wrangler)
                                     "TimerPlugin",
                                     oneResponse->timerPluginRequested,
                                     oneResponse->clientInfoString);
-
-            if (oneResponse->timerPluginRequested < earliestWake)
-            {
-                earliestWake = oneResponse->timerPluginRequested;
-                type = kChooseTimerPlugin;
-                chosenReq = reqCnt;
-            }
+            WakeRequestSet(&reqs[reqCnt], kChooseTimerPlugin, 
+                           oneResponse->timerPluginRequested, notBefore, reqCnt);
             reqCnt++;
         }
     }
@@ -2624,26 +2634,26 @@ static bool checkResponses_ScheduleWakeEvents(PMResponseWrangler *wrangler)
         goto exit;
     }
 
-    if (earliestWake < (CFAbsoluteTimeGetCurrent()+60)) {
-        // Make sure that wake request is at least 1 min from now
-        earliestWake = (CFAbsoluteTimeGetCurrent()+60);
-    }
     userWake = getEarliestRequestAutoWake();
     if (VALID_DATE(userWake)) {
         m = describeWakeRequest(m, getpid(), "UserWake", userWake, NULL);
-        if (userWake <= earliestWake) {
-            earliestWake = userWake;
-            type = kChooseFullWake;
-            chosenReq = reqCnt;
-            if (earliestWake < (CFAbsoluteTimeGetCurrent()+60)) {
-                // Make sure that wake request is at least 1 min from now
-                earliestWake = (CFAbsoluteTimeGetCurrent()+60);
-            }
-        }
+        WakeRequestSet(&reqs[reqCnt], kChooseFullWake, userWake, notBefore, reqCnt);
         userWakeReq = true;
         reqCnt++;
     }
 
+    // Serve as many requests as their tolerances allow with the first wake;
+    // the rest are requested again at the next sleep.
+    wakeCnt = WakePlanCompute(reqs, reqCnt, wakes);
+    if (wakeCnt > 0) {
+        earliestWake = wakes[0].time;
+        type = wakes[0].type;
+        chosenReq = wakes[0].firstRequest;
+
+        gWakesScheduled++;
+        gWakeRequestsMerged += wakes[0].requestCount - 1;
+    }
+
     if (ts_apo != 0) {
         // Report existence of user wake request or SS request to IOPPF(thru rootDomain)
         // This is used in figuring out if Auto Power Off should be scheduled
@@ -2655,9 +2665,18 @@ static bool checkResponses_ScheduleWakeEvents(PMResponseWrangler *wrangler)
 
     if (m != NULL) {
         char chosenStr[5];
+        char key[50];
+
         snprintf(chosenStr, sizeof(chosenStr), "%d", chosenReq);
         asl_set(m, kPMASLWakeReqChosenIdx, chosenStr);
-        asl_send(NULL, m);
+
+        for (i = 0; i < reqCnt; i++) {
+            if ((reqs[i].wake == 0) && (reqs[i].id != chosenReq)) {
+                snprintf(key, sizeof(key), "%s%d", kPMASLWakeReqMergedPrefix, reqs[i].id);
+                asl_set(m, key, "1");
+            }
+        }
+        send_msg_pmset_log(m);
     }
 
     PMScheduleWakeEventChooseBest(earliestWake, type);
@@ -2667,9 +2686,25 @@ exit:
     if (m != NULL) {
         asl_release(m);
     }
+    if (reqs) {
+        free(reqs);
+    }
+    if (wakes) {
+        free(wakes);
+    }
     return complete;
 }
 
+__private_extern__ void PMConnectionGetWakePlanStats(uint32_t *scheduled, uint32_t *merged)
+{
+    if (scheduled) {
+        *scheduled = gWakesScheduled;
+    }
+    if (merged) {
+        *merged = gWakeRequestsMerged;
+    }
+}
+
 static void checkResponses(PMResponseWrangler *wrangler)
 {
 
@@ -2694,6 +2729,7 @@ static void checkResponses(PMResponseWrangler *wrangler)
     // Handle PowerManagement acknowledgements
     if (wrangler->kernelAcknowledgementID) 
     {
+        cycleRecordClientsAcked();
         IOAllowPowerChange(gRootDomainConnect, wrangler->kernelAcknowledgementID);
     }
     
@@ -65,6 +65,12 @@ __private_extern__ void cancel_NotificationDisplayWake();
 
 __private_extern__ void InternalEvalConnections(void);
 
+/* PMConnectionGetWakePlanStats
+ * Wakes scheduled at sleep since boot, and the wake requests served by
+ * those wakes beyond the one that set their time.
+ */
+__private_extern__ void PMConnectionGetWakePlanStats(uint32_t *scheduled, uint32_t *merged);
+
 #if !TARGET_OS_EMBEDDED
 __private_extern__ int getCurrentSleepServiceCapTimeout();
 #endif
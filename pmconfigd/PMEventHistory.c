@@ -0,0 +1,782 @@
+/*
+ * Copyright (c) 2014 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#include <asl.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "PMEventHistory.h"
+
+#define kLogMagic               0x484d4550      // 'PMEH'
+#define kIndexMagic             0x494d4550      // 'PMEI'
+#define kHistoryVersion         1
+
+// Records longer than this can only be corruption
+#define kMaxRecord              (64 * 1024)
+
+enum {
+    kOldGeneration      = 0,
+    kCurrentGeneration  = 1,
+    kGenerations        = 2
+};
+
+typedef struct {
+    uint32_t                magic;
+    uint32_t                version;
+    uint64_t                reserved;
+} FileHeader;
+
+typedef struct {
+    uint32_t                length;         // of the whole record, padded to 8 bytes
+    uint32_t                checksum;       // of everything after this field
+    int64_t                 time;
+    uint16_t                kind;
+    uint16_t                fieldCount;
+    uint32_t                fieldsLength;
+} RecordHeader;
+
+typedef struct {
+    const char              *uuid;          // in the mapped index
+    CFIndex                 index;
+} UUIDLookup;
+
+typedef struct {
+    const uint8_t           *log;
+    size_t                  logSize;
+    const PMEventIndexEntry *index;
+    CFIndex                 indexCount;
+    void                    *indexMap;
+    size_t                  indexMapSize;
+} Generation;
+
+struct PMEventHistory {
+    bool                    forWriting;
+    char                    *path;
+    char                    *indexPath;
+
+    // Writer
+    pthread_mutex_t         lock;
+    int                     fd;
+    int                     indexFd;
+    off_t                   size;
+    int64_t                 lastTime;
+    char                    uuid[40];
+
+    // Reader
+    Generation              gen[kGenerations];
+
+    // Reader lookups, built on first use
+    bool                    lookupsBuilt;
+    bool                    timeOrdered;
+    CFIndex                 *boots;
+    CFIndex                 bootCount;
+    UUIDLookup              *uuids;
+    CFIndex                 uuidCount;
+};
+
+static uint32_t checksum(const void *buf, size_t len)
+{
+    const uint8_t   *p = (const uint8_t *)buf;
+    uint32_t        sum = 2166136261U;
+
+    // FNV-1a
+    while (len--) {
+        sum = (sum ^ *p++) * 16777619;
+    }
+    return sum;
+}
+
+/*
+ * Returns the record at 'off' in 'size' bytes of log, or NULL if there's
+ * no intact record there.
+ */
+static const RecordHeader *recordAt(const uint8_t *log, size_t size, uint64_t off)
+{
+    const RecordHeader  *rec;
+
+    if (off + sizeof(RecordHeader) > size) {
+        return NULL;
+    }
+    rec = (const RecordHeader *)(log + off);
+    if ((rec->length < sizeof(RecordHeader)) || (rec->length > kMaxRecord)
+        || (rec->length & 7) || (off + rec->length > size)
+        || (sizeof(RecordHeader) + rec->fieldsLength > rec->length)
+        || (rec->checksum != checksum((const uint8_t *)rec + 8, rec->length - 8)))
+    {
+        return NULL;
+    }
+    return rec;
+}
+
+static bool writeAll(int fd, const void *buf, size_t len)
+{
+    const uint8_t   *p = (const uint8_t *)buf;
+    ssize_t         n;
+
+    while (len) {
+        n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static char *pathWithSuffix(const char *path, const char *suffix1, const char *suffix2)
+{
+    char    *p = NULL;
+
+    if (asprintf(&p, "%s%s%s", path, suffix1, suffix2) < 0) {
+        return NULL;
+    }
+    return p;
+}
+
+#pragma mark -
+#pragma mark Writer
+
+static bool resetFile(int fd, uint32_t magic)
+{
+    FileHeader  hdr = { magic, kHistoryVersion, 0 };
+
+    return !ftruncate(fd, 0) && writeAll(fd, &hdr, sizeof(hdr));
+}
+
+static bool validHeader(int fd, uint32_t magic)
+{
+    FileHeader  hdr;
+
+    return (pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr))
+            && (hdr.magic == magic) && (hdr.version == kHistoryVersion);
+}
+
+/*
+ * Checks the records after the last indexed one, and drops a torn tail and
+ * any index entries past it.
+ */
+static bool recoverWriter(PMEventHistory *h)
+{
+    struct stat         logStat, indexStat;
+    PMEventIndexEntry   last;
+    const RecordHeader  *rec;
+    off_t               indexSize;
+    uint64_t            off = sizeof(FileHeader);
+    uint64_t            at = 0;
+    uint8_t             *buf = NULL;
+    size_t              len;
+
+    if (!validHeader(h->fd, kLogMagic)) {
+        h->size = sizeof(FileHeader);
+        h->lastTime = 0;
+        return resetFile(h->fd, kLogMagic) && resetFile(h->indexFd, kIndexMagic);
+    }
+    if (!validHeader(h->indexFd, kIndexMagic) && !resetFile(h->indexFd, kIndexMagic)) {
+        return false;
+    }
+    if (fstat(h->fd, &logStat) || fstat(h->indexFd, &indexStat)) {
+        return false;
+    }
+
+    // Index entries are written after their records; drop any without one
+    indexSize = indexStat.st_size - ((indexStat.st_size - sizeof(FileHeader)) % sizeof(PMEventIndexEntry));
+    while (indexSize > (off_t)sizeof(FileHeader))
+    {
+        if (pread(h->indexFd, &last, sizeof(last), indexSize - sizeof(last)) != sizeof(last)) {
+            return false;
+        }
+        if (last.offset < (uint64_t)logStat.st_size) {
+            off = last.offset;
+            h->lastTime = last.time;
+            strlcpy(h->uuid, last.uuid, sizeof(h->uuid));
+            break;
+        }
+        indexSize -= sizeof(last);
+    }
+    if ((indexSize != indexStat.st_size) && ftruncate(h->indexFd, indexSize)) {
+        return false;
+    }
+
+    len = logStat.st_size - off;
+    if (len && (buf = malloc(len)) && (pread(h->fd, buf, len, off) == (ssize_t)len)) {
+        while ((rec = recordAt(buf, len, at))) {
+            h->lastTime = rec->time;
+            at += rec->length;
+        }
+    }
+    free(buf);
+    off += at;
+
+    if (off != (uint64_t)logStat.st_size) {
+        asl_log(NULL, NULL, ASL_LEVEL_ERR,
+                "PMEventHistory: dropping %lld bytes after the last intact record\n",
+                (long long)(logStat.st_size - off));
+        if (ftruncate(h->fd, off)) {
+            return false;
+        }
+    }
+    h->size = off;
+    return true;
+}
+
+static bool openWriter(PMEventHistory *h)
+{
+    h->fd = open(h->path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    h->indexFd = open(h->indexPath, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if ((h->fd < 0) || (h->indexFd < 0)) {
+        asl_log(NULL, NULL, ASL_LEVEL_ERR, "PMEventHistory: can't open %s (%d)\n", h->path, errno);
+        return false;
+    }
+    return recoverWriter(h);
+}
+
+/*
+ * Moves the current log and index aside as the old generation and starts
+ * a new pair. The index moves first: if the log can't follow, the index is
+ * moved back, so a log is never left paired with another log's index.
+ */
+static bool rotate(PMEventHistory *h)
+{
+    char    *oldPath = pathWithSuffix(h->path, kPMEventHistoryOldSuffix, "");
+    char    *oldIndexPath = pathWithSuffix(h->path, kPMEventHistoryOldSuffix, kPMEventHistoryIndexSuffix);
+    bool    ok = false;
+    int     err = 0;
+
+    if (!oldPath || !oldIndexPath) {
+        err = ENOMEM;
+        goto exit;
+    }
+    if (rename(h->indexPath, oldIndexPath)) {
+        err = errno;
+        goto exit;
+    }
+    if (rename(h->path, oldPath)) {
+        err = errno;
+        if (rename(oldIndexPath, h->indexPath)) {
+            // Drop the index rather than leave it with the old log; the
+            // current log carries on unindexed.
+            unlink(oldIndexPath);
+            close(h->indexFd);
+            h->indexFd = open(h->indexPath, O_RDWR | O_CREAT | O_APPEND | O_TRUNC, 0644);
+            if (h->indexFd >= 0) {
+                (void)resetFile(h->indexFd, kIndexMagic);
+            }
+        }
+        goto exit;
+    }
+
+    close(h->fd);
+    close(h->indexFd);
+    h->fd = open(h->path, O_RDWR | O_CREAT | O_APPEND | O_TRUNC, 0644);
+    h->indexFd = open(h->indexPath, O_RDWR | O_CREAT | O_APPEND | O_TRUNC, 0644);
+    ok = (h->fd >= 0) && (h->indexFd >= 0)
+            && resetFile(h->fd, kLogMagic) && resetFile(h->indexFd, kIndexMagic);
+    err = errno;
+    h->size = sizeof(FileHeader);
+
+exit:
+    if (!ok) {
+        asl_log(NULL, NULL, ASL_LEVEL_ERR, "PMEventHistory: can't rotate %s (%d)\n", h->path, err);
+    }
+    free(oldPath);
+    free(oldIndexPath);
+    return ok;
+}
+
+__private_extern__ bool PMEventHistoryAppend(
+    PMEventHistory      *h,
+    int64_t             time,
+    PMEventKind         kind,
+    uint32_t            value,
+    const char          *uuid,
+    const char * const  *keys,
+    const char * const  *values,
+    int                 count)
+{
+    RecordHeader        rec;
+    PMEventIndexEntry   entry;
+    uint8_t             *buf = NULL;
+    size_t              fieldsLength = 0, len, klen, vlen;
+    uint8_t             *p;
+    bool                newUUID, timeStep;
+    bool                ok = false;
+
+    if (!h || !h->forWriting || (count > UINT16_MAX)) {
+        return false;
+    }
+
+    for (int i = 0; i < count; i++) {
+        fieldsLength += strlen(keys[i]) + 1 + strlen(values[i]) + 1;
+    }
+    len = (sizeof(rec) + fieldsLength + 7) & ~(size_t)7;
+    if (len > kMaxRecord) {
+        return false;
+    }
+    buf = calloc(1, len);
+    if (!buf) {
+        return false;
+    }
+
+    rec.length = (uint32_t)len;
+    rec.time = time;
+    rec.kind = kind;
+    rec.fieldCount = count;
+    rec.fieldsLength = (uint32_t)fieldsLength;
+    p = buf + sizeof(rec);
+    for (int i = 0; i < count; i++) {
+        klen = strlen(keys[i]) + 1;
+        vlen = strlen(values[i]) + 1;
+        memcpy(p, keys[i], klen);
+        memcpy(p + klen, values[i], vlen);
+        p += klen + vlen;
+    }
+    memcpy(buf, &rec, sizeof(rec));
+    rec.checksum = checksum(buf + 8, len - 8);
+    memcpy(buf, &rec, sizeof(rec));
+
+    pthread_mutex_lock(&h->lock);
+
+    if ((h->size + len > kPMEventHistoryMaxSize) && !rotate(h)) {
+        goto exit;
+    }
+
+    // One write() per record, so a crash leaves it whole or detectably torn
+    if (!writeAll(h->fd, buf, len)) {
+        (void)ftruncate(h->fd, h->size);
+        goto exit;
+    }
+
+    newUUID = uuid && strncmp(uuid, h->uuid, sizeof(h->uuid));
+    if (newUUID) {
+        strlcpy(h->uuid, uuid, sizeof(h->uuid));
+    }
+    timeStep = (time < h->lastTime);
+    h->lastTime = time;
+    if (newUUID || timeStep || (kind != kPMEventOther))
+    {
+        bzero(&entry, sizeof(entry));
+        entry.time = time;
+        entry.offset = h->size;
+        entry.kind = kind;
+        entry.flags = (newUUID ? kPMEventIndexNewUUID : 0) | (timeStep ? kPMEventIndexTimeStep : 0);
+        entry.value = value;
+        strlcpy(entry.uuid, h->uuid, sizeof(entry.uuid));
+        if (!writeAll(h->indexFd, &entry, sizeof(entry))) {
+            asl_log(NULL, NULL, ASL_LEVEL_ERR, "PMEventHistory: can't index record (%d)\n", errno);
+        }
+    }
+    h->size += len;
+    ok = true;
+
+exit:
+    pthread_mutex_unlock(&h->lock);
+    free(buf);
+    return ok;
+}
+
+#pragma mark -
+#pragma mark Reader
+
+static void *mapFile(const char *path, size_t *size)
+{
+    struct stat     st;
+    void            *map = NULL;
+    int             fd;
+
+    *size = 0;
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (!fstat(fd, &st) && (st.st_size >= (off_t)sizeof(FileHeader))) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            map = NULL;
+        } else {
+            *size = st.st_size;
+        }
+    }
+    close(fd);
+    return map;
+}
+
+static bool mapGeneration(Generation *g, const char *logPath, const char *indexPath)
+{
+    const FileHeader    *hdr;
+
+    g->log = mapFile(logPath, &g->logSize);
+    hdr = (const FileHeader *)g->log;
+    if (!hdr || (hdr->magic != kLogMagic) || (hdr->version != kHistoryVersion)) {
+        goto fail;
+    }
+
+    g->indexMap = mapFile(indexPath, &g->indexMapSize);
+    hdr = (const FileHeader *)g->indexMap;
+    if (hdr && (hdr->magic == kIndexMagic) && (hdr->version == kHistoryVersion)) {
+        g->index = (const PMEventIndexEntry *)((const uint8_t *)g->indexMap + sizeof(FileHeader));
+        g->indexCount = (g->indexMapSize - sizeof(FileHeader)) / sizeof(PMEventIndexEntry);
+
+        // Entries for records powerd hasn't finished writing
+        while (g->indexCount && (g->index[g->indexCount - 1].offset >= g->logSize)) {
+            g->indexCount--;
+        }
+    }
+    return true;
+
+fail:
+    if (g->log) {
+        munmap((void *)g->log, g->logSize);
+    }
+    bzero(g, sizeof(*g));
+    return false;
+}
+
+static void unmapGeneration(Generation *g)
+{
+    if (g->log) {
+        munmap((void *)g->log, g->logSize);
+    }
+    if (g->indexMap) {
+        munmap(g->indexMap, g->indexMapSize);
+    }
+    bzero(g, sizeof(*g));
+}
+
+static bool openReader(PMEventHistory *h)
+{
+    char    *oldPath = pathWithSuffix(h->path, kPMEventHistoryOldSuffix, "");
+    char    *oldIndexPath = pathWithSuffix(h->path, kPMEventHistoryOldSuffix, kPMEventHistoryIndexSuffix);
+    bool    haveOld = false, haveCurrent;
+
+    if (oldPath && oldIndexPath) {
+        haveOld = mapGeneration(&h->gen[kOldGeneration], oldPath, oldIndexPath);
+    }
+    haveCurrent = mapGeneration(&h->gen[kCurrentGeneration], h->path, h->indexPath);
+
+    free(oldPath);
+    free(oldIndexPath);
+    return haveOld || haveCurrent;
+}
+
+__private_extern__ void PMEventHistoryStart(PMEventHistory *h, PMEventHistoryCursor *cursor)
+{
+    cursor->file = kOldGeneration;
+    cursor->offset = sizeof(FileHeader);
+}
+
+__private_extern__ bool PMEventHistoryNext(
+    PMEventHistory          *h,
+    PMEventHistoryCursor    *cursor,
+    PMEventRecord           *record)
+{
+    const RecordHeader  *rec;
+    Generation          *g;
+
+    while (cursor->file < kGenerations)
+    {
+        g = &h->gen[cursor->file];
+        if (g->log && (rec = recordAt(g->log, g->logSize, cursor->offset)))
+        {
+            record->time = rec->time;
+            record->kind = rec->kind;
+            record->fields = (const char *)rec + sizeof(RecordHeader);
+            record->fieldsEnd = record->fields + rec->fieldsLength;
+            record->position = *cursor;
+            cursor->offset += rec->length;
+            return true;
+        }
+
+        // End of this generation, or a record still being written
+        cursor->file++;
+        cursor->offset = sizeof(FileHeader);
+    }
+    return false;
+}
+
+__private_extern__ bool PMEventRecordNextField(
+    const PMEventRecord     *record,
+    const char              **iter,
+    const char              **key,
+    const char              **value)
+{
+    const char  *p = *iter;
+    size_t      len;
+
+    if (p >= record->fieldsEnd) {
+        return false;
+    }
+    len = strnlen(p, record->fieldsEnd - p);
+    if (p + len >= record->fieldsEnd) {
+        return false;
+    }
+    *key = p;
+    p += len + 1;
+
+    len = strnlen(p, record->fieldsEnd - p);
+    if (p + len >= record->fieldsEnd) {
+        return false;
+    }
+    *value = p;
+    *iter = p + len + 1;
+    return true;
+}
+
+__private_extern__ const char *PMEventRecordGet(const PMEventRecord *record, const char *key)
+{
+    const char  *iter = record->fields;
+    const char  *k, *v;
+
+    while (PMEventRecordNextField(record, &iter, &k, &v)) {
+        if (!strcmp(k, key)) {
+            return v;
+        }
+    }
+    return NULL;
+}
+
+__private_extern__ CFIndex PMEventHistoryIndexCount(PMEventHistory *h)
+{
+    return h->gen[kOldGeneration].indexCount + h->gen[kCurrentGeneration].indexCount;
+}
+
+__private_extern__ const PMEventIndexEntry *PMEventHistoryIndexEntryAt(PMEventHistory *h, CFIndex i)
+{
+    if (i < h->gen[kOldGeneration].indexCount) {
+        return &h->gen[kOldGeneration].index[i];
+    }
+    return &h->gen[kCurrentGeneration].index[i - h->gen[kOldGeneration].indexCount];
+}
+
+__private_extern__ void PMEventHistoryIndexCursor(PMEventHistory *h, CFIndex i, PMEventHistoryCursor *cursor)
+{
+    cursor->file = (i < h->gen[kOldGeneration].indexCount) ? kOldGeneration : kCurrentGeneration;
+    cursor->offset = PMEventHistoryIndexEntryAt(h, i)->offset;
+}
+
+static int compareUUIDLookups(const void *a, const void *b)
+{
+    const UUIDLookup    *x = (const UUIDLookup *)a;
+    const UUIDLookup    *y = (const UUIDLookup *)b;
+    int                 c;
+
+    c = strncasecmp(x->uuid, y->uuid, sizeof(((PMEventIndexEntry *)0)->uuid));
+    if (c) {
+        return c;
+    }
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+/*
+ * One pass over the index for the boot entries, the new UUID entries sorted
+ * by UUID, and whether the entries are in time order.
+ */
+static void buildLookups(PMEventHistory *h)
+{
+    const PMEventIndexEntry *e, *prev = NULL;
+    CFIndex                 count = PMEventHistoryIndexCount(h);
+
+    if (h->lookupsBuilt) {
+        return;
+    }
+    h->lookupsBuilt = true;
+    h->timeOrdered = true;
+    h->boots = calloc(count ? count : 1, sizeof(CFIndex));
+    h->uuids = calloc(count ? count : 1, sizeof(UUIDLookup));
+
+    for (CFIndex i = 0; i < count; i++)
+    {
+        e = PMEventHistoryIndexEntryAt(h, i);
+        if ((e->kind == kPMEventBoot) && h->boots) {
+            h->boots[h->bootCount++] = i;
+        }
+        if ((e->flags & kPMEventIndexNewUUID) && h->uuids) {
+            h->uuids[h->uuidCount].uuid = e->uuid;
+            h->uuids[h->uuidCount].index = i;
+            h->uuidCount++;
+        }
+        if ((e->flags & kPMEventIndexTimeStep) || (prev && (e->time < prev->time))) {
+            h->timeOrdered = false;
+        }
+        prev = e;
+    }
+    if (h->uuids) {
+        qsort(h->uuids, h->uuidCount, sizeof(UUIDLookup), compareUUIDLookups);
+    }
+}
+
+__private_extern__ CFIndex PMEventHistoryIndexFindUUID(PMEventHistory *h, const char *uuid)
+{
+    UUIDLookup  key = { uuid, LONG_MAX };
+    CFIndex     lo = 0, hi, mid;
+
+    buildLookups(h);
+
+    // Past the last entry for 'uuid'; the one before it is the newest cycle
+    hi = h->uuidCount;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (compareUUIDLookups(&h->uuids[mid], &key) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if ((lo > 0) && !strncasecmp(h->uuids[lo - 1].uuid, uuid, sizeof(((PMEventIndexEntry *)0)->uuid))) {
+        return h->uuids[lo - 1].index;
+    }
+    return -1;
+}
+
+__private_extern__ CFIndex PMEventHistoryIndexFindBoot(PMEventHistory *h, int bootsAgo)
+{
+    buildLookups(h);
+
+    if ((bootsAgo < 0) || (bootsAgo >= h->bootCount)) {
+        return -1;
+    }
+    return h->boots[h->bootCount - 1 - bootsAgo];
+}
+
+__private_extern__ CFIndex PMEventHistoryIndexFindPosition(
+    PMEventHistory              *h,
+    const PMEventHistoryCursor  *cursor)
+{
+    CFIndex                 lo = 0, hi = PMEventHistoryIndexCount(h), mid;
+    PMEventHistoryCursor    c;
+
+    // First entry not before 'cursor'
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        PMEventHistoryIndexCursor(h, mid, &c);
+        if ((c.file < cursor->file) || ((c.file == cursor->file) && (c.offset < cursor->offset))) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return (lo < PMEventHistoryIndexCount(h)) ? lo : -1;
+}
+
+__private_extern__ void PMEventHistorySeekTime(PMEventHistory *h, int64_t time, PMEventHistoryCursor *cursor)
+{
+    CFIndex                 lo = 0, hi = PMEventHistoryIndexCount(h), mid;
+    PMEventHistoryCursor    c;
+    PMEventRecord           rec;
+
+    // A binary search only works if the clock never went back
+    buildLookups(h);
+    if (!h->timeOrdered) {
+        hi = 0;
+    }
+
+    // First entry at or after 'time'
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (PMEventHistoryIndexEntryAt(h, mid)->time < time) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    // Then read forward from the entry before it
+    if (lo > 0) {
+        PMEventHistoryIndexCursor(h, lo - 1, cursor);
+    } else {
+        PMEventHistoryStart(h, cursor);
+    }
+    c = *cursor;
+    while (PMEventHistoryNext(h, &c, &rec)) {
+        if (rec.time >= time) {
+            *cursor = rec.position;
+            return;
+        }
+    }
+    *cursor = c;
+}
+
+#pragma mark -
+#pragma mark API
+
+__private_extern__ PMEventHistory *PMEventHistoryOpen(const char *path, bool forWriting)
+{
+    PMEventHistory  *h;
+    bool            ok;
+
+    h = calloc(1, sizeof(PMEventHistory));
+    if (!h) {
+        return NULL;
+    }
+    h->forWriting = forWriting;
+    h->fd = h->indexFd = -1;
+    pthread_mutex_init(&h->lock, NULL);
+
+    h->path = strdup(path);
+    h->indexPath = pathWithSuffix(path, kPMEventHistoryIndexSuffix, "");
+    if (!h->path || !h->indexPath) {
+        PMEventHistoryClose(h);
+        return NULL;
+    }
+
+    ok = forWriting ? openWriter(h) : openReader(h);
+    if (!ok) {
+        PMEventHistoryClose(h);
+        return NULL;
+    }
+    return h;
+}
+
+__private_extern__ void PMEventHistoryClose(PMEventHistory *h)
+{
+    if (!h) {
+        return;
+    }
+
+    if (h->fd >= 0) {
+        close(h->fd);
+    }
+    if (h->indexFd >= 0) {
+        close(h->indexFd);
+    }
+    for (int g = 0; g < kGenerations; g++) {
+        unmapGeneration(&h->gen[g]);
+    }
+    pthread_mutex_destroy(&h->lock);
+    free(h->boots);
+    free(h->uuids);
+    free(h->path);
+    free(h->indexPath);
+    free(h);
+}
@@ -0,0 +1,156 @@
+/*
+ * Copyright (c) 2014 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#ifndef _PMEventHistory_h_
+#define _PMEventHistory_h_
+
+#include <CoreFoundation/CoreFoundation.h>
+
+/*
+ * PMEventHistory is a binary copy of the messages powerd sends to the
+ * 'pmset -g log' ASL facility, which pmset can read without searching the
+ * ASL store.
+ *
+ * powerd appends each message as one checksummed record of key/value
+ * strings. Boots, sleeps, wakes, dark wakes and sleep/wake UUID changes
+ * also get a fixed-size entry in an index file next to the log, giving
+ * their time and record offset. Readers map both files and seek through
+ * the index by UUID, boot or time instead of reading every record. Any
+ * record logged with an earlier time than the one before it, after the
+ * clock was set back, is indexed too, so readers know when the history
+ * isn't in time order.
+ *
+ * When the log would grow past kPMEventHistoryMaxSize, it and its index
+ * are renamed with a kPMEventHistoryOldSuffix suffix and a new pair is
+ * started, so at most two generations are kept. Readers see both as one
+ * history.
+ */
+
+#define kPMEventHistoryPath             "/var/log/powermanagement.history"
+#define kPMEventHistoryIndexSuffix      ".index"
+#define kPMEventHistoryOldSuffix        ".old"
+
+#define kPMEventHistoryMaxSize          (4 * 1024 * 1024)
+
+typedef enum {
+    kPMEventOther       = 0,
+    kPMEventBoot        = 1,
+    kPMEventSleep       = 2,
+    kPMEventWake        = 3,
+    kPMEventDarkWake    = 4
+} PMEventKind;
+
+// PMEventIndexEntry flags
+enum {
+    kPMEventIndexNewUUID    = 0x0001,   // first record with this UUID
+    kPMEventIndexTimeStep   = 0x0002    // earlier than the record before it
+};
+
+typedef struct {
+    int64_t             time;           // seconds since 1970
+    uint64_t            offset;         // of the record in its log file
+    uint16_t            kind;           // PMEventKind
+    uint16_t            flags;
+    uint32_t            value;          // sleep or dark wake count
+    char                uuid[40];       // sleep/wake UUID in effect
+} PMEventIndexEntry;
+
+typedef struct {
+    int                 file;           // 0 for the old generation, 1 for the current
+    uint64_t            offset;
+} PMEventHistoryCursor;
+
+typedef struct {
+    int64_t             time;
+    PMEventKind         kind;
+    const char          *fields;        // "key\0value\0" pairs
+    const char          *fieldsEnd;
+    PMEventHistoryCursor position;
+} PMEventRecord;
+
+typedef struct PMEventHistory PMEventHistory;
+
+/* PMEventHistoryOpen
+ * Opens the history at 'path'. A writer creates the files as needed, and
+ * drops a torn last record. A reader maps the files as they are now and
+ * returns NULL if there's no history.
+ */
+__private_extern__ PMEventHistory   *PMEventHistoryOpen(const char *path, bool forWriting);
+__private_extern__ void             PMEventHistoryClose(PMEventHistory *h);
+
+/* PMEventHistoryAppend
+ * Appends a record of 'count' key/value pairs. 'uuid' may be NULL for
+ * events outside any sleep/wake cycle.
+ */
+__private_extern__ bool PMEventHistoryAppend(PMEventHistory *h, int64_t time, PMEventKind kind,
+                                             uint32_t value, const char *uuid,
+                                             const char * const *keys, const char * const *values,
+                                             int count);
+
+/* PMEventHistoryStart, PMEventHistoryNext
+ * Iterate over records from the oldest. PMEventHistoryNext() fills in
+ * 'record' from the cursor's position and advances it; it returns false
+ * at the end of the history.
+ */
+__private_extern__ void         PMEventHistoryStart(PMEventHistory *h, PMEventHistoryCursor *cursor);
+__private_extern__ bool         PMEventHistoryNext(PMEventHistory *h, PMEventHistoryCursor *cursor,
+                                                   PMEventRecord *record);
+
+/* PMEventRecordNextField
+ * Returns the key and value at '*iter', which starts at record->fields,
+ * and advances it.
+ */
+__private_extern__ bool         PMEventRecordNextField(const PMEventRecord *record, const char **iter,
+                                                       const char **key, const char **value);
+__private_extern__ const char   *PMEventRecordGet(const PMEventRecord *record, const char *key);
+
+/*
+ * The index. Entries are numbered from the oldest, across both
+ * generations, and are in log order.
+ */
+__private_extern__ CFIndex      PMEventHistoryIndexCount(PMEventHistory *h);
+__private_extern__ const PMEventIndexEntry *PMEventHistoryIndexEntryAt(PMEventHistory *h, CFIndex i);
+__private_extern__ void         PMEventHistoryIndexCursor(PMEventHistory *h, CFIndex i,
+                                                          PMEventHistoryCursor *cursor);
+
+/* PMEventHistoryIndexFind...
+ * Return the index entry for the start of the sleep/wake cycle 'uuid', for
+ * the 'bootsAgo'th most recent boot (0 for the current one), for the first
+ * entry at or after 'cursor', or -1 if there's none. The first UUID or boot
+ * lookup sorts out the boot and new UUID entries; later ones don't read the
+ * index again.
+ */
+__private_extern__ CFIndex      PMEventHistoryIndexFindUUID(PMEventHistory *h, const char *uuid);
+__private_extern__ CFIndex      PMEventHistoryIndexFindBoot(PMEventHistory *h, int bootsAgo);
+__private_extern__ CFIndex      PMEventHistoryIndexFindPosition(PMEventHistory *h,
+                                                                const PMEventHistoryCursor *cursor);
+
+/* PMEventHistorySeekTime
+ * Sets 'cursor' to the first record at or after 'time'. Uses the index to
+ * skip to the last indexed event before it, unless the clock was set back
+ * while the history was written; then it reads from the oldest record.
+ */
+__private_extern__ void         PMEventHistorySeekTime(PMEventHistory *h, int64_t time,
+                                                       PMEventHistoryCursor *cursor);
+
+#endif // _PMEventHistory_h_
@@ -55,6 +55,7 @@ enum {
  * Keeps track of current Energy Saver settings.
  */
 static CFDictionaryRef                  energySettings = NULL;
+static CFDictionaryRef                  prefetchedSettings = NULL;
 
 /* Global - currentPowerSource
  * Keeps track of current power - battery or AC
@@ -227,7 +228,7 @@ activateSettingOverrides(void)
 
             if (!gIOPMConnection) gIOPMConnection = IOPMFindPowerManagement(0);
             if (!gIOPMConnection) break;
-            kr = IOPMSetAggressiveness(gIOPMConnection, kPMMinutesToSleep, 
+            kr = _setMinutesToSleep(gIOPMConnection,
                         (kPMPreventIdleSleep & g_overrides) ? 0 : gSleepSetting);
             if (kIOReturnSuccess != kr)
             {
@@ -464,6 +465,9 @@ activate_profiles(CFDictionaryRef d, CFStringRef s, bool removeUnsupported)
     if( !isA_CFDictionary(activePMPrefs) || !CFEqual(activePMPrefs, energy_settings) )
     {
         PMStoreSetValue(CFSTR(kIOPMDynamicStoreSettingsKey), energy_settings);
+
+        // SystemLoadPrefsHaveChanged() reads this key back from the store
+        PMStoreFlush();
     }
 
     if (activePMPrefs)
@@ -473,6 +477,11 @@ activate_profiles(CFDictionaryRef d, CFStringRef s, bool removeUnsupported)
 }
 
 
+__private_extern__ void PMSettingsPrefetch(void)
+{
+    prefetchedSettings = _copyPMSettings(kIOPMRemoveUnsupportedSettings);
+}
+
 __private_extern__ void PMSettings_prime(void)
 {
 
@@ -496,8 +505,13 @@ __private_extern__ void PMSettings_prime(void)
         currentPowerSource = CFSTR(kIOPMACPowerKey);
     }
 
-    // load the initial configuration from the database
-    energySettings = _copyPMSettings(kIOPMRemoveUnsupportedSettings);
+    // load the initial configuration from the database, unless it's been read already
+    if (prefetchedSettings) {
+        energySettings = prefetchedSettings;
+        prefetchedSettings = NULL;
+    } else {
+        energySettings = _copyPMSettings(kIOPMRemoveUnsupportedSettings);
+    }
 
     // send the initial configuration to the kernel
     if(energySettings) {
@@ -519,6 +533,7 @@ PMSettingsSupportedPrefsListHasChanged(void)
     // by a kernel driver annnouncing a new supported feature, or unloading
     // and removing support. Let's re-evaluate our known settings.
 
+    _invalidateEnergySettingsCache();
     PMSettingsPrefsHaveChanged();    
 }
 
@@ -612,7 +627,9 @@ __private_extern__ void PMSettingsPSChange(void)
 __private_extern__ IOReturn 
 _activateForcedSettings(CFDictionaryRef forceSettings)
 {
-    // Calls to "pmset force" end up here
+    // Calls to "pmset force" end up here. pmset has already written these
+    // settings to the kernel itself, so don't trust what we last sent.
+    _invalidateEnergySettingsCache();
     return activate_profiles( forceSettings, 
                         currentPowerSource,
                         kIOPMRemoveUnsupportedSettings);
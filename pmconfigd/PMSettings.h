@@ -43,6 +43,12 @@ enum {
     kPMPreventDiskSleep             = (1<<4)
 };
 
+/* PMSettingsPrefetch
+ * Reads the Energy Saver settings for PMSettings_prime() ahead of time.
+ * Safe to call from any thread before PMSettings_prime().
+ */
+__private_extern__ void PMSettingsPrefetch(void);
+
 __private_extern__ void PMSettings_prime(void);
  
 __private_extern__ void PMSettingsSleepWakeNotification(natural_t);
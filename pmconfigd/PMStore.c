@@ -22,7 +22,16 @@ __private_extern__ void PMStoreRequestCallBack(void *param, (PMStoreKeysChangedC
 static CFMutableDictionaryRef   gPMStore = NULL;
 SCDynamicStoreRef               gSCDynamicStore = NULL;
 
+/* Writes are coalesced here and handed to configd in a single
+ * SCDynamicStoreSetMultiple() once per run loop iteration.
+ */
+static CFMutableDictionaryRef   gPendingSet = NULL;
+static CFMutableArrayRef        gPendingRemove = NULL;
+static uint32_t                 gKeysWritten = 0;
+static uint32_t                 gFlushCount = 0;
+
 static void PMDynamicStoreDisconnectCallBack(SCDynamicStoreRef store, void *info __unused);
+static void PMStoreFlushObserver(CFRunLoopObserverRef observer, CFRunLoopActivity activity, void *info __unused);
 
 /* dynamicStoreNotifyCallBack
  * defined in pmconfigd.c
@@ -36,8 +45,11 @@ __private_extern__ void dynamicStoreNotifyCallBack(
 void PMStoreLoad()
 {
     CFRunLoopSourceRef      _storeRLS = NULL;
+    CFRunLoopObserverRef    _flushObserver = NULL;
 
     gPMStore = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    gPendingSet = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    gPendingRemove = CFArrayCreateMutable(0, 0, &kCFTypeArrayCallBacks);
 
     gSCDynamicStore = SCDynamicStoreCreate(0, CFSTR("powerd"), dynamicStoreNotifyCallBack, NULL);
 
@@ -51,12 +63,20 @@ void PMStoreLoad()
     }
     
     SCDynamicStoreSetDisconnectCallBack(gSCDynamicStore, PMDynamicStoreDisconnectCallBack);
+
+    // Flush pending writes each time the run loop is about to sleep.
+    _flushObserver = CFRunLoopObserverCreate(0, kCFRunLoopBeforeWaiting, true, 0, PMStoreFlushObserver, NULL);
+    if (_flushObserver) {
+        CFRunLoopAddObserver(CFRunLoopGetCurrent(), _flushObserver, kCFRunLoopCommonModes);
+        CFRelease(_flushObserver);
+    }
 }
                 
 
 bool PMStoreSetValue(CFStringRef key, CFTypeRef value)
 {
     CFTypeRef lastValue = NULL;
+    CFIndex   idx;
 
     if (!key || !value || !gPMStore)
         return false;
@@ -68,24 +88,82 @@ bool PMStoreSetValue(CFStringRef key, CFTypeRef value)
     }
     
     CFDictionarySetValue(gPMStore, key, value);
-    return SCDynamicStoreSetValue(gSCDynamicStore, key, value);
+    CFDictionarySetValue(gPendingSet, key, value);
+
+    idx = CFArrayGetFirstIndexOfValue(gPendingRemove, CFRangeMake(0, CFArrayGetCount(gPendingRemove)), key);
+    if (kCFNotFound != idx) {
+        CFArrayRemoveValueAtIndex(gPendingRemove, idx);
+    }
+    return true;
 }
 
 bool PMStoreRemoveValue(CFStringRef key)
 {
-    if (key) {
+    if (key && gPMStore) {
         CFDictionaryRemoveValue(gPMStore, key);
-        return SCDynamicStoreRemoveValue(gSCDynamicStore, key);
+        CFDictionaryRemoveValue(gPendingSet, key);
+
+        if (!CFArrayContainsValue(gPendingRemove, CFRangeMake(0, CFArrayGetCount(gPendingRemove)), key)) {
+            CFArrayAppendValue(gPendingRemove, key);
+        }
+        return true;
     }
     
     return false;
 }
 
+bool PMStoreFlush(void)
+{
+    CFIndex   setCount;
+    CFIndex   removeCount;
+    bool      ret;
+
+    if (!gPMStore)
+        return false;
+
+    setCount = CFDictionaryGetCount(gPendingSet);
+    removeCount = CFArrayGetCount(gPendingRemove);
+
+    if (0 == setCount && 0 == removeCount)
+        return true;
+
+    ret = SCDynamicStoreSetMultiple(gSCDynamicStore,
+                                    setCount ? gPendingSet : NULL,
+                                    removeCount ? gPendingRemove : NULL,
+                                    NULL);
+
+    gKeysWritten += (uint32_t)(setCount + removeCount);
+    gFlushCount++;
+
+    CFDictionaryRemoveAllValues(gPendingSet);
+    CFArrayRemoveAllValues(gPendingRemove);
+
+    return ret;
+}
+
+void PMStoreGetStats(uint32_t *keysWritten, uint32_t *flushes)
+{
+    if (keysWritten) *keysWritten = gKeysWritten;
+    if (flushes)     *flushes = gFlushCount;
+}
+
+static void PMStoreFlushObserver(
+    CFRunLoopObserverRef        observer __unused,
+    CFRunLoopActivity           activity __unused,
+    void                        *info __unused)
+{
+    PMStoreFlush();
+}
+
 static void PMDynamicStoreDisconnectCallBack(
     SCDynamicStoreRef           store,
     void                        *info __unused)
 {
     assert (store == gSCDynamicStore);
     
+    // gPMStore already reflects every pending change.
+    CFDictionaryRemoveAllValues(gPendingSet);
+    CFArrayRemoveAllValues(gPendingRemove);
+
     SCDynamicStoreSetMultiple(gSCDynamicStore, gPMStore, NULL, NULL);
 }
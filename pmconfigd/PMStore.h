@@ -13,3 +13,11 @@ __private_extern__ bool PMStoreSetValue(CFStringRef key, CFTypeRef value);
 
 __private_extern__ bool PMStoreRemoveValue(CFStringRef key);
 
+/* PMStoreSetValue and PMStoreRemoveValue queue their changes; queued changes
+ * are written to SCDynamicStore together before the run loop next sleeps.
+ * PMStoreFlush writes them immediately. Call it before notify_post()ing a
+ * notification whose listeners will read the keys just set.
+ */
+__private_extern__ bool PMStoreFlush(void);
+
+__private_extern__ void PMStoreGetStats(uint32_t *keysWritten, uint32_t *flushes);
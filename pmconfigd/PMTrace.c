@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2014 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#include <asl.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "PMTrace.h"
+
+#if PMTRACE
+
+PMTraceShared *gPMTrace = NULL;
+
+/* Maps the trace rings. Re-uses the existing object if powerd is relaunched,
+ * so the records from before the relaunch stay readable until overwritten.
+ * An object powerd doesn't own, or that others can write, is unlinked and
+ * created afresh.
+ */
+__private_extern__ void PMTrace_prime(void)
+{
+    mach_timebase_info_data_t   tb;
+    struct stat                 sb;
+    PMTraceShared               *shared;
+    void                        *addr;
+    int                         fd;
+
+    fd = shm_open(kPMTraceSharedName, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if ((fd >= 0)
+        && ((0 != fstat(fd, &sb))
+            || (sb.st_uid != geteuid())
+            || (sb.st_mode & (S_IWGRP | S_IWOTH))))
+    {
+        asl_log(NULL, NULL, ASL_LEVEL_ERR, "PMTrace: recreating trace rings not owned by powerd\n");
+        close(fd);
+        shm_unlink(kPMTraceSharedName);
+        fd = shm_open(kPMTraceSharedName, O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    }
+    if (fd < 0) {
+        asl_log(NULL, NULL, ASL_LEVEL_ERR, "PMTrace: shm_open failed (%d)\n", errno);
+        return;
+    }
+
+    if ((0 != fstat(fd, &sb))
+        || ((sb.st_size < (off_t)sizeof(PMTraceShared))
+            && (0 != ftruncate(fd, sizeof(PMTraceShared)))))
+    {
+        asl_log(NULL, NULL, ASL_LEVEL_ERR, "PMTrace: can't size trace rings (%d)\n", errno);
+        close(fd);
+        return;
+    }
+
+    addr = mmap(NULL, sizeof(PMTraceShared), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (MAP_FAILED == addr) {
+        asl_log(NULL, NULL, ASL_LEVEL_ERR, "PMTrace: can't map trace rings (%d)\n", errno);
+        return;
+    }
+
+    shared = (PMTraceShared *)addr;
+    if ((kPMTraceSharedVersion != shared->version) || (kPMTraceRingSize != shared->ringSize)) {
+        bzero(shared, sizeof(PMTraceShared));
+    }
+
+    mach_timebase_info(&tb);
+    shared->numer = tb.numer;
+    shared->denom = tb.denom;
+    shared->ringSize = kPMTraceRingSize;
+    shared->version = kPMTraceSharedVersion;
+
+    gPMTrace = shared;
+}
+
+#endif
@@ -0,0 +1,213 @@
+/*
+ * Copyright (c) 2014 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#ifndef _PMTrace_h_
+#define _PMTrace_h_
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <libkern/OSAtomic.h>
+#include <mach/mach_time.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Tracepoints on powerd's hot paths. Each traced function records its begin
+ * and end time and a small payload into a ring of kPMTraceRingSize records
+ * per event, kept in a shared memory object that `pmset -g trace` dumps
+ * after the fact.
+ *
+ * Build with PMTRACE=0 to compile the tracepoints out entirely. Built in,
+ * a tracepoint costs two mach_absolute_time() calls and a 24-byte store.
+ */
+
+#ifndef PMTRACE
+#define PMTRACE 1
+#endif
+
+#define kPMTraceSharedName              "com.apple.powerd.trace"
+#define kPMTraceSharedVersion           1
+#define kPMTraceRingSize                512     // records per event; a power of 2
+
+typedef enum {
+    kPMTraceMIG                 = 0,    // payload: msgh_id
+    kPMTracePowerCallBack,              // payload: kernel message type
+    kPMTraceFireNotification,           // payload: interest bits
+    kPMTraceEvaluateAssertions,         // payload: power source
+    kPMTracePublishPowerSources,        // payload: battery count
+    kPMTraceEnergySettings,             // payload: settings count
+    kPMTraceEventCount
+} PMTraceEvent;
+
+typedef struct {
+    uint64_t            begin;          // mach_absolute_time()
+    uint64_t            end;
+    uint64_t            payload;
+} PMTraceRecord;
+
+typedef struct {
+    volatile uint32_t   next;           // records ever written; the next goes in next % kPMTraceRingSize
+    uint32_t            reserved;
+    PMTraceRecord       records[kPMTraceRingSize];
+} PMTraceRing;
+
+typedef struct {
+    uint32_t            version;
+    uint32_t            ringSize;
+    uint32_t            numer;          // powerd's mach timebase
+    uint32_t            denom;
+    PMTraceRing         rings[kPMTraceEventCount];
+} PMTraceShared;
+
+static inline const char *PMTraceEventName(PMTraceEvent event)
+{
+    static const char *names[kPMTraceEventCount] = {
+        "mig_server_callback",
+        "PMConnectionPowerCallBack",
+        "connectionFireNotification",
+        "evaluateAssertions",
+        "HandlePublishAllPowerSources",
+        "sendEnergySettingsToKernel"
+    };
+
+    return (event < kPMTraceEventCount) ? names[event] : "unknown";
+}
+
+/* PMTraceSharedMap
+ * Maps powerd's trace rings read-only. Returns NULL if powerd hasn't
+ * published them, was built without tracepoints, or if the object isn't
+ * root's alone to write.
+ */
+static inline const PMTraceShared *PMTraceSharedMap(void)
+{
+    const PMTraceShared     *shared = NULL;
+    struct stat             sb;
+    void                    *addr;
+    int                     fd;
+
+    fd = shm_open(kPMTraceSharedName, O_RDONLY, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    if ((0 != fstat(fd, &sb))
+        || (0 != sb.st_uid)
+        || (sb.st_mode & (S_IWGRP | S_IWOTH))
+        || (sb.st_size < (off_t)sizeof(PMTraceShared)))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    addr = mmap(NULL, sizeof(PMTraceShared), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (MAP_FAILED == addr) {
+        return NULL;
+    }
+
+    shared = (const PMTraceShared *)addr;
+    if ((kPMTraceSharedVersion != shared->version) || (kPMTraceRingSize != shared->ringSize)) {
+        munmap(addr, sizeof(PMTraceShared));
+        return NULL;
+    }
+
+    return shared;
+}
+
+/* PMTraceCopyRing
+ * Copies one event's ring out of 'shared' into 'ring'. Records 'first' up to
+ * the returned count are intact, oldest first, at 'first' & (kPMTraceRingSize - 1);
+ * slots powerd reused while the ring was copied are left out.
+ */
+static inline uint32_t PMTraceCopyRing(const PMTraceShared *shared, PMTraceEvent event,
+                                       PMTraceRing *ring, uint32_t *first)
+{
+    uint32_t    before, after;
+
+    before = shared->rings[event].next;
+    OSMemoryBarrier();
+    memcpy(ring, &shared->rings[event], sizeof(*ring));
+    OSMemoryBarrier();
+    after = shared->rings[event].next;
+
+    // The slot for record 'after' may be mid-write, so it's dropped too
+    *first = (after >= kPMTraceRingSize) ? after - kPMTraceRingSize + 1 : 0;
+    return (*first < before) ? before : *first;
+}
+
+#if PMTRACE && !defined(__I_AM_PMSET__)
+
+/* NULL until PMTrace_prime() maps the rings; tracepoints do nothing until then. */
+extern PMTraceShared *gPMTrace;
+
+__private_extern__ void PMTrace_prime(void);
+
+static inline void PMTraceRecordSpan(PMTraceEvent event, uint64_t begin, uint64_t end, uint64_t payload)
+{
+    PMTraceRing     *ring = &gPMTrace->rings[event];
+    PMTraceRecord   *rec = &ring->records[ring->next & (kPMTraceRingSize - 1)];
+
+    rec->begin = begin;
+    rec->end = end;
+    rec->payload = payload;
+    OSAtomicIncrement32Barrier((volatile int32_t *)&ring->next);
+}
+
+typedef struct {
+    uint64_t        begin;
+    uint64_t        payload;
+    PMTraceEvent    event;
+} PMTraceScope;
+
+static inline void PMTraceScopeEnd(PMTraceScope *scope)
+{
+    if (scope->begin) {
+        PMTraceRecordSpan(scope->event, scope->begin, mach_absolute_time(), scope->payload);
+    }
+}
+
+/* PMTRACE_SCOPE
+ * Traces from here to the end of the enclosing block, through any return
+ * or goto out of it. Use once per function, after its declarations.
+ * PMTRACE_PAYLOAD replaces the payload before the scope ends.
+ */
+#define PMTRACE_SCOPE(event, value) \
+    PMTraceScope _pmTraceScope __attribute__((cleanup(PMTraceScopeEnd))) = \
+        { gPMTrace ? mach_absolute_time() : 0, (uint64_t)(value), (event) }
+
+#define PMTRACE_PAYLOAD(value)      (_pmTraceScope.payload = (uint64_t)(value))
+
+#else
+
+#define PMTrace_prime()             do { } while (0)
+#define PMTRACE_SCOPE(event, value) do { } while (0)
+#define PMTRACE_PAYLOAD(value)      do { } while (0)
+
+#endif
+
+#endif // _PMTrace_h_
@@ -0,0 +1,467 @@
+/*
+ * Copyright (c) 2014 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#include <IOKit/pwr_mgt/IOPMLib.h>
+#include <asl.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "PowerEventJournal.h"
+
+#define kJournalMagic           0x504d454a      // 'PMEJ'
+#define kJournalVersion         1
+
+// Records longer than this can only be corruption
+#define kJournalMaxRecord       (64 * 1024)
+
+// Don't bother compacting journals smaller than this
+#define kCompactMinRecords      256
+#define kCompactRatio           4
+
+// Fire date of the sync timer while there's nothing to sync
+#define kSyncTimerIdle          (1.0e10)
+
+typedef struct {
+    uint32_t                magic;
+    uint32_t                version;
+} JournalHeader;
+
+typedef struct {
+    uint32_t                length;         // of the payload that follows
+    uint8_t                 op;
+    uint8_t                 type;
+    uint16_t                reserved;
+    uint32_t                checksum;       // of this header (checksum 0) and payload
+} JournalRecord;
+
+struct PowerEventJournal {
+    int                     fd;
+    char                    *path;
+    off_t                   size;
+    CFIndex                 records;
+    CFIndex                 unsynced;
+    CFRunLoopTimerRef       syncTimer;
+};
+
+static uint32_t checksum(uint32_t sum, const void *buf, size_t len)
+{
+    const uint8_t   *p = (const uint8_t *)buf;
+
+    // FNV-1a
+    while (len--) {
+        sum = (sum ^ *p++) * 16777619;
+    }
+    return sum;
+}
+
+static uint32_t recordChecksum(const JournalRecord *rec, const void *payload)
+{
+    JournalRecord   tmp = *rec;
+
+    tmp.checksum = 0;
+    return checksum(checksum(2166136261U, &tmp, sizeof(tmp)), payload, rec->length);
+}
+
+static bool writeAll(int fd, const void *buf, size_t len)
+{
+    const uint8_t   *p = (const uint8_t *)buf;
+    ssize_t         n;
+
+    while (len) {
+        n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+/*
+ * Writes one record with a single write() so that an append is either
+ * wholly present or detectably torn. Returns the bytes written, or 0.
+ */
+static size_t writeRecord(int fd, int op, int type, CFDictionaryRef event)
+{
+    CFDataRef       data;
+    JournalRecord   rec;
+    uint8_t         *buf;
+    size_t          len = 0;
+
+    data = CFPropertyListCreateData(0, event, kCFPropertyListBinaryFormat_v1_0, 0, NULL);
+    if (!data) {
+        return 0;
+    }
+    if (CFDataGetLength(data) > kJournalMaxRecord) {
+        goto exit;
+    }
+
+    bzero(&rec, sizeof(rec));
+    rec.length = (uint32_t)CFDataGetLength(data);
+    rec.op = op;
+    rec.type = type;
+    rec.checksum = recordChecksum(&rec, CFDataGetBytePtr(data));
+
+    buf = malloc(sizeof(rec) + rec.length);
+    if (!buf) {
+        goto exit;
+    }
+    memcpy(buf, &rec, sizeof(rec));
+    memcpy(buf + sizeof(rec), CFDataGetBytePtr(data), rec.length);
+    if (writeAll(fd, buf, sizeof(rec) + rec.length)) {
+        len = sizeof(rec) + rec.length;
+    }
+    free(buf);
+
+exit:
+    CFRelease(data);
+    return len;
+}
+
+static bool writeHeader(int fd)
+{
+    JournalHeader   hdr = { kJournalMagic, kJournalVersion };
+
+    return writeAll(fd, &hdr, sizeof(hdr));
+}
+
+static bool eventTime(CFDictionaryRef event, CFAbsoluteTime *time)
+{
+    CFDateRef       date;
+
+    if (CFGetTypeID(event) != CFDictionaryGetTypeID()) {
+        return false;
+    }
+    date = CFDictionaryGetValue(event, CFSTR(kIOPMPowerEventTimeKey));
+    if (!date || (CFGetTypeID(date) != CFDateGetTypeID())) {
+        return false;
+    }
+    *time = CFDateGetAbsoluteTime(date);
+    return true;
+}
+
+static void applyRecord(PowerEventQueue *q, int typeCount, const JournalRecord *rec, const uint8_t *payload)
+{
+    CFDataRef           data;
+    CFDictionaryRef     event;
+    CFAbsoluteTime      time;
+    CFStringRef         appName;
+    PowerEvent          *pe;
+
+    if (rec->type >= typeCount) {
+        return;
+    }
+
+    data = CFDataCreateWithBytesNoCopy(0, payload, rec->length, kCFAllocatorNull);
+    if (!data) {
+        return;
+    }
+    event = (CFDictionaryRef)CFPropertyListCreateWithData(0, data, 0, NULL, NULL);
+    CFRelease(data);
+    if (!event) {
+        return;
+    }
+
+    if (eventTime(event, &time)) {
+        if (rec->op == kPowerEventJournalAdd) {
+            PowerEventQueueAdd(q, rec->type, time, event);
+        } else if (rec->op == kPowerEventJournalCancel) {
+            appName = CFDictionaryGetValue(event, CFSTR(kIOPMPowerEventAppNameKey));
+            if (appName && (CFGetTypeID(appName) != CFStringGetTypeID())) {
+                appName = NULL;
+            }
+            if ((pe = PowerEventQueueFind(q, rec->type, time, appName))) {
+                PowerEventQueueRemove(q, pe);
+            }
+        }
+    }
+    CFRelease(event);
+}
+
+/*
+ * Replays every intact record into 'q'. Truncates the file after the
+ * last intact record. Returns false if the file had no valid header.
+ */
+static bool replay(PowerEventJournal *j, PowerEventQueue *q, int typeCount)
+{
+    struct stat     st;
+    uint8_t         *buf = NULL;
+    JournalHeader   hdr;
+    JournalRecord   rec;
+    off_t           off;
+    ssize_t         n;
+    bool            valid = false;
+
+    if (fstat(j->fd, &st) || (st.st_size < (off_t)sizeof(hdr))) {
+        goto reset;
+    }
+
+    buf = malloc(st.st_size);
+    if (!buf) {
+        goto reset;
+    }
+    n = pread(j->fd, buf, st.st_size, 0);
+    if (n != st.st_size) {
+        goto reset;
+    }
+
+    memcpy(&hdr, buf, sizeof(hdr));
+    if ((hdr.magic != kJournalMagic) || (hdr.version != kJournalVersion)) {
+        goto reset;
+    }
+    valid = true;
+
+    off = sizeof(hdr);
+    while (off + (off_t)sizeof(rec) <= st.st_size)
+    {
+        memcpy(&rec, buf + off, sizeof(rec));
+        if ((rec.length > kJournalMaxRecord)
+            || (off + (off_t)sizeof(rec) + rec.length > st.st_size)
+            || (rec.checksum != recordChecksum(&rec, buf + off + sizeof(rec))))
+        {
+            break;
+        }
+
+        applyRecord(q, typeCount, &rec, buf + off + sizeof(rec));
+        off += sizeof(rec) + rec.length;
+        j->records++;
+    }
+
+    if (off != st.st_size) {
+        asl_log(NULL, NULL, ASL_LEVEL_ERR,
+                "PowerEventJournal: dropping %lld bytes after the last intact record\n",
+                (long long)(st.st_size - off));
+        if (ftruncate(j->fd, off)) {
+            goto reset;
+        }
+    }
+    j->size = off;
+    free(buf);
+    return true;
+
+reset:
+    if (buf) {
+        free(buf);
+    }
+    if (valid) {
+        asl_log(NULL, NULL, ASL_LEVEL_ERR, "PowerEventJournal: can't replay %s (%d)\n", j->path, errno);
+    }
+    j->records = 0;
+    j->size = 0;
+    if (!ftruncate(j->fd, 0) && writeHeader(j->fd)) {
+        j->size = sizeof(hdr);
+    }
+    return false;
+}
+
+static void syncTimerFired(CFRunLoopTimerRef timer __unused, void *info)
+{
+    PowerEventJournalSync((PowerEventJournal *)info);
+}
+
+#pragma mark -
+#pragma mark API
+
+__private_extern__ PowerEventJournal *PowerEventJournalOpen(
+    const char          *path,
+    PowerEventQueue     *replayInto,
+    int                 typeCount,
+    bool                *replayed)
+{
+    PowerEventJournal       *j;
+    CFRunLoopTimerContext   ctx;
+
+    j = calloc(1, sizeof(PowerEventJournal));
+    if (!j) {
+        return NULL;
+    }
+
+    j->path = strdup(path);
+    j->fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (!j->path || (j->fd < 0)) {
+        asl_log(NULL, NULL, ASL_LEVEL_ERR, "PowerEventJournal: can't open %s (%d)\n", path, errno);
+        PowerEventJournalClose(j);
+        return NULL;
+    }
+
+    *replayed = replay(j, replayInto, typeCount);
+
+    bzero(&ctx, sizeof(ctx));
+    ctx.info = j;
+    j->syncTimer = CFRunLoopTimerCreate(0, kSyncTimerIdle, kSyncTimerIdle, 0, 0, syncTimerFired, &ctx);
+    if (j->syncTimer) {
+        CFRunLoopAddTimer(CFRunLoopGetCurrent(), j->syncTimer, kCFRunLoopDefaultMode);
+    }
+
+    return j;
+}
+
+__private_extern__ void PowerEventJournalClose(PowerEventJournal *j)
+{
+    if (!j) {
+        return;
+    }
+
+    if (j->fd >= 0) {
+        PowerEventJournalSync(j);
+        close(j->fd);
+    }
+    if (j->syncTimer) {
+        CFRunLoopTimerInvalidate(j->syncTimer);
+        CFRelease(j->syncTimer);
+    }
+    free(j->path);
+    free(j);
+}
+
+__private_extern__ bool PowerEventJournalAppend(
+    PowerEventJournal   *j,
+    int                 op,
+    int                 type,
+    CFDictionaryRef     event)
+{
+    size_t      len;
+
+    len = writeRecord(j->fd, op, type, event);
+    if (!len) {
+        // Don't leave a partial record for the next append to follow
+        (void)ftruncate(j->fd, j->size);
+        return false;
+    }
+    j->size += len;
+    j->records++;
+
+    if (++j->unsynced >= kPowerEventJournalMaxUnsynced) {
+        PowerEventJournalSync(j);
+    } else if ((j->unsynced == 1) && j->syncTimer) {
+        CFRunLoopTimerSetNextFireDate(j->syncTimer,
+                    CFAbsoluteTimeGetCurrent() + kPowerEventJournalSyncDelay);
+    }
+
+    return true;
+}
+
+__private_extern__ void PowerEventJournalSync(PowerEventJournal *j)
+{
+    if (!j->unsynced) {
+        return;
+    }
+
+    if (fsync(j->fd)) {
+        asl_log(NULL, NULL, ASL_LEVEL_ERR, "PowerEventJournal: fsync failed (%d)\n", errno);
+    }
+    j->unsynced = 0;
+    if (j->syncTimer) {
+        CFRunLoopTimerSetNextFireDate(j->syncTimer, kSyncTimerIdle);
+    }
+}
+
+__private_extern__ bool PowerEventJournalCompactIfNeeded(
+    PowerEventJournal   *j,
+    PowerEventQueue     *q,
+    int                 typeCount,
+    bool                force)
+{
+    CFIndex     live = 0;
+    CFArrayRef  events;
+    char        *tmpPath = NULL;
+    int         fd = -1;
+    off_t       size = sizeof(JournalHeader);
+    size_t      len;
+    int         type;
+    CFIndex     i;
+
+    for (type = 0; type < typeCount; type++) {
+        live += PowerEventQueueCount(q, type);
+    }
+    if (!force
+        && ((j->records < kCompactMinRecords) || (j->records <= kCompactRatio * live)))
+    {
+        return true;
+    }
+
+    if ((asprintf(&tmpPath, "%s.tmp", j->path) < 0) || !tmpPath) {
+        return false;
+    }
+    fd = open(tmpPath, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if ((fd < 0) || !writeHeader(fd)) {
+        goto fail;
+    }
+
+    for (type = 0; type < typeCount; type++)
+    {
+        events = PowerEventQueueCopyEvents(q, type);
+        if (!events) {
+            goto fail;
+        }
+        for (i = 0; i < CFArrayGetCount(events); i++)
+        {
+            len = writeRecord(fd, kPowerEventJournalAdd, type, CFArrayGetValueAtIndex(events, i));
+            if (!len) {
+                CFRelease(events);
+                goto fail;
+            }
+            size += len;
+        }
+        CFRelease(events);
+    }
+
+    if (fsync(fd) || rename(tmpPath, j->path)) {
+        goto fail;
+    }
+
+    // Everything in the old file is now in the new one
+    close(j->fd);
+    j->fd = fd;
+    j->size = size;
+    j->records = live;
+    j->unsynced = 0;
+    if (j->syncTimer) {
+        CFRunLoopTimerSetNextFireDate(j->syncTimer, kSyncTimerIdle);
+    }
+    free(tmpPath);
+    return true;
+
+fail:
+    asl_log(NULL, NULL, ASL_LEVEL_ERR, "PowerEventJournal: compaction failed (%d)\n", errno);
+    if (fd >= 0) {
+        close(fd);
+        unlink(tmpPath);
+    }
+    free(tmpPath);
+    return false;
+}
+
+__private_extern__ CFIndex PowerEventJournalRecordCount(PowerEventJournal *j)
+{
+    return j->records;
+}
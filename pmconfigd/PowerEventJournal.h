@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2014 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#ifndef _PowerEventJournal_h_
+#define _PowerEventJournal_h_
+
+#include <CoreFoundation/CoreFoundation.h>
+#include "PowerEventQueue.h"
+
+/*
+ * PowerEventJournal is the on-disk record of scheduled power events.
+ *
+ * Each add or cancel appends one checksummed record to the journal file;
+ * nothing already written is rewritten. Appends reach the disk in batches:
+ * fsync runs kPowerEventJournalSyncDelay seconds after the first unsynced
+ * record, or at once after kPowerEventJournalMaxUnsynced records.
+ *
+ * On open the journal is replayed into a PowerEventQueue. A torn or
+ * corrupt record ends the replay and is truncated away. Once the journal
+ * holds several times more records than live events, it's compacted:
+ * rewritten as one add per live event and renamed into place.
+ */
+
+#define kPowerEventJournalPath          "/Library/Preferences/SystemConfiguration/com.apple.AutoWake.journal"
+
+#define kPowerEventJournalSyncDelay     0.5
+#define kPowerEventJournalMaxUnsynced   64
+
+enum {
+    kPowerEventJournalAdd       = 1,
+    kPowerEventJournalCancel    = 2
+};
+
+typedef struct PowerEventJournal PowerEventJournal;
+
+/* PowerEventJournalOpen
+ * Opens or creates the journal at 'path'. 'replayInto', created for
+ * 'typeCount' types, receives every event the journal holds. *replayed is
+ * set to false if there was no usable journal to replay, so the caller can
+ * import from elsewhere. Returns NULL if the file can't be opened.
+ */
+__private_extern__ PowerEventJournal *PowerEventJournalOpen(const char *path,
+                                                            PowerEventQueue *replayInto,
+                                                            int typeCount, bool *replayed);
+__private_extern__ void     PowerEventJournalClose(PowerEventJournal *j);
+
+/* PowerEventJournalAppend
+ * Appends an add or cancel of 'event' under 'type'. Returns false if the
+ * record couldn't be written; the journal is left as it was.
+ */
+__private_extern__ bool     PowerEventJournalAppend(PowerEventJournal *j, int op, int type,
+                                                    CFDictionaryRef event);
+
+/* PowerEventJournalSync
+ * Flushes unsynced records to disk now.
+ */
+__private_extern__ void     PowerEventJournalSync(PowerEventJournal *j);
+
+/* PowerEventJournalCompactIfNeeded
+ * Compacts the journal if it holds many more records than 'q' holds
+ * events, or unconditionally if 'force' is set.
+ */
+__private_extern__ bool     PowerEventJournalCompactIfNeeded(PowerEventJournal *j,
+                                                             PowerEventQueue *q,
+                                                             int typeCount, bool force);
+
+__private_extern__ CFIndex  PowerEventJournalRecordCount(PowerEventJournal *j);
+
+#endif // _PowerEventJournal_h_
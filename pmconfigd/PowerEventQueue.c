@@ -0,0 +1,383 @@
+/*
+ * Copyright (c) 2014 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#include <IOKit/pwr_mgt/IOPMLib.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "PowerEventQueue.h"
+
+typedef struct {
+    PowerEvent              **entries;
+    CFIndex                 count;
+    CFIndex                 capacity;
+} PowerEventHeap;
+
+struct PowerEventQueue {
+    int                     typeCount;
+    PowerEventHeap          *heaps;
+
+    // (type, time, appName) -> PowerEvent *, chained through sameKeyNext
+    CFMutableDictionaryRef  index;
+    uint64_t                nextSeq;
+};
+
+#pragma mark -
+#pragma mark Index
+
+static CFHashCode indexHash(const void *value)
+{
+    const PowerEvent    *pe = (const PowerEvent *)value;
+    uint64_t            bits;
+
+    memcpy(&bits, &pe->time, sizeof(bits));
+    return (CFHashCode)(bits ^ (bits >> 32)) ^ (CFHashCode)pe->type
+                ^ (pe->appName ? CFHash(pe->appName) : 0);
+}
+
+static Boolean indexEqual(const void *value1, const void *value2)
+{
+    const PowerEvent    *a = (const PowerEvent *)value1;
+    const PowerEvent    *b = (const PowerEvent *)value2;
+
+    if ((a->type != b->type) || (a->time != b->time)) {
+        return false;
+    }
+    if (a->appName == b->appName) {
+        return true;
+    }
+    return (a->appName && b->appName && CFEqual(a->appName, b->appName));
+}
+
+static const CFDictionaryKeyCallBacks kIndexKeyCallBacks = {
+    0, NULL, NULL, NULL, indexEqual, indexHash
+};
+
+static void indexInsert(PowerEventQueue *q, PowerEvent *pe)
+{
+    PowerEvent      *head = (PowerEvent *)CFDictionaryGetValue(q->index, pe);
+
+    pe->sameKeyNext = NULL;
+    if (!head) {
+        CFDictionarySetValue(q->index, pe, pe);
+        return;
+    }
+
+    while (head->sameKeyNext) {
+        head = head->sameKeyNext;
+    }
+    head->sameKeyNext = pe;
+}
+
+static void indexRemove(PowerEventQueue *q, PowerEvent *pe)
+{
+    PowerEvent      *head = (PowerEvent *)CFDictionaryGetValue(q->index, pe);
+    PowerEvent      *prev;
+
+    if (head == pe) {
+        // The dictionary holds 'pe' as its key; replace rather than
+        // leave it pointing at freed memory.
+        CFDictionaryRemoveValue(q->index, pe);
+        if (pe->sameKeyNext) {
+            CFDictionarySetValue(q->index, pe->sameKeyNext, pe->sameKeyNext);
+        }
+        return;
+    }
+
+    for (prev = head; prev && (prev->sameKeyNext != pe); prev = prev->sameKeyNext) {
+    }
+    if (prev) {
+        prev->sameKeyNext = pe->sameKeyNext;
+    }
+}
+
+#pragma mark -
+#pragma mark Heap
+
+static inline bool earlier(const PowerEvent *a, const PowerEvent *b)
+{
+    if (a->time != b->time) {
+        return (a->time < b->time);
+    }
+    return (a->seq < b->seq);
+}
+
+static inline void heapPlace(PowerEventHeap *h, CFIndex i, PowerEvent *pe)
+{
+    h->entries[i] = pe;
+    pe->heapIndex = i;
+}
+
+static void heapSiftUp(PowerEventHeap *h, CFIndex i)
+{
+    PowerEvent      *pe = h->entries[i];
+    CFIndex         parent;
+
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (!earlier(pe, h->entries[parent])) {
+            break;
+        }
+        heapPlace(h, i, h->entries[parent]);
+        i = parent;
+    }
+    heapPlace(h, i, pe);
+}
+
+static void heapSiftDown(PowerEventHeap *h, CFIndex i)
+{
+    PowerEvent      *pe = h->entries[i];
+    CFIndex         child;
+
+    while ((child = 2 * i + 1) < h->count) {
+        if ((child + 1 < h->count) && earlier(h->entries[child + 1], h->entries[child])) {
+            child++;
+        }
+        if (!earlier(h->entries[child], pe)) {
+            break;
+        }
+        heapPlace(h, i, h->entries[child]);
+        i = child;
+    }
+    heapPlace(h, i, pe);
+}
+
+static bool heapInsert(PowerEventHeap *h, PowerEvent *pe)
+{
+    if (h->count == h->capacity) {
+        CFIndex     newCapacity = h->capacity ? (2 * h->capacity) : 16;
+        PowerEvent  **newEntries = realloc(h->entries, newCapacity * sizeof(PowerEvent *));
+
+        if (!newEntries) {
+            return false;
+        }
+        h->entries = newEntries;
+        h->capacity = newCapacity;
+    }
+
+    heapPlace(h, h->count++, pe);
+    heapSiftUp(h, pe->heapIndex);
+    return true;
+}
+
+static void heapRemove(PowerEventHeap *h, PowerEvent *pe)
+{
+    CFIndex         i = pe->heapIndex;
+    PowerEvent      *last = h->entries[--h->count];
+
+    if (last == pe) {
+        return;
+    }
+
+    heapPlace(h, i, last);
+    if ((i > 0) && earlier(last, h->entries[(i - 1) / 2])) {
+        heapSiftUp(h, i);
+    } else {
+        heapSiftDown(h, i);
+    }
+}
+
+static PowerEvent *heapEarliestAtOrAfter(PowerEventHeap *h, CFIndex i, CFAbsoluteTime time)
+{
+    PowerEvent      *pe, *left, *right;
+
+    if (i >= h->count) {
+        return NULL;
+    }
+
+    // A node at or after 'time' beats everything below it
+    pe = h->entries[i];
+    if (pe->time >= time) {
+        return pe;
+    }
+
+    left = heapEarliestAtOrAfter(h, 2 * i + 1, time);
+    right = heapEarliestAtOrAfter(h, 2 * i + 2, time);
+    if (!left) {
+        return right;
+    }
+    if (!right) {
+        return left;
+    }
+    return earlier(left, right) ? left : right;
+}
+
+static int compareEntries(const void *a, const void *b)
+{
+    const PowerEvent    *pa = *(const PowerEvent * const *)a;
+    const PowerEvent    *pb = *(const PowerEvent * const *)b;
+
+    if (earlier(pa, pb)) {
+        return -1;
+    }
+    return earlier(pb, pa) ? 1 : 0;
+}
+
+#pragma mark -
+#pragma mark API
+
+__private_extern__ PowerEventQueue *PowerEventQueueCreate(int typeCount)
+{
+    PowerEventQueue     *q;
+
+    q = calloc(1, sizeof(PowerEventQueue));
+    if (!q) {
+        return NULL;
+    }
+
+    q->typeCount = typeCount;
+    q->heaps = calloc(typeCount, sizeof(PowerEventHeap));
+    q->index = CFDictionaryCreateMutable(0, 0, &kIndexKeyCallBacks, NULL);
+    if (!q->heaps || !q->index) {
+        PowerEventQueueRelease(q);
+        return NULL;
+    }
+
+    return q;
+}
+
+__private_extern__ void PowerEventQueueRelease(PowerEventQueue *q)
+{
+    PowerEvent      *pe;
+
+    if (!q) {
+        return;
+    }
+
+    for (int type = 0; q->heaps && (type < q->typeCount); type++) {
+        for (CFIndex i = 0; i < q->heaps[type].count; i++) {
+            pe = q->heaps[type].entries[i];
+            CFRelease(pe->event);
+            free(pe);
+        }
+        free(q->heaps[type].entries);
+    }
+    free(q->heaps);
+    if (q->index) {
+        CFRelease(q->index);
+    }
+    free(q);
+}
+
+__private_extern__ PowerEvent *PowerEventQueueAdd(
+    PowerEventQueue     *q,
+    int                 type,
+    CFAbsoluteTime      time,
+    CFDictionaryRef     event)
+{
+    PowerEvent      *pe;
+    CFStringRef     appName;
+
+    pe = calloc(1, sizeof(PowerEvent));
+    if (!pe) {
+        return NULL;
+    }
+
+    appName = CFDictionaryGetValue(event, CFSTR(kIOPMPowerEventAppNameKey));
+
+    pe->time = time;
+    pe->event = CFRetain(event);
+    pe->appName = (appName && (CFGetTypeID(appName) == CFStringGetTypeID())) ? appName : NULL;
+    pe->type = type;
+    pe->seq = q->nextSeq++;
+
+    if (!heapInsert(&q->heaps[type], pe)) {
+        CFRelease(pe->event);
+        free(pe);
+        return NULL;
+    }
+    indexInsert(q, pe);
+
+    return pe;
+}
+
+__private_extern__ void PowerEventQueueRemove(PowerEventQueue *q, PowerEvent *pe)
+{
+    indexRemove(q, pe);
+    heapRemove(&q->heaps[pe->type], pe);
+    CFRelease(pe->event);
+    free(pe);
+}
+
+__private_extern__ PowerEvent *PowerEventQueueFind(
+    PowerEventQueue     *q,
+    int                 type,
+    CFAbsoluteTime      time,
+    CFStringRef         appName)
+{
+    PowerEvent      probe;
+
+    bzero(&probe, sizeof(probe));
+    probe.type = type;
+    probe.time = time;
+    probe.appName = appName;
+
+    return (PowerEvent *)CFDictionaryGetValue(q->index, &probe);
+}
+
+__private_extern__ PowerEvent *PowerEventQueueEarliest(PowerEventQueue *q, int type)
+{
+    PowerEventHeap  *h = &q->heaps[type];
+
+    return h->count ? h->entries[0] : NULL;
+}
+
+__private_extern__ PowerEvent *PowerEventQueueEarliestAtOrAfter(
+    PowerEventQueue     *q,
+    int                 type,
+    CFAbsoluteTime      time)
+{
+    return heapEarliestAtOrAfter(&q->heaps[type], 0, time);
+}
+
+__private_extern__ CFIndex PowerEventQueueCount(PowerEventQueue *q, int type)
+{
+    return q->heaps[type].count;
+}
+
+__private_extern__ CFArrayRef PowerEventQueueCopyEvents(PowerEventQueue *q, int type)
+{
+    PowerEventHeap      *h = &q->heaps[type];
+    PowerEvent          **sorted = NULL;
+    CFMutableArrayRef   events;
+
+    events = CFArrayCreateMutable(0, h->count, &kCFTypeArrayCallBacks);
+    if (!events || !h->count) {
+        return events;
+    }
+
+    sorted = malloc(h->count * sizeof(PowerEvent *));
+    if (!sorted) {
+        CFRelease(events);
+        return NULL;
+    }
+    memcpy(sorted, h->entries, h->count * sizeof(PowerEvent *));
+    qsort(sorted, h->count, sizeof(PowerEvent *), compareEntries);
+
+    for (CFIndex i = 0; i < h->count; i++) {
+        CFArrayAppendValue(events, sorted[i]->event);
+    }
+    free(sorted);
+
+    return events;
+}
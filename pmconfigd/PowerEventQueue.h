@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2014 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#ifndef _PowerEventQueue_h_
+#define _PowerEventQueue_h_
+
+#include <CoreFoundation/CoreFoundation.h>
+
+/*
+ * PowerEventQueue holds every scheduled power event (IOPMSchedulePowerEvent)
+ * known to powerd.
+ *
+ * Events are kept in one indexed min-heap per event type, ordered by time
+ * and then by order of arrival. All types share one lookup index on
+ * (type, time, app name), so that a cancel finds its event without a scan.
+ *
+ *   add, remove                O(log n)
+ *   find                       O(1)
+ *   earliest event of a type   O(1)
+ */
+
+typedef struct PowerEvent {
+    CFAbsoluteTime          time;
+    CFDictionaryRef         event;          // retained; as passed to IOPMSchedulePowerEvent
+    CFStringRef             appName;        // kIOPMPowerEventAppNameKey from 'event'; may be NULL
+    int                     type;
+    uint64_t                seq;            // arrival order, breaks ties between equal times
+    CFIndex                 heapIndex;
+    struct PowerEvent       *sameKeyNext;   // other events with the same (type, time, appName)
+} PowerEvent;
+
+typedef struct PowerEventQueue PowerEventQueue;
+
+/* PowerEventQueueCreate
+ * Creates a queue for event types 0 .. typeCount-1.
+ */
+__private_extern__ PowerEventQueue *PowerEventQueueCreate(int typeCount);
+__private_extern__ void         PowerEventQueueRelease(PowerEventQueue *q);
+
+/* PowerEventQueueAdd
+ * Adds 'event' at 'time' under 'type'. Retains 'event'.
+ * Returns NULL on allocation failure.
+ */
+__private_extern__ PowerEvent   *PowerEventQueueAdd(PowerEventQueue *q, int type,
+                                                    CFAbsoluteTime time, CFDictionaryRef event);
+
+/* PowerEventQueueRemove
+ * Removes and frees 'pe', releasing its event dictionary.
+ */
+__private_extern__ void         PowerEventQueueRemove(PowerEventQueue *q, PowerEvent *pe);
+
+/* PowerEventQueueFind
+ * Returns the earliest-added event of 'type' at exactly 'time' whose app
+ * name is equal to 'appName', or NULL.
+ */
+__private_extern__ PowerEvent   *PowerEventQueueFind(PowerEventQueue *q, int type,
+                                                     CFAbsoluteTime time, CFStringRef appName);
+
+/* PowerEventQueueEarliest
+ * Returns the earliest event of 'type', or NULL if there are none.
+ */
+__private_extern__ PowerEvent   *PowerEventQueueEarliest(PowerEventQueue *q, int type);
+
+/* PowerEventQueueEarliestAtOrAfter
+ * Returns the earliest event of 'type' at or after 'time', or NULL.
+ * Cost grows only with the number of events of 'type' before 'time'.
+ */
+__private_extern__ PowerEvent   *PowerEventQueueEarliestAtOrAfter(PowerEventQueue *q, int type,
+                                                                  CFAbsoluteTime time);
+
+__private_extern__ CFIndex      PowerEventQueueCount(PowerEventQueue *q, int type);
+
+/* PowerEventQueueCopyEvents
+ * Returns the event dictionaries of 'type' sorted by time.
+ * Caller must release.
+ */
+__private_extern__ CFArrayRef   PowerEventQueueCopyEvents(PowerEventQueue *q, int type);
+
+#endif // _PowerEventQueue_h_
@@ -45,6 +45,8 @@
 #include <sys/stat.h>
 #include <sys/fcntl.h>
 #include <sys/mount.h>
+#include <sys/mman.h>
+#include <errno.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <dispatch/dispatch.h>
@@ -56,6 +58,9 @@
 #include "PMAssertions.h"
 #include "PMSettings.h"
 #include "PMAssertions.h"
+#include "PMEventHistory.h"
+#include "SleepWakeRecord.h"
+#include "PMTrace.h"
 
 #define kIntegerStringLen               15
 
@@ -64,10 +69,6 @@
 #include <systemstats/systemstats.h>
 #endif /* TARGET_OS_EMBEDDED */
 
-#ifndef kIOHIDIdleTimeKy
-#define kIOHIDIdleTimeKey                               "HIDIdleTime"
-#endif
-
 #ifndef kIOPMMaintenanceScheduleImmediate
 #define kIOPMMaintenanceScheduleImmediate               "MaintenanceImmediate"
 #endif
@@ -233,6 +234,52 @@ __private_extern__ dispatch_queue_t     _getPMDispatchQueue(void)
 }
 
 #ifndef __I_AM_PMSET__
+/* An object powerd doesn't own, or that others can write, was planted
+ * before powerd started; it is unlinked and created afresh so nobody else
+ * holds a writable descriptor to the page.
+ */
+__private_extern__ void *_sharedPageMap(const char *name, size_t size)
+{
+    struct stat     sb;
+    void            *addr;
+    int             fd;
+
+    fd = shm_open(name, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if ((fd >= 0)
+        && ((0 != fstat(fd, &sb))
+            || (sb.st_uid != geteuid())
+            || (sb.st_mode & (S_IWGRP | S_IWOTH))))
+    {
+        asl_log(NULL, NULL, ASL_LEVEL_ERR, "Recreating shared page %s not owned by powerd\n", name);
+        close(fd);
+        shm_unlink(name);
+        fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    }
+    if (fd < 0) {
+        asl_log(NULL, NULL, ASL_LEVEL_ERR, "Can't open shared page %s (%d)\n", name, errno);
+        return NULL;
+    }
+
+    if ((0 != fstat(fd, &sb))
+        || ((sb.st_size < (off_t)size)
+            && (0 != ftruncate(fd, size))))
+    {
+        asl_log(NULL, NULL, ASL_LEVEL_ERR, "Can't size shared page %s (%d)\n", name, errno);
+        close(fd);
+        return NULL;
+    }
+
+    addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (MAP_FAILED == addr) {
+        asl_log(NULL, NULL, ASL_LEVEL_ERR, "Can't map shared page %s (%d)\n", name, errno);
+        return NULL;
+    }
+
+    return addr;
+}
+
 __private_extern__ bool auditTokenHasEntitlement(
                                      audit_token_t token,
                                      CFStringRef entitlement)
@@ -734,6 +781,163 @@ static bool                     _platformSleepServiceSupport = false;
 #endif
 
 
+/* Settings pushed to the kernel by sendEnergySettingsToKernel().
+ * Indexes into the last-sent cache below.
+ */
+typedef enum {
+    kEnergySettingMinutesToSleep = 0,
+    kEnergySettingMinutesToSpin,
+    kEnergySettingMinutesToDim,
+    kEnergySettingWakeOnLAN,
+    kEnergySettingDisplaySleepUsesDim,
+    kEnergySettingWakeOnRing,
+    kEnergySettingAutomaticRestart,
+    kEnergySettingWakeOnACChange,
+    kEnergySettingSleepOnPowerButton,
+    kEnergySettingWakeOnClamshell,
+    kEnergySettingMobileMotionModule,
+    kEnergySettingGPU,
+    kEnergySettingDeepSleepEnable,
+    kEnergySettingDeepSleepDelay,
+    kEnergySettingAutoPowerOffEnable,
+    kEnergySettingAutoPowerOffDelay,
+    kEnergySettingCount
+} EnergySettingIndex;
+
+#ifndef __I_AM_PMSET__
+/* powerd remembers the last value it successfully handed to the kernel for
+ * each setting, and skips the IOPMSetAggressiveness/IORegistryEntrySetCFProperty
+ * call when the value hasn't changed. pmset is short lived and always sends.
+ *
+ * The root domain's "Supported Features" table is cached too; it only changes
+ * when the kernel sends kIOPMMessageFeatureChange.
+ */
+typedef struct {
+    bool                valid;
+    uint32_t            value;
+} EnergySettingSent;
+
+static EnergySettingSent        gEnergySettingsSent[kEnergySettingCount];
+static CFDictionaryRef          gSupportedFeatures = NULL;
+static uint32_t                 gEnergySettingsPushCount = 0;
+static uint32_t                 gEnergySettingsSkipCount = 0;
+
+__private_extern__ void _invalidateEnergySettingsCache(void)
+{
+    if (gSupportedFeatures) {
+        CFRelease(gSupportedFeatures);
+        gSupportedFeatures = NULL;
+    }
+
+    // A feature that just appeared needs its value pushed even if
+    // we've sent the same value before.
+    bzero(gEnergySettingsSent, sizeof(gEnergySettingsSent));
+}
+
+__private_extern__ void _getEnergySettingsCounts(uint32_t *pushed, uint32_t *skipped)
+{
+    if (pushed)  *pushed = gEnergySettingsPushCount;
+    if (skipped) *skipped = gEnergySettingsSkipCount;
+}
+#endif
+
+/* copySupportedFeatures
+ * Returns a retained copy of RootDomain's supported energy saver settings.
+ */
+static CFDictionaryRef copySupportedFeatures(io_registry_entry_t PMRootDomain)
+{
+#ifndef __I_AM_PMSET__
+    if (!gSupportedFeatures) {
+        gSupportedFeatures = IORegistryEntryCreateCFProperty(PMRootDomain,
+                                        CFSTR("Supported Features"), kCFAllocatorDefault, kNilOptions);
+    }
+    if (gSupportedFeatures) {
+        CFRetain(gSupportedFeatures);
+    }
+    return gSupportedFeatures;
+#else
+    return IORegistryEntryCreateCFProperty(PMRootDomain,
+                                        CFSTR("Supported Features"), kCFAllocatorDefault, kNilOptions);
+#endif
+}
+
+static bool energySettingHasChanged(EnergySettingIndex which, uint32_t value)
+{
+#ifndef __I_AM_PMSET__
+    if (gEnergySettingsSent[which].valid && (gEnergySettingsSent[which].value == value)) {
+        gEnergySettingsSkipCount++;
+        return false;
+    }
+#endif
+    return true;
+}
+
+static void energySettingWasSent(EnergySettingIndex which, uint32_t value, IOReturn ret)
+{
+#ifndef __I_AM_PMSET__
+    gEnergySettingsPushCount++;
+
+    // Only remember values the kernel accepted; failures are retried next time.
+    gEnergySettingsSent[which].valid = (kIOReturnSuccess == ret);
+    gEnergySettingsSent[which].value = value;
+#endif
+}
+
+static IOReturn setAggressivenessIfChanged(
+                                       io_connect_t                    PM_connection,
+                                       EnergySettingIndex              which,
+                                       unsigned long                   type,
+                                       uint32_t                        value)
+{
+    IOReturn                        ret;
+
+    if (!energySettingHasChanged(which, value))
+        return kIOReturnSuccess;
+
+    ret = IOPMSetAggressiveness(PM_connection, type, value);
+    energySettingWasSent(which, value, ret);
+    return ret;
+}
+
+#ifndef __I_AM_PMSET__
+__private_extern__ IOReturn _setMinutesToSleep(io_connect_t PM_connection, uint32_t minutes)
+{
+    return setAggressivenessIfChanged(PM_connection, kEnergySettingMinutesToSleep, kPMMinutesToSleep, minutes);
+}
+#endif
+
+/* setRootDomainSettingIfChanged
+ * Sends 'obj' to the root domain for 'key' when 'value' differs from what was
+ * last sent. If 'obj' is NULL, 'value' is sent as a CFNumber.
+ */
+static void setRootDomainSettingIfChanged(
+                                          io_registry_entry_t             PMRootDomain,
+                                          EnergySettingIndex              which,
+                                          CFStringRef                     key,
+                                          uint32_t                        value,
+                                          CFTypeRef                       obj)
+{
+    CFNumberRef                     num = NULL;
+    IOReturn                        ret;
+
+    if (!energySettingHasChanged(which, value))
+        return;
+
+    if (!obj) {
+        num = CFNumberCreate(0, kCFNumberIntType, &value);
+        if (!num)
+            return;
+        obj = num;
+    }
+
+    ret = IORegistryEntrySetCFProperty(PMRootDomain, key, obj);
+    energySettingWasSent(which, value, ret);
+
+    if (num) {
+        CFRelease(num);
+    }
+}
+
 static void sendEnergySettingsToKernel(
                                        CFDictionaryRef                 useSettings,
                                        bool                            removeUnsupportedSettings,
@@ -743,18 +947,8 @@ static void sendEnergySettingsToKernel(
     io_connect_t                    PM_connection = MACH_PORT_NULL;
     CFDictionaryRef                 _supportedCached = NULL;
     CFStringRef                     providing_power = NULL;
-    CFNumberRef                     number1 = NULL;
-    CFNumberRef                     number0 = NULL;
-    CFNumberRef                     num = NULL;
-    uint32_t                        i;
-
-    i = 1;
-    number1 = CFNumberCreate(kCFAllocatorDefault, kCFNumberIntType, &i);
-    i = 0;
-    number0 = CFNumberCreate(kCFAllocatorDefault, kCFNumberIntType, &i);
 
-    if (!number0 || !number1)
-        goto exit;
+    PMTRACE_SCOPE(kPMTraceEnergySettings, useSettings ? CFDictionaryGetCount(useSettings) : 0);
 
     PM_connection = IOPMFindPowerManagement(0);
 
@@ -790,58 +984,58 @@ static void sendEnergySettingsToKernel(
 #endif
 
     // Grab a copy of RootDomain's supported energy saver settings
-    _supportedCached = IORegistryEntryCreateCFProperty(PMRootDomain, CFSTR("Supported Features"), kCFAllocatorDefault, kNilOptions);
+    _supportedCached = copySupportedFeatures(PMRootDomain);
 
-    IOPMSetAggressiveness(PM_connection, kPMMinutesToSleep, p->fMinutesToSleep);
-    IOPMSetAggressiveness(PM_connection, kPMMinutesToSpinDown, p->fMinutesToSpin);
-    IOPMSetAggressiveness(PM_connection, kPMMinutesToDim, p->fMinutesToDim);
+    setAggressivenessIfChanged(PM_connection, kEnergySettingMinutesToSleep, kPMMinutesToSleep, p->fMinutesToSleep);
+    setAggressivenessIfChanged(PM_connection, kEnergySettingMinutesToSpin, kPMMinutesToSpinDown, p->fMinutesToSpin);
+    setAggressivenessIfChanged(PM_connection, kEnergySettingMinutesToDim, kPMMinutesToDim, p->fMinutesToDim);
 
 
     // Wake on LAN
     if(true == IOPMFeatureIsAvailableWithSupportedTable(CFSTR(kIOPMWakeOnLANKey), providing_power, _supportedCached))
     {
-        IOPMSetAggressiveness(PM_connection, kPMEthernetWakeOnLANSettings, p->fWakeOnLAN);
+        setAggressivenessIfChanged(PM_connection, kEnergySettingWakeOnLAN, kPMEthernetWakeOnLANSettings, p->fWakeOnLAN);
     } else {
         // Even if WakeOnLAN is reported as not supported, broadcast 0 as
         // value. We may be on a supported machine, just on battery power.
         // Wake on LAN is not supported on battery power on PPC hardware.
-        IOPMSetAggressiveness(PM_connection, kPMEthernetWakeOnLANSettings, 0);
+        setAggressivenessIfChanged(PM_connection, kEnergySettingWakeOnLAN, kPMEthernetWakeOnLANSettings, 0);
     }
 
     // Display Sleep Uses Dim
     if ( !removeUnsupportedSettings
         || IOPMFeatureIsAvailableWithSupportedTable(CFSTR(kIOPMDisplaySleepUsesDimKey), providing_power, _supportedCached))
     {
-        IORegistryEntrySetCFProperty(PMRootDomain,
-                                     CFSTR(kIOPMSettingDisplaySleepUsesDimKey),
-                                     (p->fDisplaySleepUsesDimming?number1:number0));
+        setRootDomainSettingIfChanged(PMRootDomain, kEnergySettingDisplaySleepUsesDim,
+                                      CFSTR(kIOPMSettingDisplaySleepUsesDimKey),
+                                      (p->fDisplaySleepUsesDimming?1:0), NULL);
     }
 
     // Wake On Ring
     if( !removeUnsupportedSettings
        || IOPMFeatureIsAvailableWithSupportedTable(CFSTR(kIOPMWakeOnRingKey), providing_power, _supportedCached))
     {
-        IORegistryEntrySetCFProperty(PMRootDomain,
-                                     CFSTR(kIOPMSettingWakeOnRingKey),
-                                     (p->fWakeOnRing?number1:number0));
+        setRootDomainSettingIfChanged(PMRootDomain, kEnergySettingWakeOnRing,
+                                      CFSTR(kIOPMSettingWakeOnRingKey),
+                                      (p->fWakeOnRing?1:0), NULL);
     }
 
     // Automatic Restart On Power Loss, aka FileServer mode
     if( !removeUnsupportedSettings
        || IOPMFeatureIsAvailableWithSupportedTable(CFSTR(kIOPMRestartOnPowerLossKey), providing_power, _supportedCached))
     {
-        IORegistryEntrySetCFProperty(PMRootDomain,
-                                     CFSTR(kIOPMSettingRestartOnPowerLossKey),
-                                     (p->fAutomaticRestart?number1:number0));
+        setRootDomainSettingIfChanged(PMRootDomain, kEnergySettingAutomaticRestart,
+                                      CFSTR(kIOPMSettingRestartOnPowerLossKey),
+                                      (p->fAutomaticRestart?1:0), NULL);
     }
 
     // Wake on change of AC state -- battery to AC or vice versa
     if( !removeUnsupportedSettings
        || IOPMFeatureIsAvailableWithSupportedTable(CFSTR(kIOPMWakeOnACChangeKey), providing_power, _supportedCached))
     {
-        IORegistryEntrySetCFProperty(PMRootDomain,
-                                     CFSTR(kIOPMSettingWakeOnACChangeKey),
-                                     (p->fWakeOnACChange?number1:number0));
+        setRootDomainSettingIfChanged(PMRootDomain, kEnergySettingWakeOnACChange,
+                                      CFSTR(kIOPMSettingWakeOnACChangeKey),
+                                      (p->fWakeOnACChange?1:0), NULL);
     }
 
     // Disable power button sleep on PowerMacs, Cubes, and iMacs
@@ -849,9 +1043,10 @@ static void sendEnergySettingsToKernel(
     if( !removeUnsupportedSettings
        || IOPMFeatureIsAvailableWithSupportedTable(CFSTR(kIOPMSleepOnPowerButtonKey), providing_power, _supportedCached))
     {
-        IORegistryEntrySetCFProperty(PMRootDomain,
-                                     CFSTR(kIOPMSettingSleepOnPowerButtonKey),
-                                     (p->fSleepOnPowerButton?kCFBooleanFalse:kCFBooleanTrue));
+        setRootDomainSettingIfChanged(PMRootDomain, kEnergySettingSleepOnPowerButton,
+                                      CFSTR(kIOPMSettingSleepOnPowerButtonKey),
+                                      (p->fSleepOnPowerButton?1:0),
+                                      (p->fSleepOnPowerButton?kCFBooleanFalse:kCFBooleanTrue));
     }
 
     // Wakeup on clamshell open
@@ -859,9 +1054,9 @@ static void sendEnergySettingsToKernel(
     if( !removeUnsupportedSettings
        || IOPMFeatureIsAvailableWithSupportedTable(CFSTR(kIOPMWakeOnClamshellKey), providing_power, _supportedCached))
     {
-        IORegistryEntrySetCFProperty(PMRootDomain,
-                                     CFSTR(kIOPMSettingWakeOnClamshellKey),
-                                     (p->fWakeOnClamshell?number1:number0));
+        setRootDomainSettingIfChanged(PMRootDomain, kEnergySettingWakeOnClamshell,
+                                      CFSTR(kIOPMSettingWakeOnClamshellKey),
+                                      (p->fWakeOnClamshell?1:0), NULL);
     }
 
     // Mobile Motion Module
@@ -869,9 +1064,9 @@ static void sendEnergySettingsToKernel(
     if( !removeUnsupportedSettings
        || IOPMFeatureIsAvailableWithSupportedTable(CFSTR(kIOPMMobileMotionModuleKey), providing_power, _supportedCached))
     {
-        IORegistryEntrySetCFProperty(PMRootDomain,
-                                     CFSTR(kIOPMSettingMobileMotionModuleKey),
-                                     (p->fMobileMotionModule?number1:number0));
+        setRootDomainSettingIfChanged(PMRootDomain, kEnergySettingMobileMotionModule,
+                                      CFSTR(kIOPMSettingMobileMotionModuleKey),
+                                      (p->fMobileMotionModule?1:0), NULL);
     }
 
     /*
@@ -880,13 +1075,9 @@ static void sendEnergySettingsToKernel(
     if( !removeUnsupportedSettings
        || IOPMFeatureIsAvailableWithSupportedTable(CFSTR(kIOPMGPUSwitchKey), providing_power, _supportedCached))
     {
-        num = CFNumberCreate(0, kCFNumberIntType, &p->fGPU);
-        if (num) {
-            IORegistryEntrySetCFProperty(PMRootDomain,
-                                         CFSTR(kIOPMGPUSwitchKey),
-                                         num);
-            CFRelease(num);
-        }
+        setRootDomainSettingIfChanged(PMRootDomain, kEnergySettingGPU,
+                                      CFSTR(kIOPMGPUSwitchKey),
+                                      p->fGPU, NULL);
     }
 
     // DeepSleepEnable
@@ -894,9 +1085,10 @@ static void sendEnergySettingsToKernel(
     if( !removeUnsupportedSettings
        || IOPMFeatureIsAvailableWithSupportedTable(CFSTR(kIOPMDeepSleepEnabledKey), providing_power, _supportedCached))
     {
-        IORegistryEntrySetCFProperty(PMRootDomain,
-                                     CFSTR(kIOPMDeepSleepEnabledKey),
-                                     (p->fDeepSleepEnable?kCFBooleanTrue:kCFBooleanFalse));
+        setRootDomainSettingIfChanged(PMRootDomain, kEnergySettingDeepSleepEnable,
+                                      CFSTR(kIOPMDeepSleepEnabledKey),
+                                      (p->fDeepSleepEnable?1:0),
+                                      (p->fDeepSleepEnable?kCFBooleanTrue:kCFBooleanFalse));
     }
 
     // DeepSleepDelay
@@ -904,13 +1096,9 @@ static void sendEnergySettingsToKernel(
     if( !removeUnsupportedSettings
        || IOPMFeatureIsAvailableWithSupportedTable(CFSTR(kIOPMDeepSleepDelayKey), providing_power, _supportedCached))
     {
-        num = CFNumberCreate(0, kCFNumberIntType, &p->fDeepSleepDelay);
-        if (num) {
-            IORegistryEntrySetCFProperty(PMRootDomain,
-                                         CFSTR(kIOPMDeepSleepDelayKey),
-                                         num);
-            CFRelease(num);
-        }
+        setRootDomainSettingIfChanged(PMRootDomain, kEnergySettingDeepSleepDelay,
+                                      CFSTR(kIOPMDeepSleepDelayKey),
+                                      p->fDeepSleepDelay, NULL);
     }
 
     // AutoPowerOffEnable
@@ -918,9 +1106,10 @@ static void sendEnergySettingsToKernel(
     if( !removeUnsupportedSettings
        || IOPMFeatureIsAvailableWithSupportedTable(CFSTR(kIOPMAutoPowerOffEnabledKey), providing_power, _supportedCached))
     {
-        IORegistryEntrySetCFProperty(PMRootDomain,
-                                     CFSTR(kIOPMAutoPowerOffEnabledKey),
-                                     (p->fAutoPowerOffEnable?kCFBooleanTrue:kCFBooleanFalse));
+        setRootDomainSettingIfChanged(PMRootDomain, kEnergySettingAutoPowerOffEnable,
+                                      CFSTR(kIOPMAutoPowerOffEnabledKey),
+                                      (p->fAutoPowerOffEnable?1:0),
+                                      (p->fAutoPowerOffEnable?kCFBooleanTrue:kCFBooleanFalse));
     }
 
     // AutoPowerOffDelay
@@ -928,13 +1117,9 @@ static void sendEnergySettingsToKernel(
     if( !removeUnsupportedSettings
        || IOPMFeatureIsAvailableWithSupportedTable(CFSTR(kIOPMAutoPowerOffDelayKey), providing_power, _supportedCached))
     {
-        num = CFNumberCreate(0, kCFNumberIntType, &p->fAutoPowerOffDelay);
-        if (num) {
-            IORegistryEntrySetCFProperty(PMRootDomain,
-                                         CFSTR(kIOPMAutoPowerOffDelayKey),
-                                         num);
-            CFRelease(num);
-        }
+        setRootDomainSettingIfChanged(PMRootDomain, kEnergySettingAutoPowerOffDelay,
+                                      CFSTR(kIOPMAutoPowerOffDelayKey),
+                                      p->fAutoPowerOffDelay, NULL);
     }
 
 #ifndef __I_AM_PMSET__
@@ -977,12 +1162,6 @@ static void sendEnergySettingsToKernel(
     }
 
 exit:
-    if (number0) {
-        CFRelease(number0);
-    }
-    if (number1) {
-        CFRelease(number1);
-    }
     if (IO_OBJECT_NULL != PM_connection) {
         IOServiceClose(PM_connection);
     }
@@ -1076,77 +1255,100 @@ __private_extern__ IOReturn ActivatePMSettings(
 #define kIOPMAppName                "Power Management configd plugin"
 #define kIOPMPrefsPath              "com.apple.PowerManagement.xml"
 
-IOReturn _getLowCapRatioTime(CFStringRef batterySerialNumber,
-                             boolean_t *hasLowCapRatio,
-                             time_t *since)
-{
-    IOReturn                    ret         = kIOReturnError;
-    
 #if !TARGET_OS_EMBEDDED
+/*
+ * BatteryWarn, the low capacity ratio start time keyed by battery serial
+ * number, is kept in memory so battery updates don't read the prefs file.
+ * Changes are written behind by _flushLowCapRatioTimes(); until they are,
+ * they're kept in gLowCapRatioPending (kCFNull for a removal) so a reload
+ * doesn't lose them.
+ */
+static CFMutableDictionaryRef   gLowCapRatioTimes = NULL;
+static CFMutableDictionaryRef   gLowCapRatioPending = NULL;
+static bool                     gLowCapRatioFlushScheduled = false;
+
+#define kLowCapRatioFlushDelay      (5ULL * NSEC_PER_SEC)
+
+static void _applyPendingLowCapRatioTimes(CFMutableDictionaryRef dict)
+{
+    CFIndex         count, i;
+    const void      **keys;
+    const void      **values;
+
+    if (!gLowCapRatioPending || !(count = CFDictionaryGetCount(gLowCapRatioPending))) {
+        return;
+    }
+
+    keys = malloc(2 * count * sizeof(void *));
+    if (!keys) {
+        return;
+    }
+    values = keys + count;
+    CFDictionaryGetKeysAndValues(gLowCapRatioPending, keys, values);
+    for (i = 0; i < count; i++) {
+        if (kCFNull == values[i]) {
+            CFDictionaryRemoveValue(dict, keys[i]);
+        } else {
+            CFDictionarySetValue(dict, keys[i], values[i]);
+        }
+    }
+    free(keys);
+}
+
+/* _loadLowCapRatioTimes
+ * Re-reads BatteryWarn. Called at startup and when the prefs change.
+ */
+__private_extern__ void _loadLowCapRatioTimes(void)
+{
     SCPreferencesRef            energyPrefs = NULL; // must release
     CFPropertyListRef           plist       = NULL; // do not release
-    CFNumberRef                 num         = NULL; // do not release
-    
-    if (!hasLowCapRatio || !since || !isA_CFString(batterySerialNumber)) {
-        return ret;
-    }
-    
-    *hasLowCapRatio = false;
-    *since = 0;
-    
+    CFMutableDictionaryRef      dict        = NULL;
+
     energyPrefs = SCPreferencesCreate(kCFAllocatorDefault,
                                       CFSTR(kIOPMAppName),
                                       CFSTR(kIOPMPrefsPath));
     if (!energyPrefs) {
-        goto exit;
-    }
-    
-    if (!SCPreferencesLock(energyPrefs, true)) {
-        ret = kIOReturnInternalError;
-        goto exit;
+        return;
     }
-    
-    plist = SCPreferencesGetValue(energyPrefs, CFSTR("BatteryWarn"));
-    if (!plist || CFGetTypeID(plist) != CFDictionaryGetTypeID()) {
+
+    if (SCPreferencesLock(energyPrefs, true)) {
+        plist = SCPreferencesGetValue(energyPrefs, CFSTR("BatteryWarn"));
+        if (plist && CFGetTypeID(plist) == CFDictionaryGetTypeID()) {
+            dict = CFDictionaryCreateMutableCopy(kCFAllocatorDefault, 0, plist);
+        }
         SCPreferencesUnlock(energyPrefs);
-        goto exit;
     }
-    
-    SCPreferencesUnlock(energyPrefs);
-    
-    num = CFDictionaryGetValue(plist, batterySerialNumber);
-    if (num && CFNumberGetTypeID() == CFGetTypeID(num)) {
-        if (!CFNumberGetValue(num, CFNumberGetType(num), since)) {
-            goto exit;
+    CFRelease(energyPrefs);
+
+    if (!dict) {
+        dict = CFDictionaryCreateMutable(kCFAllocatorDefault,
+                                         0,
+                                         &kCFTypeDictionaryKeyCallBacks,
+                                         &kCFTypeDictionaryValueCallBacks);
+        if (!dict) {
+            return;
         }
-        *hasLowCapRatio = true;
     }
-    
-    ret = kIOReturnSuccess;
-    
-exit:
-    if (energyPrefs) CFRelease(energyPrefs);
-    
-#endif
-    return ret;
+    _applyPendingLowCapRatioTimes(dict);
+
+    if (gLowCapRatioTimes) {
+        CFRelease(gLowCapRatioTimes);
+    }
+    gLowCapRatioTimes = dict;
 }
 
-IOReturn _setLowCapRatioTime(CFStringRef batterySerialNumber,
-                             boolean_t hasLowCapRatio,
-                             time_t since)
+static IOReturn _flushLowCapRatioTimes(void)
 {
     IOReturn                    ret         = kIOReturnError;
-#if !TARGET_OS_EMBEDDED
-    boolean_t                   contains    = false;
     boolean_t                   locked      = false;
     
     SCPreferencesRef            energyPrefs = NULL; // must release
     CFMutableDictionaryRef      dict        = NULL; // must release
-    CFNumberRef                 num         = NULL; // must release
     CFPropertyListRef           plist       = NULL; // do not release
-    
-    if (!isA_CFString(batterySerialNumber))
-        goto exit;
+
+    if (!gLowCapRatioPending || (0 == CFDictionaryGetCount(gLowCapRatioPending))) {
+        return kIOReturnSuccess;
+    }
 
     energyPrefs = SCPreferencesCreate(kCFAllocatorDefault,
                                       CFSTR(kIOPMAppName),
@@ -1162,61 +1364,28 @@ IOReturn _setLowCapRatioTime(CFStringRef batterySerialNumber,
     
     locked = true;
     
+    // Apply the pending changes to what's on disk now
     plist = SCPreferencesGetValue(energyPrefs, CFSTR("BatteryWarn"));
     
-    if (!plist) {
-        contains = false;
+    if (plist && (CFGetTypeID(plist) == CFDictionaryGetTypeID())) {
+        dict = CFDictionaryCreateMutableCopy(kCFAllocatorDefault,
+                                             0,
+                                             plist);
     }
     else {
-        if (CFGetTypeID(plist) != CFDictionaryGetTypeID()) {
-            goto exit;
-        }
-        contains = CFDictionaryContainsKey(plist, batterySerialNumber);
-    }
-    
-    if (!(hasLowCapRatio ^ contains)) {
-        // no change needed
-        ret = kIOReturnSuccess;
-        goto exit;
-    }
-    
-    // need to make changes to the SCPreferencesRef
-    
-    if (!plist) {
         dict = CFDictionaryCreateMutable(kCFAllocatorDefault,
                                          0,
                                          &kCFTypeDictionaryKeyCallBacks,
                                          &kCFTypeDictionaryValueCallBacks);
-        if (!dict) {
-            goto exit;
-        }
-    }
-    else {
-        dict = CFDictionaryCreateMutableCopy(kCFAllocatorDefault,
-                                             0,
-                                             plist);
-        if (!dict) {
-            goto exit;
-        }
-    }
-    
-    if (hasLowCapRatio && !contains) {
-        // need to add entry
-        num = CFNumberCreate(kCFAllocatorDefault,
-                             kCFNumberSInt64Type,
-                             &since);
-        CFDictionarySetValue(dict, batterySerialNumber, num);
-        CFRelease(num);
     }
-    
-    if (!hasLowCapRatio && contains) {
-        // need to remove entry
-        CFDictionaryRemoveValue(dict, batterySerialNumber);
+    if (!dict) {
+        goto exit;
     }
+    _applyPendingLowCapRatioTimes(dict);
     
     if (CFDictionaryGetCount(dict) == 0) {
         // if dictionary is empty, remove it from the SCPreferences.
-        if (!SCPreferencesRemoveValue(energyPrefs, CFSTR("BatteryWarn"))) {
+        if (plist && !SCPreferencesRemoveValue(energyPrefs, CFSTR("BatteryWarn"))) {
             goto exit;
         }
     }
@@ -1251,7 +1420,106 @@ exit:
     
     if (energyPrefs)    CFRelease(energyPrefs);
     if (dict)           CFRelease(dict);
+
+    // Retrying won't help a write that was refused; keep the change in memory only
+    if ((kIOReturnSuccess == ret) || (kIOReturnNotPrivileged == ret)) {
+        CFDictionaryRemoveAllValues(gLowCapRatioPending);
+    }
+    if (kIOReturnSuccess != ret) {
+        asl_log(NULL, NULL, ASL_LEVEL_ERR, "Can't write BatteryWarn to %s (0x%x)\n", kIOPMPrefsPath, ret);
+    }
+    return ret;
+}
+#endif
+
+IOReturn _getLowCapRatioTime(CFStringRef batterySerialNumber,
+                             boolean_t *hasLowCapRatio,
+                             time_t *since)
+{
+    IOReturn                    ret         = kIOReturnError;
+    
+#if !TARGET_OS_EMBEDDED
+    CFNumberRef                 num         = NULL; // do not release
+    
+    if (!hasLowCapRatio || !since || !isA_CFString(batterySerialNumber)) {
+        return ret;
+    }
+    
+    *hasLowCapRatio = false;
+    *since = 0;
+    
+    if (!gLowCapRatioTimes) {
+        _loadLowCapRatioTimes();
+        if (!gLowCapRatioTimes) {
+            return ret;
+        }
+    }
+    
+    num = CFDictionaryGetValue(gLowCapRatioTimes, batterySerialNumber);
+    if (num && CFNumberGetTypeID() == CFGetTypeID(num)) {
+        if (!CFNumberGetValue(num, CFNumberGetType(num), since)) {
+            return ret;
+        }
+        *hasLowCapRatio = true;
+    }
     
+    ret = kIOReturnSuccess;
+#endif
+    return ret;
+}
+
+IOReturn _setLowCapRatioTime(CFStringRef batterySerialNumber,
+                             boolean_t hasLowCapRatio,
+                             time_t since)
+{
+    IOReturn                    ret         = kIOReturnError;
+#if !TARGET_OS_EMBEDDED
+    CFNumberRef                 num         = NULL; // must release
+    
+    if (!isA_CFString(batterySerialNumber))
+        return ret;
+
+    if (!gLowCapRatioTimes) {
+        _loadLowCapRatioTimes();
+    }
+    if (!gLowCapRatioPending) {
+        gLowCapRatioPending = CFDictionaryCreateMutable(kCFAllocatorDefault,
+                                                        0,
+                                                        &kCFTypeDictionaryKeyCallBacks,
+                                                        &kCFTypeDictionaryValueCallBacks);
+    }
+    if (!gLowCapRatioTimes || !gLowCapRatioPending)
+        return ret;
+    
+    if (!(hasLowCapRatio ^ CFDictionaryContainsKey(gLowCapRatioTimes, batterySerialNumber))) {
+        // no change needed
+        return kIOReturnSuccess;
+    }
+    
+    if (hasLowCapRatio) {
+        num = CFNumberCreate(kCFAllocatorDefault,
+                             kCFNumberSInt64Type,
+                             &since);
+        if (!num)
+            return ret;
+        CFDictionarySetValue(gLowCapRatioTimes, batterySerialNumber, num);
+        CFDictionarySetValue(gLowCapRatioPending, batterySerialNumber, num);
+        CFRelease(num);
+    } else {
+        CFDictionaryRemoveValue(gLowCapRatioTimes, batterySerialNumber);
+        CFDictionarySetValue(gLowCapRatioPending, batterySerialNumber, kCFNull);
+    }
+    
+    if (!gLowCapRatioFlushScheduled) {
+        gLowCapRatioFlushScheduled = true;
+        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, kLowCapRatioFlushDelay),
+                       dispatch_get_main_queue(), ^{
+            gLowCapRatioFlushScheduled = false;
+            _flushLowCapRatioTimes();
+        });
+    }
+    
+    ret = kIOReturnSuccess;
 #endif
     return ret;
 }
@@ -1404,6 +1672,71 @@ __private_extern__ IOPMBattery *_newBatteryFound(io_registry_entry_t where)
 }
 
 
+/*
+ * Battery properties read by _prefetchBatteries(), by registry entry ID.
+ * Each is handed to the first _batteryChanged() for its battery.
+ */
+static CFMutableDictionaryRef   prefetchedBatteries = NULL;
+
+__private_extern__ void _prefetchBatteries(void)
+{
+    io_iterator_t           iter = MACH_PORT_NULL;
+    io_registry_entry_t     battery;
+    CFMutableDictionaryRef  props;
+    CFNumberRef             key;
+    uint64_t                entryID;
+
+    if (KERN_SUCCESS != IOServiceGetMatchingServices(kIOMasterPortDefault,
+                                IOServiceMatching("IOPMPowerSource"), &iter)) {
+        return;
+    }
+
+    prefetchedBatteries = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks,
+                                                    &kCFTypeDictionaryValueCallBacks);
+    while ((battery = IOIteratorNext(iter)))
+    {
+        props = NULL;
+        if ((KERN_SUCCESS == IORegistryEntryGetRegistryEntryID(battery, &entryID))
+            && (KERN_SUCCESS == IORegistryEntryCreateCFProperties(battery, &props, kCFAllocatorDefault, 0)))
+        {
+            key = CFNumberCreate(0, kCFNumberSInt64Type, &entryID);
+            if (key) {
+                CFDictionarySetValue(prefetchedBatteries, key, props);
+                CFRelease(key);
+            }
+            CFRelease(props);
+        }
+        IOObjectRelease(battery);
+    }
+    IOObjectRelease(iter);
+}
+
+static CFMutableDictionaryRef copyPrefetchedBatteryProperties(io_registry_entry_t battery)
+{
+    CFMutableDictionaryRef  props = NULL;
+    CFNumberRef             key;
+    uint64_t                entryID;
+
+    if (!prefetchedBatteries
+        || (KERN_SUCCESS != IORegistryEntryGetRegistryEntryID(battery, &entryID))) {
+        return NULL;
+    }
+    key = CFNumberCreate(0, kCFNumberSInt64Type, &entryID);
+    if (key) {
+        props = (CFMutableDictionaryRef)CFDictionaryGetValue(prefetchedBatteries, key);
+        if (props) {
+            CFRetain(props);
+            CFDictionaryRemoveValue(prefetchedBatteries, key);
+        }
+        CFRelease(key);
+    }
+    if (0 == CFDictionaryGetCount(prefetchedBatteries)) {
+        CFRelease(prefetchedBatteries);
+        prefetchedBatteries = NULL;
+    }
+    return props;
+}
+
 __private_extern__ void _batteryChanged(IOPMBattery *changed_battery)
 {
     kern_return_t       kr;
@@ -1419,6 +1752,11 @@ __private_extern__ void _batteryChanged(IOPMBattery *changed_battery)
         changed_battery->properties = NULL;
     }
 
+    if ((changed_battery->properties = copyPrefetchedBatteryProperties(changed_battery->me))) {
+        _unpackBatteryState(changed_battery, changed_battery->properties);
+        return;
+    }
+
     kr = IORegistryEntryCreateCFProperties(
                             changed_battery->me,
                             &(changed_battery->properties),
@@ -1543,6 +1881,79 @@ __private_extern__ aslmsg new_msg_pmset_log(void)
     return m;
 }
 
+#ifndef __I_AM_PMSET__
+// More keys than any 'pmset -g log' message carries
+#define kMaxEventHistoryFields      256
+
+static PMEventKind eventKindForDomain(const char *domain)
+{
+    if (!domain) {
+        return kPMEventOther;
+    }
+    if (!strcmp(domain, kPMASLDomainPMStart)) {
+        return kPMEventBoot;
+    }
+    if (!strcmp(domain, kPMASLDomainPMSleep)) {
+        return kPMEventSleep;
+    }
+    if (!strcmp(domain, kPMASLDomainPMWake)) {
+        return kPMEventWake;
+    }
+    if (!strcmp(domain, kPMASLDomainPMDarkWake)) {
+        return kPMEventDarkWake;
+    }
+    return kPMEventOther;
+}
+
+/*
+ * Copies a 'pmset -g log' message into the binary event history that
+ * pmset reads in place of the ASL store.
+ */
+static void recordEventHistory(aslmsg m)
+{
+    static PMEventHistory   *history = NULL;
+    static dispatch_once_t  onceToken;
+    const char              *keys[kMaxEventHistoryFields];
+    const char              *values[kMaxEventHistoryFields];
+    const char              *key, *value;
+    PMEventKind             kind;
+    int                     count = 0;
+
+    dispatch_once(&onceToken, ^{
+        history = PMEventHistoryOpen(kPMEventHistoryPath, true);
+    });
+    if (!history) {
+        return;
+    }
+
+    for (uint32_t i = 0; (key = asl_key(m, i)) && (count < kMaxEventHistoryFields); i++)
+    {
+        // The same for every message
+        if (!strcmp(key, ASL_KEY_LEVEL) || !strcmp(key, ASL_KEY_FACILITY)) {
+            continue;
+        }
+        if ((value = asl_get(m, key))) {
+            keys[count] = key;
+            values[count] = value;
+            count++;
+        }
+    }
+
+    kind = eventKindForDomain(asl_get(m, kPMASLDomainKey));
+    value = asl_get(m, kPMASLValueKey);
+    PMEventHistoryAppend(history, time(NULL), kind, value ? (uint32_t)strtol(value, NULL, 0) : 0,
+                         asl_get(m, kPMASLUUIDKey), keys, values, count);
+}
+#endif
+
+__private_extern__ void send_msg_pmset_log(aslmsg m)
+{
+#ifndef __I_AM_PMSET__
+    recordEventHistory(m);
+#endif
+    asl_send(NULL, m);
+}
+
 
 __private_extern__ void logASLMessagePMStart(void)
 {
@@ -1556,7 +1967,7 @@ __private_extern__ void logASLMessagePMStart(void)
     }
     asl_set(m, kPMASLDomainKey, kPMASLDomainPMStart);
     asl_set(m, ASL_KEY_MSG, "powerd process is started\n");
-    asl_send(NULL, m);
+    send_msg_pmset_log(m);
     asl_release(m);
 }
 
@@ -1617,6 +2028,7 @@ __private_extern__ void logASLMessageSleep(
     char                    messageString[200];
     char                    reasonString[100];
     char                    tcpKeepAliveString[50];
+    const char              *uuid = NULL;
 
     m = new_msg_pmset_log();
 
@@ -1661,18 +2073,26 @@ __private_extern__ void logASLMessageSleep(
 
     // UUID
     if (uuidStr) {
-        asl_set(m, kPMASLUUIDKey, uuidStr);  // Caller Provided
+        uuid = uuidStr;     // Caller Provided
     } else if (_getUUIDString(uuidString, sizeof(uuidString))) {
-        asl_set(m, kPMASLUUIDKey, uuidString);
+        uuid = uuidString;
+    }
+    if (uuid) {
+        asl_set(m, kPMASLUUIDKey, uuid);
     }
-    
+
+#ifndef __I_AM_PMSET__
+    // kIsDarkWake here is a full wake entering S0 DarkWake, not a sleep
+    cycleRecordSleep(uuid, reasonString, success ? sleepCyclesCount : 0,
+                     success, (sleepType == kIsDarkWake));
+#endif
 
     snprintf(messageString, sizeof(messageString), "%s: %s %s",
             messageString,  powerLevelBuf, tcpKeepAliveString);
 
     asl_set(m, kPMASLSignatureKey, sig);
     asl_set(m, ASL_KEY_MSG, messageString);
-    asl_send(NULL, m);
+    send_msg_pmset_log(m);
     asl_release(m);
 }
 
@@ -1701,8 +2121,11 @@ __private_extern__ void logASLMessageWake(
     CFStringRef             wakeType = NULL;
     const char *            sleepTypeString;
     bool                    success = true;
+    char                    cycleReason[50];
+    char                    cycleType[50];
 
     m = new_msg_pmset_log();
+    cycleReason[0] = cycleType[0] = 0;
 
     asl_set(m, kPMASLSignatureKey, sig);
     if (_getUUIDString(buf, sizeof(buf))) {
@@ -1726,6 +2149,8 @@ __private_extern__ void logASLMessageWake(
         if (isA_CFString(reasons.platformWakeType)) {
             CFStringGetCString(reasons.platformWakeType, wakeTypeBuf, sizeof(wakeTypeBuf), kCFStringEncodingUTF8);
         }
+        strlcpy(cycleReason, wakeReasonBuf, sizeof(cycleReason));
+        strlcpy(cycleType, wakeTypeBuf, sizeof(cycleType));
         snprintf(wakeReasonBuf, sizeof(wakeReasonBuf), "%s/%s", wakeReasonBuf, wakeTypeBuf);
         detailString = wakeReasonBuf;
         powerString(powerLevelBuf, sizeof(powerLevelBuf));
@@ -1833,10 +2258,15 @@ __private_extern__ void logASLMessageWake(
           powerLevelBuf);
 
     asl_set(m, ASL_KEY_MSG, buf);
-    asl_send(NULL, m);
+    send_msg_pmset_log(m);
     asl_release(m);
 
     logASLMessageHibernateStatistics( );
+
+#ifndef __I_AM_PMSET__
+    // After the hibernate statistics, which go in the same record
+    cycleRecordWake(success, (dark_wake == kIsDarkWake), cycleReason, cycleType);
+#endif
 }
 /*****************************************************************************/
 
@@ -1857,7 +2287,7 @@ __private_extern__ void logASLAppWakeReason(
     snprintf(msg, sizeof(msg), "AppWoke:%s Reason:%s", ident?ident:"--none--", reason?reason:"--none--");
     asl_set(m, ASL_KEY_MSG, msg);
 
-    asl_send(NULL, m);
+    send_msg_pmset_log(m);
     asl_release(m);
 }
 
@@ -1905,6 +2335,10 @@ __private_extern__ void logASLMessageHibernateStatistics(void)
             goto exit;
     }
 
+#ifndef __I_AM_PMSET__
+    cycleRecordHibernate((uint32_t)writeHIBImageMS, (uint32_t)readHIBImageMS);
+#endif
+
     m = new_msg_pmset_log();
 
     asl_set(m, kPMASLDomainKey, kPMASLDomainHibernateStatistics);
@@ -1929,7 +2363,7 @@ __private_extern__ void logASLMessageHibernateStatistics(void)
     snprintf(buf, sizeof(buf), "hibmode=%d standbydelay=%d", hibernateMode, hibernateDelay);
 
     asl_set(m, ASL_KEY_MSG, buf);
-    asl_send(NULL, m);
+    send_msg_pmset_log(m);
     asl_release(m);
 exit:
     if(statsData)
@@ -1969,7 +2403,7 @@ __private_extern__ void logASLPMConnectionNotify(
          appName,notificationBits );
 
     asl_set(m, ASL_KEY_MSG, buf);
-    asl_send(NULL, m);
+    send_msg_pmset_log(m);
     asl_release(m);
 }
 
@@ -1995,7 +2429,7 @@ __private_extern__ void logASLDisplayStateChange()
         displayState ? "off" : "on");
 
     asl_set(m, ASL_KEY_MSG, buf);
-    asl_send(NULL, m);
+    send_msg_pmset_log(m);
     asl_release(m);
 
     if (displayState) {
@@ -2007,6 +2441,29 @@ __private_extern__ void logASLDisplayStateChange()
 }
 #endif
 
+#ifndef __I_AM_PMSET__
+/* The sleep/wake record's kind of response, or 0 for one it doesn't keep */
+static PMSleepWakeResponseType cycleResponseType(CFStringRef responseTypeString)
+{
+    if (!isA_CFString(responseTypeString)) {
+        return 0;
+    }
+    if (CFEqual(responseTypeString, CFSTR(kIOPMStatsResponseTimedOut))) {
+        return kPMSleepWakeResponseTimedOut;
+    }
+    if (CFEqual(responseTypeString, CFSTR(kIOPMStatsResponseCancel))) {
+        return kPMSleepWakeResponseCancel;
+    }
+    if (CFEqual(responseTypeString, CFSTR(kIOPMStatsResponseSlow))) {
+        return kPMSleepWakeResponseSlow;
+    }
+    if (CFEqual(responseTypeString, CFSTR(kPMASLDomainSleepServiceCapApp))) {
+        return kPMSleepWakeResponseCapExceeded;
+    }
+    return 0;
+}
+#endif
+
 __private_extern__ void logASLMessagePMConnectionResponse(
     CFStringRef     logSourceString,
     CFStringRef     appNameString,
@@ -2104,10 +2561,13 @@ __private_extern__ void logASLMessagePMConnectionResponse(
        asl_set(m, kPMASLDelayKey, buf);
     }
 
-    asl_send(NULL, m);
+    send_msg_pmset_log(m);
     asl_release(m);
 
 #ifndef __I_AM_PMSET__
+    if (cycleResponseType(responseTypeString)) {
+        cycleRecordResponse(appNamePtr, cycleResponseType(responseTypeString), time);
+    }
     if (timeout) {
         mt2RecordAppTimeouts(reasons.sleepReason, appNameString);
     }
@@ -2176,6 +2636,12 @@ __private_extern__ void  logASLMessageAppStats(CFArrayRef appFailuresArray, char
             continue;
         }
 
+#ifndef __I_AM_PMSET__
+        if (cycleResponseType(responseTypeString)) {
+            cycleRecordResponse(appName, cycleResponseType(responseTypeString), num);
+        }
+#endif
+
         if (!_getUUIDString(key, sizeof(key)))
             continue;
         asl_set(m, kPMASLUUIDKey, key);
@@ -2228,7 +2694,7 @@ __private_extern__ void  logASLMessageAppStats(CFArrayRef appFailuresArray, char
         }
 #endif
     }
-    asl_send(NULL, m);
+    send_msg_pmset_log(m);
     asl_release(m);
 
 }
@@ -2262,7 +2728,7 @@ __private_extern__ void logASLMessagePMConnectionScheduledWakeEvents(CFStringRef
 
     asl_set(m, kPMASLDomainKey, kPMASLDomainPMWakeRequests);
     asl_set(m, ASL_KEY_MSG, requestors);
-    asl_send(NULL, m);
+    send_msg_pmset_log(m);
     asl_release(m);
     CFRelease(messageString);
 
@@ -2291,7 +2757,7 @@ __private_extern__ void logASLMessageExecutedWakeupEvent(CFStringRef requestedMa
 
     asl_set(m, kPMASLDomainKey, kPMASLDomainPMWakeRequests);
     asl_set(m, ASL_KEY_MSG, requestors);
-    asl_send(NULL, m);
+    send_msg_pmset_log(m);
     asl_release(m);
     CFRelease(messageString);
 }
@@ -2319,7 +2785,7 @@ __private_extern__ void logASLMessageIgnoredDWTEmergency(void)
         "Ignored DarkWake thermal emergency signal %s", tcpKeepAliveString);
     asl_set(m, ASL_KEY_MSG, strbuf);
 
-    asl_send(NULL, m);
+    send_msg_pmset_log(m);
     asl_release(m);
 }
 #endif
@@ -2347,7 +2813,7 @@ __private_extern__ void logASLMessageSleepCanceledAtLastCall(void)
         "Sleep in process aborted due to power assertion %s", tcpKeepAliveString);
     asl_set(m, ASL_KEY_MSG, strbuf);
 
-    asl_send(NULL, m);
+    send_msg_pmset_log(m);
     asl_release(m);
 }
 
@@ -2382,7 +2848,7 @@ __private_extern__ void logASLBatteryHealthChanged(const char *health,
     }
     asl_set(m, ASL_KEY_MSG, strbuf);
     
-    asl_send(NULL, m);
+    send_msg_pmset_log(m);
     asl_release(m);
 }
 
@@ -2403,7 +2869,7 @@ __private_extern__ void logASLLowBatteryWarning(IOPSLowBatteryWarningLevel level
              level, time, ccap);
     asl_set(m, ASL_KEY_MSG, strbuf);
     
-    asl_send(NULL, m);
+    send_msg_pmset_log(m);
     asl_release(m);
 #endif
 }
@@ -2445,6 +2911,30 @@ static void mt2PublishWakeReason(CFStringRef wakeTypeStr, CFStringRef claimedWak
  * MessageTracer2 DarkWake Keys
  */
 
+/* Per-process counts, each published to its own domain */
+typedef enum {
+    kMT2BackgroundTasks             = 0,
+    kMT2PushTasks,
+    kMT2PushTimeouts,
+    kMT2IdleSleepAckTimeouts,
+    kMT2DemandSleepAckTimeouts,
+    kMT2DarkWakeSleepAckTimeouts,
+    kMT2ProcessDomainCount
+} MT2ProcessDomain;
+
+/* Domains below this count a process at most once per dark wake */
+#define kMT2OncePerDarkWakeCount    (kMT2PushTimeouts + 1)
+
+#define kMT2NoProcess               UINT32_MAX
+#define kMT2MaxProcesses            256     /* Forget interned processes past this many at each period */
+
+typedef struct {
+    CFStringRef                 name;
+    CFHashCode                  hash;
+    uint32_t                    darkWakeRecorded[kMT2OncePerDarkWakeCount];    /* darkWake it was last counted in */
+    uint32_t                    counts[kMT2ProcessDomainCount];
+} MT2Process;
+
 typedef struct {
     CFAbsoluteTime              startedPeriod;
     dispatch_source_t           nextFireSource;
@@ -2458,18 +2948,16 @@ typedef struct {
     uint16_t                    wakeEvents[kWakeStateCount];
     /* for domain com.apple.darkwake.thermal */
     uint16_t                    thermalEvents[kThermalStateCount];
-    /* for domain com.apple.darkwake.backgroundtasks */
-    CFMutableSetRef             alreadyRecordedBackground;
-    CFMutableDictionaryRef      tookBackground;
-    /* for domain com.apple.darkwake.pushservicetasks */
-    CFMutableSetRef             alreadyRecordedPush;
-    CFMutableDictionaryRef      tookPush;
-    /* for domain com.apple.darkwake.pushservicetasktimeout */
-    CFMutableSetRef             alreadyRecordedPushTimeouts;
-    CFMutableDictionaryRef      timeoutPush;
-    CFMutableDictionaryRef      idleSleepAppTimeouts;
-    CFMutableDictionaryRef      demandSleepAppTimeouts;
-    CFMutableDictionaryRef      darkwakeSleepAppTimeouts;
+    /* for the per-process domains: processes interned by name into 'procs',
+     * found through 'procSlots', an open addressing table of process id + 1.
+     */
+    MT2Process                  *procs;
+    uint32_t                    procCount;
+    uint32_t                    procCapacity;
+    uint32_t                    *procSlots;
+    uint32_t                    procSlotCount;      /* a power of 2, twice procCapacity */
+    uint32_t                    epoch;              /* changes when interned processes are forgotten */
+    uint32_t                    darkWake;           /* changes as each dark wake ends */
 } MT2Aggregator;
 
 static const uint64_t   kMT2CheckIntervalTimer = 4ULL*60ULL*60ULL*NSEC_PER_SEC;     /* Check every 4 hours */
@@ -2480,37 +2968,40 @@ static MT2Aggregator    *mt2 = NULL;
 
 void initializeMT2Aggregator(void)
 {
+    uint32_t    i;
+
     if (mt2)
     {
-        /* Zero out & recycle MT2Aggregator structure */
+        /* Recycle the MT2Aggregator structure: counters are reset in place,
+         * and interned processes are kept unless there are too many of them.
+         */
         if (mt2->nextFireSource) {
+            dispatch_source_cancel(mt2->nextFireSource);
             dispatch_release(mt2->nextFireSource);
+            mt2->nextFireSource = NULL;
         }
-        CFRelease(mt2->alreadyRecordedBackground);
-        CFRelease(mt2->tookBackground);
-        CFRelease(mt2->alreadyRecordedPush);
-        CFRelease(mt2->tookPush);
-        CFRelease(mt2->alreadyRecordedPushTimeouts);
-        CFRelease(mt2->timeoutPush);
-        CFRelease(mt2->idleSleepAppTimeouts);
-        CFRelease(mt2->demandSleepAppTimeouts);
-        CFRelease(mt2->darkwakeSleepAppTimeouts);
-
-        bzero(mt2, sizeof(MT2Aggregator));
+        bzero(mt2->wakeEvents, sizeof(mt2->wakeEvents));
+        bzero(mt2->thermalEvents, sizeof(mt2->thermalEvents));
+
+        if (mt2->procCount > kMT2MaxProcesses) {
+            for (i = 0; i < mt2->procCount; i++) {
+                CFRelease(mt2->procs[i].name);
+            }
+            bzero(mt2->procSlots, mt2->procSlotCount * sizeof(uint32_t));
+            mt2->procCount = 0;
+            mt2->epoch++;
+        }
+        for (i = 0; i < mt2->procCount; i++) {
+            bzero(mt2->procs[i].counts, sizeof(mt2->procs[i].counts));
+        }
+        mt2->darkWake++;
     } else {
         /* New datastructure */
         mt2 = calloc(1, sizeof(MT2Aggregator));
+        mt2->epoch = 1;
+        mt2->darkWake = 1;
     }
     mt2->startedPeriod                      = CFAbsoluteTimeGetCurrent();
-    mt2->alreadyRecordedBackground          = CFSetCreateMutable(0, 0, &kCFTypeSetCallBacks);
-    mt2->alreadyRecordedPush                = CFSetCreateMutable(0, 0, &kCFTypeSetCallBacks);
-    mt2->alreadyRecordedPushTimeouts        = CFSetCreateMutable(0, 0, &kCFTypeSetCallBacks);
-    mt2->tookBackground                     = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, NULL);
-    mt2->tookPush                           = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, NULL);
-    mt2->timeoutPush                        = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, NULL);
-    mt2->idleSleepAppTimeouts               = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, NULL);
-    mt2->demandSleepAppTimeouts             = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, NULL);
-    mt2->darkwakeSleepAppTimeouts           = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, NULL);
 
     mt2->nextFireSource = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, dispatch_get_main_queue());
     if (mt2->nextFireSource) {
@@ -2666,41 +3157,35 @@ static int mt2PublishDomainThermals(void)
     return sentCount;
 }
 
-static int mt2PublishDomainProcess(const char *appdomain, CFDictionaryRef apps)
+static int mt2PublishDomainProcess(const char *appdomain, MT2ProcessDomain domain)
 {
 #define kMT2KeyApp                      "com.apple.message.process"
 
-    CFStringRef         *keys;
-    uintptr_t           *counts;
+    MT2Process          *proc;
     char                buf[2*kProcNameBufLen];
     int                 sendCount = 0;
-    int                 appcount = 0;
-    int                 i = 0;
+    uint32_t            i = 0;
 
-    if (!mt2 || !apps || (0 == (appcount = CFDictionaryGetCount(apps))))
+    if (!mt2)
     {
         return 0;
     }
 
-    keys = (CFStringRef *)calloc(sizeof(CFStringRef), appcount);
-    counts = (uintptr_t *)calloc(sizeof(uintptr_t), appcount);
-
-    CFDictionaryGetKeysAndValues(apps, (const void **)keys, (const void **)counts);
-
-    for (i=0; i<appcount; i++)
+    for (i=0; i<mt2->procCount; i++)
     {
-        if (0 == counts[i]) {
+        proc = &mt2->procs[i];
+        if (0 == proc->counts[domain]) {
             continue;
         }
         aslmsg m = asl_new(ASL_TYPE_MSG);
         asl_set(m, "com.apple.message.domain", appdomain);
 
-        if (!CFStringGetCString(keys[i], buf, sizeof(buf), kCFStringEncodingUTF8)) {
+        if (!CFStringGetCString(proc->name, buf, sizeof(buf), kCFStringEncodingUTF8)) {
             snprintf(buf, sizeof(buf), "com.apple.message.%s", "Unknown");
         }
         asl_set(m, kMT2KeyApp, buf);
 
-        snprintf(buf, sizeof(buf), "%d", (int)counts[i]);
+        snprintf(buf, sizeof(buf), "%d", (int)proc->counts[domain]);
         asl_set(m, "com.apple.message.count", buf);
 
         asl_log(NULL, m, ASL_LEVEL_ERR,"");
@@ -2709,9 +3194,6 @@ static int mt2PublishDomainProcess(const char *appdomain, CFDictionaryRef apps)
 
     }
 
-    free(keys);
-    free(counts);
-
     return sendCount;
 }
 
@@ -2744,12 +3226,12 @@ void mt2PublishReports(void)
     {
         mt2PublishDomainWakes();
         mt2PublishDomainThermals();
-        mt2PublishDomainProcess(kMT2DomainPushTasks, mt2->tookPush);
-        mt2PublishDomainProcess(kMT2DomainPushTimeouts, mt2->timeoutPush);
-        mt2PublishDomainProcess(kMT2DomainBackgroundTasks, mt2->tookBackground);
-        mt2PublishDomainProcess(kMT2DomainIdleSlpAckTo, mt2->idleSleepAppTimeouts);
-        mt2PublishDomainProcess(kMT2DomainDemandSlpAckTo, mt2->demandSleepAppTimeouts);
-        mt2PublishDomainProcess(kMT2DomainDarkWkSlpAckTo, mt2->darkwakeSleepAppTimeouts);
+        mt2PublishDomainProcess(kMT2DomainPushTasks, kMT2PushTasks);
+        mt2PublishDomainProcess(kMT2DomainPushTimeouts, kMT2PushTimeouts);
+        mt2PublishDomainProcess(kMT2DomainBackgroundTasks, kMT2BackgroundTasks);
+        mt2PublishDomainProcess(kMT2DomainIdleSlpAckTo, kMT2IdleSleepAckTimeouts);
+        mt2PublishDomainProcess(kMT2DomainDemandSlpAckTo, kMT2DemandSleepAckTimeouts);
+        mt2PublishDomainProcess(kMT2DomainDarkWkSlpAckTo, kMT2DarkWakeSleepAckTimeouts);
 
         // Recyle the data structure for the next reporting.
         initializeMT2Aggregator();
@@ -2767,9 +3249,8 @@ void mt2DarkWakeEnded(void)
     if (!mt2) {
         return;
     }
-    CFSetRemoveAllValues(mt2->alreadyRecordedBackground);
-    CFSetRemoveAllValues(mt2->alreadyRecordedPush);
-    CFSetRemoveAllValues(mt2->alreadyRecordedPushTimeouts);
+    /* Forgets which processes were counted during the dark wake */
+    mt2->darkWake++;
 }
 
 void mt2EvaluateSystemSupport(void)
@@ -2859,89 +3340,170 @@ void mt2RecordThermalEvent(uint32_t description)
 /* PMConnection.c */
 bool isA_DarkWakeState();
 
+static bool mt2GrowProcesses(void)
+{
+    uint32_t        capacity = mt2->procCapacity ? 2 * mt2->procCapacity : 32;
+    uint32_t        slotCount = 2 * capacity;
+    MT2Process      *procs;
+    uint32_t        *slots;
+    uint32_t        i, j;
+
+    procs = realloc(mt2->procs, capacity * sizeof(MT2Process));
+    if (!procs) {
+        return false;
+    }
+    mt2->procs = procs;
+
+    slots = calloc(slotCount, sizeof(uint32_t));
+    if (!slots) {
+        return false;
+    }
+    for (i = 0; i < mt2->procCount; i++) {
+        j = procs[i].hash & (slotCount - 1);
+        while (slots[j]) {
+            j = (j + 1) & (slotCount - 1);
+        }
+        slots[j] = i + 1;
+    }
+    free(mt2->procSlots);
+    mt2->procSlots = slots;
+    mt2->procSlotCount = slotCount;
+    mt2->procCapacity = capacity;
+    return true;
+}
+
+/* Returns the index of 'name' in mt2->procs, adding it if it's new. */
+static uint32_t mt2InternProcess(CFStringRef name)
+{
+    CFHashCode      hash = CFHash(name);
+    MT2Process      *proc;
+    uint32_t        mask, i, id;
+
+    if ((mt2->procCount == mt2->procCapacity) && !mt2GrowProcesses()) {
+        return kMT2NoProcess;
+    }
+
+    mask = mt2->procSlotCount - 1;
+    for (i = hash & mask; (id = mt2->procSlots[i]); i = (i + 1) & mask) {
+        proc = &mt2->procs[id - 1];
+        if ((proc->hash == hash) && CFEqual(proc->name, name)) {
+            return id - 1;
+        }
+    }
+
+    id = mt2->procCount++;
+    proc = &mt2->procs[id];
+    bzero(proc, sizeof(*proc));
+    proc->name = CFRetain(name);
+    proc->hash = hash;
+    mt2->procSlots[i] = id + 1;
+    return id;
+}
+
+/* The process's index is cached in its ProcessInfo, so assertions from a
+ * known process skip the name lookup.
+ */
+static uint32_t mt2ProcessForInfo(ProcessInfo *pinfo)
+{
+    uint32_t    id;
+
+    if (pinfo->mt2Epoch != mt2->epoch) {
+        id = mt2InternProcess(pinfo->name ? pinfo->name : CFSTR("Unknown"));
+        if (kMT2NoProcess == id) {
+            return id;
+        }
+        pinfo->mt2Process = id;
+        pinfo->mt2Epoch = mt2->epoch;
+    }
+    return pinfo->mt2Process;
+}
+
+static void mt2CountProcess(uint32_t id, MT2ProcessDomain domain)
+{
+    MT2Process      *proc;
+
+    if (kMT2NoProcess == id) {
+        return;
+    }
+    proc = &mt2->procs[id];
+    if (domain < kMT2OncePerDarkWakeCount) {
+        if (proc->darkWakeRecorded[domain] == mt2->darkWake) {
+            return;
+        }
+        proc->darkWakeRecorded[domain] = mt2->darkWake;
+    }
+    proc->counts[domain]++;
+}
+
 void mt2RecordAssertionEvent(assertionOps action, assertion_t *theAssertion)
 {
-    CFStringRef         processName;
     CFStringRef         assertionType;
+    MT2ProcessDomain    domain;
 
     if (!mt2) {
         return;
     }
 
-    if (!theAssertion || !theAssertion->props || !isA_DarkWakeState()) {
+    /* BackgroundTask and ApplePushServiceTask assertions are always one of these
+     * two types; ApplePushServiceTask is an alias for BackgroundTask outside of
+     * SleepServices wakes.
+     */
+    if (!theAssertion || !theAssertion->props
+        || ((kBackgroundTaskType != theAssertion->kassert) && (kPushServiceTaskType != theAssertion->kassert))
+        || !isA_DarkWakeState()) {
         return;
     }
 
-    if (!(processName = processInfoGetName(theAssertion->pinfo->pid))) {
-        processName = CFSTR("Unknown");
-    }
-
-    if (!(assertionType = CFDictionaryGetValue(theAssertion->props, kIOPMAssertionTypeKey))
-        || (!CFEqual(assertionType, kIOPMAssertionTypeBackgroundTask)
-         && !CFEqual(assertionType, kIOPMAssertionTypeApplePushServiceTask)))
-    {
+    if (!(assertionType = CFDictionaryGetValue(theAssertion->props, kIOPMAssertionTypeKey))) {
         return;
     }
 
     if (CFEqual(assertionType, kIOPMAssertionTypeBackgroundTask))
     {
-        if (kAssertionOpRaise == action) {
-            if (!CFSetContainsValue(mt2->alreadyRecordedBackground, processName)) {
-                int x = (int)CFDictionaryGetValue(mt2->tookBackground, processName);
-                x++;
-                CFDictionarySetValue(mt2->tookBackground, processName, (uintptr_t)x);
-                CFSetAddValue(mt2->alreadyRecordedBackground, processName);
-            }
+        if (kAssertionOpRaise != action) {
+            return;
         }
+        domain = kMT2BackgroundTasks;
     }
     else if (CFEqual(assertionType, kIOPMAssertionTypeApplePushServiceTask))
     {
         if (kAssertionOpRaise == action) {
-            if (!CFSetContainsValue(mt2->alreadyRecordedPush, processName)) {
-                int x = (int)CFDictionaryGetValue(mt2->tookPush, processName);
-                x++;
-                CFDictionarySetValue(mt2->tookPush, processName, (uintptr_t)x);
-                CFSetAddValue(mt2->alreadyRecordedPush, processName);
-            }
-        }
-        else if (kAssertionOpGlobalTimeout == action) {
-            if (!CFSetContainsValue(mt2->alreadyRecordedPushTimeouts, processName)) {
-                int x = (int)CFDictionaryGetValue(mt2->timeoutPush, processName);
-                x++;
-                CFDictionarySetValue(mt2->timeoutPush, (const void *)processName, (uintptr_t)x);
-                CFSetAddValue(mt2->alreadyRecordedPushTimeouts, processName);
-            }
+            domain = kMT2PushTasks;
+        } else if (kAssertionOpGlobalTimeout == action) {
+            domain = kMT2PushTimeouts;
+        } else {
+            return;
         }
     }
+    else {
+        return;
+    }
 
+    mt2CountProcess(mt2ProcessForInfo(theAssertion->pinfo), domain);
     return;
 }
 
 void mt2RecordAppTimeouts(CFStringRef sleepReason, CFStringRef procName)
 {
-    CFMutableDictionaryRef dict;
+    MT2ProcessDomain    domain;
 
     if ( !mt2 || !isA_CFString(procName)) return;
 
     if (CFStringCompare(sleepReason, CFSTR(kIOPMIdleSleepKey), 0) == kCFCompareEqualTo) {
-        dict = mt2->idleSleepAppTimeouts;
+        domain = kMT2IdleSleepAckTimeouts;
     }
     else  if ((CFStringCompare(sleepReason, CFSTR(kIOPMClamshellSleepKey), 0) == kCFCompareEqualTo) ||
             (CFStringCompare(sleepReason, CFSTR(kIOPMPowerButtonSleepKey), 0) == kCFCompareEqualTo) ||
             (CFStringCompare(sleepReason, CFSTR(kIOPMSoftwareSleepKey), 0) == kCFCompareEqualTo)) {
-        dict = mt2->demandSleepAppTimeouts;
+        domain = kMT2DemandSleepAckTimeouts;
     }
     else {
-        dict = mt2->darkwakeSleepAppTimeouts;
+        domain = kMT2DarkWakeSleepAckTimeouts;
     }
 
-    int x = (int)CFDictionaryGetValue(dict, procName);
-    x++;
-    CFDictionarySetValue(dict, (const void *)procName, (uintptr_t)x);
-
+    mt2CountProcess(mt2InternProcess(procName), domain);
 }
 
-
 #define kMT2DomainWakeReasons       "com.apple.iokit.wakereasons"
 #define kMT2DomainSleepFailure      "com.apple.sleep.failure"
 #define kMT2DomainWakeFailure       "com.apple.wake.failure"
@@ -3294,37 +3856,6 @@ void _oneOffHacksSetup(void)
 #endif
 }
 
-static const CFTimeInterval kTimeNSPerSec = 1000000000.0;
-
-CFTimeInterval _getHIDIdleTime(void)
-{
-    static io_registry_entry_t hidsys = IO_OBJECT_NULL;
-    CFNumberRef     hidsys_idlenum = NULL;
-    CFTimeInterval  ret_time = 0.0;
-    uint64_t        idle_nanos = 0;
-
-    if (IO_OBJECT_NULL == hidsys) {
-        hidsys = IOServiceGetMatchingService(kIOMasterPortDefault, IOServiceMatching("IOHIDSystem"));
-    }
-    if (!hidsys)
-        goto exit;
-
-    hidsys_idlenum = IORegistryEntryCreateCFProperty(hidsys, CFSTR(kIOHIDIdleTimeKey), 0, 0);
-
-    if (!isA_CFNumber(hidsys_idlenum))
-        goto exit;
-
-    if (CFNumberGetValue(hidsys_idlenum, kCFNumberSInt64Type, &idle_nanos))
-    {
-        ret_time = ((CFTimeInterval)idle_nanos)/kTimeNSPerSec;
-    }
-
-exit:
-    if (hidsys_idlenum)
-        CFRelease(hidsys_idlenum);
-    return ret_time;
-}
-
 /************************************************************************/
 /************************************************************************/
 /************************************************************************/
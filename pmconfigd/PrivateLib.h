@@ -58,6 +58,7 @@
 
 #include <dispatch/dispatch.h>
 #include "PMAssertions.h"
+#include "BatteryEstimator.h"
 
 #if !TARGET_OS_EMBEDDED
   #define HAVE_CF_USER_NOTIFICATION     1
@@ -151,6 +152,8 @@ struct IOPMBattery {
     int                     hwAverageTR;
     int                     hwInstantTR;
     int                     swCalculatedTR;
+    int                     swCalculatedTRLow;
+    int                     swCalculatedTRHigh;
     int                     swCalculatedPR;
     int                     invalidWakeSecs;
     CFStringRef             batterySerialNumber;
@@ -161,6 +164,7 @@ struct IOPMBattery {
     CFStringRef             chargeStatus;
     time_t                  lowCapRatioSinceTime;
     boolean_t               hasLowCapRatio;
+    BattEstimator           estimator;
 };
 typedef struct IOPMBattery IOPMBattery;
 
@@ -198,6 +202,40 @@ __private_extern__ IOReturn ActivatePMSettings(
     CFDictionaryRef                 useSettings,
     bool                            removeUnsupportedSettings);
 
+#ifndef __I_AM_PMSET__
+/* _invalidateEnergySettingsCache
+ * Forgets the cached "Supported Features" table and the last values sent to the
+ * kernel, so the next ActivatePMSettings() pushes every supported setting.
+ * Call when the kernel reports kIOPMMessageFeatureChange, or when something
+ * other than powerd has written the settings to the kernel.
+ */
+__private_extern__ void _invalidateEnergySettingsCache(void);
+
+/* _setMinutesToSleep
+ * Sends the system sleep timer to the kernel through the same cache as
+ * ActivatePMSettings(), so the two never disagree about what the kernel has.
+ */
+__private_extern__ IOReturn _setMinutesToSleep(io_connect_t PM_connection, uint32_t minutes);
+
+__private_extern__ void _getEnergySettingsCounts(uint32_t *pushed, uint32_t *skipped);
+#endif
+
+/*
+ * powerd internal counters, readable with io_pm_get_value_int() and
+ * displayed by 'pmset -g stats'.
+ * Numbered well above the kIOPMGet* selectors in IOPMLibPrivate.h.
+ */
+enum {
+    kPMStatsEnergySettingsPushed            = 0x1000,
+    kPMStatsEnergySettingsSkipped,
+    kPMStatsStoreKeysWritten,
+    kPMStatsStoreFlushes,
+    kPMStatsWakesScheduled,
+    kPMStatsWakeRequestsMerged,
+    kPMStatsUserActiveDeclared,
+    kPMStatsUserActiveCoalesced
+};
+
 
 
 #define kPowerManagementBundlePathCString       "/System/Library/CoreServices/powerd.bundle"
@@ -276,6 +314,7 @@ __private_extern__ IOReturn ActivatePMSettings(
 #define kPMASLWakeReqTypePrefix             "WakeType"
 #define kPMASLWakeReqClientInfoPrefix       "WakeClientInfo"
 #define kPMASLWakeReqChosenIdx              "WakeRequestChosen"
+#define kPMASLWakeReqMergedPrefix           "WakeMerged"
 
 
 /*
@@ -535,6 +574,12 @@ __private_extern__ void                 logASLLowBatteryWarning(IOPSLowBatteryWa
 
 __private_extern__ aslmsg               new_msg_pmset_log(void);
 
+/* send_msg_pmset_log
+ * Sends a message made by new_msg_pmset_log() to ASL, and in powerd also
+ * appends it to the event history that 'pmset -g log' reads.
+ */
+__private_extern__ void                 send_msg_pmset_log(aslmsg m);
+
 /* PM Kernel shares times with user space in a packed 64-bit integer.
  * Seconds since 1970 in the lower 32, microseconds in the upper 32.
  */
@@ -543,6 +588,11 @@ __private_extern__ CFAbsoluteTime       _CFAbsoluteTimeFromPMEventTimeStamp(uint
 __private_extern__ IOPMBattery          **_batteries(void);
 __private_extern__ IOPMBattery          *_newBatteryFound(io_registry_entry_t);
 __private_extern__ void                 _batteryChanged(IOPMBattery *);
+/* _prefetchBatteries
+ * Reads every battery's properties ahead of the first _batteryChanged().
+ * Safe to call from any thread before the batteries are matched.
+ */
+__private_extern__ void                 _prefetchBatteries(void);
 __private_extern__ bool                 _batteryHas(IOPMBattery *, CFStringRef);
 __private_extern__ int                  _batteryCount(void);
 __private_extern__ void                 _removeBattery(io_registry_entry_t);
@@ -555,6 +605,13 @@ __private_extern__ IOReturn _setLowCapRatioTime(CFStringRef batterySerialNumber,
                                                 boolean_t hasLowCapRatio,
                                                 time_t since);
 
+#if !TARGET_OS_EMBEDDED
+/* _loadLowCapRatioTimes
+ * Re-reads the cached BatteryWarn low capacity ratio times from the prefs file.
+ */
+__private_extern__ void _loadLowCapRatioTimes(void);
+#endif
+
 #if !TARGET_OS_EMBEDDED
 __private_extern__ CFUserNotificationRef _copyUPSWarning(void);
 __private_extern__ IOReturn              _smcWakeTimerPrimer(void);
@@ -593,11 +650,16 @@ __private_extern__ void                 _PortInvalidatedCallout(CFMachPortRef po
 __private_extern__ const char           *stringForLWCode(uint8_t code);
 __private_extern__ const char           *stringForPMCode(uint8_t code);
 
-__private_extern__ CFTimeInterval       _getHIDIdleTime(void);
-
 __private_extern__ CFRunLoopRef         _getPMRunLoop(void);
 __private_extern__ dispatch_queue_t     _getPMDispatchQueue(void);
 
+/* _sharedPageMap
+ * Maps a page of 'size' bytes that powerd publishes for clients under 'name',
+ * writable by powerd only. Re-uses the existing object if powerd is
+ * relaunched, so clients' existing mappings stay live.
+ */
+__private_extern__ void                 *_sharedPageMap(const char *name, size_t size);
+
 __private_extern__ bool getAggressivenessValue(CFDictionaryRef     dict,
                                                CFStringRef         key,
                                                CFNumberType        type,
@@ -26,6 +26,7 @@
 #include "RepeatingAutoWake.h"
 #include "PrivateLib.h"
 #include "AutoWakeScheduler.h"
+#include "RepeatingEventTime.h"
 
 /*
  * These are the days of the week as provided by
@@ -61,6 +62,22 @@ enum {
 static CFDictionaryRef  repeatingPowerOff = 0;
 static CFDictionaryRef  repeatingPowerOn = 0;
 
+/*
+ * The next occurrence of each repeating event, as returned by
+ * copyNextRepeatingEvent(). Valid from 'computedAt' until the occurrence
+ * passes, or until invalidateNextRepeatingEvents() on a change to the
+ * repeat settings, the clock or the time zone.
+ */
+typedef struct {
+    CFDictionaryRef     event;
+    CFAbsoluteTime      computedAt;
+    CFAbsoluteTime      time;
+} NextRepeatingEvent;
+
+static NextRepeatingEvent   nextPowerOff;
+static NextRepeatingEvent   nextPowerOn;
+static CFTimeZoneRef        repeatTimeZone = NULL;
+
 
 
 static bool 
@@ -135,70 +152,59 @@ getRepeatingDictionaryType(CFDictionaryRef event)
     return return_string;
 }
 
-// returns false if event occurs at 8PM and now it's 10PM
-// returns true if event occurs at 8PM, now it's 9AM
-static bool
-upcomingToday(CFDictionaryRef event, int today_cf)
+static void
+invalidateNextRepeatingEvents(void)
 {
-    static const int        kAllowScheduleWindowSeconds = 5;
-    uint32_t                secondsToday;
-    int                     secondsScheduled;
-	int						days_mask;
-    if(!event) return false;
-    
-    // Determine if the scheduled event falls on today's day of week
-    days_mask = getRepeatingDictionaryDayMask(event);
-    if(!(days_mask & (1 << (today_cf-1)))) return false;
-    
-    // get gregorian date for right now
-    int hour, minute;
-    CFCalendarDecomposeAbsoluteTime(_gregorian(), CFAbsoluteTimeGetCurrent(), "Hm", &hour, &minute);
-    
-    secondsToday = 60 * (hour*60 + minute);
-    secondsScheduled = 60 * getRepeatingDictionaryMinutes(event);
-
-    // Initially, we required a 2 minute safety window before scheduling the next
-    // power event. Now, we throw caution to the wind and try a 5 second window.
-    // Lost events will simply be lost events.
-    if(secondsScheduled >= (secondsToday + kAllowScheduleWindowSeconds))
-        return true;
-    else 
-        return false;
+    if (nextPowerOff.event) CFRelease(nextPowerOff.event);
+    if (nextPowerOn.event) CFRelease(nextPowerOn.event);
+    bzero(&nextPowerOff, sizeof(nextPowerOff));
+    bzero(&nextPowerOn, sizeof(nextPowerOn));
 }
 
-// daysUntil
-// returns 0 if the event is upcoming today
-// otherwise returns days until next repeating event, in range 1-7
-static int
-daysUntil(CFDictionaryRef event, int today_cf_day_of_week)
+/*
+ * Fills in 'next' with the upcoming occurrence of 'repeatDict', unless
+ * it already holds one that hasn't passed.
+ */
+static void
+updateNextRepeatingEvent(NextRepeatingEvent *next, CFDictionaryRef repeatDict)
 {
-    int days_mask = getRepeatingDictionaryDayMask(event);
-    int check = today_cf_day_of_week % 7;
-
-    if(0 == days_mask) return -1;
+    CFMutableDictionaryRef  repeatDictCopy = NULL;
+    CFAbsoluteTime          now = CFAbsoluteTimeGetCurrent();
+    CFAbsoluteTime          ev_time = 0.0;
+    CFDateRef               ev_date = NULL;
 
-    if(upcomingToday(event, today_cf_day_of_week)) return 0;
+    if (next->event && (now >= next->computedAt) && (now < next->time))
+        return;
 
-    // Note: CF days start counting at 1, the bit mask starts counting at 0.
-    // Therefore, since we're tossing the CF day of week into a variable (check)
-    // that we're checking the bitmask with, "check" effectively refers
-    // to tomorrow, whlie today_cf_day_of_week refers to today.
-    while(!(days_mask & (1<<check)))
-    {
-        check = (check + 1) % 7;
+    if (next->event) {
+        CFRelease(next->event);
+        next->event = NULL;
     }
-    check -= today_cf_day_of_week;
-	check++;	// adjust for CF day of week (1-7) vs. bitmask day of week (0-6)
-    
-    //  If the target day is next week, but earlier in the week than today, 
-	//  check will be negative.  Mod of negative is bogus, so we add an extra
-	//  7 days to make all work.
 
-    check += 7;
-    check %= 7;
-    if(check == 0) check = 7;
+    if (!repeatTimeZone)
+        repeatTimeZone = CFTimeZoneCopySystem();
+    if (!repeatTimeZone)
+        return;
+
+    if (!RepeatingEventNextOccurrence(getRepeatingDictionaryDayMask(repeatDict),
+                                      getRepeatingDictionaryMinutes(repeatDict),
+                                      now, repeatTimeZone, &ev_time))
+        return;
+
+    repeatDictCopy = CFDictionaryCreateMutableCopy(0,0,repeatDict);
+    ev_date = CFDateCreate(0, ev_time);
+    if (repeatDictCopy && ev_date) {
+        CFDictionarySetValue(repeatDictCopy, CFSTR(kIOPMPowerEventTimeKey), ev_date);
+        CFDictionarySetValue(repeatDictCopy, CFSTR(kIOPMPowerEventAppNameKey), CFSTR(kIOPMRepeatingAppName));
+
+        next->event = repeatDictCopy;
+        next->computedAt = now;
+        next->time = ev_time;
+        repeatDictCopy = NULL;
+    }
 
-    return check;
+    if (repeatDictCopy) CFRelease(repeatDictCopy);
+    if (ev_date) CFRelease(ev_date);
 }
 
 
@@ -219,6 +225,7 @@ copyScheduledRepeatPowerEvents(void)
 
     if (repeatingPowerOff) CFRelease(repeatingPowerOff);
     if (repeatingPowerOn) CFRelease(repeatingPowerOn);
+    invalidateNextRepeatingEvents();
 
     tmp = (CFDictionaryRef)SCPreferencesGetValue(prefs, CFSTR(kIOPMRepeatingPowerOffKey));
     if (tmp && isA_CFDictionary(tmp))
@@ -242,19 +249,7 @@ copyNextRepeatingEvent(CFStringRef type)
 {
     CFDictionaryRef         repeatDict = NULL;
     CFStringRef             repeatDictType = NULL;
-    CFMutableDictionaryRef  repeatDictCopy = NULL;
-    CFAbsoluteTime          ev_time = 0.0;
-    CFAbsoluteTime          adjustedForDays = 0.0;
-    CFDateRef               ev_date = NULL;
-    int                     minutes_scheduled = 0;
-    int                     year = 0;
-    int                     month = 0;
-    int                     day = 0;
-    int                     day_of_week = 0;
-    int                     myhour = 0;
-    int                     myminute = 0;
-    int                     mysecond = 0;
-    int                     days_until_event = 0;
+    NextRepeatingEvent      *next = NULL;
 
     /*
      * 'WakeOrPowerOn' repeat events are returned when caller asks
@@ -267,12 +262,14 @@ copyNextRepeatingEvent(CFStringRef type)
         || CFEqual(type, CFSTR(kIOPMAutoRestart)) )
     {
         repeatDict = repeatingPowerOff;
+        next = &nextPowerOff;
     }
     else if (
         CFEqual(type, CFSTR(kIOPMAutoPowerOn)) ||
         CFEqual(type, CFSTR(kIOPMAutoWake)) )
     {
         repeatDict = repeatingPowerOn;
+        next = &nextPowerOn;
     }
     else
         return NULL;
@@ -284,40 +281,26 @@ copyNextRepeatingEvent(CFStringRef type)
             )
        )
     {
-        repeatDictCopy = CFDictionaryCreateMutableCopy(0,0,repeatDict);
-        if (!repeatDictCopy)
-            return NULL;
-
-        CFCalendarDecomposeAbsoluteTime(_gregorian(), CFAbsoluteTimeGetCurrent(), "E", &day_of_week);
-
-        // CFCalendarDecomposeAbsoluteTime starts week with Sunday as "1".
-        // IOPMScheduleRepeatingPowerEvent() is defined to start week with Monday as "1".
-        // Reduce day_of_week by 1 to match with week used by IOPMScheduleRepeatingPowerEvent.
-        
-        day_of_week = (day_of_week == 1) ? 7 : --day_of_week;
-        days_until_event = daysUntil(repeatDict, day_of_week);
-
-        adjustedForDays = CFAbsoluteTimeGetCurrent();
-        CFCalendarAddComponents(_gregorian(), &adjustedForDays, 0, "d", days_until_event);
-        CFCalendarDecomposeAbsoluteTime(_gregorian(), adjustedForDays, "yMd", &year, &month, &day);
-
-        minutes_scheduled = getRepeatingDictionaryMinutes(repeatDict);
-
-        myhour = minutes_scheduled/60;
-        myminute = minutes_scheduled%60;
-        mysecond = 0;
-
-        CFCalendarComposeAbsoluteTime(_gregorian(), &ev_time, "yMdHms", year, month, day, myhour, myminute, mysecond);
-        
-        ev_date = CFDateCreate(0, ev_time);
-        if (ev_date) {
-            CFDictionarySetValue(repeatDictCopy, CFSTR(kIOPMPowerEventTimeKey), ev_date);
-            CFDictionarySetValue(repeatDictCopy, CFSTR(kIOPMPowerEventAppNameKey), CFSTR(kIOPMRepeatingAppName));
-            CFRelease(ev_date);
-        }
+        updateNextRepeatingEvent(next, repeatDict);
+        if (next->event)
+            return CFRetain(next->event);
     }
 
-    return repeatDictCopy;
+    return NULL;
+}
+
+/*
+ * The clock or the time zone changed; recompute occurrences on next use.
+ */
+__private_extern__ void
+RepeatingAutoWakeTimeChange(bool timeZoneChanged)
+{
+    invalidateNextRepeatingEvents();
+
+    if (timeZoneChanged && repeatTimeZone) {
+        CFRelease(repeatTimeZone);
+        repeatTimeZone = NULL;
+    }
 }
 
 
@@ -431,6 +414,7 @@ _io_pm_schedule_repeat_event
         CFRelease(repeatingPowerOn); 
 
     repeatingPowerOff = repeatingPowerOn = NULL;
+    invalidateNextRepeatingEvents();
 
 
     if (offEvents) {
@@ -512,6 +496,7 @@ _io_pm_cancel_repeat_events
         CFRelease(repeatingPowerOn); 
 
     repeatingPowerOff = repeatingPowerOn = NULL;
+    invalidateNextRepeatingEvents();
 
     if ((*return_code = updateRepeatEventsOnDisk(prefs)) != kIOReturnSuccess)
         goto exit;
@@ -28,5 +28,6 @@
 __private_extern__ CFDictionaryRef copyNextRepeatingEvent(CFStringRef type);
 
 __private_extern__ void RepeatingAutoWake_prime(void);
+__private_extern__ void RepeatingAutoWakeTimeChange(bool timeZoneChanged);
 
 #endif // _RepeatingAutoWake_h_
@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2014 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#include <math.h>
+
+#include "RepeatingEventTime.h"
+
+#define kSecondsPerDay      86400.0
+
+// IOPMScheduleRepeatingPowerEvent() day masks: bit 0 is Monday
+#define kAllDaysMask        0x7f
+
+// Absolute time 0 (1 Jan 2001 00:00 GMT) is a Monday, so local day number
+// 0 is a Monday too and (day number mod 7) indexes the day mask directly.
+
+/*
+ * Converts 'wall', local seconds since the reference date, to absolute time,
+ * taking the first of a repeated local time unless it's before 'notBefore'.
+ * Assumes at most one offset change within a day either side of 'wall'.
+ */
+static CFAbsoluteTime wallToAbsolute(CFTimeZoneRef tz, CFAbsoluteTime wall, CFAbsoluteTime notBefore)
+{
+    CFTimeInterval  before = CFTimeZoneGetSecondsFromGMT(tz, wall - kSecondsPerDay);
+    CFTimeInterval  after = CFTimeZoneGetSecondsFromGMT(tz, wall + kSecondsPerDay);
+    CFAbsoluteTime  t1 = wall - before;
+    CFAbsoluteTime  t2 = wall - after;
+    bool            v1 = (CFTimeZoneGetSecondsFromGMT(tz, t1) == before);
+    bool            v2 = (CFTimeZoneGetSecondsFromGMT(tz, t2) == after);
+    CFAbsoluteTime  first, lo, hi, mid;
+
+    if (v1 && v2) {
+        // Repeated local time, or no change at all
+        first = (t1 < t2) ? t1 : t2;
+        if (first >= notBefore) {
+            return first;
+        }
+        return (t1 > t2) ? t1 : t2;
+    }
+    if (v2) {
+        return t2;
+    }
+    if (v1) {
+        return t1;
+    }
+
+    // Skipped local time: 'before' applies at t2 and 'after' at t1, so
+    // find the instant the offset changes between them.
+    lo = t2;
+    hi = t1;
+    while (hi - lo > 1.0) {
+        mid = floor((lo + hi) / 2.0);
+        if (CFTimeZoneGetSecondsFromGMT(tz, mid) == after) {
+            hi = mid;
+        } else {
+            lo = mid;
+        }
+    }
+    return hi;
+}
+
+__private_extern__ bool RepeatingEventNextOccurrence(
+    int                 dayMask,
+    int                 minutes,
+    CFAbsoluteTime      now,
+    CFTimeZoneRef       tz,
+    CFAbsoluteTime      *next)
+{
+    static const int    kAllowScheduleWindowSeconds = 5;
+    CFAbsoluteTime      local;
+    double              day;
+    double              minuteStart;
+    int                 weekday;
+    int                 d;
+
+    if (!(dayMask & kAllDaysMask)) {
+        return false;
+    }
+
+    local = now + CFTimeZoneGetSecondsFromGMT(tz, now);
+    day = floor(local / kSecondsPerDay);
+    minuteStart = 60.0 * floor((local - day * kSecondsPerDay) / 60.0);
+    weekday = (int)fmod(day, 7.0);
+    if (weekday < 0) {
+        weekday += 7;
+    }
+
+    // Today only if its minute hasn't started; otherwise the first
+    // masked day after today, up to a week out.
+    for (d = 0; d < 7; d++)
+    {
+        if (!(dayMask & (1 << ((weekday + d) % 7)))) {
+            continue;
+        }
+        if ((d > 0) || (60 * minutes >= minuteStart + kAllowScheduleWindowSeconds)) {
+            break;
+        }
+    }
+
+    *next = wallToAbsolute(tz, (day + d) * kSecondsPerDay + 60.0 * minutes, now);
+    return true;
+}
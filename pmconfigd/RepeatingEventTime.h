@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2014 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#ifndef _RepeatingEventTime_h_
+#define _RepeatingEventTime_h_
+
+#include <CoreFoundation/CoreFoundation.h>
+
+/* RepeatingEventNextOccurrence
+ *
+ * Computes the next occurrence after 'now' of a repeating power event
+ * (IOPMScheduleRepeatingPowerEvent) at 'minutes' past local midnight on
+ * the days in 'dayMask' (bit 0 is Monday ... bit 6 is Sunday), in 'tz'.
+ *
+ * An occurrence today counts as upcoming until its minute starts. Local
+ * times that don't exist, in a daylight saving gap, resolve to the first
+ * instant after the gap. Local times that happen twice resolve to the
+ * first one, or to the second if 'now' is already past the first.
+ *
+ * Returns false if 'dayMask' has no days set.
+ */
+__private_extern__ bool RepeatingEventNextOccurrence(int dayMask, int minutes,
+                                                     CFAbsoluteTime now, CFTimeZoneRef tz,
+                                                     CFAbsoluteTime *next);
+
+#endif // _RepeatingEventTime_h_
@@ -0,0 +1,353 @@
+/*
+ * Copyright (c) 2014 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#include <asl.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/param.h>
+
+#include "SleepWakeRecord.h"
+
+struct PMSleepWakeRing {
+    int                     fd;
+    PMSleepWakeRingHeader   header;
+};
+
+static bool validHeader(const PMSleepWakeRingHeader *header)
+{
+    return (header->magic == kPMSleepWakeRingMagic)
+        && (header->version == kPMSleepWakeRingVersion)
+        && (header->recordSize == sizeof(PMSleepWakeRecord))
+        && (header->slots > 0);
+}
+
+static off_t slotOffset(const PMSleepWakeRing *ring, uint64_t n)
+{
+    return (off_t)sizeof(PMSleepWakeRingHeader)
+            + (off_t)(n % ring->header.slots) * (off_t)sizeof(PMSleepWakeRecord);
+}
+
+__private_extern__ PMSleepWakeRing *PMSleepWakeRingOpen(const char *path, bool forWriting)
+{
+    PMSleepWakeRing     *ring = calloc(1, sizeof(PMSleepWakeRing));
+
+    if (!ring) {
+        return NULL;
+    }
+
+    ring->fd = open(path, forWriting ? (O_RDWR | O_CREAT) : O_RDONLY, 0644);
+    if (ring->fd < 0) {
+        free(ring);
+        return NULL;
+    }
+
+    if ((pread(ring->fd, &ring->header, sizeof(ring->header), 0) == sizeof(ring->header))
+        && validHeader(&ring->header))
+    {
+        return ring;
+    }
+
+    if (!forWriting) {
+        PMSleepWakeRingClose(ring);
+        return NULL;
+    }
+
+    // New, or laid out by another version: start over
+    bzero(&ring->header, sizeof(ring->header));
+    ring->header.magic = kPMSleepWakeRingMagic;
+    ring->header.version = kPMSleepWakeRingVersion;
+    ring->header.recordSize = sizeof(PMSleepWakeRecord);
+    ring->header.slots = kPMSleepWakeRingSlots;
+    if ((ftruncate(ring->fd, 0) != 0)
+        || (pwrite(ring->fd, &ring->header, sizeof(ring->header), 0) != sizeof(ring->header)))
+    {
+        asl_log(NULL, NULL, ASL_LEVEL_ERR, "Can't start sleep/wake record ring %s\n", path);
+        PMSleepWakeRingClose(ring);
+        return NULL;
+    }
+    return ring;
+}
+
+__private_extern__ void PMSleepWakeRingClose(PMSleepWakeRing *ring)
+{
+    if (!ring) {
+        return;
+    }
+    close(ring->fd);
+    free(ring);
+}
+
+/*
+ * The record goes in first, then the header counting it, so a reader or a
+ * crash between the two sees the ring as it was.
+ */
+__private_extern__ bool PMSleepWakeRingAppend(PMSleepWakeRing *ring, const PMSleepWakeRecord *record)
+{
+    if (pwrite(ring->fd, record, sizeof(*record), slotOffset(ring, ring->header.written))
+            != sizeof(*record)) {
+        return false;
+    }
+    ring->header.written++;
+    return (pwrite(ring->fd, &ring->header, sizeof(ring->header), 0) == sizeof(ring->header));
+}
+
+__private_extern__ uint32_t PMSleepWakeRingCount(PMSleepWakeRing *ring)
+{
+    return (ring->header.written < ring->header.slots)
+                ? (uint32_t)ring->header.written : ring->header.slots;
+}
+
+__private_extern__ bool PMSleepWakeRingRead(PMSleepWakeRing *ring, uint32_t i, PMSleepWakeRecord *record)
+{
+    uint64_t    first = ring->header.written - PMSleepWakeRingCount(ring);
+
+    if (i >= PMSleepWakeRingCount(ring)) {
+        return false;
+    }
+    return (pread(ring->fd, record, sizeof(*record), slotOffset(ring, first + i)) == sizeof(*record));
+}
+
+#ifndef __I_AM_PMSET__
+
+/*
+ * The cycle in progress. Everything here runs on powerd's main queue.
+ */
+static PMSleepWakeRecord    gCycle;
+static bool                 gCycleOpen = false;
+static bool                 gAwaitingAcks = false;
+static bool                 gInDarkWake = false;
+static CFAbsoluteTime       gSleepStarted = 0;
+static CFAbsoluteTime       gLastWake = 0;          // start of the current dark wake
+
+static PMSleepWakeRing      *gRing = NULL;
+static bool                 gRingOpened = false;
+static char                 gRingPath[MAXPATHLEN] = kPMSleepWakeRingPath;
+
+static uint32_t msSince(CFAbsoluteTime t)
+{
+    CFAbsoluteTime  elapsed = CFAbsoluteTimeGetCurrent() - t;
+
+    return (elapsed > 0) ? (uint32_t)(elapsed * 1000.0) : 0;
+}
+
+static void writeCycle(void)
+{
+    if (!gRingOpened) {
+        gRingOpened = true;
+        gRing = PMSleepWakeRingOpen(gRingPath, true);
+    }
+    if (gRing && !PMSleepWakeRingAppend(gRing, &gCycle)) {
+        asl_log(NULL, NULL, ASL_LEVEL_ERR, "Can't write sleep/wake record to %s\n", gRingPath);
+    }
+
+    bzero(&gCycle, sizeof(gCycle));
+    gCycleOpen = false;
+    gAwaitingAcks = false;
+    gInDarkWake = false;
+    gLastWake = 0;
+}
+
+__private_extern__ void cycleRecordSetRingPath(const char *path)
+{
+    PMSleepWakeRingClose(gRing);
+    gRing = NULL;
+    gRingOpened = false;
+    strlcpy(gRingPath, path, sizeof(gRingPath));
+}
+
+__private_extern__ void cycleRecordSleep(
+    const char      *uuid,
+    const char      *reason,
+    uint32_t        sleepCount,
+    bool            success,
+    bool            s0DarkWake)
+{
+    if (!success) {
+        if (gCycleOpen && gInDarkWake) {
+            // Still in the dark wake; the cycle goes on
+            gCycle.flags |= kPMSleepWakeSleepFailed;
+            return;
+        }
+        if (!gCycleOpen) {
+            gCycle.sleepTime = time(NULL);
+            if (uuid) strlcpy(gCycle.uuid, uuid, sizeof(gCycle.uuid));
+        }
+        gCycle.flags |= kPMSleepWakeSleepFailed;
+        writeCycle();
+        return;
+    }
+
+    if (s0DarkWake) {
+        // Still awake: from a full wake no cycle starts, and a dark wake goes on
+        return;
+    }
+
+    if (gCycleOpen && gInDarkWake) {
+        // Back to sleep from a dark wake in the same cycle
+        gCycle.phaseMS[kPMSleepWakePhaseDarkWake] += msSince(gLastWake);
+        gInDarkWake = false;
+        gLastWake = 0;
+        return;
+    }
+
+    if (gCycleOpen) {
+        gCycle.flags |= kPMSleepWakeIncomplete;
+        writeCycle();
+    }
+
+    gCycleOpen = true;
+    gAwaitingAcks = true;
+    gSleepStarted = CFAbsoluteTimeGetCurrent();
+    gInDarkWake = false;
+    gLastWake = 0;
+    gCycle.sleepTime = time(NULL);
+    gCycle.sleepCount = sleepCount;
+    if (uuid) strlcpy(gCycle.uuid, uuid, sizeof(gCycle.uuid));
+    if (reason) strlcpy(gCycle.sleepReason, reason, sizeof(gCycle.sleepReason));
+}
+
+__private_extern__ void cycleRecordClientsAcked(void)
+{
+    if (gCycleOpen && gAwaitingAcks) {
+        gCycle.phaseMS[kPMSleepWakePhaseSleepNotify] = msSince(gSleepStarted);
+        gAwaitingAcks = false;
+    }
+}
+
+__private_extern__ void cycleRecordWake(
+    bool            success,
+    bool            darkWake,
+    const char      *wakeReason,
+    const char      *wakeType)
+{
+    if (!gCycleOpen) {
+        return;
+    }
+    gAwaitingAcks = false;
+
+    if (!success) {
+        gCycle.flags |= kPMSleepWakeWakeFailed;
+        writeCycle();
+        return;
+    }
+
+    if (!gCycle.wakeTime) {
+        gCycle.wakeTime = time(NULL);
+        gCycle.phaseMS[kPMSleepWakePhaseAsleep] = msSince(gSleepStarted);
+        if (wakeReason) strlcpy(gCycle.wakeReason, wakeReason, sizeof(gCycle.wakeReason));
+        if (wakeType) strlcpy(gCycle.wakeType, wakeType, sizeof(gCycle.wakeType));
+    }
+
+    if (darkWake) {
+        if (!gInDarkWake) {
+            gCycle.darkWakeCount++;
+            gInDarkWake = true;
+            gLastWake = CFAbsoluteTimeGetCurrent();
+        }
+        return;
+    }
+
+    if (gInDarkWake) {
+        gCycle.flags |= kPMSleepWakeFromDarkWake;
+        gCycle.phaseMS[kPMSleepWakePhaseDarkWake] += msSince(gLastWake);
+    }
+    gCycle.fullWakeTime = time(NULL);
+    writeCycle();
+}
+
+__private_extern__ void cycleRecordHibernate(uint32_t writeMS, uint32_t readMS)
+{
+    if (!gCycleOpen) {
+        return;
+    }
+    if (writeMS) {
+        gCycle.phaseMS[kPMSleepWakePhaseHibernateWrite] = writeMS;
+    }
+    if (readMS) {
+        gCycle.phaseMS[kPMSleepWakePhaseHibernateRead] = readMS;
+        gCycle.flags |= kPMSleepWakeHibernated;
+    }
+}
+
+/*
+ * Keeps the kPMSleepWakeMaxResponders slowest responses, and counts them all.
+ */
+__private_extern__ void cycleRecordResponse(const char *name, PMSleepWakeResponseType type, uint32_t delayMS)
+{
+    PMSleepWakeResponder    *slot = NULL;
+    int                     i;
+
+    if (!gCycleOpen || !name) {
+        return;
+    }
+    gCycle.responderCount++;
+    if (delayMS > gCycle.phaseMS[kPMSleepWakePhaseSlowestResponse]) {
+        gCycle.phaseMS[kPMSleepWakePhaseSlowestResponse] = delayMS;
+    }
+
+    for (i = 0; i < kPMSleepWakeMaxResponders; i++) {
+        if (!gCycle.responders[i].name[0]) {
+            slot = &gCycle.responders[i];
+            break;
+        }
+        if (!slot || (gCycle.responders[i].delayMS < slot->delayMS)) {
+            slot = &gCycle.responders[i];
+        }
+    }
+    if (slot->name[0] && (slot->delayMS >= delayMS)) {
+        return;
+    }
+
+    strlcpy(slot->name, name, sizeof(slot->name));
+    slot->delayMS = delayMS;
+    slot->type = type;
+}
+
+__private_extern__ void cycleRecordBlocker(const char *name, uint32_t assertionType, uint32_t heldSecs)
+{
+    PMSleepWakeBlocker      *slot;
+
+    if (!gCycleOpen || !name) {
+        return;
+    }
+    if (gCycle.blockerCount < kPMSleepWakeMaxBlockers) {
+        slot = &gCycle.blockers[gCycle.blockerCount];
+        strlcpy(slot->name, name, sizeof(slot->name));
+        slot->assertionType = assertionType;
+        slot->heldSecs = heldSecs;
+    }
+    gCycle.blockerCount++;
+}
+
+__private_extern__ void cycleRecordCanceledAtLastCall(void)
+{
+    if (gCycleOpen) {
+        gCycle.flags |= kPMSleepWakeCanceledAtLastCall;
+    }
+}
+
+#endif
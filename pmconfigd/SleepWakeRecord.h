@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2014 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#ifndef _SleepWakeRecord_h_
+#define _SleepWakeRecord_h_
+
+#include <CoreFoundation/CoreFoundation.h>
+
+/*
+ * One fixed-size binary record per sleep/wake cycle, from the sleep that
+ * starts it to the full wake that ends it, kept in a ring file of
+ * kPMSleepWakeRingSlots records.
+ *
+ * powerd fills in the record as it logs the cycle's sleep, wakes, client
+ * responses and hibernation statistics, and writes it with one pwrite()
+ * when the cycle ends. Consumers read the ring as an array of
+ * PMSleepWakeRecord; every field is a fixed-width integer or a
+ * NUL-terminated string, so records can be summed without parsing.
+ */
+
+#define kPMSleepWakeRingPath            "/var/log/powermanagement.cycles"
+#define kPMSleepWakeRingMagic           0x504d5357      // 'PMSW'
+#define kPMSleepWakeRingVersion         1
+#define kPMSleepWakeRingSlots           1024
+
+enum {
+    kPMSleepWakeMaxResponders   = 4,
+    kPMSleepWakeMaxBlockers     = 4
+};
+
+// Indexes into PMSleepWakeRecord.phaseMS
+typedef enum {
+    kPMSleepWakePhaseSleepNotify    = 0,    // sleep until all clients acknowledged it
+    kPMSleepWakePhaseAsleep,                // sleep until the first wake
+    kPMSleepWakePhaseDarkWake,              // total time in dark wakes
+    kPMSleepWakePhaseHibernateWrite,
+    kPMSleepWakePhaseHibernateRead,
+    kPMSleepWakePhaseSlowestResponse,       // longest single client response
+    kPMSleepWakePhaseCount
+} PMSleepWakePhase;
+
+// PMSleepWakeRecord flags
+enum {
+    kPMSleepWakeSleepFailed         = 0x0001,
+    kPMSleepWakeWakeFailed          = 0x0002,
+    kPMSleepWakeIncomplete          = 0x0004,   // a new sleep started before any wake
+    kPMSleepWakeHibernated          = 0x0008,
+    kPMSleepWakeFromDarkWake        = 0x0010,   // the full wake followed a dark wake
+    kPMSleepWakeCanceledAtLastCall  = 0x0020
+};
+
+// PMSleepWakeResponder types
+typedef enum {
+    kPMSleepWakeResponseSlow        = 1,
+    kPMSleepWakeResponseTimedOut    = 2,
+    kPMSleepWakeResponseCancel      = 3,
+    kPMSleepWakeResponseCapExceeded = 4
+} PMSleepWakeResponseType;
+
+typedef struct {
+    char                name[24];
+    uint32_t            delayMS;
+    uint16_t            type;           // PMSleepWakeResponseType
+    uint16_t            reserved;
+} PMSleepWakeResponder;
+
+typedef struct {
+    char                name[24];
+    uint32_t            assertionType;  // kerAssertionType
+    uint32_t            heldSecs;
+} PMSleepWakeBlocker;
+
+typedef struct {
+    char                uuid[40];
+    int64_t             sleepTime;      // seconds since 1970
+    int64_t             wakeTime;       // first wake, dark or full; 0 if none
+    int64_t             fullWakeTime;   // 0 if none
+    uint32_t            flags;
+    uint32_t            sleepCount;     // sleeps since powerd started
+    uint32_t            darkWakeCount;
+    uint32_t            phaseMS[kPMSleepWakePhaseCount];
+    uint32_t            responderCount; // all slow, timed out and canceling responses
+    uint32_t            blockerCount;   // all assertions that canceled a sleep
+    char                sleepReason[32];
+    char                wakeReason[32]; // platform reason and type of the first wake
+    char                wakeType[32];
+    uint32_t            reserved;
+    PMSleepWakeResponder responders[kPMSleepWakeMaxResponders];    // the slowest
+    PMSleepWakeBlocker  blockers[kPMSleepWakeMaxBlockers];          // the first
+} PMSleepWakeRecord;
+
+typedef struct {
+    uint32_t            magic;
+    uint16_t            version;
+    uint16_t            recordSize;
+    uint32_t            slots;
+    uint32_t            reserved;
+    uint64_t            written;        // records ever written; the next goes in slot written % slots
+} PMSleepWakeRingHeader;
+
+typedef struct PMSleepWakeRing PMSleepWakeRing;
+
+/* PMSleepWakeRingOpen
+ * Opens the ring at 'path'. A writer creates it, or starts it over if it
+ * has another layout. A reader returns NULL if there's no ring.
+ */
+__private_extern__ PMSleepWakeRing  *PMSleepWakeRingOpen(const char *path, bool forWriting);
+__private_extern__ void             PMSleepWakeRingClose(PMSleepWakeRing *ring);
+__private_extern__ bool             PMSleepWakeRingAppend(PMSleepWakeRing *ring, const PMSleepWakeRecord *record);
+
+/* PMSleepWakeRingCount, PMSleepWakeRingRead
+ * The records kept, numbered from the oldest.
+ */
+__private_extern__ uint32_t         PMSleepWakeRingCount(PMSleepWakeRing *ring);
+__private_extern__ bool             PMSleepWakeRingRead(PMSleepWakeRing *ring, uint32_t i, PMSleepWakeRecord *record);
+
+/*
+ * powerd's record of the current cycle, fed from the logASLMessage
+ * functions and written to kPMSleepWakeRingPath when the cycle ends.
+ *
+ * A cycle opens at a sleep and closes at the next full wake. Dark wakes in
+ * between, and sleeps from them, stay in the cycle; a full wake dropping
+ * into S0 DarkWake without sleeping neither opens nor closes one.
+ */
+
+/* cycleRecordSleep
+ * A sleep, or with 's0DarkWake' an entry into S0 DarkWake.
+ */
+__private_extern__ void cycleRecordSleep(const char *uuid, const char *reason, uint32_t sleepCount,
+                                         bool success, bool s0DarkWake);
+
+/* cycleRecordWake
+ * A wake from sleep into a dark wake, or a full wake from sleep or from a
+ * dark wake.
+ */
+__private_extern__ void cycleRecordWake(bool success, bool darkWake,
+                                        const char *wakeReason, const char *wakeType);
+__private_extern__ void cycleRecordClientsAcked(void);
+__private_extern__ void cycleRecordHibernate(uint32_t writeMS, uint32_t readMS);
+__private_extern__ void cycleRecordResponse(const char *name, PMSleepWakeResponseType type, uint32_t delayMS);
+__private_extern__ void cycleRecordBlocker(const char *name, uint32_t assertionType, uint32_t heldSecs);
+__private_extern__ void cycleRecordCanceledAtLastCall(void);
+
+/* cycleRecordSetRingPath
+ * Writes records to the ring at 'path' instead of kPMSleepWakeRingPath.
+ */
+__private_extern__ void cycleRecordSetRingPath(const char *path);
+
+#endif // _SleepWakeRecord_h_
@@ -33,6 +33,8 @@
 #include "PMSettings.h"
 #include "PMConnection.h"
 #include "Platform.h"
+#include "SystemLoadShared.h"
+#include "HIDIdle.h"
 
 #ifndef  kIOHIDSystemUserHidActivity
 #define kIOHIDSystemUserHidActivity    iokit_family_msg(sub_iokit_hidsystem, 6)
@@ -66,6 +68,8 @@ static bool   displaySleepEnabled       = FALSE;
 
 static int    gNotifyToken              = 0;
 
+static SystemLoadShared     *gSharedLoad = NULL;
+
 
 /*! UserActiveStruct records the many data sources that affect
  *  our concept of user-is-active; and the user's activity level.
@@ -246,6 +250,64 @@ CFAbsoluteTime get_SleepFromUserWakeTime(void)
 
 
 
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+/* Maps the shared page that mirrors the system load advisory for clients. */
+static void sharedLoadPrime(void)
+{
+    gSharedLoad = (SystemLoadShared *)_sharedPageMap(kSystemLoadSharedName, sizeof(SystemLoadShared));
+    if (!gSharedLoad) {
+        return;
+    }
+
+    // Leave any in-progress update from a previous powerd looking complete
+    if (gSharedLoad->sequence & 1) {
+        OSAtomicIncrement32Barrier((volatile int32_t *)&gSharedLoad->sequence);
+    }
+    gSharedLoad->version = kSystemLoadSharedVersion;
+}
+
+static void sharedLoadPublish(uint64_t levels, uint64_t lastLevels)
+{
+    CFAbsoluteTime  now;
+    uint64_t        changed = levels ^ lastLevels;
+
+    if (!gSharedLoad) {
+        return;
+    }
+
+    now = CFAbsoluteTimeGetCurrent();
+
+    OSAtomicIncrement32Barrier((volatile int32_t *)&gSharedLoad->sequence);
+
+    if (SYSTEM_LOAD_LEVEL(changed, kSystemLoadUserShift)) {
+        gSharedLoad->userChangeTime = now;
+    }
+    if (SYSTEM_LOAD_LEVEL(changed, kSystemLoadBatteryShift)) {
+        gSharedLoad->batteryChangeTime = now;
+    }
+    if (SYSTEM_LOAD_LEVEL(changed, kSystemLoadThermalShift)) {
+        gSharedLoad->thermalChangeTime = now;
+    }
+    if (SYSTEM_LOAD_LEVEL(changed, kSystemLoadCombinedShift)) {
+        gSharedLoad->combinedChangeTime = now;
+    }
+    gSharedLoad->levels = levels;
+    gSharedLoad->changeCount++;
+
+    OSAtomicIncrement32Barrier((volatile int32_t *)&gSharedLoad->sequence);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+/*! userActiveHandleHIDActivity
+ *  A HID event was posted through powerd; it's HID activity.
+ */
+__private_extern__ void userActiveHandleHIDActivity(void)
+{
+    HIDIdleHandleActivity();
+}
+
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 static void shareTheSystemLoad(bool shouldNotify)
@@ -310,16 +372,17 @@ static void shareTheSystemLoad(bool shouldNotify)
 /* Power Level Computation code ends here */
 /******************************************/
 
-    theseSystemLoad = combinedLevel
-                | (userLevel << 8)
-                | (batteryLevel << 16)
-                | (powerLevel << 24);
+    theseSystemLoad = (combinedLevel << kSystemLoadCombinedShift)
+                | (userLevel << kSystemLoadUserShift)
+                | (batteryLevel << kSystemLoadBatteryShift)
+                | (powerLevel << kSystemLoadThermalShift);
 
     if (theseSystemLoad != lastSystemLoad) 
     {
         CFMutableDictionaryRef publishDetails = NULL;
         CFNumberRef publishNum = NULL;
     
+        sharedLoadPublish(theseSystemLoad, lastSystemLoad);
         lastSystemLoad = theseSystemLoad;
 
         /* Publish the combinedLevel under our notify key 'kIOSystemLoadAdvisoryNotifyName'
@@ -383,6 +446,7 @@ static void shareTheSystemLoad(bool shouldNotify)
 
         // post notification
         if (shouldNotify) {
+            PMStoreFlush();
             notify_post(kIOSystemLoadAdvisoryNotifyName);
         }
     }
@@ -400,6 +464,8 @@ hidActivityStateChange(void *ref, io_service_t service, natural_t messageType, v
 
    userActive.hidActive = ((uint64_t)arg) ? false : true;
 
+    HIDIdleHIDActivityChanged(userActive.hidActive);
+
     updateUserPresentActive();
 }
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
@@ -422,13 +488,16 @@ static void hidSystemMatched(
                     NULL, 
                     &notification_object);
 
+        HIDIdleSystemMatched(hidSystem);
+
         IOServiceOpen(hidSystem, mach_task_self(), kIOHIDParamConnectType, &connect);
         if (connect) {
-            bool hidIdle;
-            IOHIDGetActivityState(connect, &hidIdle);
-            userActive.hidActive = !hidIdle;
+            bool hidIsIdle;
+            IOHIDGetActivityState(connect, &hidIsIdle);
+            userActive.hidActive = !hidIsIdle;
 
             IOServiceClose(connect);
+            HIDIdleHIDActivityChanged(userActive.hidActive);
             updateUserPresentActive();
         }
 
@@ -449,6 +518,9 @@ __private_extern__ void SystemLoad_prime(void)
 
     userActive_prime();
 
+    sharedLoadPrime();
+    HIDIdle_prime();
+
     systemLoadKey = SCDynamicStoreKeyCreate(
                     kCFAllocatorDefault, 
                     CFSTR("%@%@"),
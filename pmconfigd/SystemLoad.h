@@ -49,6 +49,7 @@ __private_extern__ bool isUserActiveRootDomain(void);
 __private_extern__ void userActiveHandleRootDomainActivity(void);
 __private_extern__ void userActiveHandleSleep(void);
 __private_extern__ void userActiveHandlePowerAssertionsChanged(void);
+__private_extern__ void userActiveHandleHIDActivity(void);
 
 __private_extern__ CFAbsoluteTime get_SleepFromUserWakeTime(void);
 
@@ -0,0 +1,176 @@
+/*
+ * Copyright (c) 2014 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#ifndef _SystemLoadShared_h_
+#define _SystemLoadShared_h_
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <libkern/OSAtomic.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * powerd publishes the system load advisory in a read-only shared memory
+ * page, in addition to notify state and the SCDynamicStore keys read by
+ * IOGetSystemLoadAdvisory() and IOPMCheckSystemLoadDetailed().
+ *
+ * Only powerd writes the page. Readers map it once and then read it without
+ * any IPC.
+ */
+
+#define kSystemLoadSharedName           "com.apple.powerd.sysload"
+#define kSystemLoadSharedVersion        1
+
+/* Packing of 'levels'; identical to the SystemLoad SCDynamicStore key. */
+#define kSystemLoadCombinedShift        0
+#define kSystemLoadUserShift            8
+#define kSystemLoadBatteryShift         16
+#define kSystemLoadThermalShift         24
+#define SYSTEM_LOAD_LEVEL(levels, shift)    ((int)(((levels) >> (shift)) & 0xFF))
+
+typedef struct {
+    uint32_t            version;
+
+    /* Odd while powerd is updating the fields below */
+    volatile uint32_t   sequence;
+
+    /* Packed user, battery, thermal and combined levels.
+     * A single aligned 64-bit word: always consistent on its own.
+     */
+    volatile uint64_t   levels;
+
+    /* Incremented each time any level changes */
+    uint64_t            changeCount;
+
+    /* Time each level last changed */
+    CFAbsoluteTime      userChangeTime;
+    CFAbsoluteTime      batteryChangeTime;
+    CFAbsoluteTime      thermalChangeTime;
+    CFAbsoluteTime      combinedChangeTime;
+} SystemLoadShared;
+
+typedef struct {
+    int                 userLevel;
+    int                 batteryLevel;
+    int                 thermalLevel;
+    int                 combinedLevel;
+    uint64_t            changeCount;
+    CFAbsoluteTime      userChangeTime;
+    CFAbsoluteTime      batteryChangeTime;
+    CFAbsoluteTime      thermalChangeTime;
+    CFAbsoluteTime      combinedChangeTime;
+} SystemLoadSnapshot;
+
+/* SystemLoadSharedMap
+ * Maps powerd's page read-only. Returns NULL if powerd hasn't published it,
+ * or if the object isn't root's alone to write.
+ * The mapping lives for the life of the process; callers should map once.
+ */
+static inline const SystemLoadShared *SystemLoadSharedMap(void)
+{
+    const SystemLoadShared  *shared = NULL;
+    struct stat             sb;
+    void                    *addr;
+    int                     fd;
+
+    fd = shm_open(kSystemLoadSharedName, O_RDONLY, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    if ((0 != fstat(fd, &sb))
+        || (0 != sb.st_uid)
+        || (sb.st_mode & (S_IWGRP | S_IWOTH))
+        || (sb.st_size < (off_t)sizeof(SystemLoadShared)))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    addr = mmap(NULL, sizeof(SystemLoadShared), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (MAP_FAILED == addr) {
+        return NULL;
+    }
+
+    shared = (const SystemLoadShared *)addr;
+    if (kSystemLoadSharedVersion != shared->version) {
+        munmap(addr, sizeof(SystemLoadShared));
+        return NULL;
+    }
+
+    return shared;
+}
+
+/* SystemLoadSharedGetLevels
+ * Wait-free: a single 64-bit load. Unpack with SYSTEM_LOAD_LEVEL().
+ */
+static inline uint64_t SystemLoadSharedGetLevels(const SystemLoadShared *shared)
+{
+    return shared->levels;
+}
+
+/* SystemLoadSharedCopySnapshot
+ * Copies levels, timestamps and the change counter as one consistent set.
+ * Never blocks; retries only if powerd is mid-update, which happens once per
+ * level change. Returns false if a consistent copy couldn't be taken.
+ */
+static inline bool SystemLoadSharedCopySnapshot(const SystemLoadShared *shared, SystemLoadSnapshot *out)
+{
+    uint32_t    seq;
+    uint64_t    levels;
+    int         tries;
+
+    for (tries = 0; tries < 100; tries++)
+    {
+        seq = shared->sequence;
+        if (seq & 1) {
+            continue;
+        }
+        OSMemoryBarrier();
+
+        levels                  = shared->levels;
+        out->changeCount        = shared->changeCount;
+        out->userChangeTime     = shared->userChangeTime;
+        out->batteryChangeTime  = shared->batteryChangeTime;
+        out->thermalChangeTime  = shared->thermalChangeTime;
+        out->combinedChangeTime = shared->combinedChangeTime;
+
+        OSMemoryBarrier();
+        if (seq == shared->sequence) {
+            out->userLevel      = SYSTEM_LOAD_LEVEL(levels, kSystemLoadUserShift);
+            out->batteryLevel   = SYSTEM_LOAD_LEVEL(levels, kSystemLoadBatteryShift);
+            out->thermalLevel   = SYSTEM_LOAD_LEVEL(levels, kSystemLoadThermalShift);
+            out->combinedLevel  = SYSTEM_LOAD_LEVEL(levels, kSystemLoadCombinedShift);
+            return true;
+        }
+    }
+    return false;
+}
+
+#endif
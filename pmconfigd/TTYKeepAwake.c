@@ -51,7 +51,6 @@
 #include <sys/stat.h>
 #include <err.h>
 #include <asl.h>
-#include <sys/queue.h>
 #include <sys/param.h>
 #include "PrivateLib.h"
 #include "TTYKeepAwake.h"
@@ -68,10 +67,16 @@
 // dev_path_t also in kextmanager_types.h but it needs IOKitLib.h
 typedef char dev_path_t[DEVMAXPATHSIZE];
 
-SLIST_HEAD(ttyhead, ttyentry);
+/*
+ * Each remote tty is known to be active until its deadline, the time its
+ * last seen access time goes stale. Active ttys are kept in a min-heap on
+ * their deadline and only stat()ed again once it passes; ttys not known to
+ * be active are stat()ed on every check, so the active list stays complete.
+ */
 struct ttyentry {
-    dev_path_t ttydev;
-    SLIST_ENTRY(ttyentry) next;
+    dev_path_t  ttydev;
+    time_t      deadline;       // valid while heapIndex >= 0
+    int         heapIndex;      // index in s_heap, or -1 if not known to be active
 };
 
 static char                     s_activetty_names[DEVMAXPATHSIZE * 4];
@@ -80,17 +85,23 @@ static char                     s_activetty_names[DEVMAXPATHSIZE * 4];
 static CFStringRef kTTYAssertion = CFSTR("com.apple.powermanagement.ttyassertion");
 
 // Globals protected by s_tty_queue
-static struct ttyhead           s_activettys = SLIST_HEAD_INITIALIZER(s_activettys);
+static struct ttyentry          **s_ttys = NULL;        // sorted by ttydev
+static int                      s_ttyCount = 0;
+static struct ttyentry          **s_heap = NULL;        // active ttys, earliest deadline first
+static int                      s_heapCount = 0;
+static bool                     s_heapChanged = false;
 static time_t                   settingIdleSleepSeconds = 0;
 static bool                     settingTTYSPreventSleep = true;
 static IOPMAssertionID          s_assertion = 0;
 static int                      s_utmpx_notify_token = -1;
+static struct timespec          s_utmpx_mtime;          // utmpx as of the last read_logins()
+static off_t                    s_utmpx_size = -1;
 static dispatch_source_t        s_timer_source;
 static dispatch_queue_t         s_tty_queue;
 
 // Protos
 static void freettys(void);
-static void addtty(char *ttyname);
+static void update_ttys(dev_path_t *lines, int count);
 static void read_logins(void);
 static boolean_t ttys_are_active(time_t *time_to_idle_out);
 static void create_assertion(void);
@@ -162,6 +173,9 @@ void TTYKeepAwakePrefsHaveChanged( void )
 
     /* Re-read the idle sleep timer if settings change */
 
+    if (!s_tty_queue)
+        return;
+
     activePMSettings = PMSettings_CopyActivePMSettings();
     if(!activePMSettings) 
         goto finish;
@@ -187,6 +201,13 @@ void TTYKeepAwakePrefsHaveChanged( void )
     dispatch_async(s_tty_queue, ^{
         settingIdleSleepSeconds = systemIdleMinutes * SEC_PER_MIN;
         settingTTYSPreventSleep = ttysPreventSleep;
+
+        // Deadlines depend on the idle time; check every tty afresh
+        for (int i = 0; i < s_heapCount; i++) {
+            s_heap[i]->heapIndex = -1;
+        }
+        s_heapCount = 0;
+        s_heapChanged = true;
     });
 
     TTYKeepAwakeConsiderAssertion();
@@ -220,12 +241,35 @@ bool  TTYKeepAwakeConsiderAssertion( void )
     return allow_sleep;
 }
 
-static void read_logins(void)
+static int compare_ttydev(const void *a, const void *b)
 {
-    struct utmpx *ent;
-    int cnt = 0;
+    return strcmp((const char *)a, (const char *)b);
+}
 
-    freettys();
+static void read_logins(void)
+{
+    struct utmpx    *ent;
+    dev_path_t      *lines = NULL;
+    dev_path_t      *grown;
+    int             cnt = 0;
+    int             capacity = 0;
+    struct stat     sb;
+    __block bool    changed = true;
+
+    /* Logouts rewrite their utmpx entry in place, so there is no tail to
+     * read from; skip the rescan when utmpx hasn't changed since the last one.
+     */
+    if (s_tty_queue && (0 == stat(_PATH_UTMPX, &sb))) {
+        dispatch_sync(s_tty_queue, ^{
+            changed = (sb.st_size != s_utmpx_size)
+                || (sb.st_mtimespec.tv_sec != s_utmpx_mtime.tv_sec)
+                || (sb.st_mtimespec.tv_nsec != s_utmpx_mtime.tv_nsec);
+            s_utmpx_size = sb.st_size;
+            s_utmpx_mtime = sb.st_mtimespec;
+        });
+    }
+    if (!changed)
+        return;
 
     setutxent();
     while((ent = getutxent())) 
@@ -235,58 +279,189 @@ static void read_logins(void)
          * (We're not interested in tracking local Terminal windows, 
          * just remote sessions.)
          */
-        if (0 < strlen(ent->ut_host))
-        {
-            addtty(ent->ut_line);            
-            cnt++;
+        if (0 == ent->ut_host[0])
+            continue;
+
+        if (cnt == capacity) {
+            capacity = capacity ? 2 * capacity : 16;
+            grown = realloc(lines, capacity * sizeof(dev_path_t));
+            if (!grown)
+                break;
+            lines = grown;
         }
+        snprintf(lines[cnt], sizeof(dev_path_t), "/dev/%.*s", (int)sizeof(ent->ut_line), ent->ut_line);
+        cnt++;
     }
     endutxent();
 
+    qsort(lines, cnt, sizeof(dev_path_t), compare_ttydev);
+
+    if (s_tty_queue) {
+        dispatch_sync(s_tty_queue, ^{
+            update_ttys(lines, cnt);
+        });
+    }
+    free(lines);
+
     TTYKeepAwakeConsiderAssertion();
 }
 
-static void freettys(void)
+/*
+ * Min-heap of active ttys on deadline. Called on s_tty_queue.
+ */
+static void heap_swap(int i, int j)
 {
-    if (s_tty_queue) {
-        dispatch_sync(s_tty_queue, ^{
-            struct ttyentry *tty;
-            struct ttyentry *tmptty;
+    struct ttyentry *tmp = s_heap[i];
 
-            SLIST_FOREACH_SAFE(tty, &s_activettys, next, tmptty) {
-                SLIST_REMOVE(&s_activettys, tty, ttyentry, next);
-                free(tty);
-            }
-        });
+    s_heap[i] = s_heap[j];
+    s_heap[j] = tmp;
+    s_heap[i]->heapIndex = i;
+    s_heap[j]->heapIndex = j;
+}
+
+static void heap_sift(int i)
+{
+    int child;
+
+    while ((i > 0) && (s_heap[i]->deadline < s_heap[(i - 1) / 2]->deadline)) {
+        heap_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    while ((child = 2 * i + 1) < s_heapCount) {
+        if ((child + 1 < s_heapCount) && (s_heap[child + 1]->deadline < s_heap[child]->deadline)) {
+            child++;
+        }
+        if (s_heap[i]->deadline <= s_heap[child]->deadline) {
+            break;
+        }
+        heap_swap(i, child);
+        i = child;
     }
 }
 
-static void addtty(char *ttyname)
+static void heap_remove(struct ttyentry *tty)
 {
-    struct ttyentry *tty;
-    size_t len;
+    int i = tty->heapIndex;
 
-    tty = malloc(sizeof(*tty));
-    if (!tty) 
-        goto finish;
+    if (i < 0)
+        return;
 
-    len = strlcpy(tty->ttydev, "/dev/", sizeof(tty->ttydev));
-    if (len > sizeof(tty->ttydev))
-        goto finish;
+    tty->heapIndex = -1;
+    s_heapCount--;
+    if (i != s_heapCount) {
+        s_heap[i] = s_heap[s_heapCount];
+        s_heap[i]->heapIndex = i;
+        heap_sift(i);
+    }
+    s_heapChanged = true;
+}
 
-    len = strlcat(tty->ttydev, ttyname, sizeof(tty->ttydev));
-    if (len > sizeof(tty->ttydev)) 
-        goto finish;
+/* Returns true if the tty has been used within the idle sleep time, and
+ * adds it to the heap or moves it to its new deadline. Called on s_tty_queue.
+ */
+static bool refresh_tty(struct ttyentry *tty, time_t now)
+{
+    struct stat sb;
 
-    dispatch_async(s_tty_queue, ^{
-        SLIST_INSERT_HEAD(&s_activettys, tty, next);
-    });
-    tty = NULL;
+    // Subtract one second so we aren't racing to check at expiration
+    if ((0 != stat(tty->ttydev, &sb))
+        || (sb.st_atime + settingIdleSleepSeconds - 1 <= now)) {
+        heap_remove(tty);
+        return false;
+    }
 
-finish:
-    if (tty) 
-        free(tty);
-    return;
+    tty->deadline = sb.st_atime + settingIdleSleepSeconds - 1;
+    if (tty->heapIndex < 0) {
+        tty->heapIndex = s_heapCount++;
+        s_heap[tty->heapIndex] = tty;
+        s_heapChanged = true;
+    }
+    heap_sift(tty->heapIndex);
+    return true;
+}
+
+/* Applies the sorted remote tty list from utmpx: ttys still logged in keep
+ * their deadlines, new ones start out not known to be active.
+ * Called on s_tty_queue.
+ */
+static void update_ttys(dev_path_t *lines, int count)
+{
+    struct ttyentry **ttys = NULL;
+    struct ttyentry **heap = NULL;
+    struct ttyentry *tty;
+    int             n = 0;
+    int             i = 0;
+    int             j = 0;
+    int             cmp;
+
+    if (count) {
+        ttys = calloc(count, sizeof(struct ttyentry *));
+        heap = calloc(count, sizeof(struct ttyentry *));
+        if (!ttys || !heap) {
+            free(ttys);
+            free(heap);
+            return;
+        }
+    }
+
+    while ((i < s_ttyCount) || (j < count))
+    {
+        if ((j > 0) && (j < count) && !strcmp(lines[j], lines[j - 1])) {
+            j++;
+            continue;
+        }
+        cmp = (i == s_ttyCount) ? 1 : (j == count) ? -1 : strcmp(s_ttys[i]->ttydev, lines[j]);
+        if (cmp < 0) {
+            // Logged out
+            heap_remove(s_ttys[i]);
+            free(s_ttys[i++]);
+        } else if (cmp == 0) {
+            ttys[n++] = s_ttys[i++];
+            j++;
+        } else {
+            tty = calloc(1, sizeof(*tty));
+            if (tty) {
+                strlcpy(tty->ttydev, lines[j], sizeof(tty->ttydev));
+                tty->heapIndex = -1;
+                ttys[n++] = tty;
+            }
+            j++;
+        }
+    }
+
+    free(s_ttys);
+    free(s_heap);
+    s_ttys = ttys;
+    s_ttyCount = n;
+
+    // Rebuild the heap over the ttys that are still logged in
+    s_heap = heap;
+    s_heapCount = 0;
+    for (i = 0; i < n; i++) {
+        if (s_ttys[i]->heapIndex >= 0) {
+            s_ttys[i]->heapIndex = s_heapCount;
+            s_heap[s_heapCount++] = s_ttys[i];
+            heap_sift(s_ttys[i]->heapIndex);
+        } else {
+            s_ttys[i]->heapIndex = -1;
+        }
+    }
+    s_heapChanged = true;
+}
+
+static void freettys(void)
+{
+    if (s_tty_queue) {
+        dispatch_sync(s_tty_queue, ^{
+            for (int i = 0; i < s_ttyCount; i++) {
+                free(s_ttys[i]);
+            }
+            free(s_ttys);
+            free(s_heap);
+            s_ttys = s_heap = NULL;
+            s_ttyCount = s_heapCount = 0;
+        });
+    }
 }
 
 static boolean_t ttys_are_active(time_t *time_to_idle_out)
@@ -300,48 +475,43 @@ static boolean_t ttys_are_active(time_t *time_to_idle_out)
     
     *time_to_idle_out = time_to_idle = 0;
 
-    bzero(s_activetty_names, sizeof(s_activetty_names));
-
     curtime = time(NULL);
     if (curtime == (time_t)-1) {
         goto finish;
     }
     
     dispatch_sync(s_tty_queue, ^{
-        struct ttyentry *tty;
-        struct stat sb;
-        time_t minimum_idle_secs;
         bool isPrintedFirst = TRUE;
 
-        minimum_idle_secs = settingIdleSleepSeconds;
+        // Recheck the ttys whose deadlines have passed; the rest are still active
+        while (s_heapCount && (s_heap[0]->deadline <= curtime)) {
+            refresh_tty(s_heap[0], curtime);
+        }
 
-        SLIST_FOREACH(tty, &s_activettys, next) {
-            time_t current_idle_secs;
-            int result;
-            
-            result = stat(tty->ttydev, &sb);
-            if (result != 0) 
-                continue;
-
-            // Add one second so we aren't racing to check at expiration
-            current_idle_secs = curtime - sb.st_atime + 1;
-            if (current_idle_secs > settingIdleSleepSeconds) {
-                continue;
-            }
-            minimum_idle_secs = MIN(current_idle_secs, minimum_idle_secs);
-            active = TRUE;
-            
-            if (isPrintedFirst) {
-                isPrintedFirst = FALSE;
-            } else { // print a pretty comma between tty names
-                strlcat(s_activetty_names, ", ", sizeof(s_activetty_names));
+        // Look for ttys that became active since the last check
+        for (int i = 0; i < s_ttyCount; i++) {
+            if (s_ttys[i]->heapIndex < 0) {
+                refresh_tty(s_ttys[i], curtime);
             }
-            
-            // Record the active ttys' device paths in the string s_activetty_names
-            strlcat(s_activetty_names, tty->ttydev, sizeof(s_activetty_names));
         }
 
-        time_to_idle = (active) ? (settingIdleSleepSeconds - minimum_idle_secs) : 0;
+        active = (s_heapCount > 0);
+        time_to_idle = active ? (s_heap[0]->deadline - curtime) : 0;
+
+        if (s_heapChanged) {
+            s_heapChanged = false;
+            bzero(s_activetty_names, sizeof(s_activetty_names));
+
+            // Record the active ttys' device paths in the string s_activetty_names
+            for (int i = 0; i < s_heapCount; i++) {
+                if (isPrintedFirst) {
+                    isPrintedFirst = FALSE;
+                } else { // print a pretty comma between tty names
+                    strlcat(s_activetty_names, ", ", sizeof(s_activetty_names));
+                }
+                strlcat(s_activetty_names, s_heap[i]->ttydev, sizeof(s_activetty_names));
+            }
+        }
     });
 
     *time_to_idle_out = time_to_idle;
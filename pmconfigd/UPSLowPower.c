@@ -77,7 +77,7 @@ static  bool        _weManageUPSPower(void);
 static  void        _getUPSShutdownThresholdsFromDisk(threshold_struct *thresho);
 static  void        _itIsLaterNow(CFRunLoopTimerRef tmr, void *info);
 static  void        _reEvaluatePowerSourcesLater(int seconds);
-static  void        _doPowerEmergencyShutdown(CFNumberRef ups_id);
+static  void        _doPowerEmergencyShutdown(CFNumberRef *ups_ids, int ups_count);
 
 enum {
     _kIOUPSInternalPowerBit,
@@ -86,13 +86,16 @@ enum {
 
 /* UPSLowPowerPrime
  *
- * Init
+ * Init. Runs after powerd is serving, so power source changes may already
+ * have been ignored for want of thresholds; evaluate the current state.
  */
 __private_extern__ void UPSLowPower_prime(void)
 {
     _thresh = (threshold_struct *)malloc(sizeof(threshold_struct));
     
     _getUPSShutdownThresholdsFromDisk(_thresh);
+
+    UPSLowPowerPSChange();
     return; 
 }
 
@@ -117,157 +120,114 @@ UPSLowPowerPrefsHaveChanged(void)
  * Is the handler that gets notified when power source (battery or UPS)
  * state changes. We might respond to this by posting a user notification
  * or performing emergency shutdown.
+ *
+ * With more than one UPS attached, the units are treated as redundant
+ * supplies: we're on UPS power only once every present unit is on battery,
+ * and the shutdown thresholds apply to their combined capacity and runtime.
  */
 __private_extern__ void
 UPSLowPowerPSChange(void)
 {
-    CFDictionaryRef     ups_info = 0;
-    int                 t1, t2;
-    CFNumberRef         n1, n2;
-    int                 minutes_remaining;
+    UPSAggregate        ups;
     int                 percent_remaining;
-    CFBooleanRef        isPresent;
     static int          last_ups_power_source = _kIOUPSExternalPowerBit;
-    CFStringRef         power_source = 0;
-    CFNumberRef         ups_id = 0;
+    bool                on_ups_power = false;
     
-    // Exit immediately if another application
-    //   is managing emergency UPS shutdown
-    if(!_weManageUPSPower()) {
+    // Exit immediately if the thresholds aren't loaded yet, or if another
+    //   application is managing emergency UPS shutdown
+    if(!_thresh || !_weManageUPSPower()) {
         goto _exit_PowerSourcesHaveChanged_;
     }
     
-    // *** Inspect UPS power levels
-    // We assume we're only dealing with 1 UPS for simplicity.
-    // The "more than one UPS attached " case is undefined.
-    if((ups_info = getActiveUPSDictionary()))
+    // *** Inspect UPS power levels across all present units
+    if(!getUPSAggregate(&ups) || (ups.onBattery < ups.present))
     {
-        ups_id = isA_CFNumber(CFDictionaryGetValue(ups_info, CFSTR(kIOPSPowerSourceIDKey)));
-        if(!ups_id) goto _exit_PowerSourcesHaveChanged_;
-        
-        // Check UPS "Is Present" key
-        isPresent = isA_CFBoolean(CFDictionaryGetValue(ups_info, CFSTR(kIOPSIsPresentKey)));
-        if(!isPresent || !CFBooleanGetValue(isPresent))
-        {
+        // No UPS present, or at least one is still running off of AC power.
+        // One could have just disappeared - if we're showing an alert, clear it.
 #if HAVE_CF_USER_NOTIFICATION
-            if(_UPSAlert)
-            {
-                CFUserNotificationCancel(_UPSAlert);
-                _UPSAlert = 0;
-            }
-#endif
-            // If UPS isn't active or connected we shouldn't base policy decisions on it
-            goto _exit_PowerSourcesHaveChanged_;
+        if(_UPSAlert)
+        {
+            CFUserNotificationCancel(_UPSAlert);
+            _UPSAlert = 0;
         }
+#endif
+        // we have to be draining the internal batteries to do a shutdown, so we'll just exit from here.
+        goto _exit_PowerSourcesHaveChanged_;
+    }
+    
+    on_ups_power = true;
+    
+    // UPS is running off of internal battery power. Show warning if we just switched from AC to battery.
+    if(_kIOUPSExternalPowerBit == last_ups_power_source)
+    {
+        _switchedToUPSPowerTime = CFAbsoluteTimeGetCurrent();
         
-        // Check Power Source
-        power_source = isA_CFString(CFDictionaryGetValue(ups_info, CFSTR(kIOPSPowerSourceStateKey)));
-        if(!power_source || !CFEqual(power_source, CFSTR(kIOPSBatteryPowerValue)))
-        {
-#if HAVE_CF_USER_NOTIFICATION
-            // Running off of AC Power
-            if(_UPSAlert)
-            {
-                CFUserNotificationCancel(_UPSAlert);
-                _UPSAlert = 0;
-            }
-#endif                
-            // we have to be draining the internal battery to do a shutdown, so we'll just exit from here.
-            goto _exit_PowerSourcesHaveChanged_;
+        if( _thresh->haltafter[kHaltEnabled] ) {    
+            // If there's a "shutdown after X minutes on UPS power" threshold, 
+            // set a timer to remind us to check UPS state again after X minutes
+            _reEvaluatePowerSourcesLater(5 + (60*_thresh->haltafter[kHaltValue]));
         }
         
-        // UPS is running off of internal battery power. Show warning if we just switched from AC to battery.
-        if(_kIOUPSExternalPowerBit == last_ups_power_source)
-        {
-            _switchedToUPSPowerTime = CFAbsoluteTimeGetCurrent();
-            
-            if( _thresh->haltafter[kHaltEnabled] ) {    
-                // If there's a "shutdown after X minutes on UPS power" threshold, 
-                // set a timer to remind us to check UPS state again after X minutes
-                _reEvaluatePowerSourcesLater(5 + (60*_thresh->haltafter[kHaltValue]));
-            }
-            
 #if HAVE_CF_USER_NOTIFICATION
-            if(!_UPSAlert) _UPSAlert = _copyUPSWarning();
+        if(!_UPSAlert) _UPSAlert = _copyUPSWarning();
 #endif 
 
-        }
-        
-        if(_batteryCount() > 0)
-        {
-            // Do not do UPS shutdown if internal battery is present.
-            // Internal battery may still be providing power. 
-            // Don't do any further UPS shutdown processing.
-            // PMU will cause an emergency sleep when the battery runs out - we fall back on that
-            // in the battery case.
-            goto _exit_PowerSourcesHaveChanged_;                
-        }
-        
-        // ******
-        // ****** Perform emergency shutdown if any of the shutdown thresholds is true
-        
-        // Check to make sure that the UPS has been on battery power for a full 10 seconds before initiating a shutdown.
-        // Certain UPS's have reported transient "on battery power with 0% capacity remaining" states for 3-5 seconds.
-        // So we make sure not to heed this shutdown notice unless we've been on battery power for 10 seconds.
-        if(_secondsSpentOnUPSPower() < 10) {
-            _reEvaluatePowerSourcesLater(10);
-            goto _exit_PowerSourcesHaveChanged_;
-         }
-        
-        // Calculate battery percentage remaining
-        n1 = isA_CFNumber(CFDictionaryGetValue(ups_info, CFSTR(kIOPSCurrentCapacityKey)));
-        n2 = isA_CFNumber(CFDictionaryGetValue(ups_info, CFSTR(kIOPSMaxCapacityKey)));
-        if(n1 && n2)
-        {
-            if( CFNumberGetValue(n1, kCFNumberIntType, &t1) &&
-                CFNumberGetValue(n2, kCFNumberIntType, &t2)) {
-                percent_remaining = (int)(100.0* ((double)t1) / ((double)t2) );
+    }
+    
+    if(_batteryCount() > 0)
+    {
+        // Do not do UPS shutdown if internal battery is present.
+        // Internal battery may still be providing power. 
+        // Don't do any further UPS shutdown processing.
+        // PMU will cause an emergency sleep when the battery runs out - we fall back on that
+        // in the battery case.
+        goto _exit_PowerSourcesHaveChanged_;                
+    }
+    
+    // ******
+    // ****** Perform emergency shutdown if any of the shutdown thresholds is true
+    
+    // Check to make sure that the UPS has been on battery power for a full 10 seconds before initiating a shutdown.
+    // Certain UPS's have reported transient "on battery power with 0% capacity remaining" states for 3-5 seconds.
+    // So we make sure not to heed this shutdown notice unless we've been on battery power for 10 seconds.
+    if(_secondsSpentOnUPSPower() < 10) {
+        _reEvaluatePowerSourcesLater(10);
+        goto _exit_PowerSourcesHaveChanged_;
+     }
     
-                if( _thresh->haltpercent[kHaltEnabled] ) {
-                    if( percent_remaining <= _thresh->haltpercent[kHaltValue] ) {
-                        _doPowerEmergencyShutdown(ups_id);
-                    }
-                }
+    // Calculate combined battery percentage remaining
+    if(ups.maxCapacity > 0)
+    {
+        percent_remaining = (int)(100.0* ((double)ups.currentCapacity) / ((double)ups.maxCapacity) );
+
+        if( _thresh->haltpercent[kHaltEnabled] ) {
+            if( percent_remaining <= _thresh->haltpercent[kHaltValue] ) {
+                _doPowerEmergencyShutdown(ups.ids, ups.onBattery);
             }
         }
-        
-        // Get UPS's estimated time remaining
-        n1 = isA_CFNumber(CFDictionaryGetValue(ups_info, CFSTR(kIOPSTimeToEmptyKey)));
-        if(n1)
-        {
-            if(CFNumberGetValue(n1, kCFNumberIntType, &minutes_remaining))
-            {
-                if( _thresh->haltremain[kHaltEnabled] ) {
-                    if( minutes_remaining <= _thresh->haltremain[kHaltValue] ) {
-                        _doPowerEmergencyShutdown(ups_id);
-                    }
-                }
+    }
+    
+    // Get the UPS units' combined estimated time remaining
+    if(ups.minutesRemaining != -1)
+    {
+        if( _thresh->haltremain[kHaltEnabled] ) {
+            if( ups.minutesRemaining <= _thresh->haltremain[kHaltValue] ) {
+                _doPowerEmergencyShutdown(ups.ids, ups.onBattery);
             }
         }
+    }
 
-        // Determine how long we've been running on UPS power
-        if( _thresh->haltafter[kHaltEnabled] ) {
-            if(_minutesSpentOnUPSPower() >= _thresh->haltafter[kHaltValue]) {
-                _doPowerEmergencyShutdown(ups_id);
-            }
-        }
-        
-    } else {
-        // No "active UPS" detected. 
-        // One could have just disappeared - if we're showing an alert, clear it.
-#if HAVE_CF_USER_NOTIFICATION
-        if(_UPSAlert)
-        {
-            CFUserNotificationCancel(_UPSAlert);
-            _UPSAlert = 0;
+    // Determine how long we've been running on UPS power
+    if( _thresh->haltafter[kHaltEnabled] ) {
+        if(_minutesSpentOnUPSPower() >= _thresh->haltafter[kHaltValue]) {
+            _doPowerEmergencyShutdown(ups.ids, ups.onBattery);
         }
-#endif
     }
     
     // exit point
     _exit_PowerSourcesHaveChanged_:
     
-    if(power_source && CFEqual(power_source, CFSTR(kIOPSBatteryPowerValue))) {
+    if(on_ups_power) {
         last_ups_power_source = _kIOUPSInternalPowerBit;
     } else {
         last_ups_power_source = _kIOUPSExternalPowerBit;
@@ -301,7 +261,7 @@ UPSLowPowerPSChange(void)
  *
  */
 static void 
-_doPowerEmergencyShutdown(CFNumberRef ups_id)
+_doPowerEmergencyShutdown(CFNumberRef *ups_ids, int ups_count)
 {
     static int      _alreadyShuttingDown = 0;
     CFDictionaryRef _ESSettings = NULL;
@@ -310,6 +270,7 @@ _doPowerEmergencyShutdown(CFNumberRef ups_id)
     IOReturn        error;
     bool            upsRestart = false;
     int             restart_setting;
+    int             i;
     
     if(_alreadyShuttingDown) 
         return;
@@ -337,9 +298,16 @@ _doPowerEmergencyShutdown(CFNumberRef ups_id)
         goto shutdown;
     }
 
-    // Does the attached UPS support RemovePowerDelayed?
-    if(_upsSupports(ups_id, CFSTR(kIOPSCommandDelayedRemovePowerKey)))
+    // Every unit feeding us has to drop power before the machine sees the
+    // "power failure" that restarts it.
+    for(i=0; i<ups_count; i++)
     {
+        CFNumberRef ups_id = ups_ids[i];
+
+        // Does this UPS support RemovePowerDelayed?
+        if(!ups_id || !_upsSupports(ups_id, CFSTR(kIOPSCommandDelayedRemovePowerKey)))
+            continue;
+
         syslog(LOG_INFO, "System will restart when external power is restored to UPS.");
 
         error = _upsCommand(ups_id, 
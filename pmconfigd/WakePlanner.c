@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2014 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#include <stdlib.h>
+
+#include "WakePlanner.h"
+
+static const CFTimeInterval kTolerance[kChooseWakeTypeCount] = {
+    [kChooseFullWake]           = kWakeToleranceFullWake,
+    [kChooseMaintenance]        = kWakeToleranceMaintenance,
+    [kChooseSleepServiceWake]   = kWakeToleranceSleepService,
+    [kChooseTimerPlugin]        = kWakeToleranceTimerPlugin
+};
+
+// A wake's type is the most capable one any of its requests needs
+static const int kTypeRank[kChooseWakeTypeCount] = {
+    [kChooseFullWake]           = 3,
+    [kChooseSleepServiceWake]   = 2,
+    [kChooseMaintenance]        = 1,
+    [kChooseTimerPlugin]        = 0
+};
+
+static int compareDeadlines(const void *a, const void *b)
+{
+    const WakeRequest   *ra = (const WakeRequest *)a;
+    const WakeRequest   *rb = (const WakeRequest *)b;
+
+    if (ra->latest != rb->latest) {
+        return (ra->latest < rb->latest) ? -1 : 1;
+    }
+    if (ra->earliest != rb->earliest) {
+        return (ra->earliest < rb->earliest) ? -1 : 1;
+    }
+    return ra->id - rb->id;
+}
+
+__private_extern__ void WakeRequestSet(
+    WakeRequest         *req,
+    wakeType_e          type,
+    CFAbsoluteTime      time,
+    CFAbsoluteTime      notBefore,
+    int                 id)
+{
+    req->type = type;
+    req->id = id;
+    req->wake = -1;
+    req->earliest = (time < notBefore) ? notBefore : time;
+    req->latest = time + kTolerance[type];
+    if (req->latest < req->earliest) {
+        req->latest = req->earliest;
+    }
+}
+
+__private_extern__ int WakePlanCompute(WakeRequest *reqs, int count, PlannedWake *wakes)
+{
+    PlannedWake     *w = NULL;
+    CFAbsoluteTime  deadline = 0.0;
+    int             n = 0;
+    int             i;
+
+    qsort(reqs, count, sizeof(WakeRequest), compareDeadlines);
+
+    for (i = 0; i < count; i++)
+    {
+        // Deadlines only grow, so a request that can start by the current
+        // wake's deadline shares that wake. Otherwise its own deadline
+        // bounds the next one.
+        if (!w || (reqs[i].earliest > deadline)) {
+            w = &wakes[n++];
+            deadline = reqs[i].latest;
+            w->time = reqs[i].earliest;
+            w->type = reqs[i].type;
+            w->requestCount = 0;
+            w->firstRequest = reqs[i].id;
+        }
+
+        // No earlier than any of its requests wants
+        if (reqs[i].earliest > w->time) {
+            w->time = reqs[i].earliest;
+        }
+        if (kTypeRank[reqs[i].type] > kTypeRank[w->type]) {
+            w->type = reqs[i].type;
+        }
+        w->requestCount++;
+        reqs[i].wake = n - 1;
+    }
+
+    return n;
+}
@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2014 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#ifndef _WakePlanner_h_
+#define _WakePlanner_h_
+
+#include <CoreFoundation/CoreFoundation.h>
+
+/*
+ * WakePlanner merges the wake requests collected at system sleep into as
+ * few RTC wakes as possible.
+ *
+ * Every request may be served any time from its requested time until
+ * that time plus its type's tolerance. WakePlanCompute() finds the fewest
+ * wakes such that each request has one inside its window (the greedy
+ * earliest-deadline cover, which is optimal for intervals), and puts
+ * each wake at the earliest time that serves all of its requests.
+ *
+ * It has no powerd state, so schedules recorded from 'pmset -g log' can
+ * be replayed through it offline.
+ */
+
+/* Array indices & for PMChooseScheduledEvent */
+typedef enum {
+    kChooseFullWake         = 0,
+    kChooseMaintenance      = 1,
+    kChooseSleepServiceWake = 2,
+    kChooseTimerPlugin      = 3,
+    kChooseWakeTypeCount    = 4
+} wakeType_e;
+
+// How late a request of each type may be served, in seconds
+#define kWakeToleranceFullWake          0
+#define kWakeToleranceMaintenance       (10 * 60)
+#define kWakeToleranceSleepService      60
+#define kWakeToleranceTimerPlugin       (10 * 60)
+
+typedef struct {
+    CFAbsoluteTime      earliest;       // requested time
+    CFAbsoluteTime      latest;         // requested time + tolerance
+    wakeType_e          type;
+    int                 id;             // caller's identifier for the request
+    int                 wake;           // set by WakePlanCompute: index of the wake serving it
+} WakeRequest;
+
+typedef struct {
+    CFAbsoluteTime      time;
+    wakeType_e          type;           // a full wake if any request needs one, etc.
+    int                 requestCount;
+    int                 firstRequest;   // id of the request with the earliest deadline
+} PlannedWake;
+
+/* WakeRequestSet
+ * Fills in 'req' for a request of 'type' at 'time', moved no earlier
+ * than 'notBefore'.
+ */
+__private_extern__ void     WakeRequestSet(WakeRequest *req, wakeType_e type, CFAbsoluteTime time,
+                                           CFAbsoluteTime notBefore, int id);
+
+/* WakePlanCompute
+ * Plans wakes for 'count' requests into 'wakes', which must have room for
+ * 'count' entries, in time order. Reorders 'reqs'. Returns the number of wakes.
+ */
+__private_extern__ int      WakePlanCompute(WakeRequest *reqs, int count, PlannedWake *wakes);
+
+#endif // _WakePlanner_h_
@@ -28,6 +28,7 @@
 #include <grp.h>
 #include <pwd.h>
 #include <mach/mach.h>
+#include <mach/mach_time.h>
 #include <servers/bootstrap.h>
 #include <notify.h> 
 #include <asl.h>
@@ -61,6 +62,7 @@
 #include "PMConnection.h"
 #include "ExternalMedia.h"
 #include "Platform.h"
+#include "PMTrace.h"
 
 // To support importance donation across IPCs
 #include <libproc_internal.h>
@@ -261,6 +263,158 @@ __private_extern__ void dynamicStoreNotifyCallBack(
                 void                *info);
 
 
+/*
+ * Startup steps, in the order they run.
+ *
+ * Prefetch steps only read state (the battery registry entries and the
+ * Energy Saver settings), so they run concurrently on a global queue from
+ * the top of main(). Every other step registers run loop sources or
+ * notifications and runs on the main thread: critical steps before powerd
+ * serves its MIG port, steps marked kStartupAfterPrefetch once the prefetches
+ * have finished, and deferred steps from the main queue once the run loop
+ * is serving. Deferred steps must cope with their callers arriving first.
+ */
+typedef enum {
+    kStartupPrefetch,
+    kStartupCritical,
+    kStartupAfterPrefetch,
+    kStartupDeferred
+} StartupPhase;
+
+typedef struct {
+    const char          *name;
+    void                (*run)(void);
+    StartupPhase        phase;
+    uint64_t            elapsed;        // mach_absolute_time units
+} StartupStep;
+
+static StartupStep startupSteps[] = {
+    { "batteries",          _prefetchBatteries,                         kStartupPrefetch },
+    { "settings",           PMSettingsPrefetch,                         kStartupPrefetch },
+    { "PMStore",            PMStoreLoad,                                kStartupCritical },
+    { "ESPrefs",            initializeESPrefsDynamicStore,              kStartupCritical },
+    { "Interest",           initializeInterestNotifications,            kStartupAfterPrefetch },
+    { "Timezone",           initializeTimezoneChangeNotifications,      kStartupCritical },
+    { "Calendar",           initializeCalendarResyncNotification,       kStartupCritical },
+    { "Shutdown",           initializeShutdownNotifications,            kStartupCritical },
+    { "RootDomain",         initializeRootDomainInterestNotifications,  kStartupCritical },
+#if !TARGET_OS_EMBEDDED
+    { "UserNotifications",  initializeUserNotifications,                kStartupCritical },
+    { "OneOffHacks",        _oneOffHacksSetup,                          kStartupCritical },
+#endif
+    { "SleepWake",          initializeSleepWakeNotifications,           kStartupCritical },
+    { "SleepWakeUUID",      pushNewSleepWakeUUID,                       kStartupCritical },
+#if PMTRACE
+    { "PMTrace",            PMTrace_prime,                              kStartupCritical },
+#endif
+    { "BatteryTimeRemaining", BatteryTimeRemaining_prime,               kStartupCritical },
+    { "PMSettings",         PMSettings_prime,                           kStartupAfterPrefetch },
+    { "AutoWake",           AutoWake_prime,                             kStartupCritical },
+    { "PMAssertions",       PMAssertions_prime,                         kStartupCritical },
+    { "PMSystemEvents",     PMSystemEvents_prime,                       kStartupCritical },
+    { "SystemLoad",         SystemLoad_prime,                           kStartupCritical },
+    { "PMConnection",       PMConnection_prime,                         kStartupCritical },
+#if !TARGET_OS_EMBEDDED
+    { "OnBootAssertions",   createOnBootAssertions,                     kStartupCritical },
+    { "SleepWakeWdog",      enableSleepWakeWdog,                        kStartupCritical },
+    { "UPSLowPower",        UPSLowPower_prime,                          kStartupDeferred },
+    { "TTYKeepAwake",       TTYKeepAwake_prime,                         kStartupDeferred },
+    { "ExternalMedia",      ExternalMedia_prime,                        kStartupDeferred },
+#endif
+};
+
+#define kStartupStepCount   (sizeof(startupSteps) / sizeof(startupSteps[0]))
+
+static void runStartupStep(StartupStep *step)
+{
+    uint64_t    start = mach_absolute_time();
+
+    step->run();
+    step->elapsed = mach_absolute_time() - start;
+}
+
+static double startupMS(uint64_t t)
+{
+    static mach_timebase_info_data_t    tb;
+
+    if (!tb.denom) {
+        mach_timebase_info(&tb);
+    }
+    return (double)t * tb.numer / tb.denom / 1000000.0;
+}
+
+/* startPrefetch
+ *
+ * Starts the prefetch steps on a global queue.
+ */
+static dispatch_group_t startPrefetch(void)
+{
+    dispatch_group_t    group = dispatch_group_create();
+    dispatch_queue_t    q = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0);
+
+    for (unsigned i = 0; i < kStartupStepCount; i++) {
+        if (startupSteps[i].phase == kStartupPrefetch) {
+            StartupStep *step = &startupSteps[i];
+            dispatch_group_async(group, q, ^{ runStartupStep(step); });
+        }
+    }
+    return group;
+}
+
+/* runStartupSteps
+ *
+ * Runs the critical and after-prefetch steps on the main thread, waiting
+ * for the prefetches before the first step that needs them.
+ */
+static void runStartupSteps(dispatch_group_t prefetch)
+{
+    for (unsigned i = 0; i < kStartupStepCount; i++)
+    {
+        if (startupSteps[i].phase == kStartupAfterPrefetch && prefetch) {
+            dispatch_group_wait(prefetch, DISPATCH_TIME_FOREVER);
+            dispatch_release(prefetch);
+            prefetch = NULL;
+        }
+        if (startupSteps[i].phase == kStartupCritical
+            || startupSteps[i].phase == kStartupAfterPrefetch) {
+            runStartupStep(&startupSteps[i]);
+        }
+    }
+    if (prefetch) {
+        dispatch_group_wait(prefetch, DISPATCH_TIME_FOREVER);
+        dispatch_release(prefetch);
+    }
+}
+
+/* runDeferredStartupSteps
+ *
+ * Runs the deferred steps once powerd is serving, then logs how long each
+ * startup step took.
+ */
+static void runDeferredStartupSteps(uint64_t launched, uint64_t serving)
+{
+    char        report[1024];
+    size_t      len = 0;
+    uint64_t    deferred = 0;
+
+    for (unsigned i = 0; i < kStartupStepCount; i++) {
+        if (startupSteps[i].phase == kStartupDeferred) {
+            runStartupStep(&startupSteps[i]);
+            deferred += startupSteps[i].elapsed;
+        }
+    }
+
+    for (unsigned i = 0; i < kStartupStepCount && len < sizeof(report); i++) {
+        len += snprintf(report + len, sizeof(report) - len, " %s%s=%.1f",
+                        (startupSteps[i].phase == kStartupDeferred) ? "*" : "",
+                        startupSteps[i].name, startupMS(startupSteps[i].elapsed));
+    }
+    asl_log(NULL, NULL, ASL_LEVEL_NOTICE,
+            "powerd serving after %.1f ms, deferred steps took %.1f ms; step ms (*deferred):%s\n",
+            startupMS(serving - launched), startupMS(deferred), report);
+}
+
+
 /* load
  *
  * configd entry point
@@ -274,7 +428,12 @@ int main(int argc __unused, char *argv[] __unused)
     CFRunLoopSourceRef      cfmp_rls = 0;
     CFMachPortContext       context  = { 0, (void *)1, NULL, NULL, serverMPCopyDescription };
     kern_return_t           kern_result = 0;
+    uint64_t                launched = mach_absolute_time();
+    uint64_t                serving;
+    dispatch_group_t        prefetch;
     
+    prefetch = startPrefetch();
+
     xpc_register();
     
     kern_result = bootstrap_check_in(
@@ -328,47 +487,18 @@ int main(int argc __unused, char *argv[] __unused)
     }
 
     _getPMRunLoop();
-    
-    PMStoreLoad();
-    
-    initializeESPrefsDynamicStore();
-    initializeInterestNotifications();
-    initializeTimezoneChangeNotifications();
-    initializeCalendarResyncNotification();    
-    initializeShutdownNotifications();
-    initializeRootDomainInterestNotifications();
-    
-#if !TARGET_OS_EMBEDDED
-    initializeUserNotifications();
-    _oneOffHacksSetup();
-#endif
-    
-    initializeSleepWakeNotifications();
-
-    // Prime the messagetracer UUID pump
-    pushNewSleepWakeUUID();
-    
-    BatteryTimeRemaining_prime();
-    PMSettings_prime();
-    AutoWake_prime();
-    PMAssertions_prime();
-    PMSystemEvents_prime();
-    SystemLoad_prime();
-    PMConnection_prime();
-
-#if !TARGET_OS_EMBEDDED
-    UPSLowPower_prime();
-    TTYKeepAwake_prime();
-    ExternalMedia_prime();
 
-    createOnBootAssertions();
-    enableSleepWakeWdog();
-#endif
+    runStartupSteps(prefetch);
 
     _unclamp_silent_running(false);
     notify_post(kIOUserAssertionReSync);
     logASLMessagePMStart();
 
+    serving = mach_absolute_time();
+    dispatch_async(dispatch_get_main_queue(), ^{
+        runDeferredStartupSteps(launched, serving);
+    });
+
     CFRunLoopRun();
     return 0;
 }
@@ -539,7 +669,9 @@ ESPrefsHaveChanged(
 #if !TARGET_OS_EMBEDDED
         UPSLowPowerPrefsHaveChanged();
         TTYKeepAwakePrefsHaveChanged();
+        _loadLowCapRatioTimes();
 #endif
+        BatteryTimeRemainingPrefsHaveChanged();
         SystemLoadPrefsHaveChanged();
     }
 
@@ -615,6 +747,10 @@ timeZoneChangedCallBack(
     if( CFEqual(notificationName, gTZNotificationNameString) )
     {
         broadcastGMTOffset();
+
+        // Repeating events are scheduled in local time
+        RepeatingAutoWakeTimeChange(true);
+        AutoWakeCalendarChange();
     }
 }
 
@@ -997,6 +1133,8 @@ mig_server_callback(CFMachPortRef port, void *msg, CFIndex size, void *info)
     mach_msg_return_t   mr;
     int                 options;
 
+    PMTRACE_SCOPE(kPMTraceMIG, bufRequest->Head.msgh_id);
+
     __MACH_PORT_DEBUG(true, "mig_server_callback", serverPort);
     
     /* we have a request message */
@@ -1155,6 +1293,38 @@ kern_return_t _io_pm_get_value_int(
     
     switch(selector)
     {
+      case kPMStatsEnergySettingsPushed:
+            _getEnergySettingsCounts((uint32_t *)outValue, NULL);
+            break;
+
+      case kPMStatsEnergySettingsSkipped:
+            _getEnergySettingsCounts(NULL, (uint32_t *)outValue);
+            break;
+
+      case kPMStatsStoreKeysWritten:
+            PMStoreGetStats((uint32_t *)outValue, NULL);
+            break;
+
+      case kPMStatsStoreFlushes:
+            PMStoreGetStats(NULL, (uint32_t *)outValue);
+            break;
+
+      case kPMStatsWakesScheduled:
+            PMConnectionGetWakePlanStats((uint32_t *)outValue, NULL);
+            break;
+
+      case kPMStatsWakeRequestsMerged:
+            PMConnectionGetWakePlanStats(NULL, (uint32_t *)outValue);
+            break;
+
+      case kPMStatsUserActiveDeclared:
+            PMAssertionsGetUserActiveStats((uint32_t *)outValue, NULL);
+            break;
+
+      case kPMStatsUserActiveCoalesced:
+            PMAssertionsGetUserActiveStats(NULL, (uint32_t *)outValue);
+            break;
+
 #if !TARGET_OS_EMBEDDED
       case kIOPMGetSilentRunningInfo:
          if ( smcSilentRunningSupport( ))
@@ -48,6 +48,9 @@
 #endif
 
 #include "../pmconfigd/PrivateLib.h"
+#include "../pmconfigd/PMEventHistory.h"
+#include "../pmconfigd/PMTrace.h"
+#include "../pmconfigd/AssertionSnapshot.h"
 
 // dynamically mig generated
 #include "powermanagement.h"
@@ -154,9 +157,15 @@
 #define ARG_ASSERTIONSLOG   "assertionslog"
 #define ARG_SYSLOAD         "sysload"
 #define ARG_SYSLOADLOG      "sysloadlog"
+#define ARG_TRACE           "trace"
 #define ARG_USERACTIVITYLOG "useractivitylog"
 #define ARG_USERACTIVITY    "useractivity"
 #define ARG_LOG             "log"
+#define ARG_LOG_SINCE       "--since"
+#define ARG_LOG_UNTIL       "--until"
+#define ARG_LOG_DOMAIN      "--domain"
+#define ARG_LOG_UUID        "--uuid"
+#define ARG_LOG_JSON        "--json"
 #define ARG_LISTEN          "listen"
 #define ARG_HISTORY         "history"
 #define ARG_HISTORY_DETAILED "historydetailed"
@@ -364,9 +373,11 @@ static void show_active_assertions(uint32_t which);
 static void show_power_sources(int which);
 static bool prevent_idle_sleep(void);
 static void show_assertions(const char *);
+static void show_assertions_binary(void);
 static void log_assertions(void);
 static void show_systemload(void);
 static void log_systemload(void);
+static void show_trace(void);
 
 static const bool kRunOnce = true;
 static const bool kRunLoop = false;
@@ -374,7 +385,7 @@ static void log_useractivity_presentActive(bool runOnce);
 static void log_useractivity_level(bool runOnce);
 static void show_useractivity_level(uint64_t lev, uint64_t msb);
 
-static void show_log(void);
+static void show_log(char **argv);
 static void show_uuid(bool keep_running);
 static void listen_for_everything(void);
 static bool is_display_dim_captured(void);
@@ -542,13 +553,15 @@ static CommandAndAction the_getters[] =
         {kActionGetOnceNoArgs,  ARG_BATTRAW,        ^(char **arg){ print_raw_battery_state(IO_OBJECT_NULL); }},
         {kActionGetOnceNoArgs,  ARG_THERM,          ^(char **arg){ show_thermal_warning_level(); show_thermal_cpu_power_level(); }},
     	{kActionGetLog,         ARG_THERMLOG,       ^(char **arg){ log_thermal_events(); }},
-    	{kActionGetOnceNoArgs,  ARG_ASSERTIONS,     ^(char **arg){ show_assertions(NULL); }},
+    	{kActionGetOnceNoArgs,  ARG_ASSERTIONS,     ^(char **arg){ if (arg && arg[0] && !strcmp(arg[0], "--binary")) show_assertions_binary();
+                                                        else show_assertions(NULL); }},
     	{kActionGetLog,         ARG_ASSERTIONSLOG,  ^(char **arg){ log_assertions(); }},
     	{kActionGetOnceNoArgs,  ARG_SYSLOAD,        ^(char **arg){ show_systemload(); }},
     	{kActionGetLog,         ARG_SYSLOADLOG,     ^(char **arg){ log_systemload(); }},
+        {kActionNotForEverything, ARG_TRACE,        ^(char **arg){ show_trace(); }},
     	{kActionGetLog,         ARG_USERACTIVITYLOG,^(char **arg){ log_useractivity_presentActive(kRunLoop); }},
     	{kActionGetOnceNoArgs,  ARG_USERACTIVITY   ,^(char **arg){ log_useractivity_presentActive(kRunOnce); }},
-    	{kActionGetOnceNoArgs,  ARG_LOG,            ^(char **arg){ show_log(); }},
+    	{kActionGetOnceNoArgs,  ARG_LOG,            ^(char **arg){ show_log(arg); }},
     	{kActionGetLog,         ARG_LISTEN,         ^(char **arg){ listen_for_everything(); }},
     	{kActionGetOnceNoArgs,  ARG_HISTORY,        ^(char **arg){ show_power_event_history(); }},
     	{kActionGetOnceNoArgs,  ARG_HISTORY_DETAILED, ^(char **arg){ show_power_event_history_detailed(); }},
@@ -689,7 +702,31 @@ int main(int argc, char *argv[]) {
         kern_return_t           kern_result;
         
         /* 
-         * Step 1 - send these forced settings over to powerd.
+         * Step 1 - this code might be running in a partilially uninitialized OS,
+         * and powerd might not be running. e.g. at Installer context.
+         * Since powerd may not be running, we activate these settings directly 
+         * to the controlling drivers in the kernel.
+         *
+         */
+        CFTypeRef       powersources = IOPSCopyPowerSourcesInfo();
+        CFStringRef     activePowerSource = NULL;
+        CFDictionaryRef useSettings = NULL;
+        if (powersources) {
+            activePowerSource = IOPSGetProvidingPowerSourceType(powersources);
+            if (!activePowerSource) {
+                activePowerSource = CFSTR(kIOPMACPowerKey);
+            }
+            useSettings = CFDictionaryGetValue(es_custom_settings, activePowerSource);
+            if (useSettings) {
+                ActivatePMSettings(useSettings, true);
+            }
+            CFRelease(powersources);
+        }
+
+        /* 
+         * Step 2 - send these forced settings over to powerd. powerd sends them
+         * to the kernel last, with its overrides applied, and forgets what it
+         * had sent before Step 1.
          * 
          */
         err = _pm_connect(&pm_server);
@@ -720,28 +757,6 @@ int main(int argc, char *argv[]) {
             _pm_disconnect(pm_server);
         }
 
-        /* 
-         * Step 2 - this code might be running in a partilially uninitialized OS,
-         * and powerd might not be running. e.g. at Installer context.
-         * Since powerd may not be running, we also activate these settings directly 
-         * to the controlling drivers in the kernel.
-         *
-         */
-        CFTypeRef       powersources = IOPSCopyPowerSourcesInfo();
-        CFStringRef     activePowerSource = NULL;
-        CFDictionaryRef useSettings = NULL;
-        if (powersources) {
-            activePowerSource = IOPSGetProvidingPowerSourceType(powersources);
-            if (!activePowerSource) {
-                activePowerSource = CFSTR(kIOPMACPowerKey);
-            }
-            useSettings = CFDictionaryGetValue(es_custom_settings, activePowerSource);
-            if (useSettings) {
-                ActivatePMSettings(useSettings, true);
-            }
-            CFRelease(powersources);
-        }
-
         // Return here. If this is a 'force' call we do _not_ want
         // to attempt to write any settings to the disk, or to try anything
         // else at all, as our environment may be unwritable / diskless
@@ -2396,25 +2411,46 @@ exit:
     return;
 }
 
-static void print_pretty_date(CFAbsoluteTime t, bool newline)
+/*
+ * Formats 't' as print_pretty_date() prints it. The formatter is made once,
+ * and the string is reused while 't' stays within the same second, as it
+ * does for runs of log messages.
+ */
+static const char *format_pretty_date(CFAbsoluteTime t)
 {
-    CFDateFormatterRef  date_format;
-    CFStringRef         time_date;
-    char                _date[60];
- 
-    date_format = CFDateFormatterCreate (NULL, NULL, kCFDateFormatterNoStyle, kCFDateFormatterNoStyle);
-    CFDateFormatterSetFormat(date_format, CFSTR("yyyy-MM-dd HH:mm:ss ZZZ"));
+    static CFDateFormatterRef   date_format = NULL;
+    static CFAbsoluteTime       cached_second = 0;
+    static char                 _date[60];
+    CFStringRef                 time_date;
+
+    if (_date[0] && (floor(t) == cached_second)) {
+        return _date;
+    }
+    if (!date_format) {
+        date_format = CFDateFormatterCreate (NULL, NULL, kCFDateFormatterNoStyle, kCFDateFormatterNoStyle);
+        CFDateFormatterSetFormat(date_format, CFSTR("yyyy-MM-dd HH:mm:ss ZZZ"));
+    }
 
+    _date[0] = 0;
     time_date = CFDateFormatterCreateStringWithAbsoluteTime(kCFAllocatorDefault,
         date_format, t);
-    CFRelease(date_format);
-
     if(time_date)
     {
-        CFStringGetCString(time_date, _date, 60, kCFStringEncodingMacRoman);
+        CFStringGetCString(time_date, _date, sizeof(_date), kCFStringEncodingMacRoman);
+        CFRelease(time_date); 
+        cached_second = floor(t);
+    }
+    return _date;
+}
+
+static void print_pretty_date(CFAbsoluteTime t, bool newline)
+{
+    const char          *_date = format_pretty_date(t);
+
+    if(_date[0])
+    {
         printf("%s ", _date); fflush(stdout);
         if(newline) printf("\n");
-        CFRelease(time_date); 
     }
 
 }
@@ -2440,16 +2476,29 @@ static void print_date_with_style(const char *dsf, CFDateFormatterStyle dayStyle
     CFLocaleRef         loc;
     char                _date[60];
  
-    loc = CFLocaleCopyCurrent();
-    date_format = CFDateFormatterCreate(kCFAllocatorDefault, loc,
-        dayStyle, timeStyle);
-    CFRelease(loc);
-    tz = CFTimeZoneCopySystem();
-    CFDateFormatterSetProperty(date_format, kCFDateFormatterTimeZone, tz);
-    CFRelease(tz);
+    // One formatter per style pair, made on first use
+    static CFDateFormatterRef   formatters[kCFDateFormatterFullStyle + 1][kCFDateFormatterFullStyle + 1];
+    bool                        cached = (dayStyle <= kCFDateFormatterFullStyle)
+                                            && (timeStyle <= kCFDateFormatterFullStyle);
+ 
+    date_format = cached ? formatters[dayStyle][timeStyle] : NULL;
+    if (!date_format) {
+        loc = CFLocaleCopyCurrent();
+        date_format = CFDateFormatterCreate(kCFAllocatorDefault, loc,
+            dayStyle, timeStyle);
+        CFRelease(loc);
+        tz = CFTimeZoneCopySystem();
+        CFDateFormatterSetProperty(date_format, kCFDateFormatterTimeZone, tz);
+        CFRelease(tz);
+        if (cached) {
+            formatters[dayStyle][timeStyle] = date_format;
+        }
+    }
     time_date = CFDateFormatterCreateStringWithAbsoluteTime(kCFAllocatorDefault,
         date_format, t);
-    CFRelease(date_format);
+    if (!cached) {
+        CFRelease(date_format);
+    }
 
     if(time_date)
     {
@@ -2462,93 +2511,124 @@ static void print_date_with_style(const char *dsf, CFDateFormatterStyle dayStyle
 
 /******************************************************************************/
 
+static bool copy_assertions_status(PMAssertionStatus *status)
+{
+    mach_port_t                 connectIt = MACH_PORT_NULL;
+    vm_offset_t                 buf = 0;
+    mach_msg_type_number_t      len = 0;
+    const PMAssertionStatus     *packed;
+    int                         rc = kIOReturnError;
+    bool                        copied = false;
+
+    if (kIOReturnSuccess != _pm_connect(&connectIt)) {
+        return false;
+    }
+    if ((KERN_SUCCESS == io_pm_assertion_copy_details(connectIt, 0, kPMAssertionMIGCopyStatusPacked, &buf, &len, &rc))
+        && (kIOReturnSuccess == rc) && (packed = PMAssertionStatusOpen((const void *)buf, len)))
+    {
+        *status = *packed;
+        copied = true;
+    }
+    if (buf) {
+        vm_deallocate(mach_task_self(), buf, len);
+    }
+    _pm_disconnect(connectIt);
+    return copied;
+}
+
+/*
+ * Bits for the types in 'names' among the status's types. Made once per
+ * run; the type numbers don't change while powerd runs.
+ */
+static uint32_t assertion_status_bits_for(const PMAssertionStatus *status, const CFStringRef *names, int count)
+{
+    CFStringRef     typeName;
+    uint32_t        bits = 0;
+    int             i, j;
+
+    for (i = 0; i < status->typeCount; i++)
+    {
+        typeName = CFStringCreateWithCString(0, status->names[i], kCFStringEncodingUTF8);
+        if (!typeName) continue;
+        for (j = 0; j < count; j++) {
+            if (kCFCompareEqualTo == CFStringCompare(typeName, names[j], 0)) {
+                bits |= (1U << i);
+                break;
+            }
+        }
+        CFRelease(typeName);
+    }
+    return bits;
+}
+
 static void show_assertions_system_aggregates(bool updates_only)
 {
     /*
      *   Copy aggregates
      */
-    CFStringRef             *assertionNames = NULL;
-    CFNumberRef             *assertionValues = NULL;
-    char                    name[50];
-    int                     val;
-    CFIndex                 count;
-    CFDictionaryRef         assertions_status;
-    IOReturn                ret;
-    int                     i;
-    char                    logStr[120];
-    int                     len = 0;
-    static CFDictionaryRef         prevAssertion_status = NULL;
-    static CFStringRef             *prevAssertionNames = NULL;
-    static CFNumberRef             *prevAssertionValues = NULL;
-    
-    ret = IOPMCopyAssertionsStatus(&assertions_status);
-    if ((kIOReturnSuccess != ret) || (NULL == assertions_status))
+    PMAssertionStatus           status;
+    char                        logStr[120];
+    int                         len = 0;
+    int                         val;
+    int                         i;
+    static PMAssertionStatus    prevStatus;
+    static bool                 havePrevStatus = false;
+    static uint32_t             rarelyUsed = 0;
+    static uint32_t             neverShown = 0;
+    static bool                 haveShownBits = false;
+
+    if (!copy_assertions_status(&status))
     {
         printf("No assertions.\n");
         return;
     }
-    
-    count = CFDictionaryGetCount(assertions_status);
-    if (0 == count)
+
+    if (0 == status.typeCount)
     {
         return;
     }
-    
-    assertionNames = (CFStringRef *)malloc(sizeof(CFStringRef *)*count);
-    assertionValues = (CFNumberRef *)malloc(sizeof(CFNumberRef *)*count);
-    CFDictionaryGetKeysAndValues(assertions_status, 
-                                 (const void **)assertionNames, (const void **)assertionValues);
-    
+
+    if (!haveShownBits) {
+        /* These are rarely used. So, print only if they are set */
+        const CFStringRef rare[] = {
+            kIOPMAssertionTypeNeedsCPU, kIOPMAssertionTypeDisableInflow, kIOPMAssertionTypeInhibitCharging,
+            kIOPMAssertionTypeDisableLowBatteryWarnings, kIOPMAssertInternalPreventSleep,
+            kIOPMAssertInternalPreventDisplaySleep, kIOPMAssertDisplayWake, kIOPMAssertPreventDiskIdle,
+            kIOPMAssertInteractivePushServiceTask, kIOPMAssertionTypeDisableRealPowerSources_Debug };
+        rarelyUsed = assertion_status_bits_for(&status, rare, sizeof(rare)/sizeof(rare[0]));
+#if !TARGET_OS_EMBEDDED
+        const CFStringRef never[] = {
+            kIOPMAssertionTypeEnableIdleSleep, kIOPMAssertAwakeReservePower, kIOPMAssertionTypeSystemIsActive };
+        neverShown = assertion_status_bits_for(&status, never, sizeof(never)/sizeof(never[0]));
+#endif
+        haveShownBits = true;
+    }
+
     logStr[0] = 0;
     if (!updates_only) printf("Assertion status system-wide:\n");
 
-    for (i=0; i<count; i++)
+    for (i=0; i<status.typeCount; i++)
     {
-        CFNumberGetValue(assertionValues[i], kCFNumberIntType, &val);    
-        if ((kCFCompareEqualTo == CFStringCompare(assertionNames[i], kIOPMAssertionTypeNeedsCPU, 0)) ||
-            (kCFCompareEqualTo == CFStringCompare(assertionNames[i], kIOPMAssertionTypeDisableInflow, 0)) ||
-            (kCFCompareEqualTo == CFStringCompare(assertionNames[i], kIOPMAssertionTypeInhibitCharging, 0)) ||
-            (kCFCompareEqualTo == CFStringCompare(assertionNames[i], kIOPMAssertionTypeDisableLowBatteryWarnings, 0)) ||
-            (kCFCompareEqualTo == CFStringCompare(assertionNames[i], kIOPMAssertInternalPreventSleep, 0)) ||
-            (kCFCompareEqualTo == CFStringCompare(assertionNames[i], kIOPMAssertInternalPreventDisplaySleep, 0)) ||
-            (kCFCompareEqualTo == CFStringCompare(assertionNames[i], kIOPMAssertDisplayWake, 0)) ||
-            (kCFCompareEqualTo == CFStringCompare(assertionNames[i], kIOPMAssertPreventDiskIdle, 0)) ||
-            (kCFCompareEqualTo == CFStringCompare(assertionNames[i], kIOPMAssertInteractivePushServiceTask, 0)) ||
-            (kCFCompareEqualTo == CFStringCompare(assertionNames[i], kIOPMAssertionTypeDisableRealPowerSources_Debug, 0)))
-        {
-            /* These are rarely used. So, print only if they are set */
-            if (val == 0)
-                continue;
-        }
-        
-#if !TARGET_OS_EMBEDDED
-        if ((kCFCompareEqualTo == CFStringCompare(assertionNames[i], kIOPMAssertionTypeEnableIdleSleep, 0)) ||
-            (kCFCompareEqualTo == CFStringCompare(assertionNames[i], kIOPMAssertAwakeReservePower, 0)) ||
-            (kCFCompareEqualTo == CFStringCompare(assertionNames[i], kIOPMAssertionTypeSystemIsActive, 0)))
+        val = status.levels[i];
+        if ((neverShown & (1U << i)) || ((rarelyUsed & (1U << i)) && (val == 0)))
             continue;
-#endif
-        
+
         if (updates_only) {
-            if ((prevAssertionNames == NULL) || (prevAssertionValues == NULL) ||
-                (CFStringCompare(assertionNames[i], prevAssertionNames[i], 0) != kCFCompareEqualTo) ||
-                (CFNumberCompare(assertionValues[i], prevAssertionValues[i], NULL) != kCFCompareEqualTo)) {
+            if (!havePrevStatus || (prevStatus.levels[i] != val) || strcmp(prevStatus.names[i], status.names[i])) {
 
                 // Print if this assertion status has changed 
-                CFStringGetCString(assertionNames[i], name, 50, kCFStringEncodingMacRoman);
-
-                if (len + strlen(name)+4 > sizeof(logStr)) {
+                if (len + strlen(status.names[i])+4 > sizeof(logStr)) {
                     print_compact_date(CFAbsoluteTimeGetCurrent(), false);
                     printf("   System wide status: %s\n", logStr);
                     len = 0;
                     logStr[0] = 0;
                 }
 
-                len += snprintf(logStr, sizeof(logStr), "%s%s: %d  ", logStr, name, val);
+                len += snprintf(logStr + len, sizeof(logStr) - len, "%s: %d  ", status.names[i], val);
             }
         }
         else {
-            CFStringGetCString(assertionNames[i], name, 50, kCFStringEncodingMacRoman);
-            printf("   %-30s %d\n", name, val);
+            printf("   %-30s %d\n", status.names[i], val);
         }
     }
 
@@ -2556,13 +2636,9 @@ static void show_assertions_system_aggregates(bool updates_only)
         print_compact_date(CFAbsoluteTimeGetCurrent(), false);
         printf("   System wide status: %s\n", logStr);
     }
-    
-    if (prevAssertionNames) free(prevAssertionNames);
-    if (prevAssertionValues) free(prevAssertionValues);
-    if (prevAssertion_status) CFRelease(prevAssertion_status);
-    prevAssertionNames = assertionNames;
-    prevAssertionValues = assertionValues;
-    prevAssertion_status = assertions_status;
+
+    prevStatus = status;
+    havePrevStatus = true;
 }
 
 static void show_assertions_individually(void (^printer)(
@@ -3068,6 +3144,40 @@ static void show_assertions(const char *decorate)
     return;
 }
 
+/*
+ * Writes powerd's columnar assertion snapshot (AssertionSnapshot.h) to
+ * stdout as is, for collectors to decode off the host.
+ */
+static void show_assertions_binary(void)
+{
+    mach_port_t             connectIt = MACH_PORT_NULL;
+    vm_offset_t             buf = 0;
+    mach_msg_type_number_t  len = 0;
+    PMAssertionSnapshot     snap;
+    int                     rc = kIOReturnError;
+    kern_return_t           kr;
+
+    if (kIOReturnSuccess != _pm_connect(&connectIt)) {
+        fprintf(stderr, "Can't connect to powerd\n");
+        exit(EX_UNAVAILABLE);
+    }
+
+    kr = io_pm_assertion_copy_details(connectIt, 0, kPMAssertionMIGCopyColumnar, &buf, &len, &rc);
+    _pm_disconnect(connectIt);
+
+    if ((KERN_SUCCESS != kr) || (kIOReturnSuccess != rc)
+        || !PMAssertionSnapshotOpen((const void *)buf, len, &snap))
+    {
+        fprintf(stderr, "Can't copy the assertion snapshot (0x%x, 0x%x)\n", kr, rc);
+        if (buf) vm_deallocate(mach_task_self(), buf, len);
+        exit(EX_SOFTWARE);
+    }
+
+    fwrite((const void *)buf, 1, len, stdout);
+    fflush(stdout);
+    vm_deallocate(mach_task_self(), buf, len);
+}
+
 static void log_assertions(void)
 {
     int                 token;
@@ -3196,6 +3306,45 @@ static void log_systemload(void)
     dispatch_main();
 }
 
+/*
+ * Dumps powerd's tracepoint rings in Chrome trace event format, for
+ * chrome://tracing or any viewer that reads it.
+ */
+static void show_trace(void)
+{
+    const PMTraceShared     *shared = PMTraceSharedMap();
+    static PMTraceRing      ring;
+    const PMTraceRecord     *rec;
+    uint32_t                first, count, n;
+    double                  usPerTick;
+    int                     event;
+
+    if (!shared) {
+        fprintf(stderr, "pmset: powerd has no trace rings; it may be built without PMTRACE\n");
+        return;
+    }
+    usPerTick = shared->denom ? (double)shared->numer / shared->denom / 1000.0 : 0.001;
+
+    printf("{\"traceEvents\":[\n");
+    printf("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"powerd\"}}");
+    for (event = 0; event < kPMTraceEventCount; event++)
+    {
+        count = PMTraceCopyRing(shared, event, &ring, &first);
+        for (n = first; n < count; n++)
+        {
+            rec = &ring.records[n & (kPMTraceRingSize - 1)];
+            if (!rec->begin || (rec->end < rec->begin)) {
+                continue;
+            }
+            printf(",\n{\"name\":\"%s\",\"cat\":\"powerd\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                   "\"pid\":1,\"tid\":1,\"args\":{\"payload\":%llu}}",
+                   PMTraceEventName(event), rec->begin * usPerTick, (rec->end - rec->begin) * usPerTick,
+                   (unsigned long long)rec->payload);
+        }
+    }
+    printf("\n],\"displayTimeUnit\":\"ms\"}\n");
+}
+
 /* 
  * IOKit has 3 SPI's tracking user active
  * (1) BSD notify: kIOUserActivityNotifyName
@@ -5823,10 +5972,15 @@ static int32_t _getNextSleepTime(asl_object_t pmresponse, const char *curr_domai
 
 #define kPMASLStorePath                 "/var/log/powermanagement"
 
-static asl_object_t open_pm_asl_store(void)
+/*
+ * Opens the PM messages in the ASL store, oldest first, from 'since' to
+ * 'until' (seconds since 1970) unless they're 0.
+ */
+static asl_object_t open_pm_asl_store(int64_t since, int64_t until)
 {
     asl_object_t        response = NULL;
     size_t              endMessageID;
+    char                timestr[24];
     
     asl_object_t query = asl_new(ASL_TYPE_LIST);
     if (query != NULL)
@@ -5835,6 +5989,14 @@ static asl_object_t open_pm_asl_store(void)
 		if (cq != NULL)
 		{
 			asl_set_query(cq, ASL_KEY_FACILITY, kPMFacility, ASL_QUERY_OP_EQUAL);
+			if (since) {
+				snprintf(timestr, sizeof(timestr), "%lld", (long long)since);
+				asl_set_query(cq, ASL_KEY_TIME, timestr, ASL_QUERY_OP_GREATER_EQUAL);
+			}
+			if (until) {
+				snprintf(timestr, sizeof(timestr), "%lld", (long long)until);
+				asl_set_query(cq, ASL_KEY_TIME, timestr, ASL_QUERY_OP_LESS_EQUAL);
+			}
 			asl_append(query, cq);
 			asl_release(cq);
 			
@@ -5864,8 +6026,7 @@ static void pmlog_print_claimedwakes(CFAbsoluteTime  abs_time, asl_object_t m)
             break;
         }
         if (i == 0) {
-            print_pretty_date(abs_time, false);
-            printf("%-20s\t",  "WakeDetails"); // domain
+            printf("%s %-20s\t", format_pretty_date(abs_time), "WakeDetails"); // domain
         }
         i++;
         printf("%-75s\n", claimed);
@@ -5878,6 +6039,7 @@ static void pmlog_print_claimedwakes(CFAbsoluteTime  abs_time, asl_object_t m)
 static void printWakeReqMsg(asl_object_t m)
 {
     int chosen = -1, cnt = 0;
+    bool    merged;
     char    key[50];
     const char    *appName, *wakeType, *delta, *str;
 
@@ -5898,11 +6060,14 @@ static void printWakeReqMsg(asl_object_t m)
         if (!(wakeType = asl_get(m, key)))
             break;
 
+        snprintf(key, sizeof(key), "%s%d", kPMASLWakeReqMergedPrefix, cnt);
+        merged = (asl_get(m, key) != NULL);
+
         snprintf(key, sizeof(key), "%s%d", kPMASLWakeReqClientInfoPrefix, cnt);
         str = asl_get(m, key); // Optional client info
 
         printf("[%sproc=%s request=%s inDelta=%s%s%s%s] ",
-               (cnt == chosen) ? "*" : "",
+               (cnt == chosen) ? "*" : (merged ? "+" : ""),
                appName, wakeType, delta,
                (str) ? " info=\"" : "",
                (str) ? str : "",
@@ -5967,184 +6132,728 @@ static void printStatsMsg(asl_object_t m)
     }
 }
 
-/* All PM messages in ASL log */
-static void show_log(void)
-{
-    asl_object_t        m = NULL;
+/* Sleep/wake cycle state carried from one 'pmset -g log' message to the next */
+typedef struct {
     char                uuid[100];
-    long                sleep_cnt = 0;
-    long                dark_wake_cnt = 0;
-    bool                first_iter = true;
-    CFAbsoluteTime      boot_time = 0;
+    long                sleep_cnt;
+    long                dark_wake_cnt;
+    bool                first_iter;
+    CFAbsoluteTime      boot_time;
+} LogPrintState;
 
-    asl_object_t        response = NULL;
+/*
+ * Seconds from a Sleep message to the following wake, or from a Wake or
+ * DarkWake message to the following sleep, or -1 if unknown.
+ * 'nextTransitionTime' returns the time of that following transition.
+ */
+static int32_t log_msg_duration(
+    asl_object_t        m,
+    int32_t             (^nextTransitionTime)(const char *domain))
+{
+    const char  *domain = asl_get(m, kPMASLDomainKey);
+    const char  *time_str = asl_get(m, ASL_KEY_TIME);
+    int32_t     next;
 
-    response = open_pm_asl_store();
-    if (!response)
+    if (!domain || !time_str) {
+        return -1;
+    }
+    if (strncmp(kPMASLDomainPMSleep, domain, sizeof(kPMASLDomainPMSleep)) &&
+        strncmp(kPMASLDomainPMWake, domain, sizeof(kPMASLDomainPMWake)) &&
+        strncmp(kPMASLDomainPMDarkWake, domain, sizeof(kPMASLDomainPMDarkWake)))
     {
-        printf("Error - no messages found in PM ASL data store at: %s\n", kPMASLStorePath);
-        return;
-    } else {
-        printf("PM ASL data store: %s\n", kPMASLStorePath);
+        return -1;
+    }
+    if ((next = nextTransitionTime(domain)) == -1) {
+        return -1;
+    }
+    return next - (int32_t)atol(time_str);
+}
+
+/*
+ * Prints one PM message. 'nextTransitionTime' returns the time of the wake
+ * following a Sleep message, or of the sleep following a Wake or DarkWake
+ * message, or -1 if there's none.
+ */
+static void print_log_msg(
+    LogPrintState       *st,
+    asl_object_t        m,
+    int32_t             (^nextTransitionTime)(const char *domain))
+{
+    const char  *val = NULL;
+    int32_t     print_duration_time = -1;
+    long        time_read = 0;
+    char        buf[40];
+    bool        new_boot_cycle = false;
+    bool        isAwakening = false;
+    bool        kerStats = false, pmStats = false;
+    bool        wakeReq = false;
+    CFAbsoluteTime  abs_time = 0;
+
+    if ((val = asl_get(m, kPMASLDomainKey)))
+    {
+        if (!strncmp(val, kPMASLDomainPMStart, sizeof(kPMASLDomainPMStart)-1)) {
+            new_boot_cycle = true;
+        }
     }
     
-    uuid[0] = 0;
+    if (((val = asl_get(m, kPMASLUUIDKey)) && (strncmp( val, st->uuid, sizeof(st->uuid)) != 0)) || new_boot_cycle ) 
+    {
+        // New Sleep cycle is about to begin
+        // Print Sleep cnt and dark wake cnt of previous sleep/wake cycle
+        if ( !st->first_iter )
+        {
+           printf("Sleep/Wakes since boot");
+           if (st->boot_time) {
+              printf(" at %s ", format_pretty_date(st->boot_time));
+           }
+           printf(":%ld   Dark Wake Count in this sleep cycle:%ld\n", st->sleep_cnt, st->dark_wake_cnt);
+        }
+        st->first_iter = false;
 
-    while ((m = _my_next_response(response)))
+        printf("\n");   // Extra line to seperate from previous sleep/wake cycles
+        st->dark_wake_cnt = 0;
+
+        // Print the header for each column
+        printf("%-25s %-20s\t%-75s\t%-10s\t%-10s\n", "Time stamp", "Domain", "Message", "Duration", "Delay");
+        printf("%-25s %-20s\t%-75s\t%-10s\t%-10s\n", "==========", "======", "=======", "========", "=====");
+
+        // Print and save UUID of the new cycle
+        snprintf(st->uuid, sizeof(st->uuid), "%s", val);
+        printf("UUID: %s\n", val);
+        st->sleep_cnt = 0;
+    }
+
+    // Time
+    if ((val = asl_get(m, ASL_KEY_TIME))) 
     {
-        const char  *val = NULL;
-        int32_t     print_duration_time = -1;
-        long        time_read = 0;
-        char        buf[40];
-        bool        new_boot_cycle = false;
-        bool        isAwakening = false;
-        bool        kerStats = false, pmStats = false;
-        bool        wakeReq = false;
-        CFAbsoluteTime  abs_time ;
-
-        if ((val = asl_get(m, kPMASLDomainKey)))
+        time_read = atol(val);
+        abs_time = (CFAbsoluteTime)(time_read - kCFAbsoluteTimeIntervalSince1970);
+        printf("%s ", format_pretty_date(abs_time));
+        if (new_boot_cycle)
+           st->boot_time = abs_time;
+    }
+
+
+    // Domain
+    if ((val = asl_get(m, kPMASLDomainKey)))
+    {   
+        const char *value1 = asl_get(m, kPMASLValueKey);
+
+        if (strnstr(val, "Response.", strlen(val))) {
+           printf("%-20s\t",  ((char *)val + (uintptr_t)strlen("Response.")));
+        } 
+        else if (!strncmp(val, kPMASLDomainKernelClientStats, sizeof(kPMASLDomainKernelClientStats))) {
+            printf("%-20s\t", "Kernel Client Acks");
+            kerStats = true;
+        } 
+        else if (!strncmp(val, kPMASLDomainPMClientStats, sizeof(kPMASLDomainPMClientStats))) {
+            printf("%-20s\t", "PM Client Acks");
+            pmStats = true;
+        }
+        else if (!strncmp(val, kPMASLDomainClientWakeRequests, sizeof(kPMASLDomainClientWakeRequests))) {
+            printf("%-20s\t", "Wake Requests");
+            wakeReq = true;
+        } 
+        else {
+            printf("%-20s\t",  (char *)val);
+        }
+
+
+        if (!strncmp(kPMASLDomainPMSleep, val, sizeof(kPMASLDomainPMSleep) )) 
         {
-            if (!strncmp(val, kPMASLDomainPMStart, sizeof(kPMASLDomainPMStart)-1)) {
-                new_boot_cycle = true;
+            print_duration_time = log_msg_duration(m, nextTransitionTime);
+
+           if (value1) {
+               st->sleep_cnt = strtol(value1, NULL, 0);
             }
         }
-        
-        if (((val = asl_get(m, kPMASLUUIDKey)) && (strncmp( val, uuid, sizeof(uuid)) != 0)) || new_boot_cycle ) 
+        else if (!strncmp(kPMASLDomainPMWake, val, sizeof(kPMASLDomainPMWake)) ||
+                 !strncmp(kPMASLDomainPMDarkWake, val, sizeof(kPMASLDomainPMDarkWake)))
         {
-            // New Sleep cycle is about to begin
-            // Print Sleep cnt and dark wake cnt of previous sleep/wake cycle
-            if ( !first_iter )
+            isAwakening = true;
+            print_duration_time = log_msg_duration(m, nextTransitionTime);
+            
+            if (value1 &&
+                !strncmp(kPMASLDomainPMDarkWake, val, sizeof(kPMASLDomainPMDarkWake) ))
             {
-               printf("Sleep/Wakes since boot");
-               if (boot_time) {
-                  printf(" at ");
-                  print_pretty_date(boot_time, false);
-
-               }
-               printf(":%ld   Dark Wake Count in this sleep cycle:%ld\n", sleep_cnt, dark_wake_cnt);
+                st->dark_wake_cnt = strtol(value1, NULL, 0);
             }
-            first_iter = false;
+        }
+    }
+    else 
+    {
+        printf("%-20s\t",  " ");
+    }
+    
+    // Message
+    if (pmStats || kerStats) {
+        printStatsMsg(m);
+    }
+    else if (wakeReq) {
+        printWakeReqMsg(m);
+    }
+    else if ((val = asl_get(m, ASL_KEY_MSG))) {
+        printf("%-75s\t", val);
+    } else {
+        printf("%-75s\t",  " ");
+    }
+    
+    // Duration/Delay
+    if (-1 != print_duration_time) {
+        snprintf(buf, sizeof(buf), "%d secs", print_duration_time);
+    } else {
+        buf[0] = 0;
+    }
+    printf("%-10s", buf);
 
-            printf("\n");   // Extra line to seperate from previous sleep/wake cycles
-            dark_wake_cnt = 0;
+    if ((val = asl_get(m, kPMASLDelayKey)))
+    {   
+        printf("%-10s\t", val);
+    }
+    
+    printf("\n");
+    
+    if (isAwakening) {
+        pmlog_print_claimedwakes(abs_time, m);
+    }
+}
 
-            // Print the header for each column
-            printf("%-25s %-20s\t%-75s\t%-10s\t%-10s\n", "Time stamp", "Domain", "Message", "Duration", "Delay");
-            printf("%-25s %-20s\t%-75s\t%-10s\t%-10s\n", "==========", "======", "=======", "========", "=====");
+/* What 'pmset -g log' shows, from its arguments */
+typedef struct {
+    int64_t             since;          // seconds since 1970, or 0
+    int64_t             until;          // seconds since 1970, or 0
+    const char          *domains;       // comma separated, or NULL for all
+    const char          *uuid;          // one sleep/wake cycle, or NULL
+    int                 boots_ago;      // since the nth most recent boot, or -1
+    bool                json;
+} LogFilter;
 
-            // Print and save UUID of the new cycle
-            snprintf(uuid, sizeof(uuid), "%s", val);
-            printf("UUID: %s\n", val);
-            sleep_cnt = 0;
+/*
+ * Reads a --since or --until time: seconds since 1970, "-<n>[smhd]" before
+ * now, or a local "MM/dd/yy HH:mm:ss" as for 'pmset schedule'.
+ */
+static bool parse_log_time(const char *arg, int64_t *t)
+{
+    CFDateFormatterRef  formatter;
+    CFStringRef         str;
+    CFDateRef           date;
+    char                *end;
+    long long           n;
+
+    if (arg[0] == '-') {
+        n = strtoll(arg + 1, &end, 10);
+        if ((end == arg + 1) || (n < 0) || (*end && end[1])) {
+            return false;
+        }
+        switch (*end) {
+            case 'd':   n *= 24;    // fall through
+            case 'h':   n *= 60;    // fall through
+            case 'm':   n *= 60;    // fall through
+            case 's':
+            case '\0':  break;
+            default:    return false;
         }
+        *t = (int64_t)time(NULL) - n;
+        return true;
+    }
 
-        // Time
-        if ((val = asl_get(m, ASL_KEY_TIME))) 
-        {
-            time_read = atol(val);
-            abs_time = (CFAbsoluteTime)(time_read - kCFAbsoluteTimeIntervalSince1970);
-            print_pretty_date(abs_time, false);
-            if (new_boot_cycle)
-               boot_time = abs_time;
-        }
-
-
-        // Domain
-        if ((val = asl_get(m, kPMASLDomainKey)))
-        {   
-            const char *value1 = asl_get(m, kPMASLValueKey);
-
-            if (strnstr(val, "Response.", strlen(val))) {
-               printf("%-20s\t",  ((char *)val + (uintptr_t)strlen("Response.")));
-            } 
-            else if (!strncmp(val, kPMASLDomainKernelClientStats, sizeof(kPMASLDomainKernelClientStats))) {
-                printf("%-20s\t", "Kernel Client Acks");
-                kerStats = true;
-            } 
-            else if (!strncmp(val, kPMASLDomainPMClientStats, sizeof(kPMASLDomainPMClientStats))) {
-                printf("%-20s\t", "PM Client Acks");
-                pmStats = true;
+    n = strtoll(arg, &end, 10);
+    if ((end != arg) && !*end) {
+        *t = n;
+        return true;
+    }
+
+    formatter = CFDateFormatterCreate(kCFAllocatorDefault, CFLocaleGetSystem(),
+        kCFDateFormatterShortStyle, kCFDateFormatterMediumStyle);
+    if (!formatter) {
+        return false;
+    }
+    CFDateFormatterSetFormat(formatter, CFSTR(kDateAndTimeFormat));
+    str = CFStringCreateWithCString(0, arg, kCFStringEncodingMacRoman);
+    date = str ? CFDateFormatterCreateDateFromString(0, formatter, str, NULL) : NULL;
+    if (date) {
+        *t = (int64_t)(CFDateGetAbsoluteTime(date) + kCFAbsoluteTimeIntervalSince1970);
+        CFRelease(date);
+    }
+    if (str) CFRelease(str);
+    CFRelease(formatter);
+    return (date != NULL);
+}
+
+/*
+ * Reads the 'pmset -g log' arguments: --since, --until, --domain, --uuid and
+ * --json, and the older forms, a bare <UUID> or "boot [n]".
+ */
+static bool parse_log_filter(char **argv, LogFilter *filter)
+{
+    const char  *opt;
+    int         i;
+
+    bzero(filter, sizeof(*filter));
+    filter->boots_ago = -1;
+
+    for (i = 0; argv && argv[i]; i++)
+    {
+        opt = argv[i];
+        if (!strcmp(opt, ARG_LOG_JSON)) {
+            filter->json = true;
+            continue;
+        }
+        if (!strcmp(opt, ARG_BOOT)) {
+            filter->boots_ago = 0;
+            if (argv[i+1] && isdigit(argv[i+1][0])) {
+                filter->boots_ago = (int)strtol(argv[++i], NULL, 10);
             }
-            else if (!strncmp(val, kPMASLDomainClientWakeRequests, sizeof(kPMASLDomainClientWakeRequests))) {
-                printf("%-20s\t", "Wake Requests");
-                wakeReq = true;
-            } 
-            else {
-                printf("%-20s\t",  (char *)val);
+            continue;
+        }
+        if (strncmp(opt, "--", 2)) {
+            filter->uuid = opt;
+            continue;
+        }
+
+        if (!argv[i+1]) {
+            printf("Error: %s needs a value\n", opt);
+            return false;
+        }
+        i++;
+        if (!strcmp(opt, ARG_LOG_SINCE) || !strcmp(opt, ARG_LOG_UNTIL)) {
+            if (!parse_log_time(argv[i], !strcmp(opt, ARG_LOG_SINCE) ? &filter->since : &filter->until)) {
+                printf("Error: Badly formatted time %s\n", argv[i]);
+                return false;
             }
+        } else if (!strcmp(opt, ARG_LOG_DOMAIN)) {
+            filter->domains = argv[i];
+        } else if (!strcmp(opt, ARG_LOG_UUID)) {
+            filter->uuid = argv[i];
+        } else {
+            printf("Error: invalid argument %s\n", opt);
+            return false;
+        }
+    }
 
-    
-            if (!strncmp(kPMASLDomainPMSleep, val, sizeof(kPMASLDomainPMSleep) )) 
-            {
-                if ( (print_duration_time = _getNextWakeTime(response)) != -1) {
-                    print_duration_time -= time_read;
-                }
+    if (filter->uuid && (filter->boots_ago >= 0)) {
+        printf("Error: give either a UUID or a boot, not both\n");
+        return false;
+    }
+    return true;
+}
+
+/* True if 'domain' is one of the comma separated --domain names */
+static bool log_filter_domain(const LogFilter *filter, const char *domain)
+{
+    const char  *d, *end;
+    size_t      len, n;
+
+    if (!filter->domains) {
+        return true;
+    }
+    if (!domain) {
+        return false;
+    }
+    len = strlen(domain);
+    for (d = filter->domains; d; d = end ? end + 1 : NULL)
+    {
+        end = strchr(d, ',');
+        n = end ? (size_t)(end - d) : strlen(d);
+        if ((n == len) && !strncasecmp(d, domain, n)) {
+            return true;
+        }
+    }
+    return false;
+}
 
-               if (value1) {
-                   sleep_cnt = strtol(value1, NULL, 0);
+/* ASL's own keys, left out of 'pmset -g log --json' */
+static const char *kLogJSONSkipKeys[] = {
+    ASL_KEY_TIME, ASL_KEY_TIME_NSEC, ASL_KEY_HOST, ASL_KEY_SENDER, ASL_KEY_FACILITY,
+    ASL_KEY_PID, ASL_KEY_UID, ASL_KEY_GID, ASL_KEY_LEVEL, ASL_KEY_READ_UID,
+    ASL_KEY_READ_GID, ASL_KEY_MSG_ID, ASL_KEY_SENDER_MACH_UUID
+};
+
+static void print_json_string(const char *str)
+{
+    const unsigned char *c;
+
+    putchar('"');
+    for (c = (const unsigned char *)str; *c; c++)
+    {
+        switch (*c) {
+            case '"':   fputs("\\\"", stdout); break;
+            case '\\':  fputs("\\\\", stdout); break;
+            case '\n':  fputs("\\n", stdout); break;
+            case '\r':  fputs("\\r", stdout); break;
+            case '\t':  fputs("\\t", stdout); break;
+            default:
+                if (*c < 0x20) {
+                    printf("\\u%04x", *c);
+                } else {
+                    putchar(*c);
                 }
+        }
+    }
+    putchar('"');
+}
+
+/*
+ * Prints one PM message as a line of JSON: its time in seconds since 1970,
+ * each key it was logged with, and its duration if known.
+ */
+static void print_log_json(asl_object_t m, int32_t duration)
+{
+    const char  *key, *val;
+    size_t      k, s;
+    size_t      skipCount = sizeof(kLogJSONSkipKeys) / sizeof(kLogJSONSkipKeys[0]);
+
+    val = asl_get(m, ASL_KEY_TIME);
+    printf("{\"time\":%ld", val ? atol(val) : 0L);
+
+    for (k = 0; (key = asl_key(m, (uint32_t)k)); k++)
+    {
+        for (s = 0; s < skipCount; s++) {
+            if (!strcmp(key, kLogJSONSkipKeys[s])) {
+                break;
             }
-            else if (!strncmp(kPMASLDomainPMWake, val, sizeof(kPMASLDomainPMWake)) ||
-                     !strncmp(kPMASLDomainPMDarkWake, val, sizeof(kPMASLDomainPMDarkWake)))
-            {
-                isAwakening = true;
-                if ( (print_duration_time = _getNextSleepTime(response, val)) != -1) {
-                    print_duration_time -= time_read;
-                }
-                
-                if (value1 &&
-                    !strncmp(kPMASLDomainPMDarkWake, val, sizeof(kPMASLDomainPMDarkWake) ))
-                {
-                    dark_wake_cnt = strtol(value1, NULL, 0);
-                }
+        }
+        if ((s < skipCount) || !(val = asl_get(m, key))) {
+            continue;
+        }
+        putchar(',');
+        print_json_string(key);
+        putchar(':');
+        print_json_string(val);
+    }
+
+    if (duration != -1) {
+        printf(",\"duration\":%d", duration);
+    }
+    printf("}\n");
+}
+
+static void print_log_entry(
+    LogPrintState       *st,
+    const LogFilter     *filter,
+    asl_object_t        m,
+    int32_t             (^nextTransitionTime)(const char *domain))
+{
+    if (filter->json) {
+        print_log_json(m, log_msg_duration(m, nextTransitionTime));
+    } else {
+        print_log_msg(st, m, nextTransitionTime);
+    }
+}
+
+/*
+ * The time of the 'boots_ago'th most recent boot in the ASL store (0 for
+ * the current one), or 0 if the store doesn't go back that far.
+ */
+static int64_t asl_boot_time(int boots_ago)
+{
+    asl_object_t        response;
+    asl_object_t        m;
+    const char          *val;
+    int64_t             *times;
+    long                count = 0;
+    int64_t             boot = 0;
+
+    if (!(response = open_pm_asl_store(0, 0))) {
+        return 0;
+    }
+    if (!(times = calloc(boots_ago + 1, sizeof(int64_t)))) {
+        asl_release(response);
+        return 0;
+    }
+
+    // The last boots_ago + 1 boots
+    while ((m = asl_next(response)))
+    {
+        if ((val = asl_get(m, kPMASLDomainKey))
+            && !strncmp(val, kPMASLDomainPMStart, sizeof(kPMASLDomainPMStart)-1)
+            && (val = asl_get(m, ASL_KEY_TIME))) {
+            times[count++ % (boots_ago + 1)] = atoll(val);
+        }
+    }
+    if (count > boots_ago) {
+        boot = times[(count - 1 - boots_ago) % (boots_ago + 1)];
+    }
+
+    free(times);
+    asl_release(response);
+    return boot;
+}
+
+/* PM messages in ASL log */
+static bool show_log_asl(LogPrintState *st, const LogFilter *filter)
+{
+    asl_object_t        m = NULL;
+    asl_object_t        response = NULL;
+    const char          *val;
+    char                cycle_uuid[100] = "";
+    int64_t             since = filter->since;
+    int64_t             boot;
+
+    if (filter->boots_ago >= 0) {
+        if (!(boot = asl_boot_time(filter->boots_ago))) {
+            printf("Error - no such boot in PM ASL data store at: %s\n", kPMASLStorePath);
+            return false;
+        }
+        if (boot > since) {
+            since = boot;
+        }
+    }
+
+    response = open_pm_asl_store(since, filter->until);
+    if (!response)
+    {
+        printf("Error - no messages found in PM ASL data store at: %s\n", kPMASLStorePath);
+        return false;
+    } else if (!filter->json) {
+        printf("PM ASL data store: %s\n", kPMASLStorePath);
+    }
+
+    while ((m = _my_next_response(response)))
+    {
+        if (filter->until && (val = asl_get(m, ASL_KEY_TIME)) && (atol(val) > filter->until)) {
+            break;
+        }
+
+        // The sleep/wake cycle this message is in
+        if ((val = asl_get(m, kPMASLDomainKey)) &&
+            !strncmp(val, kPMASLDomainPMStart, sizeof(kPMASLDomainPMStart)-1)) {
+            cycle_uuid[0] = 0;
+        }
+        if ((val = asl_get(m, kPMASLUUIDKey))) {
+            strlcpy(cycle_uuid, val, sizeof(cycle_uuid));
+        }
+
+        if ((filter->uuid && strcasecmp(filter->uuid, cycle_uuid)) ||
+            !log_filter_domain(filter, asl_get(m, kPMASLDomainKey))) {
+            continue;
+        }
+
+        print_log_entry(st, filter, m, ^(const char *domain) {
+            if (!strncmp(kPMASLDomainPMSleep, domain, sizeof(kPMASLDomainPMSleep))) {
+                return _getNextWakeTime(response);
             }
+            return _getNextSleepTime(response, domain);
+        });
+    }
+    return true;
+}
+
+/*
+ * The index equivalent of _getNextWakeTime() and _getNextSleepTime():
+ * the same transitions, found among the index entries after entry 'i'.
+ */
+static int32_t history_next_transition_time(PMEventHistory *history, CFIndex i)
+{
+    const PMEventIndexEntry *cur = PMEventHistoryIndexEntryAt(history, i);
+    const PMEventIndexEntry *next;
+    CFIndex                 count = PMEventHistoryIndexCount(history);
+
+    while (++i < count)
+    {
+        next = PMEventHistoryIndexEntryAt(history, i);
+        if ((next->kind == kPMEventOther) || (next->kind == kPMEventBoot)) {
+            continue;
         }
-        else 
+
+        if (cur->kind == kPMEventSleep) {
+            if ((next->kind == kPMEventWake) || (next->kind == kPMEventDarkWake)) {
+                return (int32_t)next->time;
+            }
+            /* Came across another sleep trace. Wake trace is missing */
+            return -1;
+        }
+
+        /* Check for events with unexpected transitions */
+        if ((cur->kind == kPMEventWake) && (next->kind != kPMEventSleep)) {
+            return -1;
+        }
+        if ((cur->kind == kPMEventDarkWake) && (next->kind == kPMEventDarkWake)) {
+            return -1;
+        }
+        if (next->value == 1) {
+            /* System rebooted at this point */
+            return -1;
+        }
+        return (int32_t)next->time;
+    }
+    return -1;
+}
+
+static asl_object_t create_history_msg(const PMEventRecord *rec)
+{
+    asl_object_t    m = asl_new(ASL_TYPE_MSG);
+    const char      *iter = rec->fields;
+    const char      *key, *value;
+    char            timeStr[24];
+
+    if (!m) {
+        return NULL;
+    }
+    snprintf(timeStr, sizeof(timeStr), "%lld", (long long)rec->time);
+    asl_set(m, ASL_KEY_TIME, timeStr);
+    while (PMEventRecordNextField(rec, &iter, &key, &value)) {
+        asl_set(m, key, value);
+    }
+    return m;
+}
+
+static bool history_cursor_before(const PMEventHistoryCursor *a, const PMEventHistoryCursor *b)
+{
+    return (a->file < b->file) || ((a->file == b->file) && (a->offset < b->offset));
+}
+
+/*
+ * PM messages from powerd's event history. The filter's UUID, boot and
+ * --since time are found through the index, and the rest are checked on
+ * each record before it's formatted. If --since is older than the oldest
+ * record, messages in the ASL store from before it come first. Returns
+ * false, having printed nothing, if the UUID or boot isn't in the history.
+ */
+static bool show_log_history(LogPrintState *st, PMEventHistory *history, const LogFilter *filter)
+{
+    PMEventHistoryCursor    cursor, since, end = { 0, 0 };
+    PMEventRecord           rec;
+    LogFilter               older;
+    asl_object_t            m;
+    CFIndex                 i = -1, count = PMEventHistoryIndexCount(history);
+    bool                    bounded = false;
+
+    PMEventHistoryStart(history, &cursor);
+
+    if (filter->boots_ago >= 0) {
+        i = PMEventHistoryIndexFindBoot(history, filter->boots_ago);
+        if (i < 0) {
+            return false;
+        }
+        PMEventHistoryIndexCursor(history, i, &cursor);
+    }
+    else if (filter->uuid) {
+        i = PMEventHistoryIndexFindUUID(history, filter->uuid);
+        if (i < 0) {
+            return false;
+        }
+        PMEventHistoryIndexCursor(history, i, &cursor);
+
+        // The cycle ends where the next one or a new boot starts
+        while (++i < count) {
+            const PMEventIndexEntry *e = PMEventHistoryIndexEntryAt(history, i);
+            if ((e->flags & kPMEventIndexNewUUID) || (e->kind == kPMEventBoot)) {
+                PMEventHistoryIndexCursor(history, i, &end);
+                bounded = true;
+                break;
+            }
+        }
+    }
+    else {
+        // Anything older than the history is only in the ASL store; the
+        // query ends where the history starts, so nothing past it is read
+        since = cursor;
+        if (filter->since && PMEventHistoryNext(history, &since, &rec) && (filter->since < rec.time))
         {
-            printf("%-20s\t",  " ");
+            older = *filter;
+            if (!older.until || (older.until >= rec.time)) {
+                older.until = rec.time - 1;
+            }
+            (void)show_log_asl(st, &older);
         }
-        
-        // Message
-        if (pmStats || kerStats) {
-            printStatsMsg(m);
+    }
+
+    if (filter->since) {
+        PMEventHistorySeekTime(history, filter->since, &since);
+        if (history_cursor_before(&cursor, &since)) {
+            cursor = since;
         }
-        else if (wakeReq) {
-            printWakeReqMsg(m);
+    }
+
+    if (!filter->json) {
+        printf("PM event history: %s\n", kPMEventHistoryPath);
+    }
+
+    // Index entry at or after the next record, kept in step with it
+    i = PMEventHistoryIndexFindPosition(history, &cursor);
+
+    while (PMEventHistoryNext(history, &cursor, &rec))
+    {
+        if (bounded && !history_cursor_before(&rec.position, &end)) {
+            break;
         }
-        else if ((val = asl_get(m, ASL_KEY_MSG))) {
-            printf("%-75s\t", val);
-        } else {
-            printf("%-75s\t",  " ");
+        if (filter->until && (rec.time > filter->until)) {
+            break;
         }
-        
-        // Duration/Delay
-        if (-1 != print_duration_time) {
-            snprintf(buf, sizeof(buf), "%d secs", print_duration_time);
-        } else {
-            buf[0] = 0;
+
+        while ((i >= 0) && (i < count)) {
+            PMEventHistoryCursor c;
+            PMEventHistoryIndexCursor(history, i, &c);
+            if (!history_cursor_before(&c, &rec.position)) {
+                break;
+            }
+            i++;
         }
-        printf("%-10s", buf);
 
-        if ((val = asl_get(m, kPMASLDelayKey)))
-        {   
-            printf("%-10s\t", val);
+        if (!log_filter_domain(filter, PMEventRecordGet(&rec, kPMASLDomainKey))) {
+            continue;
         }
-        
-        printf("\n");
-        
-        if (isAwakening) {
-            pmlog_print_claimedwakes(abs_time, m);
+        if (!(m = create_history_msg(&rec))) {
+            break;
+        }
+
+        print_log_entry(st, filter, m, ^(const char *domain) {
+            PMEventHistoryCursor c;
+
+            if ((i < 0) || (i >= count)) {
+                return (int32_t)-1;
+            }
+            PMEventHistoryIndexCursor(history, i, &c);
+            if ((c.file != rec.position.file) || (c.offset != rec.position.offset)) {
+                return (int32_t)-1;
+            }
+            return history_next_transition_time(history, i);
+        });
+        asl_release(m);
+    }
+    return true;
+}
+
+/*
+ * PM messages, from powerd's event history if it's there, and from the ASL
+ * store for anything older or not in the history. Messages are filtered
+ * before they're formatted and printed as they're read.
+ */
+static void show_log(char **argv)
+{
+    LogPrintState       st;
+    LogFilter           filter;
+    PMEventHistory      *history;
+
+    if (!parse_log_filter(argv, &filter)) {
+        return;
+    }
+
+    bzero(&st, sizeof(st));
+    st.first_iter = true;
+
+    history = PMEventHistoryOpen(kPMEventHistoryPath, false);
+    if (history && show_log_history(&st, history, &filter)) {
+        PMEventHistoryClose(history);
+    } else {
+        if (history) {
+            PMEventHistoryClose(history);
+        }
+        if (!show_log_asl(&st, &filter)) {
+            return;
         }
-        
     }
 
-    if (sleep_cnt || dark_wake_cnt) {
+    if (filter.json) {
+        return;
+    }
+    if (st.sleep_cnt || st.dark_wake_cnt) {
         printf("\nTotal Sleep/Wakes since boot");
-        if (boot_time) {
-            printf(" at ");
-            print_pretty_date(boot_time, false);
+        if (st.boot_time) {
+            printf(" at %s ", format_pretty_date(st.boot_time));
         }
-        printf(":%ld\n", sleep_cnt);
+        printf(":%ld\n", st.sleep_cnt);
     }
     printf("\n");
     show_assertions("Showing all currently held IOKit power assertions");
@@ -7251,6 +7960,41 @@ exit:
     if (subbedChs) CFRelease(subbedChs);
 }
 
+static const struct {
+    int             selector;
+    const char      *name;
+} powerdStats[] = {
+    { kPMStatsEnergySettingsPushed,     "Energy Settings Pushed" },
+    { kPMStatsEnergySettingsSkipped,    "Energy Settings Skipped" },
+    { kPMStatsStoreKeysWritten,         "Dynamic Store Keys Written" },
+    { kPMStatsStoreFlushes,             "Dynamic Store Flushes" },
+    { kPMStatsWakesScheduled,           "Wakes Scheduled" },
+    { kPMStatsWakeRequestsMerged,       "Wake Requests Merged" },
+    { kPMStatsUserActiveDeclared,       "User Activity Declarations" },
+    { kPMStatsUserActiveCoalesced,      "User Activity Declarations Coalesced" },
+};
+
+static void show_powerd_stats(void)
+{
+    mach_port_t     connectIt = MACH_PORT_NULL;
+    int             value;
+    int             i;
+
+    if (kIOReturnSuccess != _pm_connect(&connectIt)) {
+        return;
+    }
+
+    for (i = 0; i < (int)(sizeof(powerdStats)/sizeof(powerdStats[0])); i++)
+    {
+        value = 0;
+        if (KERN_SUCCESS == io_pm_get_value_int(connectIt, powerdStats[i].selector, &value)) {
+            printf("%s:%u\n", powerdStats[i].name, (uint32_t)value);
+        }
+    }
+
+    _pm_disconnect(connectIt);
+}
+
 static void show_rdStats(char **argv)
 {
 
@@ -7263,6 +8007,7 @@ static void show_rdStats(char **argv)
     fetchChannelData("IOPMrootDomain", kUserWkCntChID, true,
             ^(uint64_t state_id, CFStringRef drv_name){ printf("User Wake Count:%lld\n", state_id); } );
 
+    show_powerd_stats();
 }
 
 static void cancelAggregates( int param )
@@ -7442,10 +8187,35 @@ static void get_sw_failure_string(long boottime, char *failure, size_t len)
     char    timestr[20];
     const char    *str;
     size_t  cnt;
+    PMEventHistory          *history;
+    PMEventHistoryCursor    cursor;
+    PMEventRecord           rec;
+
+    // Seek to the boot in the event history rather than search ASL, if
+    // the history goes back that far
+    history = PMEventHistoryOpen(kPMEventHistoryPath, false);
+    if (history) {
+        PMEventHistoryStart(history, &cursor);
+        if (!PMEventHistoryNext(history, &cursor, &rec) || (rec.time > boottime)) {
+            PMEventHistoryClose(history);
+            history = NULL;
+        }
+    }
+    if (history) {
+        PMEventHistorySeekTime(history, boottime, &cursor);
+        while (PMEventHistoryNext(history, &cursor, &rec)) {
+            str = PMEventRecordGet(&rec, kPMASLDomainKey);
+            if (str && !strcmp(str, kPMASLDomainSWFailure) && (str = PMEventRecordGet(&rec, ASL_KEY_MSG))) {
+                strncpy(failure, str, len);
+            }
+        }
+        PMEventHistoryClose(history);
+        return;
+    }
 
     snprintf(timestr, sizeof(timestr), "%ld", boottime);
 
-    store = open_pm_asl_store();
+    store = open_pm_asl_store(0, 0);
     asl_object_t cq = asl_new(ASL_TYPE_QUERY);
     if (cq == NULL)  return;
 